@@ -20,8 +20,8 @@ typedef signed char S8;
 typedef unsigned char U8;
 typedef signed short S16;
 typedef unsigned short U16;
-typedef signed long S32;
-typedef unsigned long U32;
+typedef signed int S32;
+typedef unsigned int U32;
 typedef LONG64 S64;
 typedef ULONG64 U64;
 
@@ -20,9 +20,14 @@
 
 #include <windows.h>
 #include <tlhelp32.h>
+#include <intrin.h>
 #include <stdio.h>
 #include "mhook.h"
 #include "../disasm-lib/disasm.h"
+#ifdef __ELF__
+#include <link.h>
+#include <dlfcn.h>
+#endif
 
 //=========================================================================
 #ifndef cntof
@@ -45,7 +50,7 @@
 #ifdef _DEBUG
 #define ODPRINTF(a) odprintf a
 #else
-#define ODPRINTF(a)
+#define ODPRINTF(a) ((void)0)
 #endif
 
 inline void __cdecl odprintf(PCSTR format, ...) {
@@ -95,50 +100,275 @@ inline void __cdecl odprintf(PCWSTR format, ...) {
 #endif //#ifndef ODPRINTF
 
 //=========================================================================
-#define MHOOKS_MAX_CODE_BYTES	32
-#define MHOOKS_MAX_RIPS			 4
+#define MHOOKS_MAX_CODE_BYTES		32
+#define MHOOKS_MAX_TRAMPOLINE_BYTES	128
+#define MHOOKS_MAX_INSTRUCTIONS		16
+#define MHOOKS_MAX_RELOCATED_BYTES	18	// longest code a single relocated instruction turns into
+#define MHOOKS_MAX_PROBE_BYTES		208	// thunks of an instrumented hook or a context hook
+#define MHOOKS_PROBE_DEPTH			64	// nesting depth of timed calls per thread
+#define MHOOKS_MAX_CALLOUT_BYTES	112	// code that calls a helper and jumps to where it says
+#define MHOOKS_MAX_GATE_BYTES		48	// checks whether a hook is switched on
+#define MHOOKS_MAX_CHAINED_HOOKS	8	// hooks added on top of the first one of a function
+#define MHOOKS_RECLAIM_THRESHOLD	16	// retired trampolines that trigger reclamation
+#define MHOOKS_MAX_BLOCK_SLOTS		64	// trampolines carved out of one allocation granularity block
+
+//=========================================================================
+// Entries in front of a virtual function table that belong to it (run-time
+// type information, offset to the complete object)
+#ifdef _MSC_VER
+#define MHOOKS_VTABLE_PREFIX	1
+#else
+#define MHOOKS_VTABLE_PREFIX	2
+#endif
+
+// Link numbers in a dispatch chain that don't refer to a chained hook
+#define MHOOKS_CHAIN_BASE		((DWORD)-1)	// the hook that set up the trampoline
+#define MHOOKS_CHAIN_DISPATCH	((DWORD)-2)	// the dispatcher itself
+
+//=========================================================================
+// How an instruction has to be adjusted when it moves into the trampoline
+#define MHOOKS_RELOC_NONE	0	// position independent, copied as is
+#define MHOOKS_RELOC_IPREL	1	// RIP-relative memory operand, displacement adjusted
+#define MHOOKS_RELOC_JMP	2	// jmp rel8/rel32
+#define MHOOKS_RELOC_JCC	3	// jcc rel8/rel32
+#define MHOOKS_RELOC_CALL	4	// call rel32
+#define MHOOKS_RELOC_LOOP	5	// loop/loopcc/jecxz rel8, which have no rel32 form
+
+//=========================================================================
+// Internal flags of a hook operation, next to the MHOOK_* ones
+#define MHOOKS_FLAG_CONTEXT		0x80000000	// hook calls back with the registers, anywhere in a function
+
+//=========================================================================
+// How a hook gets written into the system function
+#define MHOOKS_INSTALL_SUSPEND	0	// other threads suspended, jump written byte by byte
+#define MHOOKS_INSTALL_ATOMIC	1	// 5-byte jump written with one interlocked compare-exchange
+#define MHOOKS_INSTALL_HOTPATCH	2	// jump in the padding before the function, 2-byte short
+									//   jump to it written with one interlocked compare-exchange
+
+// Size of the naturally aligned window we can compare-exchange in one go
+#ifdef _M_X64
+#define MHOOKS_ATOMIC_WINDOW	16
+#else
+#define MHOOKS_ATOMIC_WINDOW	8
+#endif
 
 //=========================================================================
 // The trampoline structure - stores every bit of info about a hook
 struct MHOOKS_TRAMPOLINE {
 	PBYTE	pSystemFunction;								// the original system function
 	DWORD	cbOverwrittenCode;								// number of bytes overwritten by the jump
+	DWORD	dwInstallMode;									// MHOOKS_INSTALL_*
 	PBYTE	pHookFunction;									// the hook function that we provide
+	MHOOK_STATS* pStats;									// call statistics of an instrumented hook, or NULL
+	PBYTE	pbProbeExit;									// where timed calls return to (in codeProbe)
+	BOOL	bContextHook;									// codeProbe calls back with the registers
+	volatile LONG* plDisabled;								// switch of a switchable hook (heap, so it stays
+															//   writable), or NULL
+	struct MHOOKS_DISPATCH* pDispatch;						// state of chained hooks, or NULL
+	DWORD	nInstructions;									// instructions in the overwrite zone
+	BYTE	originalOffsets[MHOOKS_MAX_INSTRUCTIONS];		// where each of them starts in the system function
+	BYTE	relocatedOffsets[MHOOKS_MAX_INSTRUCTIONS];		//   and where its copy starts in codeTrampoline
 	BYTE	codeJumpToHookFunction[MHOOKS_MAX_CODE_BYTES];	// placeholder for code that jumps to the hook function
-	BYTE	codeTrampoline[MHOOKS_MAX_CODE_BYTES];			// placeholder for code that holds the first few
-															//   bytes from the system function and a jump to the remainder
-															//   in the original location
+	BYTE	codeTrampoline[MHOOKS_MAX_TRAMPOLINE_BYTES];	// placeholder for code that holds the first few
+															//   instructions from the system function, relocated,
+															//   and a jump to the remainder in the original location
 	BYTE	codeUntouched[MHOOKS_MAX_CODE_BYTES];			// placeholder for unmodified original code
 															//   (we patch IP-relative addressing)
+	BYTE	codeProbe[MHOOKS_MAX_PROBE_BYTES];				// thunks that time an instrumented hook
+	BYTE	codeGate[MHOOKS_MAX_GATE_BYTES];				// skips a switched off hook
+	BYTE	codeDispatch[MHOOKS_MAX_CALLOUT_BYTES];			// jumps to the first hook of the chain
+	BYTE	codeLinks[MHOOKS_MAX_CHAINED_HOOKS][MHOOKS_MAX_CALLOUT_BYTES];
+															// what chained hooks call as the original
+															//   function: jump to the next hook of the chain
+};
+
+// trampolines are handed out in cache line aligned slots
+#define MHOOKS_TRAMPOLINE_SLOT	((sizeof(MHOOKS_TRAMPOLINE) + 63) & ~(DWORD_PTR)63)
+
+//=========================================================================
+// Several hooks on one function are called one after the other: the
+// system function jumps to the dispatcher, which calls the newest hook.
+// Each hook calls on through its link, which finds the next hook in the
+// chain, down to the trampoline. Chains are never modified once they are
+// published; adding or removing a hook swaps in a new one. Replaced chains
+// don't make a reclamation happen, which would suspend all threads on a
+// path that promises not to; they are freed by the next one that retired
+// trampolines set off, or along with the trampoline.
+struct MHOOKS_CHAIN_ENTRY
+{
+	PBYTE	pHookFunction;
+	DWORD	nLink;				// index into codeLinks, or MHOOKS_CHAIN_BASE
+};
+
+struct MHOOKS_CHAIN
+{
+	MHOOKS_CHAIN*		pPrevious;		// replaced chains, which may still be walked
+	DWORD				nHandlers;
+	MHOOKS_CHAIN_ENTRY	entries[MHOOKS_MAX_CHAINED_HOOKS + 1];
+};
+
+struct MHOOKS_DISPATCH
+{
+	MHOOKS_CHAIN* volatile	pChain;			// the current chain
+	DWORD					dwLinksInUse;	// bit mask of codeLinks handed out
+	BOOL					bDispatching;	// system function jumps to the dispatcher
 };
 
 
 //=========================================================================
-// The patch data structures - store info about rip-relative instructions
-// during hook placement
-struct MHOOKS_RIPINFO
+// The patch data structures - store info about the instructions in the
+// overwrite zone and how to relocate them during hook placement
+struct MHOOKS_INSTRUCTION
 {
-	DWORD	dwOffset;
-	S64		nDisplacement;
+	DWORD	dwOffset;		// offset from the start of the overwrite zone
+	DWORD	cbLength;		// length of the original instruction
+	DWORD	dwReloc;		// MHOOKS_RELOC_*
+	DWORD	dwDispOffset;	// IPREL: offset of the 32-bit displacement in the instruction
+	BYTE	bOpcode;		// JCC: condition code, LOOP: opcode
+	PBYTE	pbTarget;		// absolute address a relative operand refers to
 };
 
 struct MHOOKS_PATCHDATA
 {
-	S64				nLimitUp;
-	S64				nLimitDown;
-	DWORD			nRipCnt;
-	MHOOKS_RIPINFO	rips[MHOOKS_MAX_RIPS];
+	S64					nLimitUp;
+	S64					nLimitDown;
+	DWORD				nInstructions;
+	MHOOKS_INSTRUCTION	instructions[MHOOKS_MAX_INSTRUCTIONS];
+};
+
+//=========================================================================
+// The hook registry keeps every trampoline in two sorted indexes, one by
+// hooked system function and one by trampoline address. The entries carry
+// both keys so lookups never have to touch the trampoline pages.
+struct MHOOKS_REGISTRY_ENTRY
+{
+	PBYTE				pSystemFunction;
+	MHOOKS_TRAMPOLINE*	pTrampoline;
+};
+
+//=========================================================================
+// The free-region map caches the free parts of the address space, in whole
+// allocation granularity blocks, so trampolines can be placed without
+// walking the address space for every hook.
+struct MHOOKS_FREE_REGION
+{
+	PBYTE	pbStart;
+	PBYTE	pbEnd;
+};
+
+//=========================================================================
+// A block the trampolines live in. Each block is reserved from the free
+// region map and given back to it once its last trampoline is released.
+struct MHOOKS_TRAMPOLINE_BLOCK
+{
+	PBYTE		pbBase;
+	ULONGLONG	qwSlotsInUse;	// bit mask of slots handed out
+};
+
+//=========================================================================
+// Calls into instrumented hooks that are waiting to return, per thread.
+// The exit thunk pops the innermost one.
+struct MHOOKS_PROBE_FRAME
+{
+	MHOOK_STATS*	pStats;
+	PBYTE			pReturnAddress;		// where the call really returns to
+	ULONGLONG		qwEntryTsc;
+};
+
+struct MHOOKS_PROBE_THREAD
+{
+	DWORD				nDepth;
+	MHOOKS_PROBE_FRAME	frames[MHOOKS_PROBE_DEPTH];
+};
+
+//=========================================================================
+// A hook that works by swapping a single function pointer the hooked code
+// calls through, such as an import address table entry.
+struct MHOOKS_POINTER_HOOK
+{
+	PVOID*	ppSlot;				// the pointer that was swapped
+	PVOID	pOriginal;			// what it pointed to before
+	PVOID	pHookFunction;		// what it points to now
+	PVOID*	ppFunction;			// the caller's function pointer, identifies the hook
+};
+
+//=========================================================================
+// A private copy of a virtual function table, which objects hooked on
+// their own point to instead of their class's table. Copies live as long
+// as the process, as any object may still be using them.
+struct MHOOKS_VTABLE_CLONE
+{
+	PVOID*	pVtable;			// the class's table
+	PVOID*	pClone;				// the copy, which starts with the entries in front of the table
+	DWORD	nSlots;				// virtual functions copied
+};
+
+//=========================================================================
+// A queued hook or unhook operation. Transactions collect these and apply
+// them all while the other threads are suspended once.
+struct MHOOKS_PATCH_OP
+{
+	BOOL				bUnhook;			// remove a hook instead of setting one
+	PVOID*				ppFunction;			// the caller's function pointer, updated on commit
+	PVOID				pHookFunction;		// the hook function (when setting a hook)
+	PVOID				pHookArg;			// what a context hook's callback gets passed
+	const MHOOK_PLAN*	pPlan;				// how to hook the function, worked out beforehand
+	DWORD				dwFlags;			// MHOOK_* flags (when setting a hook)
+	BOOL				bChained;			// only adds to or removes from a dispatch chain
+	DWORD				nLink;				// link of the hook added to or removed from a chain
+	BOOL				bSuspend;			// other threads must be suspended for this operation
+	BOOL				bBlocked;			// a suspended thread is stuck in the code to be patched
+	BOOL				bThreadsMoved;		// suspended threads were moved into the trampoline
+	MHOOKS_CHAIN*		pChain;				// new chain to publish, allocated up front
+	MHOOKS_DISPATCH*	pDispatch;			// dispatcher state for a function's first chained hook
+	MHOOKS_TRAMPOLINE*	pTrampoline;		// trampoline prepared for (or found by) this operation
+	PBYTE				pbJumpTo;			// where the patched system function will jump to
+	BOOL*				pbResult;			// optional result slot for the caller
+	BOOL				bResult;			// result of this operation
 };
 
 //=========================================================================
 // Global vars
 static BOOL g_bVarsInitialized = FALSE;
 static CRITICAL_SECTION g_cs;
-static MHOOKS_TRAMPOLINE* g_pHooks[MHOOKS_MAX_SUPPORTED_HOOKS];
+static MHOOKS_REGISTRY_ENTRY* g_pHooksByFunction = NULL;	// sorted by hooked system function
+static MHOOKS_REGISTRY_ENTRY* g_pHooksByTrampoline = NULL;	// sorted by trampoline address
 static DWORD g_nHooksInUse = 0;
-static HANDLE* g_hThreadHandles = NULL;
+static DWORD g_nHooksAlloc = 0;
+static HANDLE* g_hThreadHandles = NULL;		// kept between suspensions
 static DWORD g_nThreadHandles = 0;
+static DWORD g_nThreadHandlesAlloc = 0;
+static BOOL g_bAllThreadsSuspended = FALSE;
+static MHOOKS_TRAMPOLINE** g_pRetired = NULL;	// unhooked trampolines waiting to be freed
+static DWORD g_nRetired = 0;
+static DWORD g_nRetiredAlloc = 0;
+static DWORD g_nReclaimAt = MHOOKS_RECLAIM_THRESHOLD;	// g_nRetired that sets off reclamation
+static MHOOKS_FREE_REGION* g_pFreeRegions = NULL;	// sorted by address, never adjacent
+static DWORD g_nFreeRegions = 0;
+static DWORD g_nFreeRegionsAlloc = 0;
+static BOOL g_bFreeRegionsValid = FALSE;
+static MHOOKS_TRAMPOLINE_BLOCK* g_pTrampolineBlocks = NULL;
+static DWORD g_nTrampolineBlocks = 0;
+static DWORD g_nTrampolineBlocksAlloc = 0;
+static DWORD_PTR g_dwAllocationGranularity = 0;
+static DWORD g_dwTransactionThread = 0;			// thread with a transaction open, or 0
+static MHOOKS_PATCH_OP* g_pTransactionOps = NULL;
+static DWORD g_nTransactionOps = 0;
+static DWORD g_nTransactionOpsAlloc = 0;
+static DWORD g_dwProbeTls = TLS_OUT_OF_INDEXES;
+static MHOOK_TIMINGS g_timings = {};
+static ULONGLONG g_qwSuspendStart = 0;			// rdtsc when the other threads got stopped, or 0
+static MHOOKS_POINTER_HOOK* g_pPointerHooks = NULL;
+static DWORD g_nPointerHooks = 0;
+static DWORD g_nPointerHooksAlloc = 0;
+static MHOOKS_VTABLE_CLONE* g_pVtableClones = NULL;
+static DWORD g_nVtableClones = 0;
+static DWORD g_nVtableClonesAlloc = 0;
+// marks a thread whose probe buffer is being allocated, in case the
+// allocator itself is instrumented
+#define MHOOKS_PROBE_BUSY ((MHOOKS_PROBE_THREAD*)1)
 #define MHOOK_JMPSIZE 5
+#define MHOOK_SHORTJMPSIZE 2
 
 //=========================================================================
 // Toolhelp defintions so the functions can be dynamically bound to
@@ -167,7 +397,6 @@ _Thread32Next fnThread32Next = (_Thread32Next) GetProcAddress(GetModuleHandle(L"
 static VOID EnterCritSec() {
 	if (!g_bVarsInitialized) {
 		InitializeCriticalSection(&g_cs);
-		ZeroMemory(g_pHooks, sizeof(g_pHooks));
 		g_bVarsInitialized = TRUE;
 	}
 	EnterCriticalSection(&g_cs);
@@ -178,6 +407,18 @@ static VOID LeaveCritSec() {
 	LeaveCriticalSection(&g_cs);
 }
 
+//=========================================================================
+// Internal function:
+//
+// Account for something mhook did that took qwTicks.
+//=========================================================================
+static VOID TimingAdd(ULONGLONG* pnCount, ULONGLONG* pqwTotal, ULONGLONG* pqwMax, ULONGLONG qwTicks) {
+	(*pnCount)++;
+	*pqwTotal += qwTicks;
+	if (qwTicks > *pqwMax)
+		*pqwMax = qwTicks;
+}
+
 //=========================================================================
 // Internal function:
 // 
@@ -268,548 +509,2913 @@ static PBYTE EmitJump(PBYTE pbCode, PBYTE pbJumpTo) {
 //=========================================================================
 // Internal function:
 //
-// Will try to allocate the trampoline structure within 2 gigabytes of
-// the target function. 
+// Build a 5-byte relative jump in a buffer, as it will look once it is
+// written to pbCode.
 //=========================================================================
-static MHOOKS_TRAMPOLINE* TrampolineAlloc(PBYTE pSystemFunction, S64 nLimitUp, S64 nLimitDown) {
+static VOID BuildNearJump(BYTE pbBuffer[MHOOK_JMPSIZE], PBYTE pbCode, PBYTE pbJumpTo) {
+	pbBuffer[0] = 0xe9;
+	*((PDWORD)&pbBuffer[1]) = (DWORD)(DWORD_PTR)(pbJumpTo - (pbCode + MHOOK_JMPSIZE));
+}
 
-	MHOOKS_TRAMPOLINE* pTrampoline = NULL;
+//=========================================================================
+// Internal function:
+//
+// Check whether a code range lies within one naturally aligned window
+// that AtomicPatch can replace in a single operation.
+//=========================================================================
+static BOOL CanPatchAtomically(PBYTE pbCode, DWORD cbBytes) {
+	return ((ULONG_PTR)pbCode % MHOOKS_ATOMIC_WINDOW) + cbBytes <= MHOOKS_ATOMIC_WINDOW;
+}
 
-	// do we have room to store this guy?
-	if (g_nHooksInUse < MHOOKS_MAX_SUPPORTED_HOOKS) {
-
-		// determine lower and upper bounds for the allocation locations.
-		// in the basic scenario this is +/- 2GB but IP-relative instructions
-		// found in the original code may require a smaller window.
-		PBYTE pLower = pSystemFunction + nLimitUp;
-		pLower = pLower < (PBYTE)(DWORD_PTR)0x0000000080000000 ? 
-							(PBYTE)(0x1) : (PBYTE)(pLower - (PBYTE)0x7fff0000);
-		PBYTE pUpper = pSystemFunction + nLimitDown;
-		pUpper = pUpper < (PBYTE)(DWORD_PTR)0xffffffff80000000 ? 
-			(PBYTE)(pUpper + (DWORD_PTR)0x7ff80000) : (PBYTE)(DWORD_PTR)0xfffffffffff80000;
-		ODPRINTF((L"mhooks: TrampolineAlloc: Allocating for %p between %p and %p", pSystemFunction, pLower, pUpper));
-
-		SYSTEM_INFO sSysInfo =  {0};
-		::GetSystemInfo(&sSysInfo);
-
-		// go through the available memory blocks and try to allocate a chunk for us
-		for (PBYTE pbAlloc = pLower; pbAlloc < pUpper;) {
-			// determine current state
-			MEMORY_BASIC_INFORMATION mbi;
-			ODPRINTF((L"mhooks: TrampolineAlloc: Looking at address %p", pbAlloc));
-			if (!VirtualQuery(pbAlloc, &mbi, sizeof(mbi)))
-				break;
-			// free & large enough?
-			if (mbi.State == MEM_FREE && mbi.RegionSize >= sizeof(MHOOKS_TRAMPOLINE) && mbi.RegionSize >= sSysInfo.dwAllocationGranularity) {
-				// yes, align the pointer to the 64K boundary first
-				pbAlloc = (PBYTE)(ULONG_PTR((ULONG_PTR(pbAlloc) + (sSysInfo.dwAllocationGranularity-1)) / sSysInfo.dwAllocationGranularity) * sSysInfo.dwAllocationGranularity);
-				// and then try to allocate it
-				pTrampoline = (MHOOKS_TRAMPOLINE*)VirtualAlloc(pbAlloc, sizeof(MHOOKS_TRAMPOLINE), MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READ);
-				if (pTrampoline) {
-					ODPRINTF((L"mhooks: TrampolineAlloc: Allocated block at %p as the trampoline", pTrampoline));
-					break;
-				}
-			}
-			// continue the search
-			pbAlloc = (PBYTE)mbi.BaseAddress + mbi.RegionSize;
-		}
-
-		// found and allocated a trampoline?
-		if (pTrampoline) {
-			// put it into our list so we know we'll have to free it
-			for (DWORD i=0; i<MHOOKS_MAX_SUPPORTED_HOOKS; i++) {
-				if (g_pHooks[i] == NULL) {
-					g_pHooks[i] = pTrampoline;
-					g_nHooksInUse++;
-					break;
-				}
-			}
-		}
+//=========================================================================
+// Internal function:
+//
+// Write a few bytes of code with a single interlocked compare-exchange,
+// so that a thread running through them sees either all of the old or
+// all of the new bytes. The surrounding bytes in the window are written
+// back unchanged. The code must be writable.
+//=========================================================================
+static BOOL AtomicPatch(PBYTE pbCode, const BYTE* pbNewCode, DWORD cbBytes) {
+	if (!CanPatchAtomically(pbCode, cbBytes))
+		return FALSE;
+	PBYTE pbWindow = (PBYTE)((ULONG_PTR)pbCode & ~(ULONG_PTR)(MHOOKS_ATOMIC_WINDOW - 1));
+	DWORD dwOffset = (DWORD)(pbCode - pbWindow);
+#ifdef _M_X64
+	DECLSPEC_ALIGN(16) LONG64 nExpected[2];
+	LONG64 nDesired[2];
+	nExpected[0] = ((volatile LONG64*)pbWindow)[0];
+	nExpected[1] = ((volatile LONG64*)pbWindow)[1];
+	// a torn read just makes the first exchange fail and reload the window
+	do {
+		CopyMemory(nDesired, nExpected, sizeof(nDesired));
+		CopyMemory((PBYTE)nDesired + dwOffset, pbNewCode, cbBytes);
+	} while (!_InterlockedCompareExchange128((volatile LONG64*)pbWindow, nDesired[1], nDesired[0], nExpected));
+#else
+	LONG64 nExpected = *(volatile LONG64*)pbWindow;
+	for (;;) {
+		LONG64 nDesired = nExpected;
+		CopyMemory((PBYTE)&nDesired + dwOffset, pbNewCode, cbBytes);
+		LONG64 nPrevious = _InterlockedCompareExchange64((volatile LONG64*)pbWindow, nDesired, nExpected);
+		if (nPrevious == nExpected)
+			break;
+		nExpected = nPrevious;
 	}
+#endif
+	return TRUE;
+}
 
-	return pTrampoline;
+//=========================================================================
+// Internal function:
+//
+// Check for a hot-patch point: the function starts with the "mov edi, edi"
+// (8b ff) that MSVC's /hotpatch emits for this purpose and is preceded by
+// at least five bytes of int3 padding that can hold a jump. Other two-byte
+// instructions may be branch targets, and nop padding may be code that
+// falls through into the function.
+//=========================================================================
+static BOOL IsHotPatchPoint(PBYTE pbCode, DWORD cbFirstInstruction) {
+	if (cbFirstInstruction != MHOOK_SHORTJMPSIZE || pbCode[0] != 0x8b || pbCode[1] != 0xff ||
+		!CanPatchAtomically(pbCode, MHOOK_SHORTJMPSIZE))
+		return FALSE;
+	PBYTE pbPadding = pbCode - MHOOK_JMPSIZE;
+	// the padding may live on the previous page - make sure we can read it
+	if (((ULONG_PTR)pbCode & 0xfff) < MHOOK_JMPSIZE) {
+		MEMORY_BASIC_INFORMATION mbi;
+		if (!VirtualQuery(pbPadding, &mbi, sizeof(mbi)) || mbi.State != MEM_COMMIT)
+			return FALSE;
+	}
+	for (DWORD i = 0; i < MHOOK_JMPSIZE; i++) {
+		if (pbPadding[i] != 0xcc)
+			return FALSE;
+	}
+	return TRUE;
 }
 
 //=========================================================================
 // Internal function:
 //
-// Return the internal trampoline structure that belongs to a hooked function.
+// Return the range of code that installing a hook writes to.
 //=========================================================================
-static MHOOKS_TRAMPOLINE* TrampolineGet(PBYTE pHookedFunction) {
-	for (DWORD i=0; i<MHOOKS_MAX_SUPPORTED_HOOKS; i++) {
-		if (g_pHooks[i]) {
-			if (g_pHooks[i]->codeTrampoline == pHookedFunction)
-				return g_pHooks[i];
-		}
+static VOID GetPatchRange(MHOOKS_TRAMPOLINE* pTrampoline, PBYTE* ppbStart, DWORD* pcbBytes) {
+	*ppbStart = pTrampoline->pSystemFunction;
+	*pcbBytes = pTrampoline->cbOverwrittenCode;
+	if (pTrampoline->dwInstallMode == MHOOKS_INSTALL_HOTPATCH) {
+		*ppbStart -= MHOOK_JMPSIZE;
+		*pcbBytes += MHOOK_JMPSIZE;
 	}
-	return NULL;
 }
 
 //=========================================================================
 // Internal function:
 //
-// Free a trampoline structure.
+// Binary search in one of the registry indexes. Returns the position of
+// the first entry whose key is not below pKey.
 //=========================================================================
-static VOID TrampolineFree(MHOOKS_TRAMPOLINE* pTrampoline, BOOL bNeverUsed) {
-	for (DWORD i=0; i<MHOOKS_MAX_SUPPORTED_HOOKS; i++) {
-		if (g_pHooks[i] == pTrampoline) {
-			g_pHooks[i] = NULL;
-			// It might be OK to call VirtualFree, but quite possibly it isn't: 
-			// If a thread has some of our trampoline code on its stack
-			// and we yank the region from underneath it then it will
-			// surely crash upon returning. So instead of freeing the 
-			// memory we just let it leak. Ugly, but safe.
-			if (bNeverUsed)
-				VirtualFree(pTrampoline, 0, MEM_RELEASE);
-			g_nHooksInUse--;
-			break;
-		}
+static inline PBYTE RegistryKey(const MHOOKS_REGISTRY_ENTRY& entry, BOOL bByFunction) {
+	return bByFunction ? entry.pSystemFunction : (PBYTE)entry.pTrampoline;
+}
+
+static DWORD RegistryLowerBound(MHOOKS_REGISTRY_ENTRY* pIndex, PBYTE pKey, BOOL bByFunction) {
+	DWORD nLow = 0, nHigh = g_nHooksInUse;
+	while (nLow < nHigh) {
+		DWORD nMid = nLow + (nHigh - nLow) / 2;
+		if (RegistryKey(pIndex[nMid], bByFunction) < pKey)
+			nLow = nMid + 1;
+		else
+			nHigh = nMid;
 	}
+	return nLow;
 }
 
 //=========================================================================
 // Internal function:
 //
-// Suspend a given thread and try to make sure that its instruction
-// pointer is not in the given range.
+// Add a trampoline to both registry indexes, growing them as needed.
 //=========================================================================
-static HANDLE SuspendOneThread(DWORD dwThreadId, PBYTE pbCode, DWORD cbBytes) {
-	// open the thread
-	HANDLE hThread = OpenThread(THREAD_ALL_ACCESS, FALSE, dwThreadId);
-	if (GOOD_HANDLE(hThread)) {
-		// attempt suspension
-		DWORD dwSuspendCount = SuspendThread(hThread);
-		if (dwSuspendCount != -1) {
-			// see where the IP is
-			CONTEXT ctx;
-			ctx.ContextFlags = CONTEXT_CONTROL;
-			int nTries = 0;
-			while (GetThreadContext(hThread, &ctx)) {
-#ifdef _M_IX86
-				PBYTE pIp = (PBYTE)(DWORD_PTR)ctx.Eip;
-#elif defined _M_X64
-				PBYTE pIp = (PBYTE)(DWORD_PTR)ctx.Rip;
-#endif
-				if (pIp >= pbCode && pIp < (pbCode + cbBytes)) {
-					if (nTries < 3) {
-						// oops - we should try to get the instruction pointer out of here. 
-						ODPRINTF((L"mhooks: SuspendOneThread: suspended thread %d - IP is at %p - IS COLLIDING WITH CODE", dwThreadId, pIp));
-						ResumeThread(hThread);
-						Sleep(100);
-						SuspendThread(hThread);
-						nTries++;
-					} else {
-						// we gave it all we could. (this will probably never 
-						// happen - unless the thread has already been suspended 
-						// to begin with)
-						ODPRINTF((L"mhooks: SuspendOneThread: suspended thread %d - IP is at %p - IS COLLIDING WITH CODE - CAN'T FIX", dwThreadId, pIp));
-						ResumeThread(hThread);
-						CloseHandle(hThread);
-						hThread = NULL;
-						break;
-					}
-				} else {
-					// success, the IP is not conflicting
-					ODPRINTF((L"mhooks: SuspendOneThread: Successfully suspended thread %d - IP is at %p", dwThreadId, pIp));
-					break;
-				}
-			}
-		} else {
-			// couldn't suspend
-			CloseHandle(hThread);
-			hThread = NULL;
-		}
+static BOOL RegistryInsert(MHOOKS_TRAMPOLINE* pTrampoline, PBYTE pSystemFunction) {
+	if (g_nHooksInUse == g_nHooksAlloc) {
+		DWORD nAlloc = g_nHooksAlloc ? 2 * g_nHooksAlloc : 64;
+		MHOOKS_REGISTRY_ENTRY* pByFunction = (MHOOKS_REGISTRY_ENTRY*)realloc(g_pHooksByFunction, nAlloc * sizeof(MHOOKS_REGISTRY_ENTRY));
+		if (!pByFunction)
+			return FALSE;
+		g_pHooksByFunction = pByFunction;
+		MHOOKS_REGISTRY_ENTRY* pByTrampoline = (MHOOKS_REGISTRY_ENTRY*)realloc(g_pHooksByTrampoline, nAlloc * sizeof(MHOOKS_REGISTRY_ENTRY));
+		if (!pByTrampoline)
+			return FALSE;
+		g_pHooksByTrampoline = pByTrampoline;
+		g_nHooksAlloc = nAlloc;
 	}
-	return hThread;
+	MHOOKS_REGISTRY_ENTRY entry = { pSystemFunction, pTrampoline };
+	MHOOKS_REGISTRY_ENTRY* pIndexes[2] = { g_pHooksByFunction, g_pHooksByTrampoline };
+	for (int i=0; i<2; i++) {
+		MHOOKS_REGISTRY_ENTRY* pIndex = pIndexes[i];
+		DWORD nPos = RegistryLowerBound(pIndex, RegistryKey(entry, i == 0), i == 0);
+		MoveMemory(&pIndex[nPos + 1], &pIndex[nPos], (g_nHooksInUse - nPos) * sizeof(MHOOKS_REGISTRY_ENTRY));
+		pIndex[nPos] = entry;
+	}
+	g_nHooksInUse++;
+	return TRUE;
 }
 
 //=========================================================================
 // Internal function:
 //
-// Resumes all previously suspended threads in the current process.
+// Remove a trampoline from both registry indexes.
 //=========================================================================
-static VOID ResumeOtherThreads() {
-	// make sure things go as fast as possible
-	INT nOriginalPriority = GetThreadPriority(GetCurrentThread());
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
-	// go through our list
-	for (DWORD i=0; i<g_nThreadHandles; i++) {
-		// and resume & close thread handles
-		ResumeThread(g_hThreadHandles[i]);
-		CloseHandle(g_hThreadHandles[i]);
+static BOOL RegistryRemove(MHOOKS_TRAMPOLINE* pTrampoline) {
+	DWORD nTrampolinePos = RegistryLowerBound(g_pHooksByTrampoline, (PBYTE)pTrampoline, FALSE);
+	if (nTrampolinePos == g_nHooksInUse || g_pHooksByTrampoline[nTrampolinePos].pTrampoline != pTrampoline)
+		return FALSE;
+	// several trampolines may briefly share a system function while a
+	// transaction is being prepared, so look for the exact entry
+	PBYTE pSystemFunction = g_pHooksByTrampoline[nTrampolinePos].pSystemFunction;
+	DWORD nFunctionPos = RegistryLowerBound(g_pHooksByFunction, pSystemFunction, TRUE);
+	while (g_pHooksByFunction[nFunctionPos].pTrampoline != pTrampoline)
+		nFunctionPos++;
+	g_nHooksInUse--;
+	MoveMemory(&g_pHooksByTrampoline[nTrampolinePos], &g_pHooksByTrampoline[nTrampolinePos + 1], (g_nHooksInUse - nTrampolinePos) * sizeof(MHOOKS_REGISTRY_ENTRY));
+	MoveMemory(&g_pHooksByFunction[nFunctionPos], &g_pHooksByFunction[nFunctionPos + 1], (g_nHooksInUse - nFunctionPos) * sizeof(MHOOKS_REGISTRY_ENTRY));
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Position of the first free region that starts above pbAddress.
+//=========================================================================
+static DWORD FreeMapUpperBound(PBYTE pbAddress) {
+	DWORD nLow = 0, nHigh = g_nFreeRegions;
+	while (nLow < nHigh) {
+		DWORD nMid = nLow + (nHigh - nLow) / 2;
+		if (g_pFreeRegions[nMid].pbStart <= pbAddress)
+			nLow = nMid + 1;
+		else
+			nHigh = nMid;
 	}
-	// clean up
-	free(g_hThreadHandles);
-	g_hThreadHandles = NULL;
-	g_nThreadHandles = 0;
-	SetThreadPriority(GetCurrentThread(), nOriginalPriority);
+	return nLow;
 }
 
 //=========================================================================
 // Internal function:
 //
-// Suspend all threads in this process while trying to make sure that their 
-// instruction pointer is not in the given range.
+// Record a range of the address space as free. Only whole allocation
+// granularity blocks are kept, merged with free neighbours.
 //=========================================================================
-static BOOL SuspendOtherThreads(PBYTE pbCode, DWORD cbBytes) {
-	BOOL bRet = FALSE;
-	// make sure we're the most important thread in the process
-	INT nOriginalPriority = GetThreadPriority(GetCurrentThread());
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
-	// get a view of the threads in the system
-	HANDLE hSnap = fnCreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, GetCurrentProcessId());
-	if (GOOD_HANDLE(hSnap)) {
-		THREADENTRY32 te;
-		te.dwSize = sizeof(te);
-		// count threads in this process (except for ourselves)
-		DWORD nThreadsInProcess = 0;
-		if (fnThread32First(hSnap, &te)) {
-			do {
-				if (te.th32OwnerProcessID == GetCurrentProcessId()) {
-					if (te.th32ThreadID != GetCurrentThreadId()) {
-						nThreadsInProcess++;
-					}
-				}
-				te.dwSize = sizeof(te);
-			} while(fnThread32Next(hSnap, &te));
-		}
-		ODPRINTF((L"mhooks: SuspendOtherThreads: counted %d other threads", nThreadsInProcess));
-		if (nThreadsInProcess) {
-			// alloc buffer for the handles we really suspended
-			g_hThreadHandles = (HANDLE*)malloc(nThreadsInProcess*sizeof(HANDLE));
-			if (g_hThreadHandles) {
-				ZeroMemory(g_hThreadHandles, nThreadsInProcess*sizeof(HANDLE));
-				DWORD nCurrentThread = 0;
-				BOOL bFailed = FALSE;
-				te.dwSize = sizeof(te);
-				// go through every thread
-				if (fnThread32First(hSnap, &te)) {
-					do {
-						if (te.th32OwnerProcessID == GetCurrentProcessId()) {
-							if (te.th32ThreadID != GetCurrentThreadId()) {
-								// attempt to suspend it
-								g_hThreadHandles[nCurrentThread] = SuspendOneThread(te.th32ThreadID, pbCode, cbBytes);
-								if (GOOD_HANDLE(g_hThreadHandles[nCurrentThread])) {
-									ODPRINTF((L"mhooks: SuspendOtherThreads: successfully suspended %d", te.th32ThreadID));
-									nCurrentThread++;
-								} else {
-									ODPRINTF((L"mhooks: SuspendOtherThreads: error while suspending thread %d: %d", te.th32ThreadID, gle()));
-									// TODO: this might not be the wisest choice
-									// but we can choose to ignore failures on
-									// thread suspension. It's pretty unlikely that
-									// we'll fail - and even if we do, the chances
-									// of a thread's IP being in the wrong place
-									// is pretty small.
-									// bFailed = TRUE;
-								}
-							}
-						}
-						te.dwSize = sizeof(te);
-					} while(fnThread32Next(hSnap, &te) && !bFailed);
-				}
-				g_nThreadHandles = nCurrentThread;
-				bRet = !bFailed;
-			}
+static VOID FreeMapAdd(PBYTE pbStart, PBYTE pbEnd) {
+	DWORD_PTR dwGranularity = g_dwAllocationGranularity;
+	pbStart = (PBYTE)(((DWORD_PTR)pbStart + dwGranularity - 1) & ~(dwGranularity - 1));
+	pbEnd = (PBYTE)((DWORD_PTR)pbEnd & ~(dwGranularity - 1));
+	if (pbEnd <= pbStart)
+		return;
+	DWORD nPos = FreeMapUpperBound(pbStart);
+	// merge with the region before and/or after
+	if (nPos > 0 && g_pFreeRegions[nPos - 1].pbEnd >= pbStart) {
+		if (g_pFreeRegions[nPos - 1].pbEnd < pbEnd)
+			g_pFreeRegions[nPos - 1].pbEnd = pbEnd;
+		while (nPos < g_nFreeRegions && g_pFreeRegions[nPos].pbStart <= g_pFreeRegions[nPos - 1].pbEnd) {
+			if (g_pFreeRegions[nPos - 1].pbEnd < g_pFreeRegions[nPos].pbEnd)
+				g_pFreeRegions[nPos - 1].pbEnd = g_pFreeRegions[nPos].pbEnd;
+			MoveMemory(&g_pFreeRegions[nPos], &g_pFreeRegions[nPos + 1], (--g_nFreeRegions - nPos) * sizeof(MHOOKS_FREE_REGION));
 		}
-		CloseHandle(hSnap);
-		//TODO: we might want to have another pass to make sure all threads
-		// in the current process (including those that might have been
-		// created since we took the original snapshot) have been 
-		// suspended.
-	} else {
-		ODPRINTF((L"mhooks: SuspendOtherThreads: can't CreateToolhelp32Snapshot: %d", gle()));
+		return;
 	}
-	SetThreadPriority(GetCurrentThread(), nOriginalPriority);
-	if (!bRet) {
-		ODPRINTF((L"mhooks: SuspendOtherThreads: Had a problem (or not running multithreaded), resuming all threads."));
-		ResumeOtherThreads();
+	if (nPos < g_nFreeRegions && g_pFreeRegions[nPos].pbStart <= pbEnd) {
+		g_pFreeRegions[nPos].pbStart = pbStart;
+		if (g_pFreeRegions[nPos].pbEnd < pbEnd)
+			g_pFreeRegions[nPos].pbEnd = pbEnd;
+		return;
 	}
-	return bRet;
+	if (g_nFreeRegions == g_nFreeRegionsAlloc) {
+		DWORD nAlloc = g_nFreeRegionsAlloc ? 2 * g_nFreeRegionsAlloc : 256;
+		MHOOKS_FREE_REGION* pRegions = (MHOOKS_FREE_REGION*)realloc(g_pFreeRegions, nAlloc * sizeof(MHOOKS_FREE_REGION));
+		// without room the range simply won't be used for trampolines
+		if (!pRegions)
+			return;
+		g_pFreeRegions = pRegions;
+		g_nFreeRegionsAlloc = nAlloc;
+	}
+	MoveMemory(&g_pFreeRegions[nPos + 1], &g_pFreeRegions[nPos], (g_nFreeRegions - nPos) * sizeof(MHOOKS_FREE_REGION));
+	g_pFreeRegions[nPos].pbStart = pbStart;
+	g_pFreeRegions[nPos].pbEnd = pbEnd;
+	g_nFreeRegions++;
 }
 
 //=========================================================================
-// if IP-relative addressing has been detected, fix up the code so the
-// offset points to the original location
-static void FixupIPRelativeAddressing(PBYTE pbNew, PBYTE pbOriginal, MHOOKS_PATCHDATA* pdata)
-{
-#if defined _M_X64
-	S64 diff = pbNew - pbOriginal;
-	for (DWORD i = 0; i < pdata->nRipCnt; i++) {
-		DWORD dwNewDisplacement = (DWORD)(pdata->rips[i].nDisplacement - diff);
-		ODPRINTF((L"mhooks: fixing up RIP instruction operand for code at 0x%p: "
-			L"old displacement: 0x%8.8x, new displacement: 0x%8.8x", 
-			pbNew + pdata->rips[i].dwOffset, 
-			(DWORD)pdata->rips[i].nDisplacement, 
-			dwNewDisplacement));
-		*(PDWORD)(pbNew + pdata->rips[i].dwOffset) = dwNewDisplacement;
+// Internal function:
+//
+// Take one allocation granularity block at pbBlock out of the map.
+//=========================================================================
+static VOID FreeMapRemove(PBYTE pbBlock) {
+	DWORD nPos = FreeMapUpperBound(pbBlock);
+	if (nPos == 0 || g_pFreeRegions[nPos - 1].pbEnd <= pbBlock)
+		return;
+	MHOOKS_FREE_REGION* pRegion = &g_pFreeRegions[nPos - 1];
+	PBYTE pbEnd = pRegion->pbEnd;
+	pRegion->pbEnd = pbBlock;
+	if (pRegion->pbStart == pbBlock) {
+		MoveMemory(pRegion, pRegion + 1, (--g_nFreeRegions - (nPos - 1)) * sizeof(MHOOKS_FREE_REGION));
 	}
-#endif
+	FreeMapAdd(pbBlock + g_dwAllocationGranularity, pbEnd);
 }
 
 //=========================================================================
-// Examine the machine code at the target function's entry point, and
-// skip bytes in a way that we'll always end on an instruction boundary.
-// We also detect branches and subroutine calls (as well as returns)
-// at which point disassembly must stop.
-// Finally, detect and collect information on IP-relative instructions
-// that we can patch.
-static DWORD DisassembleAndSkip(PVOID pFunction, DWORD dwMinLen, MHOOKS_PATCHDATA* pdata) {
-	DWORD dwRet = 0;
-	pdata->nLimitDown = 0;
-	pdata->nLimitUp = 0;
-	pdata->nRipCnt = 0;
-#ifdef _M_IX86
-	ARCHITECTURE_TYPE arch = ARCH_X86;
-#elif defined _M_X64
-	ARCHITECTURE_TYPE arch = ARCH_X64;
-#else
-	#error unsupported platform
-#endif
-	DISASSEMBLER dis;
-	if (InitDisassembler(&dis, arch)) {
-		INSTRUCTION* pins = NULL;
-		U8* pLoc = (U8*)pFunction;
-		DWORD dwFlags = DISASM_DECODE | DISASM_DISASSEMBLE | DISASM_ALIGNOUTPUT;
-
-		ODPRINTF((L"mhooks: DisassembleAndSkip: Disassembling %p", pLoc));
-		while ( (dwRet < dwMinLen) && (pins = GetInstruction(&dis, (ULONG_PTR)pLoc, pLoc, dwFlags)) ) {
-			ODPRINTF(("mhooks: DisassembleAndSkip: %p:(0x%2.2x) %s", pLoc, pins->Length, pins->String));
-			if (pins->Type == ITYPE_RET		) break;
-			if (pins->Type == ITYPE_BRANCH	) break;
-			if (pins->Type == ITYPE_BRANCHCC) break;
-			if (pins->Type == ITYPE_CALL	) break;
-			if (pins->Type == ITYPE_CALLCC	) break;
-
-			#if defined _M_X64
-				BOOL bProcessRip = FALSE;
-				// mov or lea to register from rip+imm32
-				if ((pins->Type == ITYPE_MOV || pins->Type == ITYPE_LEA) && (pins->X86.Relative) && 
-					(pins->X86.OperandSize == 8) && (pins->OperandCount == 2) &&
-					(pins->Operands[1].Flags & OP_IPREL) && (pins->Operands[1].Register == AMD64_REG_RIP))
-				{
-					// rip-addressing "mov reg, [rip+imm32]"
-					ODPRINTF((L"mhooks: DisassembleAndSkip: found OP_IPREL on operand %d with displacement 0x%x (in memory: 0x%x)", 1, pins->X86.Displacement, *(PDWORD)(pLoc+3)));
-					bProcessRip = TRUE;
-				}
-				// mov or lea to rip+imm32 from register
-				else if ((pins->Type == ITYPE_MOV || pins->Type == ITYPE_LEA) && (pins->X86.Relative) && 
-					(pins->X86.OperandSize == 8) && (pins->OperandCount == 2) &&
-					(pins->Operands[0].Flags & OP_IPREL) && (pins->Operands[0].Register == AMD64_REG_RIP))
-				{
-					// rip-addressing "mov [rip+imm32], reg"
-					ODPRINTF((L"mhooks: DisassembleAndSkip: found OP_IPREL on operand %d with displacement 0x%x (in memory: 0x%x)", 0, pins->X86.Displacement, *(PDWORD)(pLoc+3)));
-					bProcessRip = TRUE;
-				}
-				else if ( (pins->OperandCount >= 1) && (pins->Operands[0].Flags & OP_IPREL) )
-				{
-					// unsupported rip-addressing
-					ODPRINTF((L"mhooks: DisassembleAndSkip: found unsupported OP_IPREL on operand %d", 0));
-					// dump instruction bytes to the debug output
-					for (DWORD i=0; i<pins->Length; i++) {
-						ODPRINTF((L"mhooks: DisassembleAndSkip: instr byte %2.2d: 0x%2.2x", i, pLoc[i]));
-					}
-					break;
-				}
-				else if ( (pins->OperandCount >= 2) && (pins->Operands[1].Flags & OP_IPREL) )
-				{
-					// unsupported rip-addressing
-					ODPRINTF((L"mhooks: DisassembleAndSkip: found unsupported OP_IPREL on operand %d", 1));
-					// dump instruction bytes to the debug output
-					for (DWORD i=0; i<pins->Length; i++) {
-						ODPRINTF((L"mhooks: DisassembleAndSkip: instr byte %2.2d: 0x%2.2x", i, pLoc[i]));
-					}
-					break;
-				}
-				else if ( (pins->OperandCount >= 3) && (pins->Operands[2].Flags & OP_IPREL) )
-				{
-					// unsupported rip-addressing
-					ODPRINTF((L"mhooks: DisassembleAndSkip: found unsupported OP_IPREL on operand %d", 2));
-					// dump instruction bytes to the debug output
-					for (DWORD i=0; i<pins->Length; i++) {
-						ODPRINTF((L"mhooks: DisassembleAndSkip: instr byte %2.2d: 0x%2.2x", i, pLoc[i]));
-					}
-					break;
-				}
-				// follow through with RIP-processing if needed
-				if (bProcessRip) {
-					// calculate displacement relative to function start
-					S64 nAdjustedDisplacement = pins->X86.Displacement + (pLoc - (U8*)pFunction);
-					// store displacement values furthest from zero (both positive and negative)
-					if (nAdjustedDisplacement < pdata->nLimitDown)
-						pdata->nLimitDown = nAdjustedDisplacement;
-					if (nAdjustedDisplacement > pdata->nLimitUp)
-						pdata->nLimitUp = nAdjustedDisplacement;
-					// store patch info
-					if (pdata->nRipCnt < MHOOKS_MAX_RIPS) {
-						pdata->rips[pdata->nRipCnt].dwOffset = dwRet + 3;
-						pdata->rips[pdata->nRipCnt].nDisplacement = pins->X86.Displacement;
-						pdata->nRipCnt++;
-					} else {
-						// no room for patch info, stop disassembly
-						break;
-					}
-				}
-			#endif
+// Internal function:
+//
+// (Re)build the free-region map by walking the whole address space once.
+//=========================================================================
+static VOID FreeMapBuild() {
+	SYSTEM_INFO sSysInfo = {};
+	::GetSystemInfo(&sSysInfo);
+	g_dwAllocationGranularity = sSysInfo.dwAllocationGranularity;
+	g_nFreeRegions = 0;
+	PBYTE pbMax = (PBYTE)sSysInfo.lpMaximumApplicationAddress;
+	for (PBYTE pbQuery = (PBYTE)sSysInfo.lpMinimumApplicationAddress; pbQuery < pbMax;) {
+		MEMORY_BASIC_INFORMATION mbi;
+		if (!VirtualQuery(pbQuery, &mbi, sizeof(mbi)))
+			break;
+		PBYTE pbEnd = (PBYTE)mbi.BaseAddress + mbi.RegionSize;
+		if (mbi.State == MEM_FREE)
+			FreeMapAdd((PBYTE)mbi.BaseAddress, pbEnd < pbMax ? pbEnd : pbMax);
+		pbQuery = pbEnd;
+	}
+	g_bFreeRegionsValid = TRUE;
+	ODPRINTF((L"mhooks: FreeMapBuild: %d free regions", g_nFreeRegions));
+}
 
-			dwRet += pins->Length;
-			pLoc  += pins->Length;
+//=========================================================================
+// Internal function:
+//
+// Find the free block closest to pbTarget that starts within [pLower,
+// pUpper). Looks at the nearest usable region on either side of the target.
+//=========================================================================
+static PBYTE FreeMapFindNear(PBYTE pbTarget, PBYTE pLower, PBYTE pUpper) {
+	DWORD_PTR dwGranularity = g_dwAllocationGranularity;
+	PBYTE pbLowest = (PBYTE)(((DWORD_PTR)pLower + dwGranularity - 1) & ~(dwGranularity - 1));
+	PBYTE pbHighest = (PBYTE)(((DWORD_PTR)pUpper - 1) & ~(dwGranularity - 1));
+	PBYTE pbAligned = (PBYTE)((DWORD_PTR)pbTarget & ~(dwGranularity - 1));
+	if (pUpper <= pbLowest)
+		return NULL;
+	PBYTE pbBest = NULL;
+	DWORD_PTR dwBestDistance = 0;
+	DWORD nAbove = FreeMapUpperBound(pbTarget);
+	// regions at or below the target, then above it
+	for (int nSide = 0; nSide < 2; nSide++) {
+		for (DWORD i = nAbove; nSide ? i < g_nFreeRegions : i > 0; nSide ? i++ : i--) {
+			MHOOKS_FREE_REGION* pRegion = &g_pFreeRegions[nSide ? i : i - 1];
+			if (nSide ? pRegion->pbStart > pbHighest : pRegion->pbEnd <= pbLowest)
+				break;
+			PBYTE pbFirst = pRegion->pbStart > pbLowest ? pRegion->pbStart : pbLowest;
+			PBYTE pbLast = pRegion->pbEnd - dwGranularity < pbHighest ? pRegion->pbEnd - dwGranularity : pbHighest;
+			if (pbFirst > pbLast)
+				continue;
+			PBYTE pbCandidate = pbAligned < pbFirst ? pbFirst : pbAligned > pbLast ? pbLast : pbAligned;
+			DWORD_PTR dwDistance = pbCandidate < pbTarget ? pbTarget - pbCandidate : pbCandidate - pbTarget;
+			if (!pbBest || dwDistance < dwBestDistance) {
+				pbBest = pbCandidate;
+				dwBestDistance = dwDistance;
+			}
+			break;
 		}
-
-		CloseDisassembler(&dis);
 	}
+	return pbBest;
+}
 
-	return dwRet;
+//=========================================================================
+// Internal function:
+//
+// Number of trampoline slots in one allocation granularity block.
+//=========================================================================
+static DWORD BlockSlots() {
+	DWORD_PTR nSlots = g_dwAllocationGranularity / MHOOKS_TRAMPOLINE_SLOT;
+	return nSlots < MHOOKS_MAX_BLOCK_SLOTS ? (DWORD)nSlots : MHOOKS_MAX_BLOCK_SLOTS;
 }
 
 //=========================================================================
-BOOL Mhook_SetHook(PVOID *ppSystemFunction, PVOID pHookFunction) {
-	MHOOKS_TRAMPOLINE* pTrampoline = NULL;
-	PVOID pSystemFunction = *ppSystemFunction;
-	// ensure thread-safety
-	EnterCritSec();
-	ODPRINTF((L"mhooks: Mhook_SetHook: Started on the job: %p / %p", pSystemFunction, pHookFunction));
-	// find the real functions (jump over jump tables, if any)
-	pSystemFunction = SkipJumps((PBYTE)pSystemFunction);
-	pHookFunction   = SkipJumps((PBYTE)pHookFunction);
-	ODPRINTF((L"mhooks: Mhook_SetHook: Started on the job: %p / %p", pSystemFunction, pHookFunction));
-	// figure out the length of the overwrite zone
-	MHOOKS_PATCHDATA patchdata = {0};
-	DWORD dwInstructionLength = DisassembleAndSkip(pSystemFunction, MHOOK_JMPSIZE, &patchdata);
-	if (dwInstructionLength >= MHOOK_JMPSIZE) {
-		ODPRINTF((L"mhooks: Mhook_SetHook: disassembly signals %d bytes", dwInstructionLength));
-		// suspend every other thread in this process, and make sure their IP 
-		// is not in the code we're about to overwrite.
-		SuspendOtherThreads((PBYTE)pSystemFunction, dwInstructionLength);
-		// allocate a trampoline structure (TODO: it is pretty wasteful to get
-		// VirtualAlloc to grab chunks of memory smaller than 100 bytes)
-		pTrampoline = TrampolineAlloc((PBYTE)pSystemFunction, patchdata.nLimitUp, patchdata.nLimitDown);
-		if (pTrampoline) {
-			ODPRINTF((L"mhooks: Mhook_SetHook: allocated structure at %p", pTrampoline));
-			DWORD dwOldProtectSystemFunction = 0;
-			DWORD dwOldProtectTrampolineFunction = 0;
-			// set the system function to PAGE_EXECUTE_READWRITE
-			if (VirtualProtect(pSystemFunction, dwInstructionLength, PAGE_EXECUTE_READWRITE, &dwOldProtectSystemFunction)) {
-				ODPRINTF((L"mhooks: Mhook_SetHook: readwrite set on system function"));
-				// mark our trampoline buffer to PAGE_EXECUTE_READWRITE
-				if (VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), PAGE_EXECUTE_READWRITE, &dwOldProtectTrampolineFunction)) {
-					ODPRINTF((L"mhooks: Mhook_SetHook: readwrite set on trampoline structure"));
-
-					// create our trampoline function
-					PBYTE pbCode = pTrampoline->codeTrampoline;
-					// save original code..
-					for (DWORD i = 0; i<dwInstructionLength; i++) {
-						pTrampoline->codeUntouched[i] = pbCode[i] = ((PBYTE)pSystemFunction)[i];
-					}
-					pbCode += dwInstructionLength;
-					// plus a jump to the continuation in the original location
-					pbCode = EmitJump(pbCode, ((PBYTE)pSystemFunction) + dwInstructionLength);
-					ODPRINTF((L"mhooks: Mhook_SetHook: updated the trampoline"));
-
-					// fix up any IP-relative addressing in the code
-					FixupIPRelativeAddressing(pTrampoline->codeTrampoline, (PBYTE)pSystemFunction, &patchdata);
-
-					DWORD_PTR dwDistance = (PBYTE)pHookFunction < (PBYTE)pSystemFunction ? 
-						(PBYTE)pSystemFunction - (PBYTE)pHookFunction : (PBYTE)pHookFunction - (PBYTE)pSystemFunction;
-					if (dwDistance > 0x7fff0000) {
-						// create a stub that jumps to the replacement function.
-						// we need this because jumping from the API to the hook directly 
-						// will be a long jump, which is 14 bytes on x64, and we want to 
-						// avoid that - the API may or may not have room for such stuff. 
-						// (remember, we only have 5 bytes guaranteed in the API.)
-						// on the other hand we do have room, and the trampoline will always be
-						// within +/- 2GB of the API, so we do the long jump in there. 
-						// the API will jump to the "reverse trampoline" which
-						// will jump to the user's hook code.
-						pbCode = pTrampoline->codeJumpToHookFunction;
-						pbCode = EmitJump(pbCode, (PBYTE)pHookFunction);
-						ODPRINTF((L"mhooks: Mhook_SetHook: created reverse trampoline"));
-						FlushInstructionCache(GetCurrentProcess(), pTrampoline->codeJumpToHookFunction, 
-							pbCode - pTrampoline->codeJumpToHookFunction);
-
-						// update the API itself
-						pbCode = (PBYTE)pSystemFunction;
-						pbCode = EmitJump(pbCode, pTrampoline->codeJumpToHookFunction);
-					} else {
-						// the jump will be at most 5 bytes so we can do it directly
-						// update the API itself
-						pbCode = (PBYTE)pSystemFunction;
-						pbCode = EmitJump(pbCode, (PBYTE)pHookFunction);
-					}
+// Internal function:
+//
+// Hand out a free slot of a block that starts within [pLower, pUpper),
+// the same range a new block could come from, from the block closest to
+// pSystemFunction. Returns NULL if no block in range has room.
+//=========================================================================
+static MHOOKS_TRAMPOLINE* BlockTakeSlot(PBYTE pSystemFunction, PBYTE pLower, PBYTE pUpper) {
+	ULONGLONG qwFull = BlockSlots() == 64 ? ~0ULL : (1ULL << BlockSlots()) - 1;
+	MHOOKS_TRAMPOLINE_BLOCK* pBest = NULL;
+	DWORD_PTR dwBestDistance = 0;
+	for (DWORD i=0; i<g_nTrampolineBlocks; i++) {
+		MHOOKS_TRAMPOLINE_BLOCK* pBlock = &g_pTrampolineBlocks[i];
+		if (pBlock->qwSlotsInUse == qwFull || pBlock->pbBase < pLower || pBlock->pbBase >= pUpper)
+			continue;
+		DWORD_PTR dwDistance = pBlock->pbBase < pSystemFunction ?
+			pSystemFunction - pBlock->pbBase : pBlock->pbBase - pSystemFunction;
+		if (!pBest || dwDistance < dwBestDistance) {
+			pBest = pBlock;
+			dwBestDistance = dwDistance;
+		}
+	}
+	if (!pBest)
+		return NULL;
+	DWORD nSlot = 0;
+	while (pBest->qwSlotsInUse & (1ULL << nSlot))
+		nSlot++;
+	pBest->qwSlotsInUse |= 1ULL << nSlot;
+	return (MHOOKS_TRAMPOLINE*)(pBest->pbBase + nSlot * MHOOKS_TRAMPOLINE_SLOT);
+}
 
-					// update data members
-					pTrampoline->cbOverwrittenCode = dwInstructionLength;
-					pTrampoline->pSystemFunction = (PBYTE)pSystemFunction;
-					pTrampoline->pHookFunction = (PBYTE)pHookFunction;
+//=========================================================================
+// Internal function:
+//
+// Take a freshly allocated block into the block list.
+//=========================================================================
+static BOOL BlockInsert(PBYTE pbBase) {
+	if (g_nTrampolineBlocks == g_nTrampolineBlocksAlloc) {
+		DWORD nAlloc = g_nTrampolineBlocksAlloc ? 2 * g_nTrampolineBlocksAlloc : 16;
+		MHOOKS_TRAMPOLINE_BLOCK* pBlocks = (MHOOKS_TRAMPOLINE_BLOCK*)realloc(g_pTrampolineBlocks, nAlloc * sizeof(MHOOKS_TRAMPOLINE_BLOCK));
+		if (!pBlocks)
+			return FALSE;
+		g_pTrampolineBlocks = pBlocks;
+		g_nTrampolineBlocksAlloc = nAlloc;
+	}
+	g_pTrampolineBlocks[g_nTrampolineBlocks].pbBase = pbBase;
+	g_pTrampolineBlocks[g_nTrampolineBlocks].qwSlotsInUse = 0;
+	g_nTrampolineBlocks++;
+	return TRUE;
+}
 
-					// flush instruction cache and restore original protection
-					FlushInstructionCache(GetCurrentProcess(), pTrampoline->codeTrampoline, dwInstructionLength);
-					VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), dwOldProtectTrampolineFunction, &dwOldProtectTrampolineFunction);
-				} else {
-					ODPRINTF((L"mhooks: Mhook_SetHook: failed VirtualProtect 2: %d", gle()));
-				}
-				// flush instruction cache and restore original protection
-				FlushInstructionCache(GetCurrentProcess(), pSystemFunction, dwInstructionLength);
-				VirtualProtect(pSystemFunction, dwInstructionLength, dwOldProtectSystemFunction, &dwOldProtectSystemFunction);
-			} else {
-				ODPRINTF((L"mhooks: Mhook_SetHook: failed VirtualProtect 1: %d", gle()));
-			}
-			if (pTrampoline->pSystemFunction) {
-				// this is what the application will use as the entry point
-				// to the "original" unhooked function.
-				*ppSystemFunction = pTrampoline->codeTrampoline;
-				ODPRINTF((L"mhooks: Mhook_SetHook: Hooked the function!"));
+//=========================================================================
+// Internal function:
+//
+// Give a trampoline's slot back to its block, and the block back to the
+// system once it is empty.
+//=========================================================================
+static VOID BlockReleaseSlot(MHOOKS_TRAMPOLINE* pTrampoline) {
+	PBYTE pbBase = (PBYTE)((DWORD_PTR)pTrampoline & ~(g_dwAllocationGranularity - 1));
+	for (DWORD i=0; i<g_nTrampolineBlocks; i++) {
+		MHOOKS_TRAMPOLINE_BLOCK* pBlock = &g_pTrampolineBlocks[i];
+		if (pBlock->pbBase != pbBase)
+			continue;
+		pBlock->qwSlotsInUse &= ~(1ULL << (((PBYTE)pTrampoline - pbBase) / MHOOKS_TRAMPOLINE_SLOT));
+		if (pBlock->qwSlotsInUse) {
+			// the next trampoline in this slot has to start out zeroed, like fresh memory
+			DWORD dwOldProtect = 0;
+			if (VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), PAGE_EXECUTE_READWRITE, &dwOldProtect)) {
+				ZeroMemory(pTrampoline, sizeof(MHOOKS_TRAMPOLINE));
+				VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), dwOldProtect, &dwOldProtect);
 			} else {
-				// if we failed discard the trampoline (forcing VirtualFree)
-				TrampolineFree(pTrampoline, TRUE);
-				pTrampoline = NULL;
+				// a slot that can't be cleared is never handed out again
+				pBlock->qwSlotsInUse |= 1ULL << (((PBYTE)pTrampoline - pbBase) / MHOOKS_TRAMPOLINE_SLOT);
 			}
+			return;
 		}
-		// resume everybody else
-		ResumeOtherThreads();
-	} else {
-		ODPRINTF((L"mhooks: disassembly signals %d bytes (unacceptable)", dwInstructionLength));
+		ODPRINTF((L"mhooks: BlockReleaseSlot: releasing block at %p", pbBase));
+		VirtualFree(pbBase, 0, MEM_RELEASE);
+		FreeMapAdd(pbBase, pbBase + g_dwAllocationGranularity);
+		g_pTrampolineBlocks[i] = g_pTrampolineBlocks[--g_nTrampolineBlocks];
+		return;
 	}
-	LeaveCritSec();
-	return (pTrampoline != NULL);
 }
 
 //=========================================================================
-BOOL Mhook_Unhook(PVOID *ppHookedFunction) {
-	ODPRINTF((L"mhooks: Mhook_Unhook: %p", *ppHookedFunction));
-	BOOL bRet = FALSE;
-	EnterCritSec();
-	// get the trampoline structure that corresponds to our function
-	MHOOKS_TRAMPOLINE* pTrampoline = TrampolineGet((PBYTE)*ppHookedFunction);
-	if (pTrampoline) {
-		// make sure nobody's executing code where we're about to overwrite a few bytes
-		SuspendOtherThreads(pTrampoline->pSystemFunction, pTrampoline->cbOverwrittenCode);
-		ODPRINTF((L"mhooks: Mhook_Unhook: found struct at %p", pTrampoline));
-		DWORD dwOldProtectSystemFunction = 0;
-		// make memory writable
-		if (VirtualProtect(pTrampoline->pSystemFunction, pTrampoline->cbOverwrittenCode, PAGE_EXECUTE_READWRITE, &dwOldProtectSystemFunction)) {
-			ODPRINTF((L"mhooks: Mhook_Unhook: readwrite set on system function"));
-			PBYTE pbCode = (PBYTE)pTrampoline->pSystemFunction;
-			for (DWORD i = 0; i<pTrampoline->cbOverwrittenCode; i++) {
-				pbCode[i] = pTrampoline->codeUntouched[i];
+// Internal function:
+//
+// Will try to allocate the trampoline structure within 2 gigabytes of
+// the target function, as close to it as possible. Trampolines share
+// blocks: a new block is only reserved when none in range has room.
+//=========================================================================
+static MHOOKS_TRAMPOLINE* TrampolineAlloc(PBYTE pSystemFunction, S64 nLimitUp, S64 nLimitDown) {
+
+	MHOOKS_TRAMPOLINE* pTrampoline = NULL;
+
+	// determine lower and upper bounds for the allocation locations.
+	// in the basic scenario this is +/- 2GB but IP-relative instructions
+	// found in the original code may require a smaller window.
+	PBYTE pLower = pSystemFunction + nLimitUp;
+	pLower = pLower < (PBYTE)(DWORD_PTR)0x0000000080000000 ? 
+						(PBYTE)(0x1) : (PBYTE)(pLower - (PBYTE)0x7fff0000);
+	PBYTE pUpper = pSystemFunction + nLimitDown;
+	pUpper = pUpper < (PBYTE)(DWORD_PTR)0xffffffff80000000 ? 
+		(PBYTE)(pUpper + (DWORD_PTR)0x7ff80000) : (PBYTE)(DWORD_PTR)0xfffffffffff80000;
+	ODPRINTF((L"mhooks: TrampolineAlloc: Allocating for %p between %p and %p", pSystemFunction, pLower, pUpper));
+
+	if (!g_bFreeRegionsValid)
+		FreeMapBuild();
+	pTrampoline = BlockTakeSlot(pSystemFunction, pLower, pUpper);
+	if (pTrampoline) {
+		ODPRINTF((L"mhooks: TrampolineAlloc: using slot at %p as the trampoline", pTrampoline));
+	}
+	// the map may be out of date: other code allocates and frees memory too.
+	// Blocks that turn out to be taken are dropped from it as we go, and if
+	// nothing fits any more the map is built afresh once.
+	for (int nPass = 0; nPass < 2 && !pTrampoline; nPass++) {
+		PBYTE pbAlloc;
+		while (!pTrampoline && (pbAlloc = FreeMapFindNear(pSystemFunction, pLower, pUpper)) != NULL) {
+			FreeMapRemove(pbAlloc);
+			PBYTE pbBlock = (PBYTE)VirtualAlloc(pbAlloc, g_dwAllocationGranularity, MEM_COMMIT|MEM_RESERVE, PAGE_EXECUTE_READ);
+			if (!pbBlock) {
+				ODPRINTF((L"mhooks: TrampolineAlloc: %p is no longer free", pbAlloc));
+			} else if (!BlockInsert(pbBlock)) {
+				ODPRINTF((L"mhooks: TrampolineAlloc: out of memory for the block list"));
+				VirtualFree(pbBlock, 0, MEM_RELEASE);
+				FreeMapAdd(pbBlock, pbBlock + g_dwAllocationGranularity);
+				return NULL;
+			} else {
+				ODPRINTF((L"mhooks: TrampolineAlloc: Allocated block at %p for trampolines", pbBlock));
+				pTrampoline = BlockTakeSlot(pSystemFunction, pLower, pUpper);
+			}
+		}
+		if (!pTrampoline && nPass == 0)
+			FreeMapBuild();
+	}
+
+	// found and allocated a trampoline?
+	if (pTrampoline) {
+		// put it into our registry so we know we'll have to free it
+		if (!RegistryInsert(pTrampoline, pSystemFunction)) {
+			ODPRINTF((L"mhooks: TrampolineAlloc: out of memory for the hook registry"));
+			BlockReleaseSlot(pTrampoline);
+			pTrampoline = NULL;
+		}
+	}
+
+	return pTrampoline;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Return which of a trampoline's chain links a hooked function pointer
+// refers to, or MHOOKS_CHAIN_BASE if it is not a link.
+//=========================================================================
+static DWORD TrampolineGetLink(MHOOKS_TRAMPOLINE* pTrampoline, PBYTE pHookedFunction) {
+	for (DWORD i=0; i<MHOOKS_MAX_CHAINED_HOOKS; i++) {
+		if (pHookedFunction == pTrampoline->codeLinks[i])
+			return i;
+	}
+	return MHOOKS_CHAIN_BASE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Return the internal trampoline structure that belongs to a hooked function,
+// which is either the trampoline code itself or one of its chain links.
+//=========================================================================
+static MHOOKS_TRAMPOLINE* TrampolineGet(PBYTE pHookedFunction) {
+	// the trampoline has to be the last one that starts below the pointer
+	DWORD nPos = RegistryLowerBound(g_pHooksByTrampoline, pHookedFunction, FALSE);
+	if (nPos == 0)
+		return NULL;
+	MHOOKS_TRAMPOLINE* pTrampoline = g_pHooksByTrampoline[nPos - 1].pTrampoline;
+	if (pHookedFunction == pTrampoline->codeTrampoline ||
+		TrampolineGetLink(pTrampoline, pHookedFunction) != MHOOKS_CHAIN_BASE)
+		return pTrampoline;
+	return NULL;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Return the internal trampoline structure that hooks a system function.
+//=========================================================================
+static MHOOKS_TRAMPOLINE* TrampolineFind(PBYTE pSystemFunction) {
+	DWORD nPos = RegistryLowerBound(g_pHooksByFunction, pSystemFunction, TRUE);
+	if (nPos < g_nHooksInUse && g_pHooksByFunction[nPos].pSystemFunction == pSystemFunction)
+		return g_pHooksByFunction[nPos].pTrampoline;
+	return NULL;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Free the chains a dispatcher has replaced over time.
+//=========================================================================
+static VOID ChainReleasePrevious(MHOOKS_CHAIN* pChain) {
+	MHOOKS_CHAIN* pPrevious = pChain->pPrevious;
+	// pPrevious is only bookkeeping, ChainNext never follows it
+	pChain->pPrevious = NULL;
+	while (pPrevious) {
+		MHOOKS_CHAIN* pNext = pPrevious->pPrevious;
+		free(pPrevious);
+		pPrevious = pNext;
+	}
+}
+
+//=========================================================================
+// Internal function:
+//
+// Give a trampoline and everything hanging off it back to the system.
+//=========================================================================
+static VOID TrampolineRelease(MHOOKS_TRAMPOLINE* pTrampoline) {
+	free(pTrampoline->pStats);
+	free((PVOID)pTrampoline->plDisabled);
+	if (pTrampoline->pDispatch) {
+		ChainReleasePrevious(pTrampoline->pDispatch->pChain);
+		free(pTrampoline->pDispatch->pChain);
+		free(pTrampoline->pDispatch);
+	}
+	BlockReleaseSlot(pTrampoline);
+}
+
+//=========================================================================
+// Internal function:
+//
+// Free a trampoline structure.
+//=========================================================================
+static VOID TrampolineFree(MHOOKS_TRAMPOLINE* pTrampoline, BOOL bNeverUsed) {
+	if (RegistryRemove(pTrampoline)) {
+		// It might be OK to call VirtualFree, but quite possibly it isn't: 
+		// If a thread has some of our trampoline code on its stack
+		// and we yank the region from underneath it then it will
+		// surely crash upon returning. So a trampoline that has been in
+		// use is retired, and only released once ReclaimGarbage finds
+		// that no thread refers to it any more.
+		if (bNeverUsed) {
+			TrampolineRelease(pTrampoline);
+		} else {
+			if (g_nRetired == g_nRetiredAlloc) {
+				DWORD nAlloc = g_nRetiredAlloc ? 2 * g_nRetiredAlloc : 16;
+				MHOOKS_TRAMPOLINE** pRetired = (MHOOKS_TRAMPOLINE**)realloc(g_pRetired, nAlloc * sizeof(MHOOKS_TRAMPOLINE*));
+				if (pRetired) {
+					g_pRetired = pRetired;
+					g_nRetiredAlloc = nAlloc;
+				}
+			}
+			// without room to remember it, the trampoline leaks
+			if (g_nRetired < g_nRetiredAlloc) {
+				g_pRetired[g_nRetired++] = pTrampoline;
+			}
+		}
+	}
+}
+
+//=========================================================================
+// Internal function:
+//
+// Lock-free helpers for the call statistics, which are updated from
+// whatever thread happens to call an instrumented hook.
+//=========================================================================
+static VOID ProbeAdd(ULONGLONG* pqwValue, ULONGLONG qwAdd) {
+	LONGLONG llOld;
+	do {
+		llOld = *(volatile LONGLONG*)pqwValue;
+	} while (_InterlockedCompareExchange64((volatile LONGLONG*)pqwValue, llOld + qwAdd, llOld) != llOld);
+}
+
+static VOID ProbeMin(ULONGLONG* pqwValue, ULONGLONG qwNew) {
+	LONGLONG llOld;
+	do {
+		llOld = *(volatile LONGLONG*)pqwValue;
+		if ((ULONGLONG)llOld <= qwNew)
+			return;
+	} while (_InterlockedCompareExchange64((volatile LONGLONG*)pqwValue, qwNew, llOld) != llOld);
+}
+
+static VOID ProbeMax(ULONGLONG* pqwValue, ULONGLONG qwNew) {
+	LONGLONG llOld;
+	do {
+		llOld = *(volatile LONGLONG*)pqwValue;
+		if ((ULONGLONG)llOld >= qwNew)
+			return;
+	} while (_InterlockedCompareExchange64((volatile LONGLONG*)pqwValue, qwNew, llOld) != llOld);
+}
+
+//=========================================================================
+// Internal function:
+//
+// Called by the entry thunk of an instrumented hook. Counts the call and,
+// if the thread's probe buffer has room, records the entry time and
+// redirects the return address to the exit thunk. Preserves the last
+// error value, which the hook may depend on.
+//=========================================================================
+static VOID WINAPI ProbeEnter(MHOOKS_TRAMPOLINE* pTrampoline, PBYTE* ppReturnAddress) {
+	DWORD dwLastError = GetLastError();
+	ULONGLONG qwTsc = __rdtsc();
+	MHOOK_STATS* pStats = pTrampoline->pStats;
+	ProbeAdd(&pStats->nCalls, 1);
+	if (!pStats->qwFirstCallTsc)
+		_InterlockedCompareExchange64((volatile LONGLONG*)&pStats->qwFirstCallTsc, qwTsc, 0);
+	ProbeMax(&pStats->qwLastCallTsc, qwTsc);
+
+	MHOOKS_PROBE_THREAD* pThread = (MHOOKS_PROBE_THREAD*)TlsGetValue(g_dwProbeTls);
+	if (!pThread) {
+		// first instrumented call on this thread. The buffer stays around
+		// for the lifetime of the thread, we get no notification when it ends.
+		TlsSetValue(g_dwProbeTls, MHOOKS_PROBE_BUSY);
+		pThread = (MHOOKS_PROBE_THREAD*)malloc(sizeof(MHOOKS_PROBE_THREAD));
+		if (pThread)
+			pThread->nDepth = 0;
+		TlsSetValue(g_dwProbeTls, pThread);
+	}
+	if (pThread && pThread != MHOOKS_PROBE_BUSY && pThread->nDepth < MHOOKS_PROBE_DEPTH) {
+		MHOOKS_PROBE_FRAME* pFrame = &pThread->frames[pThread->nDepth++];
+		pFrame->pStats = pStats;
+		pFrame->pReturnAddress = *ppReturnAddress;
+		pFrame->qwEntryTsc = qwTsc;
+		*ppReturnAddress = pTrampoline->pbProbeExit;
+	}
+	SetLastError(dwLastError);
+}
+
+//=========================================================================
+// Internal function:
+//
+// Called by the exit thunk when a timed call returns. Accounts for the
+// call duration and hands back the real return address.
+//=========================================================================
+static PBYTE WINAPI ProbeExit() {
+	ULONGLONG qwTsc = __rdtsc();
+	DWORD dwLastError = GetLastError();
+	MHOOKS_PROBE_THREAD* pThread = (MHOOKS_PROBE_THREAD*)TlsGetValue(g_dwProbeTls);
+	MHOOKS_PROBE_FRAME* pFrame = &pThread->frames[--pThread->nDepth];
+	MHOOK_STATS* pStats = pFrame->pStats;
+	ULONGLONG qwTicks = qwTsc - pFrame->qwEntryTsc;
+	DWORD nBucket = 0;
+	while (nBucket < MHOOK_LATENCY_BUCKETS - 1 && (qwTicks >> (nBucket + 1)))
+		nBucket++;
+	ProbeAdd(&pStats->nReturns, 1);
+	ProbeAdd(&pStats->qwTotalTicks, qwTicks);
+	ProbeMin(&pStats->qwMinTicks, qwTicks);
+	ProbeMax(&pStats->qwMaxTicks, qwTicks);
+	ProbeAdd(&pStats->nLatency[nBucket], 1);
+	SetLastError(dwLastError);
+	return pFrame->pReturnAddress;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Append raw code bytes, or a pointer-sized immediate, at pbCode.
+//=========================================================================
+static PBYTE EmitBytes(PBYTE pbCode, const BYTE* pbBytes, DWORD cbBytes) {
+	CopyMemory(pbCode, pbBytes, cbBytes);
+	return pbCode + cbBytes;
+}
+
+static PBYTE EmitPointer(PBYTE pbCode, PVOID pValue) {
+	*(PVOID*)pbCode = pValue;
+	return pbCode + sizeof(PVOID);
+}
+
+//=========================================================================
+// Internal function:
+//
+// Emit code that calls a WINAPI helper with two arguments while keeping
+// every argument register of the function being called intact. The first
+// argument is pArg1; the second is either pArg2 or, with bReturnAddress,
+// a pointer to the slot holding the return address of the intercepted
+// call. The helper's result is left in eax/rax.
+//=========================================================================
+static PBYTE EmitCallout(PBYTE pbCode, PVOID pfnCallout, PVOID pArg1, BOOL bReturnAddress, PVOID pArg2) {
+#ifdef _M_IX86
+	// keep ecx and edx for thiscall/fastcall functions
+	static const BYTE codeSave[] = {
+		0x51,							// push ecx
+		0x52,							// push edx
+	};
+	static const BYTE codePushReturnAddress[] = {
+		0x8d, 0x44, 0x24, 0x08,			// lea eax, [esp+8]
+		0x50,							// push eax
+	};
+	static const BYTE codePushImmediate[] = { 0x68 };		// push imm32
+	static const BYTE codeLoadCallout[] = { 0xb8 };			// mov eax, imm32
+	static const BYTE codeRestore[] = {
+		0xff, 0xd0,						// call eax (stdcall, cleans up)
+		0x5a,							// pop edx
+		0x59,							// pop ecx
+	};
+
+	pbCode = EmitBytes(pbCode, codeSave, sizeof(codeSave));
+	if (bReturnAddress) {
+		pbCode = EmitBytes(pbCode, codePushReturnAddress, sizeof(codePushReturnAddress));
+	} else {
+		pbCode = EmitBytes(pbCode, codePushImmediate, sizeof(codePushImmediate));
+		pbCode = EmitPointer(pbCode, pArg2);
+	}
+	pbCode = EmitBytes(pbCode, codePushImmediate, sizeof(codePushImmediate));
+	pbCode = EmitPointer(pbCode, pArg1);
+#elif defined _M_X64
+	// keep the four argument registers, both integer and xmm, and call
+	// with the stack aligned and 32 bytes of home space
+	static const BYTE codeSave[] = {
+		0x51,							// push rcx
+		0x52,							// push rdx
+		0x41, 0x50,						// push r8
+		0x41, 0x51,						// push r9
+		0x48, 0x83, 0xec, 0x68,			// sub rsp, 0x68
+		0xf3, 0x0f, 0x7f, 0x44, 0x24, 0x20,	// movdqu [rsp+0x20], xmm0
+		0xf3, 0x0f, 0x7f, 0x4c, 0x24, 0x30,	// movdqu [rsp+0x30], xmm1
+		0xf3, 0x0f, 0x7f, 0x54, 0x24, 0x40,	// movdqu [rsp+0x40], xmm2
+		0xf3, 0x0f, 0x7f, 0x5c, 0x24, 0x50,	// movdqu [rsp+0x50], xmm3
+	};
+	static const BYTE codeLoadReturnAddress[] = {
+		0x48, 0x8d, 0x94, 0x24, 0x88, 0x00, 0x00, 0x00,	// lea rdx, [rsp+0x88]
+	};
+	static const BYTE codeLoadArg2[] = { 0x48, 0xba };		// mov rdx, imm64
+	static const BYTE codeLoadArg1[] = { 0x48, 0xb9 };		// mov rcx, imm64
+	static const BYTE codeLoadCallout[] = { 0x48, 0xb8 };	// mov rax, imm64
+	static const BYTE codeRestore[] = {
+		0xff, 0xd0,						// call rax
+		0xf3, 0x0f, 0x6f, 0x44, 0x24, 0x20,	// movdqu xmm0, [rsp+0x20]
+		0xf3, 0x0f, 0x6f, 0x4c, 0x24, 0x30,	// movdqu xmm1, [rsp+0x30]
+		0xf3, 0x0f, 0x6f, 0x54, 0x24, 0x40,	// movdqu xmm2, [rsp+0x40]
+		0xf3, 0x0f, 0x6f, 0x5c, 0x24, 0x50,	// movdqu xmm3, [rsp+0x50]
+		0x48, 0x83, 0xc4, 0x68,			// add rsp, 0x68
+		0x41, 0x59,						// pop r9
+		0x41, 0x58,						// pop r8
+		0x5a,							// pop rdx
+		0x59,							// pop rcx
+	};
+
+	pbCode = EmitBytes(pbCode, codeSave, sizeof(codeSave));
+	if (bReturnAddress) {
+		pbCode = EmitBytes(pbCode, codeLoadReturnAddress, sizeof(codeLoadReturnAddress));
+	} else {
+		pbCode = EmitBytes(pbCode, codeLoadArg2, sizeof(codeLoadArg2));
+		pbCode = EmitPointer(pbCode, pArg2);
+	}
+	pbCode = EmitBytes(pbCode, codeLoadArg1, sizeof(codeLoadArg1));
+	pbCode = EmitPointer(pbCode, pArg1);
+#else
+#error unsupported platform
+#endif
+	pbCode = EmitBytes(pbCode, codeLoadCallout, sizeof(codeLoadCallout));
+	pbCode = EmitPointer(pbCode, pfnCallout);
+	pbCode = EmitBytes(pbCode, codeRestore, sizeof(codeRestore));
+	return pbCode;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Build the thunks of an instrumented hook in the trampoline. The system
+// function jumps to the entry thunk, which calls ProbeEnter and goes on
+// to the hook function. Timed calls return into the exit thunk, which
+// saves the return value registers, calls ProbeExit and returns to the
+// real caller. The real return address is kept in the thread's probe
+// buffer, which unwind information can't describe, so exceptions must not
+// propagate out of an instrumented hook (see mhook.h). Returns the end of
+// the code.
+//=========================================================================
+static PBYTE EmitProbe(MHOOKS_TRAMPOLINE* pTrampoline, PBYTE pHookFunction) {
+#ifdef _M_IX86
+	// exit: keep edx:eax, the return value goes into a slot for ret
+	static const BYTE codeExitSave[] = {
+		0x50,							// push eax (return address slot)
+		0x50,							// push eax
+		0x52,							// push edx
+		0xb8,							// mov eax, ProbeExit
+	};
+	static const BYTE codeExitRestore[] = {
+		0xff, 0xd0,						// call eax
+		0x89, 0x44, 0x24, 0x08,			// mov [esp+8], eax
+		0x5a,							// pop edx
+		0x58,							// pop eax
+		0xc3,							// ret
+	};
+#elif defined _M_X64
+	// exit: keep rax and xmm0, the return value goes into a slot for ret
+	static const BYTE codeExitSave[] = {
+		0x50,							// push rax (return address slot)
+		0x50,							// push rax
+		0x48, 0x83, 0xec, 0x30,			// sub rsp, 0x30
+		0xf3, 0x0f, 0x7f, 0x44, 0x24, 0x20,	// movdqu [rsp+0x20], xmm0
+		0x48, 0xb8,						// mov rax, ProbeExit
+	};
+	static const BYTE codeExitRestore[] = {
+		0xff, 0xd0,						// call rax
+		0x48, 0x89, 0x44, 0x24, 0x38,	// mov [rsp+0x38], rax
+		0xf3, 0x0f, 0x6f, 0x44, 0x24, 0x20,	// movdqu xmm0, [rsp+0x20]
+		0x48, 0x83, 0xc4, 0x30,			// add rsp, 0x30
+		0x58,							// pop rax
+		0xc3,							// ret
+	};
+#else
+#error unsupported platform
+#endif
+	PBYTE pbCode = pTrampoline->codeProbe;
+	pbCode = EmitCallout(pbCode, (PVOID)ProbeEnter, pTrampoline, TRUE, NULL);
+	pbCode = EmitJump(pbCode, pHookFunction);
+
+	pTrampoline->pbProbeExit = pbCode;
+	pbCode = EmitBytes(pbCode, codeExitSave, sizeof(codeExitSave));
+	pbCode = EmitPointer(pbCode, (PVOID)ProbeExit);
+	pbCode = EmitBytes(pbCode, codeExitRestore, sizeof(codeExitRestore));
+	return pbCode;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Build the gate of a switchable hook: it checks the hook's switch and
+// goes on to the hook, or straight to the trampoline while it is off.
+// Only the flags register is changed, which nothing expects to survive a
+// call. Returns the end of the code.
+//=========================================================================
+static PBYTE EmitGate(MHOOKS_TRAMPOLINE* pTrampoline, PBYTE pbJumpTo) {
+	PBYTE pbCode = pTrampoline->codeGate;
+#ifdef _M_IX86
+	static const BYTE codeCheck[] = {
+		0x83, 0x3d,						// cmp dword ptr [plDisabled], 0
+	};
+	pbCode = EmitBytes(pbCode, codeCheck, sizeof(codeCheck));
+	pbCode = EmitPointer(pbCode, (PVOID)pTrampoline->plDisabled);
+	*pbCode++ = 0x00;
+#elif defined _M_X64
+	// the switch may be out of reach of a RIP-relative operand
+	static const BYTE codeLoad[] = {
+		0x50,							// push rax
+		0x48, 0xb8,						// mov rax, plDisabled
+	};
+	static const BYTE codeCheck[] = {
+		0x83, 0x38, 0x00,				// cmp dword ptr [rax], 0
+		0x58,							// pop rax
+	};
+	pbCode = EmitBytes(pbCode, codeLoad, sizeof(codeLoad));
+	pbCode = EmitPointer(pbCode, (PVOID)pTrampoline->plDisabled);
+	pbCode = EmitBytes(pbCode, codeCheck, sizeof(codeCheck));
+#else
+#error unsupported platform
+#endif
+	// jne codeTrampoline
+	pbCode[0] = 0x0f;
+	pbCode[1] = 0x85;
+	*((PDWORD)(pbCode + 2)) = (DWORD)(pTrampoline->codeTrampoline - (pbCode + 6));
+	pbCode += 6;
+	return EmitJump(pbCode, pbJumpTo);
+}
+
+//=========================================================================
+// Internal function:
+//
+// Build the thunk of a context hook in the trampoline. The hooked code
+// jumps to it; it saves all registers in an MHOOK_REGISTERS structure on
+// the stack, calls the callback on it with the stack aligned, loads the
+// registers back and goes on to the relocated original instructions.
+// On x64 it steps over the 128 bytes below the stack pointer first: the
+// System V ABI lets leaf functions keep data there (the red zone), and
+// nothing may be pushed on top of it. Returns the end of the code.
+//=========================================================================
+static PBYTE EmitContextThunk(MHOOKS_TRAMPOLINE* pTrampoline, PVOID pfnCallback, PVOID pHookArg) {
+#ifdef _M_IX86
+	static const BYTE codeSave[] = {
+		0x9c,							// pushfd
+		0x60,							// pushad
+		0x81, 0xec, 0x80, 0x00, 0x00, 0x00,	// sub esp, 0x80
+		0x83, 0x84, 0x24, 0x8c, 0x00, 0x00, 0x00, 0x04,	// add dword ptr [esp+0x8c], 4 (esp before pushfd)
+		0xf3, 0x0f, 0x7f, 0x44, 0x24, 0x00,	// movdqu [esp+0x00], xmm0
+		0xf3, 0x0f, 0x7f, 0x4c, 0x24, 0x10,	// movdqu [esp+0x10], xmm1
+		0xf3, 0x0f, 0x7f, 0x54, 0x24, 0x20,	// movdqu [esp+0x20], xmm2
+		0xf3, 0x0f, 0x7f, 0x5c, 0x24, 0x30,	// movdqu [esp+0x30], xmm3
+		0xf3, 0x0f, 0x7f, 0x64, 0x24, 0x40,	// movdqu [esp+0x40], xmm4
+		0xf3, 0x0f, 0x7f, 0x6c, 0x24, 0x50,	// movdqu [esp+0x50], xmm5
+		0xf3, 0x0f, 0x7f, 0x74, 0x24, 0x60,	// movdqu [esp+0x60], xmm6
+		0xf3, 0x0f, 0x7f, 0x7c, 0x24, 0x70,	// movdqu [esp+0x70], xmm7
+		0x89, 0xe0,						// mov eax, esp
+		0x89, 0xe3,						// mov ebx, esp
+		0x83, 0xe4, 0xf0,				// and esp, -16
+		0x83, 0xec, 0x08,				// sub esp, 8
+		0x68,							// push pHookArg
+	};
+	static const BYTE codeCall[] = {
+		0x50,							// push eax
+		0xb8,							// mov eax, pfnCallback
+	};
+	static const BYTE codeRestore[] = {
+		0xff, 0xd0,						// call eax (stdcall, cleans up)
+		0x89, 0xdc,						// mov esp, ebx
+		0xf3, 0x0f, 0x6f, 0x44, 0x24, 0x00,	// movdqu xmm0, [esp+0x00]
+		0xf3, 0x0f, 0x6f, 0x4c, 0x24, 0x10,	// movdqu xmm1, [esp+0x10]
+		0xf3, 0x0f, 0x6f, 0x54, 0x24, 0x20,	// movdqu xmm2, [esp+0x20]
+		0xf3, 0x0f, 0x6f, 0x5c, 0x24, 0x30,	// movdqu xmm3, [esp+0x30]
+		0xf3, 0x0f, 0x6f, 0x64, 0x24, 0x40,	// movdqu xmm4, [esp+0x40]
+		0xf3, 0x0f, 0x6f, 0x6c, 0x24, 0x50,	// movdqu xmm5, [esp+0x50]
+		0xf3, 0x0f, 0x6f, 0x74, 0x24, 0x60,	// movdqu xmm6, [esp+0x60]
+		0xf3, 0x0f, 0x6f, 0x7c, 0x24, 0x70,	// movdqu xmm7, [esp+0x70]
+		0x81, 0xc4, 0x80, 0x00, 0x00, 0x00,	// add esp, 0x80
+		0x61,							// popad (skips esp)
+		0x9d,							// popfd
+	};
+#elif defined _M_X64
+	static const BYTE codeSave[] = {
+		0x48, 0x8d, 0x64, 0x24, 0x80,	// lea rsp, [rsp-0x80] (skips the red zone)
+		0x54,							// push rsp
+		0x9c,							// pushfq
+		0x48, 0x83, 0x6c, 0x24, 0x08, 0x80,	// sub qword ptr [rsp+8], -0x80 (rsp before the red zone)
+		0x50, 0x51, 0x52, 0x53,			// push rax, rcx, rdx, rbx
+		0x55, 0x56, 0x57,				// push rbp, rsi, rdi
+		0x41, 0x50, 0x41, 0x51,			// push r8, r9
+		0x41, 0x52, 0x41, 0x53,			// push r10, r11
+		0x41, 0x54, 0x41, 0x55,			// push r12, r13
+		0x41, 0x56, 0x41, 0x57,			// push r14, r15
+		0x48, 0x83, 0xec, 0x60,			// sub rsp, 0x60
+		0xf3, 0x0f, 0x7f, 0x44, 0x24, 0x00,	// movdqu [rsp+0x00], xmm0
+		0xf3, 0x0f, 0x7f, 0x4c, 0x24, 0x10,	// movdqu [rsp+0x10], xmm1
+		0xf3, 0x0f, 0x7f, 0x54, 0x24, 0x20,	// movdqu [rsp+0x20], xmm2
+		0xf3, 0x0f, 0x7f, 0x5c, 0x24, 0x30,	// movdqu [rsp+0x30], xmm3
+		0xf3, 0x0f, 0x7f, 0x64, 0x24, 0x40,	// movdqu [rsp+0x40], xmm4
+		0xf3, 0x0f, 0x7f, 0x6c, 0x24, 0x50,	// movdqu [rsp+0x50], xmm5
+		0x48, 0x89, 0xe1,				// mov rcx, rsp
+		0x48, 0x89, 0xe3,				// mov rbx, rsp
+		0x48, 0x83, 0xe4, 0xf0,			// and rsp, -16
+		0x48, 0x83, 0xec, 0x20,			// sub rsp, 0x20
+		0x48, 0xba,						// mov rdx, pHookArg
+	};
+	static const BYTE codeCall[] = {
+		0x48, 0xb8,						// mov rax, pfnCallback
+	};
+	static const BYTE codeRestore[] = {
+		0xff, 0xd0,						// call rax
+		0x48, 0x89, 0xdc,				// mov rsp, rbx
+		0xf3, 0x0f, 0x6f, 0x44, 0x24, 0x00,	// movdqu xmm0, [rsp+0x00]
+		0xf3, 0x0f, 0x6f, 0x4c, 0x24, 0x10,	// movdqu xmm1, [rsp+0x10]
+		0xf3, 0x0f, 0x6f, 0x54, 0x24, 0x20,	// movdqu xmm2, [rsp+0x20]
+		0xf3, 0x0f, 0x6f, 0x5c, 0x24, 0x30,	// movdqu xmm3, [rsp+0x30]
+		0xf3, 0x0f, 0x6f, 0x64, 0x24, 0x40,	// movdqu xmm4, [rsp+0x40]
+		0xf3, 0x0f, 0x6f, 0x6c, 0x24, 0x50,	// movdqu xmm5, [rsp+0x50]
+		0x48, 0x83, 0xc4, 0x60,			// add rsp, 0x60
+		0x41, 0x5f, 0x41, 0x5e,			// pop r15, r14
+		0x41, 0x5d, 0x41, 0x5c,			// pop r13, r12
+		0x41, 0x5b, 0x41, 0x5a,			// pop r11, r10
+		0x41, 0x59, 0x41, 0x58,			// pop r9, r8
+		0x5f, 0x5e, 0x5d,				// pop rdi, rsi, rbp
+		0x5b, 0x5a, 0x59, 0x58,			// pop rbx, rdx, rcx, rax
+		0x9d,							// popfq
+		0x48, 0x8d, 0xa4, 0x24, 0x88, 0x00, 0x00, 0x00,	// lea rsp, [rsp+0x88] (skips rsp and the red zone)
+	};
+#else
+#error unsupported platform
+#endif
+	PBYTE pbCode = pTrampoline->codeProbe;
+	pbCode = EmitBytes(pbCode, codeSave, sizeof(codeSave));
+	pbCode = EmitPointer(pbCode, pHookArg);
+	pbCode = EmitBytes(pbCode, codeCall, sizeof(codeCall));
+	pbCode = EmitPointer(pbCode, pfnCallback);
+	pbCode = EmitBytes(pbCode, codeRestore, sizeof(codeRestore));
+	return EmitJump(pbCode, pTrampoline->codeTrampoline);
+}
+
+//=========================================================================
+// Internal function:
+//
+// Called by the dispatcher and the chain links. Returns the hook that
+// comes after the given link in the current chain (the first one for the
+// dispatcher), or the trampoline once the chain runs out. A link that has
+// just been removed from the chain goes straight to the trampoline.
+//=========================================================================
+static PBYTE WINAPI ChainNext(MHOOKS_TRAMPOLINE* pTrampoline, DWORD_PTR nLink) {
+	MHOOKS_CHAIN* pChain = pTrampoline->pDispatch->pChain;
+	DWORD i = 0;
+	if (nLink != MHOOKS_CHAIN_DISPATCH) {
+		while (i < pChain->nHandlers && pChain->entries[i].nLink != nLink)
+			i++;
+		i++;
+	}
+	if (i < pChain->nHandlers)
+		return pChain->entries[i].pHookFunction;
+	return pTrampoline->codeTrampoline;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Build the dispatcher and all chain links in the trampoline. They are
+// written once and never change, chains are switched by swapping data.
+//=========================================================================
+static VOID EmitDispatch(MHOOKS_TRAMPOLINE* pTrampoline) {
+	static const BYTE codeJumpToResult[] = { 0xff, 0xe0 };	// jmp eax / jmp rax
+	PBYTE pbCode = EmitCallout(pTrampoline->codeDispatch, (PVOID)ChainNext, pTrampoline, FALSE, (PVOID)(DWORD_PTR)MHOOKS_CHAIN_DISPATCH);
+	EmitBytes(pbCode, codeJumpToResult, sizeof(codeJumpToResult));
+	for (DWORD i=0; i<MHOOKS_MAX_CHAINED_HOOKS; i++) {
+		pbCode = EmitCallout(pTrampoline->codeLinks[i], (PVOID)ChainNext, pTrampoline, FALSE, (PVOID)(DWORD_PTR)i);
+		EmitBytes(pbCode, codeJumpToResult, sizeof(codeJumpToResult));
+	}
+}
+
+//=========================================================================
+// Internal function:
+//
+// Where the jump to the hook sits in a hooked system function.
+//=========================================================================
+static PBYTE GetHookJump(MHOOKS_TRAMPOLINE* pTrampoline) {
+	if (pTrampoline->dwInstallMode == MHOOKS_INSTALL_HOTPATCH)
+		return pTrampoline->pSystemFunction - MHOOK_JMPSIZE;
+	return pTrampoline->pSystemFunction;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Find the operation about to overwrite the code an instruction pointer
+// lies in. A thread right at the start of the code is fine: it will run
+// the new code from the beginning.
+//=========================================================================
+static MHOOKS_PATCH_OP* FindPatchOp(PBYTE pIp, MHOOKS_PATCH_OP* pOps, DWORD nOps) {
+	for (DWORD i=0; i<nOps; i++) {
+		MHOOKS_TRAMPOLINE* pTrampoline = pOps[i].pTrampoline;
+		if (pTrampoline && pOps[i].bSuspend && !pOps[i].bChained &&
+			pIp > pTrampoline->pSystemFunction && 
+			pIp < (pTrampoline->pSystemFunction + pTrampoline->cbOverwrittenCode))
+			return &pOps[i];
+	}
+	return NULL;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Translate an instruction pointer within the overwrite zone of a system
+// function to the same instruction in the trampoline's relocated copy.
+// Returns NULL if it isn't at the start of one of the instructions.
+//=========================================================================
+static PBYTE GetTrampolineIp(MHOOKS_TRAMPOLINE* pTrampoline, PBYTE pIp) {
+	DWORD dwOffset = (DWORD)(pIp - pTrampoline->pSystemFunction);
+	for (DWORD i=0; i<pTrampoline->nInstructions; i++) {
+		if (pTrampoline->originalOffsets[i] == dwOffset)
+			return pTrampoline->codeTrampoline + pTrampoline->relocatedOffsets[i];
+	}
+	return NULL;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Suspend a given thread. If its instruction pointer is in the middle of
+// code that is about to be hooked, point it at the same instruction in the
+// trampoline, where it carries on as if nothing happened. A thread that
+// can't be moved blocks the operation instead of the suspension.
+//=========================================================================
+static HANDLE SuspendOneThread(DWORD dwThreadId, MHOOKS_PATCH_OP* pOps, DWORD nOps) {
+	// open the thread
+	HANDLE hThread = OpenThread(THREAD_ALL_ACCESS, FALSE, dwThreadId);
+	if (!GOOD_HANDLE(hThread))
+		return NULL;
+	// attempt suspension
+	if (SuspendThread(hThread) == (DWORD)-1) {
+		CloseHandle(hThread);
+		return NULL;
+	}
+	if (!nOps)
+		return hThread;
+	// see where the IP is
+	CONTEXT ctx;
+	ctx.ContextFlags = CONTEXT_CONTROL;
+	if (!GetThreadContext(hThread, &ctx)) {
+		// the thread could be anywhere, including the code about to be
+		// patched, so nothing that relies on the suspension goes ahead
+		ODPRINTF((L"mhooks: SuspendOneThread: can't get the context of thread %d: %d", dwThreadId, gle()));
+		for (DWORD i=0; i<nOps; i++) {
+			if (pOps[i].pTrampoline && pOps[i].bSuspend && !pOps[i].bChained)
+				pOps[i].bBlocked = TRUE;
+		}
+		return hThread;
+	}
+#ifdef _M_IX86
+	PBYTE pIp = (PBYTE)(DWORD_PTR)ctx.Eip;
+#elif defined _M_X64
+	PBYTE pIp = (PBYTE)(DWORD_PTR)ctx.Rip;
+#endif
+	MHOOKS_PATCH_OP* pOp = FindPatchOp(pIp, pOps, nOps);
+	if (!pOp) {
+		ODPRINTF((L"mhooks: SuspendOneThread: Successfully suspended thread %d - IP is at %p", dwThreadId, pIp));
+		return hThread;
+	}
+	// an installed hook's jump is never executed halfway, so only threads
+	// in code about to be hooked can be found here
+	PBYTE pNewIp = pOp->bUnhook ? NULL : GetTrampolineIp(pOp->pTrampoline, pIp);
+#ifdef _M_IX86
+	ctx.Eip = (DWORD)(DWORD_PTR)pNewIp;
+#elif defined _M_X64
+	ctx.Rip = (DWORD64)pNewIp;
+#endif
+	if (pNewIp && SetThreadContext(hThread, &ctx)) {
+		ODPRINTF((L"mhooks: SuspendOneThread: suspended thread %d - IP was at %p - moved to %p", dwThreadId, pIp, pNewIp));
+		pOp->bThreadsMoved = TRUE;
+	} else {
+		ODPRINTF((L"mhooks: SuspendOneThread: suspended thread %d - IP is at %p - IS COLLIDING WITH CODE - CAN'T FIX", dwThreadId, pIp));
+		pOp->bBlocked = TRUE;
+	}
+	return hThread;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Resumes all previously suspended threads in the current process.
+//=========================================================================
+static VOID ResumeOtherThreads() {
+	// make sure things go as fast as possible
+	INT nOriginalPriority = GetThreadPriority(GetCurrentThread());
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	// go through our list
+	for (DWORD i=0; i<g_nThreadHandles; i++) {
+		// and resume & close thread handles
+		ResumeThread(g_hThreadHandles[i]);
+		CloseHandle(g_hThreadHandles[i]);
+	}
+	if (g_qwSuspendStart) {
+		TimingAdd(&g_timings.nSuspensions, &g_timings.qwSuspendedTicks, &g_timings.qwMaxSuspendedTicks,
+			__rdtsc() - g_qwSuspendStart);
+		g_qwSuspendStart = 0;
+	}
+	// clean up, keeping the buffer for next time
+	g_nThreadHandles = 0;
+	SetThreadPriority(GetCurrentThread(), nOriginalPriority);
+}
+
+//=========================================================================
+// Internal function:
+//
+// Suspend all threads in this process while making sure that none of them
+// is in the middle of the code to be patched. Goes through the snapshot
+// once and doesn't allocate while any thread is suspended: if the handle
+// buffer runs out, everybody is let go while it grows and the pass starts
+// over. Returns whether every other thread got suspended.
+//=========================================================================
+static BOOL SuspendOtherThreads(MHOOKS_PATCH_OP* pOps, DWORD nOps) {
+	g_bAllThreadsSuspended = FALSE;
+	// make sure we're the most important thread in the process
+	INT nOriginalPriority = GetThreadPriority(GetCurrentThread());
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	// get a view of the threads in the system
+	HANDLE hSnap = fnCreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, GetCurrentProcessId());
+	if (GOOD_HANDLE(hSnap)) {
+		THREADENTRY32 te;
+		te.dwSize = sizeof(te);
+		g_bAllThreadsSuspended = TRUE;
+		g_qwSuspendStart = __rdtsc();
+		BOOL bMore = fnThread32First(hSnap, &te);
+		while (bMore) {
+			if (te.th32OwnerProcessID == GetCurrentProcessId() && te.th32ThreadID != GetCurrentThreadId()) {
+				if (g_nThreadHandles == g_nThreadHandlesAlloc) {
+					ResumeOtherThreads();
+					DWORD nAlloc = g_nThreadHandlesAlloc ? g_nThreadHandlesAlloc * 2 : 64;
+					HANDLE* hThreadHandles = (HANDLE*)realloc(g_hThreadHandles, nAlloc * sizeof(HANDLE));
+					if (!hThreadHandles) {
+						g_bAllThreadsSuspended = FALSE;
+						break;
+					}
+					ODPRINTF((L"mhooks: SuspendOtherThreads: room for %d threads, starting over", nAlloc));
+					g_hThreadHandles = hThreadHandles;
+					g_nThreadHandlesAlloc = nAlloc;
+					for (DWORD i=0; i<nOps; i++)
+						pOps[i].bBlocked = FALSE;
+					g_qwSuspendStart = __rdtsc();
+					te.dwSize = sizeof(te);
+					bMore = fnThread32First(hSnap, &te);
+					continue;
+				}
+				// attempt to suspend it
+				HANDLE hThread = SuspendOneThread(te.th32ThreadID, pOps, nOps);
+				if (GOOD_HANDLE(hThread)) {
+					g_hThreadHandles[g_nThreadHandles++] = hThread;
+				} else {
+					// we can choose to ignore failures on thread suspension.
+					// It's pretty unlikely that we'll fail - and even if we
+					// do, the chances of a thread's IP being in the wrong
+					// place is pretty small.
+					ODPRINTF((L"mhooks: SuspendOtherThreads: error while suspending thread %d: %d", te.th32ThreadID, gle()));
+					g_bAllThreadsSuspended = FALSE;
+				}
+			}
+			te.dwSize = sizeof(te);
+			bMore = fnThread32Next(hSnap, &te);
+		}
+		CloseHandle(hSnap);
+		ODPRINTF((L"mhooks: SuspendOtherThreads: suspended %d other threads", g_nThreadHandles));
+		if (g_nThreadHandles > g_timings.nMaxSuspendedThreads)
+			g_timings.nMaxSuspendedThreads = g_nThreadHandles;
+	} else {
+		ODPRINTF((L"mhooks: SuspendOtherThreads: can't CreateToolhelp32Snapshot: %d", gle()));
+	}
+	SetThreadPriority(GetCurrentThread(), nOriginalPriority);
+	return g_bAllThreadsSuspended;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Mark the reclamation candidate (sorted by address) that pbValue points
+// into, if any.
+//=========================================================================
+static VOID MarkReference(PBYTE pbValue, MHOOKS_TRAMPOLINE** pCandidates, DWORD nCandidates, BOOL* pbReferenced) {
+	DWORD nLow = 0, nHigh = nCandidates;
+	while (nLow < nHigh) {
+		DWORD nMid = nLow + (nHigh - nLow) / 2;
+		if ((PBYTE)pCandidates[nMid] <= pbValue)
+			nLow = nMid + 1;
+		else
+			nHigh = nMid;
+	}
+	if (nLow && pbValue < (PBYTE)pCandidates[nLow - 1] + sizeof(MHOOKS_TRAMPOLINE))
+		pbReferenced[nLow - 1] = TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Mark the hot-patched candidates whose padding jump a thread is about to
+// execute: it took the short jump just before the hook was removed, and
+// the jump still leads into the trampoline.
+//=========================================================================
+static VOID MarkPaddingReference(PBYTE pbIp, MHOOKS_TRAMPOLINE** pCandidates, DWORD nCandidates, BOOL* pbReferenced) {
+	for (DWORD i=0; i<nCandidates; i++) {
+		MHOOKS_TRAMPOLINE* pTrampoline = pCandidates[i];
+		if (pTrampoline->dwInstallMode == MHOOKS_INSTALL_HOTPATCH &&
+			pbIp >= pTrampoline->pSystemFunction - MHOOK_JMPSIZE && pbIp < pTrampoline->pSystemFunction)
+			pbReferenced[i] = TRUE;
+	}
+}
+
+//=========================================================================
+// Internal function:
+//
+// Put the int3 padding back in front of an unhooked hot-patch point, so
+// nothing leads into its trampoline any more. Nothing executes the padding
+// once no thread is on its way through it, and no newer hook can have put
+// its own jump there: the function isn't a hot-patch point again until the
+// padding is back. Returns FALSE if the trampoline is still the padding's
+// target.
+//=========================================================================
+static BOOL ClearHotPatchPadding(MHOOKS_TRAMPOLINE* pTrampoline) {
+	PBYTE pbPadding = pTrampoline->pSystemFunction - MHOOK_JMPSIZE;
+	DWORD dwOldProtect = 0;
+	if (!VirtualProtect(pbPadding, MHOOK_JMPSIZE, PAGE_EXECUTE_READWRITE, &dwOldProtect)) {
+		ODPRINTF((L"mhooks: ClearHotPatchPadding: failed VirtualProtect: %d", gle()));
+		return FALSE;
+	}
+	FillMemory(pbPadding, MHOOK_JMPSIZE, 0xcc);
+	VirtualProtect(pbPadding, MHOOK_JMPSIZE, dwOldProtect, &dwOldProtect);
+	FlushInstructionCache(GetCurrentProcess(), pbPadding, MHOOK_JMPSIZE);
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Mark every candidate that a thread's stack refers to, from its stack
+// pointer up to the top of the stack. Anything that looks like a pointer
+// counts, so a return address into a trampoline is never missed.
+//=========================================================================
+static BOOL MarkStackReferences(PBYTE pbSp, MHOOKS_TRAMPOLINE** pCandidates, DWORD nCandidates, BOOL* pbReferenced) {
+	MEMORY_BASIC_INFORMATION mbi;
+	if (!VirtualQuery(pbSp, &mbi, sizeof(mbi)) || mbi.State != MEM_COMMIT)
+		return FALSE;
+	PBYTE* ppbEnd = (PBYTE*)((PBYTE)mbi.BaseAddress + mbi.RegionSize);
+	for (PBYTE* ppb = (PBYTE*)((DWORD_PTR)pbSp & ~(sizeof(PBYTE) - 1)); ppb < ppbEnd; ppb++)
+		MarkReference(*ppb, pCandidates, nCandidates, pbReferenced);
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Mark every candidate that a suspended thread is executing or refers to
+// from its registers or its stack.
+//=========================================================================
+static BOOL MarkThreadReferences(HANDLE hThread, MHOOKS_TRAMPOLINE** pCandidates, DWORD nCandidates, BOOL* pbReferenced) {
+	CONTEXT ctx;
+	ctx.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+	if (!GetThreadContext(hThread, &ctx))
+		return FALSE;
+#ifdef _M_IX86
+	DWORD_PTR dwRegisters[] = { ctx.Eip, ctx.Eax, ctx.Ebx, ctx.Ecx, ctx.Edx, ctx.Esi, ctx.Edi, ctx.Ebp };
+	PBYTE pbSp = (PBYTE)(DWORD_PTR)ctx.Esp;
+#elif defined _M_X64
+	DWORD_PTR dwRegisters[] = { ctx.Rip, ctx.Rax, ctx.Rbx, ctx.Rcx, ctx.Rdx, ctx.Rsi, ctx.Rdi, ctx.Rbp,
+		ctx.R8, ctx.R9, ctx.R10, ctx.R11, ctx.R12, ctx.R13, ctx.R14, ctx.R15 };
+	PBYTE pbSp = (PBYTE)(DWORD_PTR)ctx.Rsp;
+#endif
+	for (DWORD i=0; i<sizeof(dwRegisters)/sizeof(dwRegisters[0]); i++)
+		MarkReference((PBYTE)dwRegisters[i], pCandidates, nCandidates, pbReferenced);
+	MarkPaddingReference((PBYTE)dwRegisters[0], pCandidates, nCandidates, pbReferenced);
+	return MarkStackReferences(pbSp, pCandidates, nCandidates, pbReferenced);
+}
+
+static int CompareTrampolines(const void* p1, const void* p2) {
+	PBYTE pb1 = *(PBYTE*)p1;
+	PBYTE pb2 = *(PBYTE*)p2;
+	return pb1 < pb2 ? -1 : pb1 > pb2 ? 1 : 0;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Free retired trampolines and replaced dispatch chains once no thread can
+// get at them any more. With all threads suspended, a trampoline nobody
+// is executing and no register or stack refers to is quiescent: its hook
+// is gone, so nothing new can enter it. The same goes for the old chains
+// of a dispatcher, which ChainNext only reads while its caller's return
+// address into the trampoline is on the stack. A hot-patch trampoline is
+// also kept while a thread is about to take the jump in the padding, and
+// released only once the padding is cleared. Must be called inside the
+// critical section.
+//=========================================================================
+static VOID ReclaimGarbage() {
+	ODPRINTF((L"mhooks: ReclaimGarbage: %d retired trampolines", g_nRetired));
+	// collect the candidates up front: no allocations while threads are suspended
+	DWORD nCandidates = g_nRetired;
+	for (DWORD i=0; i<g_nHooksInUse; i++) {
+		MHOOKS_DISPATCH* pDispatch = g_pHooksByTrampoline[i].pTrampoline->pDispatch;
+		if (pDispatch && pDispatch->pChain->pPrevious)
+			nCandidates++;
+	}
+	MHOOKS_TRAMPOLINE** pCandidates = (MHOOKS_TRAMPOLINE**)malloc(nCandidates * sizeof(MHOOKS_TRAMPOLINE*));
+	BOOL* pbReferenced = (BOOL*)calloc(nCandidates, sizeof(BOOL));
+	if (!nCandidates || !pCandidates || !pbReferenced) {
+		free(pCandidates);
+		free(pbReferenced);
+		return;
+	}
+	CopyMemory(pCandidates, g_pRetired, g_nRetired * sizeof(MHOOKS_TRAMPOLINE*));
+	for (DWORD i=0, n=g_nRetired; i<g_nHooksInUse; i++) {
+		MHOOKS_TRAMPOLINE* pTrampoline = g_pHooksByTrampoline[i].pTrampoline;
+		if (pTrampoline->pDispatch && pTrampoline->pDispatch->pChain->pPrevious)
+			pCandidates[n++] = pTrampoline;
+	}
+	qsort(pCandidates, nCandidates, sizeof(MHOOKS_TRAMPOLINE*), CompareTrampolines);
+
+	// look at every thread, including this one
+	BYTE bHere = 0;
+	BOOL bComplete = MarkStackReferences(&bHere, pCandidates, nCandidates, pbReferenced);
+	SuspendOtherThreads(NULL, 0);
+	bComplete &= g_bAllThreadsSuspended;
+	for (DWORD i=0; bComplete && i<g_nThreadHandles; i++)
+		bComplete = MarkThreadReferences(g_hThreadHandles[i], pCandidates, nCandidates, pbReferenced);
+	ResumeOtherThreads();
+
+	DWORD nReleased = 0;
+	if (bComplete) {
+		for (DWORD i=0; i<nCandidates; i++) {
+			if (pbReferenced[i])
+				continue;
+			MHOOKS_TRAMPOLINE* pTrampoline = pCandidates[i];
+			DWORD nRetired = 0;
+			while (nRetired < g_nRetired && g_pRetired[nRetired] != pTrampoline)
+				nRetired++;
+			if (nRetired < g_nRetired) {
+				if (pTrampoline->dwInstallMode == MHOOKS_INSTALL_HOTPATCH && !ClearHotPatchPadding(pTrampoline))
+					continue;
+				g_pRetired[nRetired] = g_pRetired[--g_nRetired];
+				TrampolineRelease(pTrampoline);
+			} else {
+				ChainReleasePrevious(pTrampoline->pDispatch->pChain);
+			}
+			nReleased++;
+		}
+	}
+	ODPRINTF((L"mhooks: ReclaimGarbage: released %d of %d candidates", nReleased, nCandidates));
+	free(pCandidates);
+	free(pbReferenced);
+
+	// whatever is still in use is only retried once enough newly retired
+	// trampolines have piled up on top of it
+	g_nReclaimAt = g_nRetired + MHOOKS_RECLAIM_THRESHOLD;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Check whether a rel32 operand can reach from pbFrom to pbTo. Same margin
+// as EmitJump uses.
+//=========================================================================
+static BOOL IsWithinRel32(PBYTE pbFrom, PBYTE pbTo) {
+	SIZE_T cbDiff = pbFrom > pbTo ? pbFrom - pbTo : pbTo - pbFrom;
+	return cbDiff <= 0x7fff0000;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Work out whether and how an instruction needs to be relocated when it is
+// moved into the trampoline. Returns FALSE for instructions we can't move.
+//=========================================================================
+static BOOL ClassifyInstruction(INSTRUCTION* pins, PBYTE pLoc, MHOOKS_INSTRUCTION* pInstr) {
+	PBYTE pbOpcode = pins->OpcodeAddress;
+	PBYTE pbNext = pLoc + pins->Length;
+	BOOL bRelativeBranch = TRUE;
+	if (pbOpcode[0] == 0xeb) {
+		pInstr->dwReloc = MHOOKS_RELOC_JMP;
+		pInstr->pbTarget = pbNext + *(CHAR *)&pbOpcode[1];
+	} else if (pbOpcode[0] == 0xe9) {
+		pInstr->dwReloc = MHOOKS_RELOC_JMP;
+		pInstr->pbTarget = pbNext + *(INT32 *)&pbOpcode[1];
+	} else if (pbOpcode[0] == 0xe8) {
+		pInstr->dwReloc = MHOOKS_RELOC_CALL;
+		pInstr->pbTarget = pbNext + *(INT32 *)&pbOpcode[1];
+	} else if (pbOpcode[0] >= 0x70 && pbOpcode[0] <= 0x7f) {
+		pInstr->dwReloc = MHOOKS_RELOC_JCC;
+		pInstr->bOpcode = pbOpcode[0] & 0x0f;
+		pInstr->pbTarget = pbNext + *(CHAR *)&pbOpcode[1];
+	} else if (pbOpcode[0] == 0x0f && pbOpcode[1] >= 0x80 && pbOpcode[1] <= 0x8f) {
+		pInstr->dwReloc = MHOOKS_RELOC_JCC;
+		pInstr->bOpcode = pbOpcode[1] & 0x0f;
+		pInstr->pbTarget = pbNext + *(INT32 *)&pbOpcode[2];
+	} else if (pbOpcode[0] >= 0xe0 && pbOpcode[0] <= 0xe3) {
+		pInstr->dwReloc = MHOOKS_RELOC_LOOP;
+		pInstr->bOpcode = pbOpcode[0];
+		pInstr->pbTarget = pbNext + *(CHAR *)&pbOpcode[1];
+	} else {
+		bRelativeBranch = FALSE;
+	}
+
+	if (bRelativeBranch) {
+		// operand and address size prefixes change what these instructions
+		// do in ways we don't rewrite (rel16 targets, cx instead of ecx/rcx)
+		for (PBYTE pb = pLoc; pb < pbOpcode; pb++) {
+			if (*pb == 0x66 || *pb == 0x67)
+				return FALSE;
+		}
+		return TRUE;
+	}
+
+	for (DWORD i = 0; i < pins->OperandCount; i++) {
+		if (pins->Operands[i].Flags & OP_IPREL) {
+#if defined _M_X64
+			// RIP-relative memory operand: ModRM follows the opcode, and with
+			// RIP-relative addressing there is no SIB, so the displacement is next
+			pInstr->dwReloc = MHOOKS_RELOC_IPREL;
+			pInstr->dwDispOffset = (DWORD)(pbOpcode - pLoc) + pins->OpcodeLength + 1;
+			if (pInstr->dwDispOffset + sizeof(INT32) > pins->Length ||
+				*(INT32 *)(pLoc + pInstr->dwDispOffset) != (INT32)pins->X86.Displacement) {
+				ODPRINTF((L"mhooks: ClassifyInstruction: can't locate the displacement of IP-relative operand %d", i));
+				return FALSE;
+			}
+			pInstr->pbTarget = pbNext + pins->X86.Displacement;
+			return TRUE;
+#else
+			// all IP-relative forms on x86 are branches, which we handled above
+			return FALSE;
+#endif
+		}
+	}
+
+	pInstr->dwReloc = MHOOKS_RELOC_NONE;
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Write one instruction from the overwrite zone to its new location at
+// pbCode, pointing any relative operand at pbTarget. Branches may grow into
+// longer forms (or short instruction sequences) to reach their target.
+//=========================================================================
+static PBYTE EmitRelocatedInstruction(PBYTE pbCode, PBYTE pbOriginal, MHOOKS_INSTRUCTION* pInstr, PBYTE pbTarget) {
+	PBYTE pbPatch;
+	switch (pInstr->dwReloc) {
+	case MHOOKS_RELOC_JMP:
+		return EmitJump(pbCode, pbTarget);
+
+	case MHOOKS_RELOC_CALL:
+		if (IsWithinRel32(pbCode + 5, pbTarget)) {
+			pbCode[0] = 0xe8;
+			*((PDWORD)&pbCode[1]) = (DWORD)(DWORD_PTR)(pbTarget - (pbCode + 5));
+			return pbCode + 5;
+		}
+		// call [target address]; jmp over the target address
+		pbCode[0] = 0xff;
+		pbCode[1] = 0x15;
+#ifdef _M_IX86
+		// on x86 we call through an absolute address...
+		*((PDWORD)&pbCode[2]) = (DWORD)(DWORD_PTR)(pbCode + 8);
+#elif defined _M_X64
+		// ...on x64 through a RIP-relative one
+		*((PDWORD)&pbCode[2]) = 2;
+#endif
+		pbCode[6] = 0xeb;
+		pbCode[7] = sizeof(DWORD_PTR);
+		*((PDWORD_PTR)&pbCode[8]) = (DWORD_PTR)pbTarget;
+		return pbCode + 8 + sizeof(DWORD_PTR);
+
+	case MHOOKS_RELOC_JCC:
+		if (IsWithinRel32(pbCode + 6, pbTarget)) {
+			pbCode[0] = 0x0f;
+			pbCode[1] = 0x80 | pInstr->bOpcode;
+			*((PDWORD)&pbCode[2]) = (DWORD)(DWORD_PTR)(pbTarget - (pbCode + 6));
+			return pbCode + 6;
+		}
+		// inverted condition skips over a long jump to the target
+		pbCode[0] = 0x70 | (pInstr->bOpcode ^ 1);
+		pbPatch = pbCode + 2;
+		pbCode = EmitJump(pbPatch, pbTarget);
+		pbPatch[-1] = (BYTE)(pbCode - pbPatch);
+		return pbCode;
+
+	case MHOOKS_RELOC_LOOP:
+		// loop/jecxz only have a rel8 form, so let them hop onto a jump
+		// to the target, and skip that jump when they are not taken:
+		//   loop +2; jmp short +n; jmp target
+		pbCode[0] = pInstr->bOpcode;
+		pbCode[1] = 2;
+		pbCode[2] = 0xeb;
+		pbPatch = pbCode + 4;
+		pbCode = EmitJump(pbPatch, pbTarget);
+		pbPatch[-1] = (BYTE)(pbCode - pbPatch);
+		return pbCode;
+
+	case MHOOKS_RELOC_IPREL:
+		CopyMemory(pbCode, pbOriginal + pInstr->dwOffset, pInstr->cbLength);
+		*((PDWORD)(pbCode + pInstr->dwDispOffset)) = (DWORD)(DWORD_PTR)(pbTarget - (pbCode + pInstr->cbLength));
+		ODPRINTF((L"mhooks: fixing up RIP instruction operand for code at 0x%p: new displacement: 0x%8.8x", 
+			pbCode, *((PDWORD)(pbCode + pInstr->dwDispOffset))));
+		return pbCode + pInstr->cbLength;
+
+	default:
+		CopyMemory(pbCode, pbOriginal + pInstr->dwOffset, pInstr->cbLength);
+		return pbCode + pInstr->cbLength;
+	}
+}
+
+//=========================================================================
+// Internal function:
+//
+// Copy the instructions of the overwrite zone to pbCode, relocating every
+// IP-relative operand. Branches that stay inside the overwrite zone are
+// pointed at the copy of their target. Stores where each instruction ends
+// up in dwNewOffsets. Returns the end of the emitted code, or NULL if it
+// can't be relocated.
+//=========================================================================
+static PBYTE RelocateCode(PBYTE pbCode, DWORD cbCode, PBYTE pbOriginal, DWORD cbOriginal, MHOOKS_PATCHDATA* pdata,
+						  DWORD dwNewOffsets[MHOOKS_MAX_INSTRUCTIONS]) {
+	if (pdata->nInstructions * MHOOKS_MAX_RELOCATED_BYTES > cbCode)
+		return NULL;
+	PBYTE pbEnd = pbCode;
+	// the first pass lays out the code to find where each instruction ends
+	// up, the second pass emits it again with zone-internal branches resolved.
+	// Internal branches always use the near forms, so both passes agree.
+	for (int nPass = 0; nPass < 2; nPass++) {
+		pbEnd = pbCode;
+		for (DWORD i = 0; i < pdata->nInstructions; i++) {
+			MHOOKS_INSTRUCTION* pInstr = &pdata->instructions[i];
+			PBYTE pbTarget = pInstr->pbTarget;
+			dwNewOffsets[i] = (DWORD)(pbEnd - pbCode);
+			if (pInstr->dwReloc >= MHOOKS_RELOC_JMP && pbTarget >= pbOriginal && pbTarget < pbOriginal + cbOriginal) {
+				DWORD j = 0;
+				while (j < pdata->nInstructions && pbOriginal + pdata->instructions[j].dwOffset != pbTarget)
+					j++;
+				if (j == pdata->nInstructions) {
+					ODPRINTF((L"mhooks: RelocateCode: branch into the middle of an instruction at %p", pbTarget));
+					return NULL;
+				}
+				pbTarget = pbCode + (nPass ? dwNewOffsets[j] : 0);
+			}
+			pbEnd = EmitRelocatedInstruction(pbEnd, pbOriginal, pInstr, pbTarget);
+		}
+	}
+	return pbEnd;
+}
+
+//=========================================================================
+// Examine the machine code at the target function's entry point, and
+// skip bytes in a way that we'll always end on an instruction boundary.
+// Returns are not moved, and nothing after an unconditional jump belongs
+// to the code we're moving, so disassembly stops there.
+// Collect information on every instruction so that IP-relative operands
+// and relative branches can be relocated into the trampoline.
+static DWORD DisassembleAndSkip(PVOID pFunction, DWORD dwMinLen, MHOOKS_PATCHDATA* pdata) {
+	DWORD dwRet = 0;
+	pdata->nLimitDown = 0;
+	pdata->nLimitUp = 0;
+	pdata->nInstructions = 0;
+#ifdef _M_IX86
+	ARCHITECTURE_TYPE arch = ARCH_X86;
+#elif defined _M_X64
+	ARCHITECTURE_TYPE arch = ARCH_X64;
+#else
+	#error unsupported platform
+#endif
+	DISASSEMBLER dis;
+	if (InitDisassembler(&dis, arch)) {
+		INSTRUCTION* pins = NULL;
+		U8* pLoc = (U8*)pFunction;
+		DWORD dwFlags = DISASM_DECODE | DISASM_DISASSEMBLE | DISASM_ALIGNOUTPUT;
+
+		ODPRINTF((L"mhooks: DisassembleAndSkip: Disassembling %p", pLoc));
+		while ( (dwRet < dwMinLen) && (pins = GetInstruction(&dis, (ULONG_PTR)pLoc, pLoc, dwFlags)) ) {
+			ODPRINTF(("mhooks: DisassembleAndSkip: %p:(0x%2.2x) %s", pLoc, pins->Length, pins->String));
+			if (pins->Type == ITYPE_RET		) break;
+			if (pdata->nInstructions == MHOOKS_MAX_INSTRUCTIONS) break;
+
+			MHOOKS_INSTRUCTION* pInstr = &pdata->instructions[pdata->nInstructions];
+			ZeroMemory(pInstr, sizeof(*pInstr));
+			pInstr->dwOffset = dwRet;
+			pInstr->cbLength = pins->Length;
+			if (!ClassifyInstruction(pins, pLoc, pInstr)) {
+				ODPRINTF((L"mhooks: DisassembleAndSkip: found unsupported IP-relative instruction"));
+				// dump instruction bytes to the debug output
+				for (DWORD i=0; i<pins->Length; i++) {
+					ODPRINTF((L"mhooks: DisassembleAndSkip: instr byte %2.2d: 0x%2.2x", i, pLoc[i]));
+				}
+				break;
+			}
+			if (pInstr->dwReloc == MHOOKS_RELOC_IPREL) {
+				// data referenced through RIP has to stay within reach of the
+				// trampoline: store offsets furthest from the function start
+				// (both positive and negative)
+				S64 nAdjustedDisplacement = pInstr->pbTarget - (U8*)pFunction;
+				if (nAdjustedDisplacement < pdata->nLimitDown)
+					pdata->nLimitDown = nAdjustedDisplacement;
+				if (nAdjustedDisplacement > pdata->nLimitUp)
+					pdata->nLimitUp = nAdjustedDisplacement;
+			}
+			pdata->nInstructions++;
+
+			dwRet += pins->Length;
+			pLoc  += pins->Length;
+			if (pins->Type == ITYPE_BRANCH	) break;
+		}
+
+		CloseDisassembler(&dis);
+	}
+
+	return dwRet;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Figure out the length of the overwrite zone of a function and whether
+// we can get away without suspending the other threads:
+// - at a hot-patch point only a 2-byte instruction gets replaced
+// - if the first instruction is at least as long as our jump, no thread
+//   can be stopped halfway through the overwrite zone, so the jump can be
+//   written atomically if it fits into one aligned window.
+// Hot-patch points are only looked for at function entry points. Returns
+// the length of the overwrite zone, or 0 if it can't be hooked.
+//=========================================================================
+static DWORD PlanOverwrite(PBYTE pSystemFunction, BOOL bEntryPoint, MHOOKS_PATCHDATA* pdata, DWORD* pdwInstallMode) {
+	*pdwInstallMode = MHOOKS_INSTALL_SUSPEND;
+	DWORD dwFirstInstructionLength = DisassembleAndSkip(pSystemFunction, 1, pdata);
+	DWORD dwInstructionLength = dwFirstInstructionLength;
+	if (bEntryPoint && IsHotPatchPoint(pSystemFunction, dwFirstInstructionLength)) {
+		ODPRINTF((L"mhooks: PlanOverwrite: hot-patch point at %p", pSystemFunction));
+		*pdwInstallMode = MHOOKS_INSTALL_HOTPATCH;
+	} else {
+		dwInstructionLength = DisassembleAndSkip(pSystemFunction, MHOOK_JMPSIZE, pdata);
+		if (dwInstructionLength < MHOOK_JMPSIZE) {
+			ODPRINTF((L"mhooks: disassembly signals %d bytes (unacceptable)", dwInstructionLength));
+			return 0;
+		}
+		if (dwFirstInstructionLength >= MHOOK_JMPSIZE && CanPatchAtomically(pSystemFunction, MHOOK_JMPSIZE))
+			*pdwInstallMode = MHOOKS_INSTALL_ATOMIC;
+	}
+	ODPRINTF((L"mhooks: PlanOverwrite: disassembly signals %d bytes, install mode %d", dwInstructionLength, *pdwInstallMode));
+	return dwInstructionLength;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Store the outcome of PlanOverwrite in a plan. Everything is kept
+// relative to the function, so the plan holds wherever it gets loaded.
+//=========================================================================
+static BOOL PlanStore(MHOOK_PLAN* pPlan, PBYTE pSystemFunction, DWORD dwInstructionLength, MHOOKS_PATCHDATA* pdata, DWORD dwInstallMode) {
+	if (dwInstructionLength > MHOOK_PLAN_MAX_BYTES || pdata->nInstructions > MHOOK_PLAN_MAX_INSTRUCTIONS ||
+		pdata->nLimitUp > 0x7fffffff || pdata->nLimitDown < -0x7fffffff)
+		return FALSE;
+	pPlan->dwVersion = MHOOK_PLAN_VERSION;
+	pPlan->cbOverwrite = (BYTE)dwInstructionLength;
+	pPlan->bInstallMode = (BYTE)dwInstallMode;
+	pPlan->nInstructions = (BYTE)pdata->nInstructions;
+	pPlan->lLimitUp = (LONG)pdata->nLimitUp;
+	pPlan->lLimitDown = (LONG)pdata->nLimitDown;
+	CopyMemory(pPlan->codeExpected, pSystemFunction, dwInstructionLength);
+	for (DWORD i=0; i<pdata->nInstructions; i++) {
+		MHOOKS_INSTRUCTION* pInstr = &pdata->instructions[i];
+		MHOOK_PLAN_INSTRUCTION* pPlanned = &pPlan->instructions[i];
+		S64 nTarget = pInstr->pbTarget ? pInstr->pbTarget - pSystemFunction : 0;
+		if (nTarget > 0x7fffffff || nTarget < -0x7fffffff)
+			return FALSE;
+		pPlanned->bOffset = (BYTE)pInstr->dwOffset;
+		pPlanned->cbLength = (BYTE)pInstr->cbLength;
+		pPlanned->bReloc = (BYTE)pInstr->dwReloc;
+		pPlanned->bDispOffset = (BYTE)pInstr->dwDispOffset;
+		pPlanned->bOpcode = pInstr->bOpcode;
+		pPlanned->lTarget = (LONG)nTarget;
+	}
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Check that a plan is something PlanStore could have made: a known
+// version and install mode, instructions that cover the overwritten bytes
+// one after the other, and relocations the trampoline knows how to apply.
+// A plan comes from outside, and the relocations write where it says.
+//=========================================================================
+static BOOL PlanIsValid(const MHOOK_PLAN* pPlan) {
+	if (pPlan->dwVersion != MHOOK_PLAN_VERSION || pPlan->bInstallMode > MHOOKS_INSTALL_HOTPATCH ||
+		pPlan->cbOverwrite > MHOOK_PLAN_MAX_BYTES ||
+		pPlan->cbOverwrite < (pPlan->bInstallMode == MHOOKS_INSTALL_HOTPATCH ? MHOOK_SHORTJMPSIZE : MHOOK_JMPSIZE) ||
+		!pPlan->nInstructions || pPlan->nInstructions > MHOOK_PLAN_MAX_INSTRUCTIONS)
+		return FALSE;
+	DWORD dwOffset = 0;
+	for (DWORD i=0; i<pPlan->nInstructions; i++) {
+		const MHOOK_PLAN_INSTRUCTION* pPlanned = &pPlan->instructions[i];
+		if (pPlanned->bOffset != dwOffset || !pPlanned->cbLength || pPlanned->bReloc > MHOOKS_RELOC_LOOP)
+			return FALSE;
+		if (pPlanned->bReloc == MHOOKS_RELOC_IPREL && pPlanned->bDispOffset + sizeof(LONG) > pPlanned->cbLength)
+			return FALSE;
+		dwOffset += pPlanned->cbLength;
+	}
+	return dwOffset == pPlan->cbOverwrite;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Take the overwrite zone of a function from a plan instead of working it
+// out, provided the function still looks the way it did when the plan was
+// made. Returns the length of the overwrite zone, or 0 if the plan doesn't
+// fit the function.
+//=========================================================================
+static DWORD PlanLoad(const MHOOK_PLAN* pPlan, PBYTE pSystemFunction, MHOOKS_PATCHDATA* pdata, DWORD* pdwInstallMode) {
+	if (!PlanIsValid(pPlan)) {
+		ODPRINTF((L"mhooks: PlanLoad: the plan for %p is damaged or from another version", pSystemFunction));
+		return 0;
+	}
+	if (memcmp(pSystemFunction, pPlan->codeExpected, pPlan->cbOverwrite) != 0) {
+		ODPRINTF((L"mhooks: PlanLoad: %p doesn't match the plan", pSystemFunction));
+		return 0;
+	}
+	// the surroundings are cheap to check again
+	*pdwInstallMode = pPlan->bInstallMode;
+	if (*pdwInstallMode == MHOOKS_INSTALL_HOTPATCH && !IsHotPatchPoint(pSystemFunction, pPlan->cbOverwrite)) {
+		ODPRINTF((L"mhooks: PlanLoad: %p is no longer a hot-patch point", pSystemFunction));
+		return 0;
+	}
+	if (*pdwInstallMode == MHOOKS_INSTALL_ATOMIC && !CanPatchAtomically(pSystemFunction, MHOOK_JMPSIZE))
+		*pdwInstallMode = MHOOKS_INSTALL_SUSPEND;
+	pdata->nLimitUp = pPlan->lLimitUp;
+	pdata->nLimitDown = pPlan->lLimitDown;
+	pdata->nInstructions = pPlan->nInstructions;
+	for (DWORD i=0; i<pPlan->nInstructions; i++) {
+		const MHOOK_PLAN_INSTRUCTION* pPlanned = &pPlan->instructions[i];
+		MHOOKS_INSTRUCTION* pInstr = &pdata->instructions[i];
+		pInstr->dwOffset = pPlanned->bOffset;
+		pInstr->cbLength = pPlanned->cbLength;
+		pInstr->dwReloc = pPlanned->bReloc;
+		pInstr->dwDispOffset = pPlanned->bDispOffset;
+		pInstr->bOpcode = pPlanned->bOpcode;
+		pInstr->pbTarget = pInstr->dwReloc != MHOOKS_RELOC_NONE ? pSystemFunction + pPlanned->lTarget : NULL;
+	}
+	ODPRINTF((L"mhooks: PlanLoad: %d bytes, install mode %d, as planned", pPlan->cbOverwrite, *pdwInstallMode));
+	return pPlan->cbOverwrite;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Find the module a function is in, and how far into it the function is.
+//=========================================================================
+static BOOL GetFunctionRva(PBYTE pFunction, DWORD* pdwRva) {
+	HMODULE hModule = NULL;
+	if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		(LPCWSTR)pFunction, &hModule))
+		return FALSE;
+	*pdwRva = (DWORD)(pFunction - (PBYTE)hModule);
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Prepare setting a hook: find the real function, figure out the length
+// of the overwrite zone and build the trampoline. The system function
+// itself is left alone, so this runs while the other threads are active.
+//=========================================================================
+static BOOL PrepareSetHook(MHOOKS_PATCH_OP* pOp) {
+	PVOID pSystemFunction = *pOp->ppFunction;
+	PVOID pHookFunction = pOp->pHookFunction;
+	ODPRINTF((L"mhooks: PrepareSetHook: Started on the job: %p / %p", pSystemFunction, pHookFunction));
+	// SkipJumps would follow an existing hook's jump, so catch those first:
+	// another hook on the same function gets chained to the existing one
+	MHOOKS_TRAMPOLINE* pExisting = TrampolineFind((PBYTE)pSystemFunction);
+	if (pExisting) {
+		ODPRINTF((L"mhooks: PrepareSetHook: %p is already hooked, chaining", pSystemFunction));
+		if ((pOp->dwFlags & (MHOOK_INSTRUMENT | MHOOK_SWITCHABLE | MHOOKS_FLAG_CONTEXT)) || pExisting->pStats || pExisting->bContextHook) {
+			ODPRINTF((L"mhooks: PrepareSetHook: instrumented, switchable and context hooks can't be chained"));
+			return FALSE;
+		}
+		pOp->pTrampoline = pExisting;
+		pOp->pHookFunction = SkipJumps((PBYTE)pHookFunction);
+		pOp->bChained = TRUE;
+		// allocate now, other threads may be suspended while the chain is updated
+		pOp->pChain = (MHOOKS_CHAIN*)malloc(sizeof(MHOOKS_CHAIN));
+		if (!pOp->pChain)
+			return FALSE;
+		if (!pExisting->pDispatch) {
+			pOp->pDispatch = (MHOOKS_DISPATCH*)calloc(1, sizeof(MHOOKS_DISPATCH));
+			if (!pOp->pDispatch)
+				return FALSE;
+			pOp->pDispatch->pChain = (MHOOKS_CHAIN*)calloc(1, sizeof(MHOOKS_CHAIN));
+			if (!pOp->pDispatch->pChain)
+				return FALSE;
+		}
+		// the system function's jump has to be redirected to the dispatcher
+		// the first time round
+		pOp->bSuspend = !(pExisting->pDispatch && pExisting->pDispatch->bDispatching) &&
+			!CanPatchAtomically(GetHookJump(pExisting), MHOOK_JMPSIZE);
+		return TRUE;
+	}
+	// find the real functions (jump over jump tables, if any). A context
+	// hook goes exactly where it was asked to.
+	if (!(pOp->dwFlags & MHOOKS_FLAG_CONTEXT))
+		pSystemFunction = SkipJumps((PBYTE)pSystemFunction);
+	pHookFunction   = SkipJumps((PBYTE)pHookFunction);
+	ODPRINTF((L"mhooks: PrepareSetHook: Started on the job: %p / %p", pSystemFunction, pHookFunction));
+	DWORD dwRva;
+	if (pOp->pPlan && (!GetFunctionRva((PBYTE)pSystemFunction, &dwRva) || dwRva != pOp->pPlan->dwRva)) {
+		ODPRINTF((L"mhooks: PrepareSetHook: the plan is for a different function than %p", pSystemFunction));
+		return FALSE;
+	}
+	MHOOKS_PATCHDATA patchdata = {};
+	DWORD dwInstallMode = MHOOKS_INSTALL_SUSPEND;
+	DWORD dwInstructionLength = pOp->pPlan ?
+		PlanLoad(pOp->pPlan, (PBYTE)pSystemFunction, &patchdata, &dwInstallMode) :
+		PlanOverwrite((PBYTE)pSystemFunction, !(pOp->dwFlags & MHOOKS_FLAG_CONTEXT), &patchdata, &dwInstallMode);
+	if (!dwInstructionLength)
+		return FALSE;
+	// allocate a trampoline structure
+	ULONGLONG qwAllocStart = __rdtsc();
+	MHOOKS_TRAMPOLINE* pTrampoline = TrampolineAlloc((PBYTE)pSystemFunction, patchdata.nLimitUp, patchdata.nLimitDown);
+	TimingAdd(&g_timings.nTrampolineAllocs, &g_timings.qwTrampolineAllocTicks, &g_timings.qwMaxTrampolineAllocTicks,
+		__rdtsc() - qwAllocStart);
+	if (!pTrampoline) {
+		ODPRINTF((L"mhooks: PrepareSetHook: failed to allocate a trampoline"));
+		return FALSE;
+	}
+	ODPRINTF((L"mhooks: PrepareSetHook: allocated structure at %p", pTrampoline));
+	// mark our trampoline buffer to PAGE_EXECUTE_READWRITE
+	DWORD dwOldProtectTrampolineFunction = 0;
+	if (!VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), PAGE_EXECUTE_READWRITE, &dwOldProtectTrampolineFunction)) {
+		ODPRINTF((L"mhooks: PrepareSetHook: failed VirtualProtect 2: %d", gle()));
+		// discard the trampoline (releasing it right away)
+		TrampolineFree(pTrampoline, TRUE);
+		return FALSE;
+	}
+	ODPRINTF((L"mhooks: PrepareSetHook: readwrite set on trampoline structure"));
+
+	// save original code..
+	CopyMemory(pTrampoline->codeUntouched, pSystemFunction, dwInstructionLength);
+	// create our trampoline function from the relocated original code..
+	DWORD dwNewOffsets[MHOOKS_MAX_INSTRUCTIONS];
+	PBYTE pbCode = RelocateCode(pTrampoline->codeTrampoline, sizeof(pTrampoline->codeTrampoline) - MHOOKS_MAX_RELOCATED_BYTES,
+		(PBYTE)pSystemFunction, dwInstructionLength, &patchdata, dwNewOffsets);
+	if (!pbCode) {
+		ODPRINTF((L"mhooks: PrepareSetHook: failed to relocate the original code"));
+		VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), dwOldProtectTrampolineFunction, &dwOldProtectTrampolineFunction);
+		TrampolineFree(pTrampoline, TRUE);
+		return FALSE;
+	}
+	// remember where each instruction went, for threads caught halfway through
+	pTrampoline->nInstructions = patchdata.nInstructions;
+	for (DWORD i = 0; i < patchdata.nInstructions; i++) {
+		pTrampoline->originalOffsets[i] = (BYTE)patchdata.instructions[i].dwOffset;
+		pTrampoline->relocatedOffsets[i] = (BYTE)dwNewOffsets[i];
+	}
+	// plus a jump to the continuation in the original location
+	pbCode = EmitJump(pbCode, ((PBYTE)pSystemFunction) + dwInstructionLength);
+	DWORD cbTrampolineCode = (DWORD)(pbCode - pTrampoline->codeTrampoline);
+	ODPRINTF((L"mhooks: PrepareSetHook: updated the trampoline"));
+
+	DWORD_PTR dwDistance = (PBYTE)pHookFunction < (PBYTE)pSystemFunction ? 
+		(PBYTE)pSystemFunction - (PBYTE)pHookFunction : (PBYTE)pHookFunction - (PBYTE)pSystemFunction;
+	if (pOp->dwFlags & MHOOKS_FLAG_CONTEXT) {
+		// the hooked code goes through the register saving thunk, which
+		// goes on to the trampoline itself
+		pbCode = EmitContextThunk(pTrampoline, (PBYTE)pHookFunction, pOp->pHookArg);
+		ODPRINTF((L"mhooks: PrepareSetHook: created context thunk"));
+		FlushInstructionCache(GetCurrentProcess(), pTrampoline->codeProbe, 
+			pbCode - pTrampoline->codeProbe);
+		pTrampoline->bContextHook = TRUE;
+		pOp->pbJumpTo = pTrampoline->codeProbe;
+	} else if (pOp->dwFlags & MHOOK_INSTRUMENT) {
+		// route the hook through the probe thunks, which live in the
+		// trampoline and can take the long jump to the hook themselves
+		if (g_dwProbeTls == TLS_OUT_OF_INDEXES)
+			g_dwProbeTls = TlsAlloc();
+		pTrampoline->pStats = (MHOOK_STATS*)calloc(1, sizeof(MHOOK_STATS));
+		if (g_dwProbeTls == TLS_OUT_OF_INDEXES || !pTrampoline->pStats) {
+			ODPRINTF((L"mhooks: PrepareSetHook: failed to set up instrumentation"));
+			VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), dwOldProtectTrampolineFunction, &dwOldProtectTrampolineFunction);
+			TrampolineFree(pTrampoline, TRUE);
+			return FALSE;
+		}
+		pTrampoline->pStats->qwMinTicks = ~0ULL;
+		pbCode = EmitProbe(pTrampoline, (PBYTE)pHookFunction);
+		ODPRINTF((L"mhooks: PrepareSetHook: created instrumentation thunks"));
+		FlushInstructionCache(GetCurrentProcess(), pTrampoline->codeProbe, 
+			pbCode - pTrampoline->codeProbe);
+		pOp->pbJumpTo = pTrampoline->codeProbe;
+	} else if (dwDistance > 0x7fff0000) {
+		// create a stub that jumps to the replacement function.
+		// we need this because jumping from the API to the hook directly 
+		// will be a long jump, which is 14 bytes on x64, and we want to 
+		// avoid that - the API may or may not have room for such stuff. 
+		// (remember, we only have 5 bytes guaranteed in the API.)
+		// on the other hand we do have room, and the trampoline will always be
+		// within +/- 2GB of the API, so we do the long jump in there. 
+		// the API will jump to the "reverse trampoline" which
+		// will jump to the user's hook code.
+		pbCode = pTrampoline->codeJumpToHookFunction;
+		pbCode = EmitJump(pbCode, (PBYTE)pHookFunction);
+		ODPRINTF((L"mhooks: PrepareSetHook: created reverse trampoline"));
+		FlushInstructionCache(GetCurrentProcess(), pTrampoline->codeJumpToHookFunction, 
+			pbCode - pTrampoline->codeJumpToHookFunction);
+		pOp->pbJumpTo = pTrampoline->codeJumpToHookFunction;
+	} else {
+		// the jump will be at most 5 bytes so we can do it directly
+		pOp->pbJumpTo = (PBYTE)pHookFunction;
+	}
+	if (pOp->dwFlags & MHOOK_SWITCHABLE) {
+		// put the gate in front of wherever the hook goes
+		pTrampoline->plDisabled = (volatile LONG*)calloc(1, sizeof(LONG));
+		if (!pTrampoline->plDisabled) {
+			ODPRINTF((L"mhooks: PrepareSetHook: failed to allocate the switch"));
+			VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), dwOldProtectTrampolineFunction, &dwOldProtectTrampolineFunction);
+			TrampolineFree(pTrampoline, TRUE);
+			return FALSE;
+		}
+		pbCode = EmitGate(pTrampoline, pOp->pbJumpTo);
+		ODPRINTF((L"mhooks: PrepareSetHook: created gate"));
+		FlushInstructionCache(GetCurrentProcess(), pTrampoline->codeGate, 
+			pbCode - pTrampoline->codeGate);
+		pOp->pbJumpTo = pTrampoline->codeGate;
+	}
+
+	// update data members
+	pTrampoline->cbOverwrittenCode = dwInstructionLength;
+	pTrampoline->dwInstallMode = dwInstallMode;
+	pTrampoline->pSystemFunction = (PBYTE)pSystemFunction;
+	pTrampoline->pHookFunction = (PBYTE)pHookFunction;
+
+	// flush instruction cache and restore original protection
+	FlushInstructionCache(GetCurrentProcess(), pTrampoline->codeTrampoline, cbTrampolineCode);
+	VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), dwOldProtectTrampolineFunction, &dwOldProtectTrampolineFunction);
+
+	pOp->pTrampoline = pTrampoline;
+	pOp->bSuspend = (dwInstallMode == MHOOKS_INSTALL_SUSPEND);
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Prepare removing a hook: find the trampoline that belongs to it.
+//=========================================================================
+static BOOL PrepareUnhook(MHOOKS_PATCH_OP* pOp) {
+	ODPRINTF((L"mhooks: PrepareUnhook: %p", *pOp->ppFunction));
+	// get the trampoline structure that corresponds to our function
+	MHOOKS_TRAMPOLINE* pTrampoline = TrampolineGet((PBYTE)*pOp->ppFunction);
+	if (!pTrampoline)
+		return FALSE;
+	ODPRINTF((L"mhooks: PrepareUnhook: found struct at %p", pTrampoline));
+	pOp->nLink = TrampolineGetLink(pTrampoline, (PBYTE)*pOp->ppFunction);
+	if (pTrampoline->pDispatch) {
+		// one of several chained hooks only has to leave the chain
+		MHOOKS_CHAIN* pChain = pTrampoline->pDispatch->pChain;
+		DWORD i = 0;
+		while (i < pChain->nHandlers && pChain->entries[i].nLink != pOp->nLink)
+			i++;
+		if (i == pChain->nHandlers) {
+			ODPRINTF((L"mhooks: PrepareUnhook: %p is not in the chain", *pOp->ppFunction));
+			return FALSE;
+		}
+		pOp->bChained = (pChain->nHandlers > 1);
+		if (pOp->bChained) {
+			pOp->pChain = (MHOOKS_CHAIN*)malloc(sizeof(MHOOKS_CHAIN));
+			if (!pOp->pChain)
+				return FALSE;
+		}
+	}
+	pOp->pTrampoline = pTrampoline;
+	pOp->bSuspend = !pOp->bChained && (pTrampoline->dwInstallMode == MHOOKS_INSTALL_SUSPEND);
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Check whether a prepared operation overlaps with one of the operations
+// queued before it (e.g. the same function hooked twice in one go).
+//=========================================================================
+static BOOL CollidesWithEarlierOp(MHOOKS_PATCH_OP* pOps, DWORD nOp) {
+	PBYTE pbStart, pbOtherStart;
+	DWORD cbBytes, cbOtherBytes;
+	GetPatchRange(pOps[nOp].pTrampoline, &pbStart, &cbBytes);
+	for (DWORD i=0; i<nOp; i++) {
+		if (!pOps[i].pTrampoline)
+			continue;
+		GetPatchRange(pOps[i].pTrampoline, &pbOtherStart, &cbOtherBytes);
+		if (pbStart < pbOtherStart + cbOtherBytes && pbOtherStart < pbStart + cbBytes)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Patch the jump into a system function. Other threads must be suspended
+// unless the hook is installed atomically. The caller's function pointer
+// leads to the trampoline before the patch goes live: the hook may be
+// called right away, even by code we call ourselves, and calling the
+// original through a stale pointer would land in the hook again.
+//=========================================================================
+static BOOL ApplySetHook(MHOOKS_PATCH_OP* pOp) {
+	MHOOKS_TRAMPOLINE* pTrampoline = pOp->pTrampoline;
+	PBYTE pbPatch;
+	DWORD cbPatch;
+	GetPatchRange(pTrampoline, &pbPatch, &cbPatch);
+	DWORD dwOldProtectSystemFunction = 0;
+	// set the system function to PAGE_EXECUTE_READWRITE
+	if (!VirtualProtect(pbPatch, cbPatch, PAGE_EXECUTE_READWRITE, &dwOldProtectSystemFunction)) {
+		ODPRINTF((L"mhooks: ApplySetHook: failed VirtualProtect 1: %d", gle()));
+		return FALSE;
+	}
+	ODPRINTF((L"mhooks: ApplySetHook: readwrite set on system function"));
+	// this is what the application will use as the entry point
+	// to the "original" unhooked function
+	PVOID pPrevious = *pOp->ppFunction;
+	*pOp->ppFunction = pTrampoline->codeTrampoline;
+	// update the API itself
+	BOOL bPatched = TRUE;
+	BYTE codeJump[MHOOK_JMPSIZE];
+	switch (pTrampoline->dwInstallMode) {
+	case MHOOKS_INSTALL_HOTPATCH:
+		// nobody executes the padding, so the long jump can go in as is...
+		EmitJump(pbPatch, pOp->pbJumpTo);
+		// ...then atomically replace the first instruction with a short jump to it
+		codeJump[0] = 0xeb;
+		codeJump[1] = (BYTE)-(MHOOK_JMPSIZE + MHOOK_SHORTJMPSIZE);
+		bPatched = AtomicPatch(pTrampoline->pSystemFunction, codeJump, MHOOK_SHORTJMPSIZE);
+		break;
+	case MHOOKS_INSTALL_ATOMIC:
+		BuildNearJump(codeJump, pTrampoline->pSystemFunction, pOp->pbJumpTo);
+		bPatched = AtomicPatch(pTrampoline->pSystemFunction, codeJump, MHOOK_JMPSIZE);
+		break;
+	default:
+		EmitJump(pTrampoline->pSystemFunction, pOp->pbJumpTo);
+		break;
+	}
+	if (!bPatched)
+		*pOp->ppFunction = pPrevious;
+	// restore original protection (the instruction cache is flushed by the caller)
+	VirtualProtect(pbPatch, cbPatch, dwOldProtectSystemFunction, &dwOldProtectSystemFunction);
+	ODPRINTF((L"mhooks: ApplySetHook: %s", bPatched ? L"Hooked the function!" : L"patch failed"));
+	return bPatched;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Restore the original code of a system function. Other threads must be
+// suspended unless the hook was installed atomically.
+//=========================================================================
+static BOOL ApplyUnhook(MHOOKS_PATCH_OP* pOp) {
+	MHOOKS_TRAMPOLINE* pTrampoline = pOp->pTrampoline;
+	DWORD dwOldProtectSystemFunction = 0;
+	// make memory writable
+	if (!VirtualProtect(pTrampoline->pSystemFunction, pTrampoline->cbOverwrittenCode, PAGE_EXECUTE_READWRITE, &dwOldProtectSystemFunction)) {
+		ODPRINTF((L"mhooks: ApplyUnhook: failed VirtualProtect 1: %d", gle()));
+		return FALSE;
+	}
+	ODPRINTF((L"mhooks: ApplyUnhook: readwrite set on system function"));
+	switch (pTrampoline->dwInstallMode) {
+	case MHOOKS_INSTALL_HOTPATCH:
+		// put the first instruction back. The jump in the padding stays:
+		// a thread may have just taken the short jump and be on its way there.
+		// ReclaimGarbage clears it once none is.
+		AtomicPatch(pTrampoline->pSystemFunction, pTrampoline->codeUntouched, MHOOK_SHORTJMPSIZE);
+		break;
+	case MHOOKS_INSTALL_ATOMIC:
+		AtomicPatch(pTrampoline->pSystemFunction, pTrampoline->codeUntouched, MHOOK_JMPSIZE);
+		break;
+	default:
+		{
+			PBYTE pbCode = (PBYTE)pTrampoline->pSystemFunction;
+			for (DWORD i = 0; i<pTrampoline->cbOverwrittenCode; i++) {
+				pbCode[i] = pTrampoline->codeUntouched[i];
+			}
+		}
+		break;
+	}
+	// make memory unwritable (the instruction cache is flushed by the caller)
+	VirtualProtect(pTrampoline->pSystemFunction, pTrampoline->cbOverwrittenCode, dwOldProtectSystemFunction, &dwOldProtectSystemFunction);
+	ODPRINTF((L"mhooks: ApplyUnhook: unhook successful"));
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Add a hook to the chain of an already hooked system function. Sets up
+// the dispatcher the first time and points the system function at it.
+// Other threads must be suspended if that can't be done atomically.
+//=========================================================================
+static BOOL ApplyChainHook(MHOOKS_PATCH_OP* pOp) {
+	MHOOKS_TRAMPOLINE* pTrampoline = pOp->pTrampoline;
+	MHOOKS_DISPATCH* pDispatch = pTrampoline->pDispatch;
+	if (!pDispatch) {
+		DWORD dwOldProtectTrampolineFunction = 0;
+		if (!VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), PAGE_EXECUTE_READWRITE, &dwOldProtectTrampolineFunction)) {
+			ODPRINTF((L"mhooks: ApplyChainHook: failed VirtualProtect 2: %d", gle()));
+			return FALSE;
+		}
+		// the existing hook starts out as the only one in the chain
+		pDispatch = pOp->pDispatch;
+		pDispatch->pChain->nHandlers = 1;
+		pDispatch->pChain->entries[0].pHookFunction = pTrampoline->plDisabled ?
+			pTrampoline->codeGate : pTrampoline->pHookFunction;
+		pDispatch->pChain->entries[0].nLink = MHOOKS_CHAIN_BASE;
+		EmitDispatch(pTrampoline);
+		pTrampoline->pDispatch = pDispatch;
+		pOp->pDispatch = NULL;
+		VirtualProtect(pTrampoline, sizeof(MHOOKS_TRAMPOLINE), dwOldProtectTrampolineFunction, &dwOldProtectTrampolineFunction);
+		ODPRINTF((L"mhooks: ApplyChainHook: created dispatcher for %p", pTrampoline->pSystemFunction));
+	}
+
+	// find a free link for the new hook
+	MHOOKS_CHAIN* pOldChain = pDispatch->pChain;
+	DWORD nLink = 0;
+	while (nLink < MHOOKS_MAX_CHAINED_HOOKS && (pDispatch->dwLinksInUse & (1 << nLink)))
+		nLink++;
+	if (nLink == MHOOKS_MAX_CHAINED_HOOKS || pOldChain->nHandlers > MHOOKS_MAX_CHAINED_HOOKS) {
+		ODPRINTF((L"mhooks: ApplyChainHook: too many hooks on %p", pTrampoline->pSystemFunction));
+		return FALSE;
+	}
+
+	PBYTE pbJump = GetHookJump(pTrampoline);
+	DWORD dwOldProtectSystemFunction = 0;
+	if (!pDispatch->bDispatching &&
+		!VirtualProtect(pbJump, MHOOK_JMPSIZE, PAGE_EXECUTE_READWRITE, &dwOldProtectSystemFunction)) {
+		ODPRINTF((L"mhooks: ApplyChainHook: failed VirtualProtect 1: %d", gle()));
+		return FALSE;
+	}
+
+	// publish a new chain with the new hook in front. The new hook calls
+	// on through its link, which has to be in place before the first call.
+	*pOp->ppFunction = pTrampoline->codeLinks[nLink];
+	MHOOKS_CHAIN* pChain = pOp->pChain;
+	pOp->pChain = NULL;
+	pChain->pPrevious = pOldChain;
+	pChain->nHandlers = pOldChain->nHandlers + 1;
+	pChain->entries[0].pHookFunction = (PBYTE)pOp->pHookFunction;
+	pChain->entries[0].nLink = nLink;
+	CopyMemory(&pChain->entries[1], pOldChain->entries, pOldChain->nHandlers * sizeof(MHOOKS_CHAIN_ENTRY));
+	InterlockedExchangePointer((PVOID volatile*)&pDispatch->pChain, pChain);
+	pDispatch->dwLinksInUse |= (1 << nLink);
+	pOp->nLink = nLink;
+
+	if (!pDispatch->bDispatching) {
+		// from now on the system function goes through the dispatcher
+		BYTE codeJump[MHOOK_JMPSIZE];
+		BuildNearJump(codeJump, pbJump, pTrampoline->codeDispatch);
+		if (CanPatchAtomically(pbJump, MHOOK_JMPSIZE))
+			AtomicPatch(pbJump, codeJump, MHOOK_JMPSIZE);
+		else
+			CopyMemory(pbJump, codeJump, MHOOK_JMPSIZE);
+		VirtualProtect(pbJump, MHOOK_JMPSIZE, dwOldProtectSystemFunction, &dwOldProtectSystemFunction);
+		pDispatch->bDispatching = TRUE;
+	}
+	ODPRINTF((L"mhooks: ApplyChainHook: chained %p as link %d", pOp->pHookFunction, nLink));
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Take one hook out of a chain that keeps at least one other hook. The
+// system function stays patched, so no thread needs to be suspended.
+//=========================================================================
+static BOOL ApplyChainUnhook(MHOOKS_PATCH_OP* pOp) {
+	MHOOKS_DISPATCH* pDispatch = pOp->pTrampoline->pDispatch;
+	MHOOKS_CHAIN* pOldChain = pDispatch->pChain;
+	MHOOKS_CHAIN* pChain = pOp->pChain;
+	pOp->pChain = NULL;
+	pChain->pPrevious = pOldChain;
+	pChain->nHandlers = 0;
+	for (DWORD i=0; i<pOldChain->nHandlers; i++) {
+		if (pOldChain->entries[i].nLink != pOp->nLink)
+			pChain->entries[pChain->nHandlers++] = pOldChain->entries[i];
+	}
+	InterlockedExchangePointer((PVOID volatile*)&pDispatch->pChain, pChain);
+	// the link's code never changes, so it can be handed out again even
+	// while a thread is still on its way through it
+	if (pOp->nLink != MHOOKS_CHAIN_BASE)
+		pDispatch->dwLinksInUse &= ~(1 << pOp->nLink);
+	ODPRINTF((L"mhooks: ApplyChainUnhook: removed link %d", pOp->nLink));
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Carry out a list of hook and unhook operations. Everything that can be
+// done up front is done while the other threads keep running; then they
+// are suspended once, all patches are written, the instruction cache is
+// flushed once and the threads are resumed. Returns the number of
+// successful operations. Must be called inside the critical section.
+//=========================================================================
+static int CommitOps(MHOOKS_PATCH_OP* pOps, DWORD nOps) {
+	ULONGLONG qwCommitStart = __rdtsc();
+	BOOL bAnyPrepared = FALSE;
+	BOOL bNeedSuspend = FALSE;
+	for (DWORD i=0; i<nOps; i++) {
+		MHOOKS_PATCH_OP* pOp = &pOps[i];
+		pOp->bResult = FALSE;
+		pOp->pTrampoline = NULL;
+		pOp->bChained = FALSE;
+		pOp->bSuspend = FALSE;
+		pOp->bBlocked = FALSE;
+		pOp->bThreadsMoved = FALSE;
+		pOp->pChain = NULL;
+		pOp->pDispatch = NULL;
+		BOOL bPrepared = pOp->bUnhook ? PrepareUnhook(pOp) : PrepareSetHook(pOp);
+		if (bPrepared && CollidesWithEarlierOp(pOps, i)) {
+			ODPRINTF((L"mhooks: CommitOps: operation %d overlaps an earlier one", i));
+			if (!pOp->bUnhook && !pOp->bChained)
+				TrampolineFree(pOp->pTrampoline, TRUE);
+			bPrepared = FALSE;
+		}
+		if (!bPrepared)
+			pOp->pTrampoline = NULL;
+		else if (pOp->bSuspend)
+			bNeedSuspend = TRUE;
+		bAnyPrepared |= bPrepared;
+	}
+
+	if (bAnyPrepared) {
+		// suspend every other thread in this process, and make sure their IP 
+		// is not in any of the code we're about to overwrite. Not needed if
+		// every patch in this batch can be written atomically.
+		if (bNeedSuspend)
+			SuspendOtherThreads(pOps, nOps);
+		for (DWORD i=0; i<nOps; i++) {
+			MHOOKS_PATCH_OP* pOp = &pOps[i];
+			if (!pOp->pTrampoline || pOp->bBlocked)
+				continue;
+			if (pOp->bChained)
+				pOp->bResult = pOp->bUnhook ? ApplyChainUnhook(pOp) : ApplyChainHook(pOp);
+			else
+				pOp->bResult = pOp->bUnhook ? ApplyUnhook(pOp) : ApplySetHook(pOp);
+		}
+		FlushInstructionCache(GetCurrentProcess(), NULL, 0);
+		// resume everybody else
+		if (bNeedSuspend)
+			ResumeOtherThreads();
+	}
+
+	int nSucceeded = 0;
+	for (DWORD i=0; i<nOps; i++) {
+		MHOOKS_PATCH_OP* pOp = &pOps[i];
+		if (pOp->bResult) {
+			if (pOp->bUnhook) {
+				// return the original function pointer
+				*pOp->ppFunction = pOp->pTrampoline->pSystemFunction;
+				ODPRINTF((L"mhooks: CommitOps: sysfunc: %p", *pOp->ppFunction));
+				// free the trampoline while not really discarding it from memory,
+				// unless other hooks are still chained to it
+				if (!pOp->bChained)
+					TrampolineFree(pOp->pTrampoline, FALSE);
+			}
+			// a new hook's function pointer was set up by the Apply function
+			nSucceeded++;
+		} else if (!pOp->bUnhook && !pOp->bChained && pOp->pTrampoline) {
+			// if we failed discard the trampoline (releasing it right away),
+			// unless threads have been sent through it
+			TrampolineFree(pOp->pTrampoline, !pOp->bThreadsMoved);
+		}
+		// chain memory that didn't get used
+		free(pOp->pChain);
+		if (pOp->pDispatch) {
+			free(pOp->pDispatch->pChain);
+			free(pOp->pDispatch);
+		}
+		if (pOp->pbResult)
+			*pOp->pbResult = pOp->bResult;
+	}
+	// free unhooked trampolines and replaced chains every once in a while
+	if (g_nRetired >= g_nReclaimAt)
+		ReclaimGarbage();
+	TimingAdd(&g_timings.nCommits, &g_timings.qwCommitTicks, &g_timings.qwMaxCommitTicks, __rdtsc() - qwCommitStart);
+	g_timings.nOperations += nOps;
+	g_timings.nFailedOperations += nOps - nSucceeded;
+	return nSucceeded;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Swap a function pointer from one value to another, provided nobody else
+// changed it in the meantime. The pointer may share its page with code.
+//=========================================================================
+static BOOL SwapPointer(PVOID* ppSlot, PVOID pFrom, PVOID pTo) {
+	DWORD dwOldProtect = 0;
+	if (!VirtualProtect(ppSlot, sizeof(PVOID), PAGE_EXECUTE_READWRITE, &dwOldProtect)) {
+		ODPRINTF((L"mhooks: SwapPointer: failed VirtualProtect: %d", gle()));
+		return FALSE;
+	}
+	BOOL bRet = (InterlockedCompareExchangePointer((PVOID volatile*)ppSlot, pTo, pFrom) == pFrom);
+	VirtualProtect(ppSlot, sizeof(PVOID), dwOldProtect, &dwOldProtect);
+	return bRet;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Redirect a function pointer to a hook, handing its original value to the
+// caller. Must be called inside the critical section.
+//=========================================================================
+static BOOL PointerHookAdd(PVOID* ppSlot, PVOID* ppFunction, PVOID pHookFunction) {
+	if (g_nPointerHooks == g_nPointerHooksAlloc) {
+		DWORD nAlloc = g_nPointerHooksAlloc ? g_nPointerHooksAlloc * 2 : 16;
+		MHOOKS_POINTER_HOOK* pHooks = (MHOOKS_POINTER_HOOK*)realloc(g_pPointerHooks, nAlloc * sizeof(MHOOKS_POINTER_HOOK));
+		if (!pHooks)
+			return FALSE;
+		g_pPointerHooks = pHooks;
+		g_nPointerHooksAlloc = nAlloc;
+	}
+	PVOID pOriginal = *ppSlot;
+	PVOID pPrevious = *ppFunction;
+	// the caller's pointer has to be valid before the first call comes in
+	*ppFunction = pOriginal;
+	if (!SwapPointer(ppSlot, pOriginal, pHookFunction)) {
+		*ppFunction = pPrevious;
+		return FALSE;
+	}
+	MHOOKS_POINTER_HOOK* pHook = &g_pPointerHooks[g_nPointerHooks++];
+	pHook->ppSlot = ppSlot;
+	pHook->pOriginal = pOriginal;
+	pHook->pHookFunction = pHookFunction;
+	pHook->ppFunction = ppFunction;
+	ODPRINTF((L"mhooks: PointerHookAdd: %p now points to %p instead of %p", ppSlot, pHookFunction, pOriginal));
+	return TRUE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Put back the original value of a hooked function pointer. Fails if
+// another hook has been put on top of ours since. Must be called inside
+// the critical section.
+//=========================================================================
+static BOOL PointerHookRemove(PVOID* ppFunction) {
+	for (DWORD i=0; i<g_nPointerHooks; i++) {
+		MHOOKS_POINTER_HOOK* pHook = &g_pPointerHooks[i];
+		if (pHook->ppFunction != ppFunction)
+			continue;
+		if (!SwapPointer(pHook->ppSlot, pHook->pHookFunction, pHook->pOriginal)) {
+			ODPRINTF((L"mhooks: PointerHookRemove: %p no longer points to our hook", pHook->ppSlot));
+			return FALSE;
+		}
+		*ppFunction = pHook->pOriginal;
+		g_pPointerHooks[i] = g_pPointerHooks[--g_nPointerHooks];
+		return TRUE;
+	}
+	ODPRINTF((L"mhooks: PointerHookRemove: %p is not a pointer hook", ppFunction));
+	return FALSE;
+}
+
+#ifdef __ELF__
+//=========================================================================
+// ELF counterparts of the import address table: the relocations that fill
+// in the global offset table entries a module calls functions through
+#if defined __x86_64__
+typedef ElfW(Rela) MHOOKS_ELF_RELOC;
+#define MHOOKS_DT_RELOC			DT_RELA
+#define MHOOKS_DT_RELOCSZ		DT_RELASZ
+#define MHOOKS_R_JUMP_SLOT		R_X86_64_JUMP_SLOT
+#define MHOOKS_R_GLOB_DAT		R_X86_64_GLOB_DAT
+#define MHOOKS_R_TYPE			ELF64_R_TYPE
+#define MHOOKS_R_SYM			ELF64_R_SYM
+#else
+typedef ElfW(Rel) MHOOKS_ELF_RELOC;
+#define MHOOKS_DT_RELOC			DT_REL
+#define MHOOKS_DT_RELOCSZ		DT_RELSZ
+#define MHOOKS_R_JUMP_SLOT		R_386_JMP_SLOT
+#define MHOOKS_R_GLOB_DAT		R_386_GLOB_DAT
+#define MHOOKS_R_TYPE			ELF32_R_TYPE
+#define MHOOKS_R_SYM			ELF32_R_SYM
+#endif
+
+//=========================================================================
+// Internal function:
+//
+// Whether an address lies in one of the loaded segments of an object.
+//=========================================================================
+static BOOL ElfContains(const struct dl_phdr_info* pInfo, PBYTE pbAddress) {
+	for (ElfW(Half) i=0; i<pInfo->dlpi_phnum; i++) {
+		const ElfW(Phdr)* pPhdr = &pInfo->dlpi_phdr[i];
+		PBYTE pbSegment = (PBYTE)(pInfo->dlpi_addr + pPhdr->p_vaddr);
+		if (pPhdr->p_type == PT_LOAD && pbAddress >= pbSegment && pbAddress < pbSegment + pPhdr->p_memsz)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+//=========================================================================
+// Internal function:
+//
+// dl_iterate_phdr callback that stops at the object containing the
+// address passed in as pData's dlpi_addr, or at the executable for NULL,
+// and hands back its dl_phdr_info in the same place.
+//=========================================================================
+static int ElfFindObject(struct dl_phdr_info* pInfo, size_t /*cbInfo*/, void* pData) {
+	struct dl_phdr_info* pFound = (struct dl_phdr_info*)pData;
+	if (pFound->dlpi_addr && !ElfContains(pInfo, (PBYTE)pFound->dlpi_addr))
+		return 0;
+	*pFound = *pInfo;
+	return 1;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Find the global offset table entry a module calls a function through.
+// ELF modules don't say which library a function is to come from, so
+// pszImportModule only has to define it. An entry that hasn't been bound
+// yet leads to the lazy binding stub, which would overwrite the hook on
+// the first call, so it is bound here the way that call would have.
+//=========================================================================
+static PVOID* FindImportSlot(HMODULE hModule, LPCSTR pszImportModule, LPCSTR pszFunctionName) {
+	struct dl_phdr_info info;
+	info.dlpi_addr = (ElfW(Addr))hModule;
+	if (!dl_iterate_phdr(ElfFindObject, &info))
+		return NULL;
+	void* hImportModule = dlopen(pszImportModule, RTLD_LAZY | RTLD_NOLOAD);
+	if (!hImportModule)
+		return NULL;
+	PVOID pResolved = dlsym(hImportModule, pszFunctionName);
+	dlclose(hImportModule);
+	if (!pResolved)
+		return NULL;
+
+	const ElfW(Dyn)* pDynamic = NULL;
+	for (ElfW(Half) i=0; i<info.dlpi_phnum; i++) {
+		if (info.dlpi_phdr[i].p_type == PT_DYNAMIC)
+			pDynamic = (const ElfW(Dyn)*)(info.dlpi_addr + info.dlpi_phdr[i].p_vaddr);
+	}
+	if (!pDynamic)
+		return NULL;
+	const ElfW(Sym)* pSymbols = NULL;
+	LPCSTR pszStrings = NULL;
+	const MHOOKS_ELF_RELOC* pRelocs[2] = { NULL, NULL };
+	SIZE_T cbRelocs[2] = { 0, 0 };
+	for (const ElfW(Dyn)* pDyn = pDynamic; pDyn->d_tag != DT_NULL; pDyn++) {
+		// the dynamic linker relocates these addresses in place, mostly
+		ElfW(Addr) pAddress = pDyn->d_un.d_ptr;
+		if (pAddress < info.dlpi_addr)
+			pAddress += info.dlpi_addr;
+		switch (pDyn->d_tag) {
+		case DT_SYMTAB:			pSymbols = (const ElfW(Sym)*)pAddress; break;
+		case DT_STRTAB:			pszStrings = (LPCSTR)pAddress; break;
+		case DT_JMPREL:			pRelocs[0] = (const MHOOKS_ELF_RELOC*)pAddress; break;
+		case DT_PLTRELSZ:		cbRelocs[0] = pDyn->d_un.d_val; break;
+		case MHOOKS_DT_RELOC:	pRelocs[1] = (const MHOOKS_ELF_RELOC*)pAddress; break;
+		case MHOOKS_DT_RELOCSZ:	cbRelocs[1] = pDyn->d_un.d_val; break;
+		}
+	}
+	if (!pSymbols || !pszStrings)
+		return NULL;
+
+	for (DWORD nTable=0; nTable<2; nTable++) {
+		if (!pRelocs[nTable])
+			continue;
+		for (SIZE_T i=0; i<cbRelocs[nTable] / sizeof(MHOOKS_ELF_RELOC); i++) {
+			const MHOOKS_ELF_RELOC* pReloc = &pRelocs[nTable][i];
+			DWORD dwType = (DWORD)MHOOKS_R_TYPE(pReloc->r_info);
+			if (dwType != MHOOKS_R_JUMP_SLOT && dwType != MHOOKS_R_GLOB_DAT)
+				continue;
+			const ElfW(Sym)* pSymbol = &pSymbols[MHOOKS_R_SYM(pReloc->r_info)];
+			if (strcmp(pszStrings + pSymbol->st_name, pszFunctionName) != 0)
+				continue;
+			PVOID* ppSlot = (PVOID*)(info.dlpi_addr + pReloc->r_offset);
+			PVOID pCurrent = *ppSlot;
+			BOOL bUnbound = dwType == MHOOKS_R_JUMP_SLOT && pCurrent != pResolved && ElfContains(&info, (PBYTE)pCurrent);
+			// a hook of our own in the module isn't the lazy binding stub
+			for (DWORD j=0; bUnbound && j<g_nPointerHooks; j++)
+				bUnbound = g_pPointerHooks[j].ppSlot != ppSlot;
+			if (bUnbound && !SwapPointer(ppSlot, pCurrent, pResolved))
+				return NULL;
+			return ppSlot;
+		}
+	}
+	return NULL;
+}
+#else
+//=========================================================================
+// Internal function:
+//
+// Find the import address table entry a module calls a function of
+// another module through. Entries are matched by name where the module
+// has an import name table, and by address otherwise.
+//=========================================================================
+static PVOID* FindImportSlot(HMODULE hModule, LPCSTR pszImportModule, LPCSTR pszFunctionName) {
+	if (!hModule)
+		hModule = GetModuleHandle(NULL);
+	PBYTE pbBase = (PBYTE)hModule;
+	PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pbBase;
+	if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+		return NULL;
+	PIMAGE_NT_HEADERS pNtHeaders = (PIMAGE_NT_HEADERS)(pbBase + pDosHeader->e_lfanew);
+	if (pNtHeaders->Signature != IMAGE_NT_SIGNATURE)
+		return NULL;
+	IMAGE_DATA_DIRECTORY* pImports = &pNtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	if (!pImports->VirtualAddress || !pImports->Size)
+		return NULL;
+	HMODULE hImportModule = GetModuleHandleA(pszImportModule);
+	PVOID pResolved = hImportModule ? (PVOID)GetProcAddress(hImportModule, pszFunctionName) : NULL;
+	for (PIMAGE_IMPORT_DESCRIPTOR pDescriptor = (PIMAGE_IMPORT_DESCRIPTOR)(pbBase + pImports->VirtualAddress);
+		 pDescriptor->Name; pDescriptor++) {
+		if (lstrcmpiA((LPCSTR)(pbBase + pDescriptor->Name), pszImportModule) != 0)
+			continue;
+		PIMAGE_THUNK_DATA pThunk = (PIMAGE_THUNK_DATA)(pbBase + pDescriptor->FirstThunk);
+		PIMAGE_THUNK_DATA pName = pDescriptor->OriginalFirstThunk ?
+			(PIMAGE_THUNK_DATA)(pbBase + pDescriptor->OriginalFirstThunk) : NULL;
+		for (; pThunk->u1.Function; pThunk++) {
+			BOOL bMatch;
+			if (pName && !IMAGE_SNAP_BY_ORDINAL(pName->u1.Ordinal)) {
+				PIMAGE_IMPORT_BY_NAME pImportByName = (PIMAGE_IMPORT_BY_NAME)(pbBase + pName->u1.AddressOfData);
+				bMatch = !strcmp((LPCSTR)pImportByName->Name, pszFunctionName);
+			} else {
+				bMatch = pResolved && (PVOID)pThunk->u1.Function == pResolved;
+			}
+			if (bMatch)
+				return (PVOID*)&pThunk->u1.Function;
+			if (pName)
+				pName++;
+		}
+	}
+	return NULL;
+}
+#endif
+
+//=========================================================================
+// Internal function:
+//
+// Find the copy of a virtual function table that objects hooked on their
+// own point to, or NULL if pVtable isn't one.
+//=========================================================================
+static MHOOKS_VTABLE_CLONE* VtableCloneFind(PVOID* pVtable) {
+	for (DWORD i=0; i<g_nVtableClones; i++) {
+		if (g_pVtableClones[i].pClone == pVtable)
+			return &g_pVtableClones[i];
+	}
+	return NULL;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Make an object use its own copy of its class's virtual function table,
+// unless it already does. Returns the copy, or NULL on failure. Must be
+// called inside the critical section.
+//=========================================================================
+static MHOOKS_VTABLE_CLONE* VtableCloneAttach(PVOID pObject, DWORD nSlots) {
+	PVOID* pVtable = *(PVOID**)pObject;
+	MHOOKS_VTABLE_CLONE* pClone = VtableCloneFind(pVtable);
+	if (pClone)
+		return pClone;
+	if (g_nVtableClones == g_nVtableClonesAlloc) {
+		DWORD nAlloc = g_nVtableClonesAlloc ? g_nVtableClonesAlloc * 2 : 16;
+		MHOOKS_VTABLE_CLONE* pClones = (MHOOKS_VTABLE_CLONE*)realloc(g_pVtableClones, nAlloc * sizeof(MHOOKS_VTABLE_CLONE));
+		if (!pClones)
+			return NULL;
+		g_pVtableClones = pClones;
+		g_nVtableClonesAlloc = nAlloc;
+	}
+	PVOID* pCopy = (PVOID*)malloc((MHOOKS_VTABLE_PREFIX + nSlots) * sizeof(PVOID));
+	if (!pCopy)
+		return NULL;
+	CopyMemory(pCopy, pVtable - MHOOKS_VTABLE_PREFIX, (MHOOKS_VTABLE_PREFIX + nSlots) * sizeof(PVOID));
+	// hooks on the class don't carry over, they may go away while the copy stays
+	for (DWORD i=0; i<g_nPointerHooks; i++) {
+		PVOID* ppSlot = g_pPointerHooks[i].ppSlot;
+		if (ppSlot >= pVtable && ppSlot < pVtable + nSlots && pCopy[MHOOKS_VTABLE_PREFIX + (ppSlot - pVtable)] == g_pPointerHooks[i].pHookFunction)
+			pCopy[MHOOKS_VTABLE_PREFIX + (ppSlot - pVtable)] = g_pPointerHooks[i].pOriginal;
+	}
+	// the object's calls go through the copy from here on
+	if (!SwapPointer((PVOID*)pObject, pVtable, pCopy + MHOOKS_VTABLE_PREFIX)) {
+		free(pCopy);
+		return NULL;
+	}
+	pClone = &g_pVtableClones[g_nVtableClones++];
+	pClone->pVtable = pVtable;
+	pClone->pClone = pCopy + MHOOKS_VTABLE_PREFIX;
+	pClone->nSlots = nSlots;
+	ODPRINTF((L"mhooks: VtableCloneAttach: %p uses %p instead of %p", pObject, pClone->pClone, pVtable));
+	return pClone;
+}
+
+//=========================================================================
+// Internal function:
+//
+// Queue an operation in the currently open transaction.
+//=========================================================================
+static BOOL TransactionAdd(BOOL bUnhook, PVOID* ppFunction, PVOID pHookFunction, BOOL* pbResult) {
+	BOOL bRet = FALSE;
+	EnterCritSec();
+	if (g_dwTransactionThread == GetCurrentThreadId()) {
+		if (g_nTransactionOps == g_nTransactionOpsAlloc) {
+			DWORD nAlloc = g_nTransactionOpsAlloc ? 2 * g_nTransactionOpsAlloc : 16;
+			MHOOKS_PATCH_OP* pOps = (MHOOKS_PATCH_OP*)realloc(g_pTransactionOps, nAlloc * sizeof(MHOOKS_PATCH_OP));
+			if (pOps) {
+				g_pTransactionOps = pOps;
+				g_nTransactionOpsAlloc = nAlloc;
 			}
-			// flush instruction cache and make memory unwritable
-			FlushInstructionCache(GetCurrentProcess(), pTrampoline->pSystemFunction, pTrampoline->cbOverwrittenCode);
-			VirtualProtect(pTrampoline->pSystemFunction, pTrampoline->cbOverwrittenCode, dwOldProtectSystemFunction, &dwOldProtectSystemFunction);
-			// return the original function pointer
-			*ppHookedFunction = pTrampoline->pSystemFunction;
+		}
+		if (g_nTransactionOps < g_nTransactionOpsAlloc) {
+			MHOOKS_PATCH_OP* pOp = &g_pTransactionOps[g_nTransactionOps++];
+			ZeroMemory(pOp, sizeof(*pOp));
+			pOp->bUnhook = bUnhook;
+			pOp->ppFunction = ppFunction;
+			pOp->pHookFunction = pHookFunction;
+			pOp->pbResult = pbResult;
 			bRet = TRUE;
-			ODPRINTF((L"mhooks: Mhook_Unhook: sysfunc: %p", *ppHookedFunction));
-			// free the trampoline while not really discarding it from memory
-			TrampolineFree(pTrampoline, FALSE);
-			ODPRINTF((L"mhooks: Mhook_Unhook: unhook successful"));
-		} else {
-			ODPRINTF((L"mhooks: Mhook_Unhook: failed VirtualProtect 1: %d", gle()));
 		}
-		// make the other guys runnable
-		ResumeOtherThreads();
 	}
 	LeaveCritSec();
 	return bRet;
 }
 
 //=========================================================================
+// Internal function:
+//
+// Close the transaction the calling thread has open, if any. Call this
+// with the critical section held.
+//=========================================================================
+static VOID TransactionEnd(BOOL bCommit, int* pnSucceeded) {
+	if (g_dwTransactionThread != GetCurrentThreadId())
+		return;
+	if (bCommit) {
+		ODPRINTF((L"mhooks: Mhook_CommitTransaction: committing %d operations", g_nTransactionOps));
+		*pnSucceeded = CommitOps(g_pTransactionOps, g_nTransactionOps);
+	} else {
+		for (DWORD i=0; i<g_nTransactionOps; i++) {
+			if (g_pTransactionOps[i].pbResult)
+				*g_pTransactionOps[i].pbResult = FALSE;
+		}
+	}
+	free(g_pTransactionOps);
+	g_pTransactionOps = NULL;
+	g_nTransactionOps = 0;
+	g_nTransactionOpsAlloc = 0;
+	g_dwTransactionThread = 0;
+}
+
+//=========================================================================
+BOOL Mhook_SetHook(PVOID *ppSystemFunction, PVOID pHookFunction) {
+	return Mhook_SetHookEx(ppSystemFunction, pHookFunction, 0);
+}
+
+//=========================================================================
+BOOL Mhook_SetHookEx(PVOID *ppSystemFunction, PVOID pHookFunction, DWORD dwFlags) {
+	MHOOKS_PATCH_OP op = {};
+	op.ppFunction = ppSystemFunction;
+	op.pHookFunction = pHookFunction;
+	op.dwFlags = dwFlags;
+	// ensure thread-safety
+	EnterCritSec();
+	int nSucceeded = CommitOps(&op, 1);
+	LeaveCritSec();
+	return (nSucceeded == 1);
+}
+
+//=========================================================================
+BOOL Mhook_SetContextHook(PVOID *ppAddress, MHOOK_CONTEXT_CALLBACK pfnCallback, PVOID pArg) {
+	MHOOKS_PATCH_OP op = {};
+	op.ppFunction = ppAddress;
+	op.pHookFunction = (PVOID)pfnCallback;
+	op.pHookArg = pArg;
+	op.dwFlags = MHOOKS_FLAG_CONTEXT;
+	EnterCritSec();
+	int nSucceeded = CommitOps(&op, 1);
+	LeaveCritSec();
+	return (nSucceeded == 1);
+}
+
+//=========================================================================
+BOOL Mhook_PlanHook(PVOID pSystemFunction, MHOOK_PLAN *pPlan) {
+	ZeroMemory(pPlan, sizeof(MHOOK_PLAN));
+	PBYTE pbFunction = SkipJumps((PBYTE)pSystemFunction);
+	MHOOKS_PATCHDATA patchdata = {};
+	DWORD dwInstallMode;
+	EnterCritSec();
+	// a function that is hooked already doesn't look like it will next time
+	BOOL bRet = !TrampolineFind((PBYTE)pSystemFunction) && GetFunctionRva(pbFunction, &pPlan->dwRva);
+	if (bRet) {
+		DWORD dwInstructionLength = PlanOverwrite(pbFunction, TRUE, &patchdata, &dwInstallMode);
+		bRet = dwInstructionLength && PlanStore(pPlan, pbFunction, dwInstructionLength, &patchdata, dwInstallMode);
+	}
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+BOOL Mhook_SetHookFromPlan(PVOID *ppSystemFunction, PVOID pHookFunction, DWORD dwFlags, const MHOOK_PLAN *pPlan) {
+	MHOOKS_PATCH_OP op = {};
+	op.ppFunction = ppSystemFunction;
+	op.pHookFunction = pHookFunction;
+	op.dwFlags = dwFlags;
+	op.pPlan = pPlan;
+	EnterCritSec();
+	int nSucceeded = CommitOps(&op, 1);
+	LeaveCritSec();
+	return (nSucceeded == 1);
+}
+
+//=========================================================================
+BOOL Mhook_Unhook(PVOID *ppHookedFunction) {
+	MHOOKS_PATCH_OP op = {};
+	op.bUnhook = TRUE;
+	op.ppFunction = ppHookedFunction;
+	EnterCritSec();
+	int nSucceeded = CommitOps(&op, 1);
+	LeaveCritSec();
+	return (nSucceeded == 1);
+}
+
+//=========================================================================
+BOOL Mhook_GetHookStats(PVOID pHookedFunction, MHOOK_STATS *pStats) {
+	BOOL bRet = FALSE;
+	EnterCritSec();
+	MHOOKS_TRAMPOLINE* pTrampoline = TrampolineGet((PBYTE)pHookedFunction);
+	if (pTrampoline && pTrampoline->pStats) {
+		// the counters keep moving while we copy, which is fine for statistics
+		*pStats = *pTrampoline->pStats;
+		if (!pStats->nReturns)
+			pStats->qwMinTicks = 0;
+		bRet = TRUE;
+	}
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+BOOL Mhook_SetImportHook(HMODULE hModule, LPCSTR pszImportModule, LPCSTR pszFunctionName, PVOID *ppSystemFunction, PVOID pHookFunction) {
+	BOOL bRet = FALSE;
+	EnterCritSec();
+	PVOID* ppSlot = FindImportSlot(hModule, pszImportModule, pszFunctionName);
+	if (ppSlot)
+		bRet = PointerHookAdd(ppSlot, ppSystemFunction, pHookFunction);
+	else
+		ODPRINTF((L"mhooks: Mhook_SetImportHook: %S!%S is not imported by %p", pszImportModule, pszFunctionName, hModule));
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+BOOL Mhook_UnhookImport(PVOID *ppHookedFunction) {
+	EnterCritSec();
+	BOOL bRet = PointerHookRemove(ppHookedFunction);
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+BOOL Mhook_SetVtableHook(PVOID pObject, DWORD nSlot, DWORD nSlots, PVOID *ppOriginal, PVOID pHookFunction) {
+	BOOL bRet = FALSE;
+	EnterCritSec();
+	PVOID* pVtable = *(PVOID**)pObject;
+	// an object hooked on its own still tells us its class's table
+	MHOOKS_VTABLE_CLONE* pClone = VtableCloneFind(pVtable);
+	if (pClone)
+		pVtable = pClone->pVtable;
+	if (nSlot < nSlots)
+		bRet = PointerHookAdd(&pVtable[nSlot], ppOriginal, pHookFunction);
+	else
+		ODPRINTF((L"mhooks: Mhook_SetVtableHook: slot %d is outside the %d slots of %p", nSlot, nSlots, pVtable));
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+BOOL Mhook_SetInstanceHook(PVOID pObject, DWORD nSlot, DWORD nSlots, PVOID *ppOriginal, PVOID pHookFunction) {
+	BOOL bRet = FALSE;
+	EnterCritSec();
+	// an object that already has a copy may have a shorter one
+	MHOOKS_VTABLE_CLONE* pClone = nSlot < nSlots ? VtableCloneAttach(pObject, nSlots) : NULL;
+	if (pClone && nSlot < pClone->nSlots)
+		bRet = PointerHookAdd(&pClone->pClone[nSlot], ppOriginal, pHookFunction);
+	else
+		ODPRINTF((L"mhooks: Mhook_SetInstanceHook: can't hook slot %d of %p", nSlot, pObject));
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+BOOL Mhook_UnhookVtable(PVOID *ppHookedFunction) {
+	EnterCritSec();
+	BOOL bRet = PointerHookRemove(ppHookedFunction);
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+BOOL Mhook_EnableHook(PVOID pHookedFunction, BOOL bEnable) {
+	BOOL bRet = FALSE;
+	EnterCritSec();
+	MHOOKS_TRAMPOLINE* pTrampoline = TrampolineGet((PBYTE)pHookedFunction);
+	// only the hook that set up the trampoline can have a switch
+	if (pTrampoline && pTrampoline->plDisabled &&
+		TrampolineGetLink(pTrampoline, (PBYTE)pHookedFunction) == MHOOKS_CHAIN_BASE) {
+		InterlockedExchange(pTrampoline->plDisabled, !bEnable);
+		bRet = TRUE;
+	}
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+VOID Mhook_GetTimings(MHOOK_TIMINGS *pTimings) {
+	EnterCritSec();
+	*pTimings = g_timings;
+	LeaveCritSec();
+}
+
+//=========================================================================
+BOOL Mhook_BeginTransaction() {
+	BOOL bRet = FALSE;
+	EnterCritSec();
+	if (g_dwTransactionThread) {
+		ODPRINTF((L"mhooks: Mhook_BeginTransaction: a transaction is already open"));
+	} else {
+		// the transaction only collects operations until the commit, so the
+		// critical section isn't held in between: other threads can still
+		// hook and unhook while the caller queues things up
+		g_dwTransactionThread = GetCurrentThreadId();
+		bRet = TRUE;
+	}
+	LeaveCritSec();
+	return bRet;
+}
+
+//=========================================================================
+BOOL Mhook_TransactionSetHook(PVOID *ppSystemFunction, PVOID pHookFunction, BOOL *pbResult) {
+	return TransactionAdd(FALSE, ppSystemFunction, pHookFunction, pbResult);
+}
+
+//=========================================================================
+BOOL Mhook_TransactionUnhook(PVOID *ppHookedFunction, BOOL *pbResult) {
+	return TransactionAdd(TRUE, ppHookedFunction, NULL, pbResult);
+}
+
+//=========================================================================
+int Mhook_CommitTransaction() {
+	int nSucceeded = 0;
+	EnterCritSec();
+	TransactionEnd(TRUE, &nSucceeded);
+	LeaveCritSec();
+	return nSucceeded;
+}
+
+//=========================================================================
+VOID Mhook_AbortTransaction() {
+	EnterCritSec();
+	TransactionEnd(FALSE, NULL);
+	LeaveCritSec();
+}
+
+//=========================================================================
@@ -24,8 +24,150 @@
 #define _M_IX86_X64
 #endif
 
+// Hooking a function that is already hooked chains the new hook in front
+// of the existing ones; each hook's function pointer leads on to the next.
 BOOL Mhook_SetHook(PVOID *ppSystemFunction, PVOID pHookFunction);
 BOOL Mhook_Unhook(PVOID *ppHookedFunction);
 
-#define MHOOKS_MAX_SUPPORTED_HOOKS	64
+// Flags for Mhook_SetHookEx
+#define MHOOK_INSTRUMENT		0x00000001	// count calls and time them with rdtsc
+#define MHOOK_SWITCHABLE		0x00000002	// can be switched off and on with Mhook_EnableHook
+
+// Statistics gathered for an instrumented hook. Calls are timed from entering
+// the hook function until it returns; calls nested deeper than a per-thread
+// limit are counted but not timed. A timed call returns through a thunk that
+// has no unwind information, so an instrumented hook must not let a C++ or
+// structured exception escape: the stack can't be unwound past it.
+#define MHOOK_LATENCY_BUCKETS	32
+struct MHOOK_STATS {
+	ULONGLONG	nCalls;							// calls that entered the hook
+	ULONGLONG	nReturns;						// calls that returned and were timed
+	ULONGLONG	qwFirstCallTsc;					// rdtsc at the first and the latest call,
+	ULONGLONG	qwLastCallTsc;					//   for working out the call rate
+	ULONGLONG	qwTotalTicks;					// sum, minimum and maximum duration in ticks
+	ULONGLONG	qwMinTicks;
+	ULONGLONG	qwMaxTicks;
+	ULONGLONG	nLatency[MHOOK_LATENCY_BUCKETS];	// bucket n counts durations of [2^n, 2^(n+1)) ticks
+};
+
+BOOL Mhook_SetHookEx(PVOID *ppSystemFunction, PVOID pHookFunction, DWORD dwFlags);
+// Takes the same function pointer that would be handed to Mhook_Unhook
+BOOL Mhook_GetHookStats(PVOID pHookedFunction, MHOOK_STATS *pStats);
+
+// Hook plans: what Mhook_SetHook works out by disassembling a function, done
+// ahead of time, e.g. by another process that has the same module loaded.
+// Setting a hook from a plan only checks that the function still has the
+// bytes the plan was made for. Everything is relative to the function's
+// module, so a plan holds wherever the module is loaded. Plans made by a
+// different MHOOK_PLAN_VERSION, which changes with the layout or meaning of
+// these structures, are refused.
+#define MHOOK_PLAN_VERSION			1
+#define MHOOK_PLAN_MAX_INSTRUCTIONS	16
+#define MHOOK_PLAN_MAX_BYTES		32
+struct MHOOK_PLAN_INSTRUCTION {
+	BYTE	bOffset;						// start of the instruction in the overwritten bytes
+	BYTE	cbLength;
+	BYTE	bReloc;							// how it gets adjusted in the trampoline
+	BYTE	bDispOffset;					// start of an IP-relative displacement in it
+	BYTE	bOpcode;						// condition code or opcode of a rewritten branch
+	LONG	lTarget;						// what a relative operand refers to, from the function
+};
+struct MHOOK_PLAN {
+	DWORD	dwVersion;						// MHOOK_PLAN_VERSION
+	DWORD	dwRva;							// the function's offset into its module
+	BYTE	cbOverwrite;					// bytes of the function that get overwritten
+	BYTE	bInstallMode;
+	BYTE	nInstructions;
+	LONG	lLimitUp;						// furthest IP-relative data references, from the
+	LONG	lLimitDown;						//   function, which the trampoline has to reach
+	BYTE	codeExpected[MHOOK_PLAN_MAX_BYTES];	// the overwritten bytes the plan was made for
+	MHOOK_PLAN_INSTRUCTION instructions[MHOOK_PLAN_MAX_INSTRUCTIONS];
+};
+
+BOOL Mhook_PlanHook(PVOID pSystemFunction, MHOOK_PLAN *pPlan);
+BOOL Mhook_SetHookFromPlan(PVOID *ppSystemFunction, PVOID pHookFunction, DWORD dwFlags, const MHOOK_PLAN *pPlan);
+
+// Context hooks: hook any instruction, not just a function's entry point.
+// Execution reaching the address calls the callback with all registers, which
+// it may change (except the stack pointer), then carries on with the original
+// instructions. The 5 bytes from the address on must not be branched into.
+// On x64 the 128 bytes below Rsp are left alone, so leaf functions that keep
+// data in the System V red zone can be hooked too.
+// *ppAddress becomes the address to hand to Mhook_Unhook.
+#ifdef _M_IX86
+struct MHOOK_REGISTERS {
+	BYTE	Xmm[8][16];
+	DWORD	Edi, Esi, Ebp, Esp, Ebx, Edx, Ecx, Eax;
+	DWORD	EFlags;
+};
+#elif defined _M_X64
+struct MHOOK_REGISTERS {
+	BYTE	Xmm[6][16];						// the volatile ones
+	DWORD64	R15, R14, R13, R12, R11, R10, R9, R8;
+	DWORD64	Rdi, Rsi, Rbp, Rbx, Rdx, Rcx, Rax;
+	DWORD64	EFlags;
+	DWORD64	Rsp;
+};
+#endif
+typedef VOID (WINAPI *MHOOK_CONTEXT_CALLBACK)(MHOOK_REGISTERS *pRegisters, PVOID pArg);
+BOOL Mhook_SetContextHook(PVOID *ppAddress, MHOOK_CONTEXT_CALLBACK pfnCallback, PVOID pArg);
+
+// Import table hooks: redirect the calls one module (NULL for the executable)
+// makes to a function of another module ("user32.dll") by swapping a single
+// import address table entry. Nothing is disassembled and no thread is
+// suspended. Unhooking takes the same variable the original was stored in.
+// On ELF systems the module's global offset table entry for the function is
+// swapped instead; hModule may be any address in the module, and the
+// function has to be defined by pszImportModule ("libc.so.6").
+BOOL Mhook_SetImportHook(HMODULE hModule, LPCSTR pszImportModule, LPCSTR pszFunctionName, PVOID *ppSystemFunction, PVOID pHookFunction);
+BOOL Mhook_UnhookImport(PVOID *ppHookedFunction);
+
+// Virtual function hooks: redirect one slot of the virtual function table of
+// an object's class, for every object of the class, or just for this one
+// object, which then gets its own copy of the first nSlots entries of the
+// table. The object keeps its copy after unhooking, and no longer sees hooks
+// on its class. nSlots is the number of virtual functions the class has, and
+// nSlot has to be below it. Unhooking takes the same variable the original
+// was stored in.
+BOOL Mhook_SetVtableHook(PVOID pObject, DWORD nSlot, DWORD nSlots, PVOID *ppOriginal, PVOID pHookFunction);
+BOOL Mhook_SetInstanceHook(PVOID pObject, DWORD nSlot, DWORD nSlots, PVOID *ppOriginal, PVOID pHookFunction);
+BOOL Mhook_UnhookVtable(PVOID *ppHookedFunction);
+
+// Switch a hook set with MHOOK_SWITCHABLE off and on again. A switched off
+// hook is skipped and calls go straight to the original code; only a flag
+// changes, so this is cheap and doesn't stop any threads. Takes the same
+// function pointer that would be handed to Mhook_Unhook.
+BOOL Mhook_EnableHook(PVOID pHookedFunction, BOOL bEnable);
+
+// What mhook's own work has cost so far, in rdtsc ticks. A commit is one
+// Mhook_SetHook/Mhook_Unhook call or transaction, including the suspension
+// of the other threads and the trampoline allocations it needed.
+struct MHOOK_TIMINGS {
+	ULONGLONG	nCommits;
+	ULONGLONG	qwCommitTicks;					// total and longest duration of a commit
+	ULONGLONG	qwMaxCommitTicks;
+	ULONGLONG	nOperations;					// hooks and unhooks in all commits,
+	ULONGLONG	nFailedOperations;				//   and how many of them failed
+	ULONGLONG	nSuspensions;					// times the other threads were stopped,
+	ULONGLONG	qwSuspendedTicks;				//   for how long in total and at most
+	ULONGLONG	qwMaxSuspendedTicks;
+	ULONGLONG	nMaxSuspendedThreads;
+	ULONGLONG	nTrampolineAllocs;
+	ULONGLONG	qwTrampolineAllocTicks;			// total and longest time to place a trampoline
+	ULONGLONG	qwMaxTrampolineAllocTicks;
+};
+VOID Mhook_GetTimings(MHOOK_TIMINGS *pTimings);
+
+// Transactions: hooks and unhooks queued between Mhook_BeginTransaction and
+// Mhook_CommitTransaction are applied under a single suspension of all other
+// threads. Function pointers and the optional per-operation results are only
+// updated by the commit. The commit returns the number of successful operations.
+// A transaction belongs to the thread that began it: only that thread can queue,
+// commit or abort, and there is one open transaction at a time. No lock is held
+// while it is open, so other threads can still hook and unhook in the meantime.
+BOOL Mhook_BeginTransaction();
+BOOL Mhook_TransactionSetHook(PVOID *ppSystemFunction, PVOID pHookFunction, BOOL *pbResult);
+BOOL Mhook_TransactionUnhook(PVOID *ppHookedFunction, BOOL *pbResult);
+int Mhook_CommitTransaction();
+VOID Mhook_AbortTransaction();
 
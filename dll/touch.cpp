@@ -0,0 +1,624 @@
+/*
+ * Traktouch touch state machine
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "touch.h"
+
+#include <string.h>
+#include <math.h>
+
+static inline bool isMouseEvent(TouchEventType type)
+{
+	return type == TOUCH_EVENT_MOUSE || type == TOUCH_EVENT_MOUSE_MOVE ||
+		type == TOUCH_EVENT_BUTTON_DOWN || type == TOUCH_EVENT_BUTTON_UP;
+}
+
+static inline void emit(TouchOutput &out, TouchEventType type, const TouchEvent &at, uintptr_t keys)
+{
+	TouchEvent &event = out.events[out.count++];
+	event.type = type;
+	event.fromTouch = false;
+	event.x = at.x;
+	event.y = at.y;
+	event.right = event.bottom = 0;
+	event.keys = keys;
+}
+
+TouchFilter::TouchFilter()
+	: minCutoff(0), beta(0), speedCutoff(1), lastTime(0)
+{
+	axisX.value = axisX.speed = 0;
+	axisY.value = axisY.speed = 0;
+}
+
+void TouchFilter::configure(float minCutoff, float beta, float speedCutoff)
+{
+	this->minCutoff = minCutoff;
+	this->beta = beta;
+	this->speedCutoff = speedCutoff;
+}
+
+void TouchFilter::reset(short x, short y, uint64_t time)
+{
+	axisX.value = x;
+	axisY.value = y;
+	axisX.speed = axisY.speed = 0;
+	lastTime = time;
+}
+
+/* Smoothing factor of an exponential low pass with the given cutoff frequency and time step */
+static inline float lowPassAlpha(float cutoff, float dt)
+{
+	const float tau = 1.0f / (2.0f * 3.14159265f * cutoff);
+	return 1.0f / (1.0f + tau / dt);
+}
+
+float TouchFilter::filterAxis(Axis &axis, float x, float dt)
+{
+	float speed = (x - axis.value) / dt;
+	axis.speed += lowPassAlpha(speedCutoff, dt) * (speed - axis.speed);
+
+	float cutoff = minCutoff + beta * fabsf(axis.speed);
+	axis.value += lowPassAlpha(cutoff, dt) * (x - axis.value);
+	return axis.value;
+}
+
+void TouchFilter::apply(short &x, short &y, uint64_t time)
+{
+	/* Two reports at the same time can't tell us anything about speed */
+	if (time <= lastTime) {
+		x = (short)floorf(axisX.value + 0.5f);
+		y = (short)floorf(axisY.value + 0.5f);
+		return;
+	}
+
+	float dt = float(time - lastTime) * 1e-6f;
+	lastTime = time;
+	x = (short)floorf(filterAxis(axisX, x, dt) + 0.5f);
+	y = (short)floorf(filterAxis(axisY, y, dt) + 0.5f);
+}
+
+TouchTracker::TouchTracker()
+	: touching(false), lifting(false), initialJerk(false), correctionX(0), correctionY(0), lagX(0), lagY(0),
+	  deferButtonDown(false), deferButtonUp(false), deferDeadline(0), touchX(0), touchY(0),
+	  frameMoved(false), frameDeadline(0), movePending(false)
+{
+	config.pointerInput = false;
+	config.deferButtons = 0;
+	config.deferAdaptive = false;
+	config.coalesceMoves = 0;
+	config.smoothMinCutoff = 0;
+	config.smoothBeta = 0;
+	config.smoothSpeedCutoff = 1;
+	deferredButton = TouchEvent();
+	memset(readiness, 0, sizeof(readiness));
+	deferredReadiness = 0;
+	pendingMove = TouchEvent();
+}
+
+uint32_t *TouchTracker::readinessFor(short x, short y)
+{
+	int rx = x < 0 ? 0 : x / TOUCH_REGION_SIZE;
+	int ry = y < 0 ? 0 : y / TOUCH_REGION_SIZE;
+	if (rx >= TOUCH_REGIONS_X)
+		rx = TOUCH_REGIONS_X - 1;
+	if (ry >= TOUCH_REGIONS_Y)
+		ry = TOUCH_REGIONS_Y - 1;
+	return &readiness[ry][rx];
+}
+
+/* Does the repaint event cover the region (x, y) is in? */
+static bool repaints(const TouchEvent &paint, short x, short y)
+{
+	int left = x < 0 ? 0 : x - x % TOUCH_REGION_SIZE;
+	int top = y < 0 ? 0 : y - y % TOUCH_REGION_SIZE;
+	return paint.x < left + TOUCH_REGION_SIZE && paint.right > left &&
+		paint.y < top + TOUCH_REGION_SIZE && paint.bottom > top;
+}
+
+void TouchTracker::configure(const TouchConfig &config)
+{
+	this->config = config;
+	filter.configure(config.smoothMinCutoff, config.smoothBeta, config.smoothSpeedCutoff);
+}
+
+/*
+ * If the user is not touching the screen, let the cursor move.
+ *
+ * If the user _is_ touching the screen, don't move the cursor but instead store the offset
+ * that will need to be applied to the touch position to make it _appear_ to Traktor as if
+ * it had moved the cursor.
+ */
+bool TouchTracker::setCursorPos(int x, int y, int cursorX, int cursorY)
+{
+	if (!touching && !lifting)
+		return false;
+
+	/* The cursor is where the finger really is; Traktor has only seen the smoothed position */
+	correctionX = (short)(cursorX - lagX - x);
+	correctionY = (short)(cursorY - lagY - y);
+	initialJerk = false;
+	return true;
+}
+
+bool TouchTracker::nextDeadline(uint64_t &deadline) const
+{
+	if (deferButtonDown && (!movePending || deferDeadline < frameDeadline))
+		deadline = deferDeadline;
+	else
+		deadline = frameDeadline;
+	return deferButtonDown || movePending;
+}
+
+void TouchTracker::cancelTouch(TouchOutput &out)
+{
+	out.count = 0;
+	lifting = false;
+	if (!touching)
+		return;
+
+	touching = false;
+	movePending = false;
+	deferredReadiness = 0;
+	if (deferButtonDown)
+		deferButtonDown = false;
+	else {
+		TouchEvent at = TouchEvent();
+		at.x = touchX;
+		at.y = touchY;
+		emit(out, TOUCH_EVENT_BUTTON_UP, at, 0);
+	}
+}
+
+void TouchTracker::processEvent(TouchEvent &event, TouchOutput &out)
+{
+	TouchEventType originalType = event.type;
+	out.count = 0;
+	lifting = false;
+
+	/*
+	* While in "touching" mode, all mouse events get a correction offset applied to emulate the
+	* effects of SetCursorPos(). The correction is updated by setCursorPos().
+	*
+	* Also, Windows' mouse emulation has a dead zone of 20 or so pixels before it starts reporting
+	* mouse movement for touch events. Once this dead zone is overcome, it will generate a WM_MOUSEDOWN
+	* event at the location where we touched the screen, and a WM_MOUSEMOVE event at the location
+	* where we are now, 20ish pixels over. This would cause an initial jerk of the knob we're
+	* manipulating and we don't want that, so we have to compensate for that too.
+	*/
+	if (touching && isMouseEvent(event.type) && event.fromTouch) {
+		if (initialJerk) {
+			/* record offset of initial jerk motion to compensate */
+			correctionX = event.x - correctionX;
+			correctionY = event.y - correctionY;
+			initialJerk = false;
+
+			/* and don't let the smoothing filter see the jump either */
+			filter.reset(event.x, event.y, event.time);
+			lagX = lagY = 0;
+		}
+		else if (config.smoothMinCutoff > 0) {
+			/*
+			 * Smooth the real finger position rather than the corrected one, which jumps whenever
+			 * Traktor moves the cursor. setCursorPos() then accounts for what the filter held back.
+			 */
+			short x = event.x, y = event.y;
+			filter.apply(event.x, event.y, event.time);
+			lagX = x - event.x;
+			lagY = y - event.y;
+		}
+		event.x -= correctionX;
+		event.y -= correctionY;
+	}
+
+	/* When a finger touches the screen, go into "touching" mode and reset the touch correction. */
+	if (event.type == TOUCH_EVENT_BUTTON_DOWN && event.fromTouch) {
+		touching = true;
+
+		if (config.pointerInput) {
+			/* No mouse emulation, no dead zone, nothing to compensate */
+			initialJerk = false;
+			correctionX = correctionY = 0;
+		}
+		else {
+			initialJerk = true;
+			correctionX = event.x; // Temporarily store the location of the MOUSEDOWN
+			correctionY = event.y;
+		}
+		filter.reset(event.x, event.y, event.time);
+		lagX = lagY = 0;
+
+		/*
+		 * Traktor seems to require that the mouse is hovering over a control before we can
+		 * click and drag it, perhaps because the control must be in a "hovered" state. With a mouse
+		 * that's no problem, but touch interaction will cause the mouse position to jump when the
+		 * WM_LBUTTONDOWN event is generated, giving Traktor no chance to put the control into "hovered"
+		 * state first.
+		 *
+		 * To overcome this, we have two options:
+		 *  a) The light option: Simply turn the current message into WM_MOUSEMOVE and insert a WM_LBUTTONDOWN
+		 *     into the windows' message queue next. This seems to work well for all controls except the stripe.
+		 *  b) The heavy option: We generate WM_MOUSEMOVE now, but defer WM_LBUTTONDOWN for a short amount of
+		 *     time to give Traktor an opportunity to come to terms with the new mouse position. This seems to
+		 *     work with the stripe too but introduces a bit of lag, and is more complicated so may bug out, so
+		 *     I'm keeping the light option around to fall back on.
+		 */
+		if (config.deferButtons) {
+			/* Heavy option: Defer button event */
+			deferButtonDown = true;
+			deferButtonUp = false;
+			deferDeadline = event.time + config.deferButtons;
+			deferredButton = event;
+
+			/*
+			 * Traktor repaints once a control has gone into hover state, so the time until that
+			 * first repaint is all the delay needed. Where we have seen that before, wait only that
+			 * long plus a bit of slack; never longer than the configured delay, though, which still
+			 * applies wherever Traktor didn't repaint in time to tell.
+			 */
+			if (config.deferAdaptive) {
+				deferredReadiness = readinessFor(event.x, event.y);
+				uint64_t learned = *deferredReadiness;
+				if (learned && learned + learned / 4 < config.deferButtons)
+					deferDeadline = event.time + learned + learned / 4;
+			}
+		}
+		else {
+			/* Light option: Post button event now */
+			emit(out, TOUCH_EVENT_BUTTON_DOWN, event, event.keys);
+		}
+
+		/* Either way, turn this message into a WM_MOUSEMOVE */
+		event.type = TOUCH_EVENT_MOUSE_MOVE;
+		event.keys = 0;
+	}
+
+	/*
+	 * The first repaint of the touched region tells how long it needs to get ready, even if it
+	 * comes after the button down went out; then we were too quick and learn from it. Repaints
+	 * elsewhere, say of a level meter, don't tell us anything.
+	 */
+	if (event.type == TOUCH_EVENT_PAINT && deferredReadiness && repaints(event, deferredButton.x, deferredButton.y)) {
+		uint64_t observed = event.time - deferredButton.time;
+		if (observed > config.deferButtons)
+			observed = config.deferButtons;
+		uint32_t &learned = *deferredReadiness;
+		learned = learned ? uint32_t((learned * 3 + observed) / 4) : uint32_t(observed);
+		deferredReadiness = 0;
+	}
+
+	/* Exit "touching" mode when the finger leaves the screen */
+	if (event.type == TOUCH_EVENT_BUTTON_UP && event.fromTouch) {
+		touching = false;
+
+		/* If we're still waiting to generate the WM_LBUTTONDOWN event, defer the LBUTTONUP event too */
+		if (deferButtonDown) {
+			deferButtonUp = true;
+			event.type = TOUCH_EVENT_DISCARD;
+		}
+	}
+
+	/*
+	 * Send the deferred button events once their time has come. This comes last so that a
+	 * finger leaving the screen right now still gets its button up deferred behind the down.
+	 */
+	if (deferButtonDown && event.time >= deferDeadline) {
+		deferButtonDown = false;
+		emit(out, TOUCH_EVENT_BUTTON_DOWN, deferredButton, deferredButton.keys);
+		if (deferButtonUp)
+			emit(out, TOUCH_EVENT_BUTTON_UP, deferredButton, 0);
+	}
+
+	/*
+	 * The digitizer reports moves a lot more often than Traktor repaints, and every one of them
+	 * costs Traktor a round of hit testing and a SetCursorPos call. So while dragging, only the
+	 * first move of a frame goes through and the latest of the others waits for the next frame.
+	 * As long as Traktor hasn't seen a move it hasn't moved the cursor back either, so that one
+	 * move carries all the motion of the ones dropped before it.
+	 */
+	if (config.coalesceMoves) {
+		bool dragMove = originalType == TOUCH_EVENT_MOUSE_MOVE && event.fromTouch && touching && !deferButtonDown;
+
+		if (event.type == TOUCH_EVENT_PAINT || event.time >= frameDeadline) {
+			/* A new frame: whatever was held back goes out now, unless a newer move is already here */
+			frameMoved = false;
+			if (movePending && !dragMove) {
+				emit(out, TOUCH_EVENT_MOUSE_MOVE, pendingMove, pendingMove.keys);
+				frameMoved = true;
+				frameDeadline = event.time + config.coalesceMoves;
+			}
+			movePending = false;
+		}
+
+		if (dragMove) {
+			if (!frameMoved) {
+				frameMoved = true;
+				frameDeadline = event.time + config.coalesceMoves;
+			}
+			else {
+				pendingMove = event;
+				movePending = true;
+				event.type = TOUCH_EVENT_DISCARD;
+			}
+		}
+		else if (movePending && (event.type == TOUCH_EVENT_BUTTON_DOWN || event.type == TOUCH_EVENT_BUTTON_UP)) {
+			/*
+			 * A button goes behind the held back move: send the move in its place, and the button
+			 * after it. For a finger that lifted, Traktor moving the cursor back for that move is
+			 * still a correction and mustn't make the cursor jump.
+			 */
+			lifting = !touching && event.fromTouch;
+			emit(out, event.type, event, event.keys);
+			event.type = TOUCH_EVENT_MOUSE_MOVE;
+			event.x = pendingMove.x;
+			event.y = pendingMove.y;
+			event.keys = pendingMove.keys;
+			movePending = false;
+		}
+		else if (movePending && isMouseEvent(event.type)) {
+			emit(out, TOUCH_EVENT_MOUSE_MOVE, pendingMove, pendingMove.keys);
+			movePending = false;
+		}
+	}
+
+	if (touching && event.fromTouch && isMouseEvent(event.type)) {
+		touchX = event.x;
+		touchY = event.y;
+	}
+
+	/* A timer event is ours alone */
+	if (event.type == TOUCH_EVENT_TIMER)
+		event.type = TOUCH_EVENT_DISCARD;
+}
+
+PanRecognizer::PanRecognizer()
+	: nContacts(0), threshold(0), gesture(false), panning(false), startY(0), lastY(0)
+{
+	memset(contacts, 0, sizeof(contacts));
+}
+
+void PanRecognizer::configure(int threshold)
+{
+	this->threshold = threshold;
+}
+
+int PanRecognizer::centroidY() const
+{
+	int sum = 0;
+	for (int i = 0; i < nContacts; i++)
+		sum += contacts[i].y;
+	return nContacts ? sum / nContacts : 0;
+}
+
+bool PanRecognizer::processContact(TouchContactType type, uint32_t id, short x, short y, int &deltaY)
+{
+	deltaY = 0;
+
+	int i;
+	for (i = 0; i < nContacts; i++)
+		if (contacts[i].id == id)
+			break;
+
+	switch (type) {
+	case TOUCH_CONTACT_DOWN:
+		if (i == nContacts) {
+			/* Fingers beyond what we can keep track of just don't count */
+			if (nContacts == TOUCH_MAX_CONTACTS)
+				return gesture;
+			nContacts++;
+		}
+		contacts[i].id = id;
+		contacts[i].x = x;
+		contacts[i].y = y;
+
+		/* A new finger starts a new gesture, or restarts the one in progress */
+		if (nContacts > 1) {
+			gesture = true;
+			panning = false;
+			startY = lastY = centroidY();
+		}
+		return gesture;
+
+	case TOUCH_CONTACT_MOVE:
+		if (i == nContacts)
+			return gesture;
+		contacts[i].x = x;
+		contacts[i].y = y;
+
+		if (gesture && nContacts == 2) {
+			int midY = centroidY();
+			if (!panning && (midY - startY >= threshold || startY - midY >= threshold))
+				panning = true;
+			if (panning) {
+				deltaY = midY - lastY;
+				lastY = midY;
+			}
+		}
+		return gesture;
+
+	case TOUCH_CONTACT_UP:
+	default:
+		bool wasGesture = gesture;
+		if (i < nContacts)
+			contacts[i] = contacts[--nContacts];
+
+		/* A finger lifting ends the pan, but it's still a gesture until the last one is gone */
+		panning = false;
+		lastY = centroidY();
+		if (!nContacts)
+			gesture = false;
+		return wasGesture;
+	}
+}
+
+void TouchPointerInput::configure(int panThreshold)
+{
+	pan.configure(panThreshold);
+}
+
+TouchPointerAction TouchPointerInput::translate(const TouchPointer &pointer, short clientX, short clientY, TouchEvent &event, int &panDelta)
+{
+	/*
+	 * Every finger goes past our own pan recognizer first. Windows' one never gets to see them,
+	 * and ours starts scrolling sooner. Once a second finger comes down the first one no
+	 * longer counts as a touch, and the pointer messages go to the scroll engine instead.
+	 */
+	if (pan.processContact(pointer.type, pointer.id, pointer.x, pointer.y, panDelta)) {
+		switch (pointer.type) {
+		case TOUCH_CONTACT_DOWN: return TOUCH_POINTER_PAN_BEGIN;
+		case TOUCH_CONTACT_MOVE: return TOUCH_POINTER_PAN_MOVE;
+		default:                 return TOUCH_POINTER_PAN_END;
+		}
+	}
+
+	/* Further fingers that don't make a gesture don't make a touch either */
+	if (!pointer.primary)
+		return TOUCH_POINTER_DROP;
+
+	event.type = pointer.type == TOUCH_CONTACT_DOWN ? TOUCH_EVENT_BUTTON_DOWN :
+		pointer.type == TOUCH_CONTACT_UP ? TOUCH_EVENT_BUTTON_UP : TOUCH_EVENT_MOUSE_MOVE;
+	event.fromTouch = true;
+	event.x = short(pointer.x - clientX);
+	event.y = short(pointer.y - clientY);
+	event.right = event.bottom = 0;
+	event.keys = pointer.type == TOUCH_CONTACT_UP ? 0 : TOUCH_KEY_LBUTTON;
+	return TOUCH_POINTER_MOUSE;
+}
+
+ScrollEngine::ScrollEngine()
+	: active(false), following(false), pendingDelta(0), velocity(0), remainder(0), lastMove(0), lastTick(0)
+{
+	config.scale = 0;
+	config.accelDeadZone = 0;
+	config.accelExponent = 1;
+	config.cadence = 16000;
+	config.inertia = 0;
+	memset(acceleration, 0, sizeof(acceleration));
+}
+
+void ScrollEngine::configure(const ScrollConfig &config)
+{
+	this->config = config;
+
+	/*
+	* The mouse wheel distance is calculated from the pan movement per tick times a scaling factor,
+	* and accelerated slightly so the user can scroll really fast if they want. That curve is the
+	* same for every tick, so work it out once.
+	*/
+	for (int i = 0; i < SCROLL_LUT_SIZE; i++) {
+		float distance = float(i) / SCROLL_LUT_STEPS;
+		float deadZone = float(config.accelDeadZone);
+		if (distance < deadZone)
+			acceleration[i] = distance * config.scale;
+		else
+			acceleration[i] = (powf(distance - deadZone, config.accelExponent) + deadZone) * config.scale;
+	}
+}
+
+void ScrollEngine::begin(uint64_t time)
+{
+	active = true;
+	following = true;
+	pendingDelta = 0;
+	velocity = 0;
+	remainder = 0;
+	lastMove = lastTick = time;
+}
+
+void ScrollEngine::move(int delta, uint64_t time)
+{
+	if (!following)
+		return;
+
+	pendingDelta += delta;
+	if (delta)
+		lastMove = time;
+}
+
+void ScrollEngine::end(uint64_t time)
+{
+	if (!following)
+		return;
+	following = false;
+
+	/* Fingers that rested before lifting don't throw anything */
+	if (!config.inertia || time - lastMove > 2 * config.cadence)
+		velocity = 0;
+}
+
+int ScrollEngine::tick(uint64_t time)
+{
+	if (!active || time <= lastTick)
+		return 0;
+
+	float elapsed = float(time - lastTick);
+	float ticks = elapsed / float(config.cadence);
+	lastTick = time;
+
+	float distance;
+	if (following) {
+		distance = pendingDelta;
+		pendingDelta = 0;
+
+		/*
+		 * The speed of the fingers over this tick, averaged a little since the motion doesn't
+		 * spread evenly over the ticks. A tick that comes much too early or a glitch in the pan
+		 * reports still mustn't throw the track list to the end.
+		 */
+		float speed = distance * 1e6f / elapsed;
+		velocity += 0.5f * (speed - velocity);
+		if (velocity > SCROLL_MAX_SPEED)
+			velocity = SCROLL_MAX_SPEED;
+		else if (velocity < -SCROLL_MAX_SPEED)
+			velocity = -SCROLL_MAX_SPEED;
+	}
+	else if (pendingDelta) {
+		/* What the fingers moved since the last tick before lifting still goes out as it is */
+		distance = pendingDelta;
+		pendingDelta = 0;
+	}
+	else {
+		distance = velocity * elapsed * 1e-6f;
+		velocity *= expf(-elapsed / float(config.inertia ? config.inertia : 1));
+		if (fabsf(velocity) * float(config.cadence) * 1e-6f < SCROLL_STOP_DISTANCE) {
+			velocity = 0;
+			active = false;
+		}
+	}
+
+	/* Look up the wheel distance for the speed of this tick, then scale it to the time that passed */
+	int index = int(fabsf(distance) / ticks * SCROLL_LUT_STEPS + 0.5f);
+	if (index >= SCROLL_LUT_SIZE)
+		index = SCROLL_LUT_SIZE - 1;
+	float wheel = acceleration[index] * ticks;
+	if (distance < 0)
+		wheel = -wheel;
+	wheel += remainder;
+
+	/* Make sure we don't accidentally wrap if the acceleration grows too large */
+	if (wheel > 32767.0f)
+		wheel = 32767.0f;
+	else if (wheel < -32768.0f)
+		wheel = -32768.0f;
+
+	int scroll = int(wheel);
+	remainder = active ? wheel - float(scroll) : 0;
+	return scroll;
+}
+
+/* End of File */
@@ -0,0 +1,316 @@
+#ifndef __TOUCH_H__
+
+#define __TOUCH_H__
+
+/*
+ * Traktouch touch state machine
+ *
+ * The part of Traktouch that turns touch-generated mouse messages into what Traktor needs to see,
+ * without any Windows calls: the caller translates its messages into TouchEvents, feeds them in
+ * and carries out whatever comes back. That keeps the logic testable outside of Traktor.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+/* What kind of message an event is; a processed event may come back as a different kind */
+enum TouchEventType {
+	TOUCH_EVENT_OTHER,        /* anything we don't care about */
+	TOUCH_EVENT_MOUSE,        /* a mouse message not listed below */
+	TOUCH_EVENT_MOUSE_MOVE,
+	TOUCH_EVENT_BUTTON_DOWN,  /* left button */
+	TOUCH_EVENT_BUTTON_UP,
+	TOUCH_EVENT_PAINT,        /* the window is being repainted */
+	TOUCH_EVENT_TIMER,        /* a deadline from nextDeadline() has passed */
+	TOUCH_EVENT_DISCARD,      /* only on output: drop the message */
+};
+
+struct TouchEvent {
+	TouchEventType type;
+	bool fromTouch;           /* caused by a touch rather than the mouse */
+	short x, y;               /* mouse position in client coordinates, or top left of the area to repaint */
+	short right, bottom;      /* for a repaint, bottom right of the area, exclusive */
+	uintptr_t keys;           /* button and modifier key state, passed through as is */
+	uint64_t time;            /* when the event is processed, in microseconds on the caller's clock */
+};
+
+/* Messages to send to the window right after the current one */
+#define TOUCH_MAX_OUTPUT 3
+struct TouchOutput {
+	int count;
+	TouchEvent events[TOUCH_MAX_OUTPUT];
+};
+
+struct TouchConfig {
+	bool pointerInput;        /* touches come straight from the digitizer, not through mouse emulation */
+	uint64_t deferButtons;    /* microseconds to hold back a touch's button down for, 0 = don't */
+	bool deferAdaptive;       /* only hold it back as long as Traktor has needed in that spot before */
+	uint64_t coalesceMoves;   /* during a drag, pass on one move per this many microseconds or repaint, 0 = all */
+	float smoothMinCutoff;    /* smoothing filter cutoff in Hz when the finger is at rest, 0 = no smoothing */
+	float smoothBeta;         /* how fast the cutoff rises with speed, per pixel per second */
+	float smoothSpeedCutoff;  /* cutoff in Hz for the speed estimate itself */
+};
+
+/*
+ * The 1 Euro filter (Casiez, Roussel, Vogel 2012): a low pass filter whose cutoff frequency rises
+ * with speed, so it takes the jitter out of slow, fine movements without dragging behind fast ones.
+ */
+class TouchFilter {
+public:
+	TouchFilter();
+
+	void configure(float minCutoff, float beta, float speedCutoff);
+
+	/* Start over at (x, y) */
+	void reset(short x, short y, uint64_t time);
+
+	/* Replace (x, y), taken at time microseconds, with its smoothed version */
+	void apply(short &x, short &y, uint64_t time);
+
+private:
+	struct Axis {
+		float value;
+		float speed;
+	};
+	float filterAxis(Axis &axis, float x, float dt);
+
+	float minCutoff, beta, speedCutoff;
+	Axis axisX, axisY;
+	uint64_t lastTime;
+};
+
+/*
+ * For adaptive deferral the window is cut into square regions, and each one remembers how long
+ * Traktor took to repaint it after the mouse moved there. Positions beyond the table share the
+ * regions at its edges. Only repaints that cover the touched region count, but one that covers
+ * the whole window does too, so where Traktor redraws everything every frame this learns the
+ * frame time rather than how long the control took to get ready.
+ */
+#define TOUCH_REGION_SIZE 64
+#define TOUCH_REGIONS_X   64
+#define TOUCH_REGIONS_Y   48
+
+class TouchTracker {
+public:
+	TouchTracker();
+
+	void configure(const TouchConfig &config);
+
+	/*
+	 * Process one message on its way to Traktor. The event gets rewritten in place,
+	 * messages to send right behind it are returned in out.
+	 */
+	void processEvent(TouchEvent &event, TouchOutput &out);
+
+	/*
+	 * Traktor wants the cursor at (x, y) while it really is at (cursorX, cursorY).
+	 * Returns false if the cursor should actually be moved, true if the move has
+	 * been turned into a correction for the following touch events instead.
+	 */
+	bool setCursorPos(int x, int y, int cursorX, int cursorY);
+
+	/*
+	 * When the next deferred event is due, on the clock of TouchEvent::time. Any event
+	 * processed after that time sends it; if the caller has nothing else to process,
+	 * it should feed in a TOUCH_EVENT_TIMER then. Returns false if nothing is pending.
+	 */
+	bool nextDeadline(uint64_t &deadline) const;
+
+	/*
+	 * The touch turned out to be part of a multi-finger gesture. Forget about it: drop deferred
+	 * button events, or have the button released if it already went down.
+	 */
+	void cancelTouch(TouchOutput &out);
+
+	bool isTouching() const { return touching; }
+
+	/* Should Traktor moving the cursor go to setCursorPos()? Until it has seen the last move of a touch */
+	bool isCorrecting() const { return touching || lifting; }
+
+private:
+	uint32_t *readinessFor(short x, short y);
+
+	TouchConfig config;
+
+	/* Is the user currently touching the screen, and the accumulated correction offset for mouse events */
+	bool touching;
+	bool lifting;             /* the finger is up, but the move held back in front of it is going out now */
+	bool initialJerk;
+	short correctionX, correctionY;
+
+	/* How far the smoothed touch position lags behind the real one */
+	TouchFilter filter;
+	short lagX, lagY;
+
+	/* A touch's button events held back until Traktor has seen the mouse move there */
+	bool deferButtonDown;
+	bool deferButtonUp;
+	uint64_t deferDeadline;
+	TouchEvent deferredButton;
+
+	/* Where Traktor saw the touch last */
+	short touchX, touchY;
+
+	/* Microseconds from the mouse moving into a region until its first repaint, 0 = not seen yet */
+	uint32_t readiness[TOUCH_REGIONS_Y][TOUCH_REGIONS_X];
+	uint32_t *deferredReadiness;   /* the entry to update on the next repaint, if any */
+
+	/* Drag moves are passed on once per frame, the latest one of the rest is held back for the next */
+	bool frameMoved;
+	uint64_t frameDeadline;
+	bool movePending;
+	TouchEvent pendingMove;
+};
+
+/*
+ * Two-finger pan recognizer working on raw touch contacts. Once two fingers have moved together by
+ * more than a small threshold, every further bit of vertical motion of their midpoint is reported
+ * for scrolling, including the motion that got them over the threshold.
+ */
+#define TOUCH_MAX_CONTACTS 10
+
+enum TouchContactType {
+	TOUCH_CONTACT_DOWN,
+	TOUCH_CONTACT_MOVE,
+	TOUCH_CONTACT_UP,
+};
+
+class PanRecognizer {
+public:
+	PanRecognizer();
+
+	void configure(int threshold);
+
+	/*
+	 * Process one contact going down, moving or lifting. Returns true if it is part of a gesture
+	 * of more than one finger and shouldn't be taken as a touch; then deltaY is how far to scroll.
+	 * A gesture lasts until the last finger has lifted.
+	 */
+	bool processContact(TouchContactType type, uint32_t id, short x, short y, int &deltaY);
+
+	bool inGesture() const { return gesture; }
+
+private:
+	int centroidY() const;
+
+	struct Contact {
+		uint32_t id;
+		short x, y;
+	};
+	Contact contacts[TOUCH_MAX_CONTACTS];
+	int nContacts;
+
+	int threshold;
+	bool gesture;
+	bool panning;
+	int startY, lastY;    /* midpoint where the fingers came down, and where they were last */
+};
+
+/*
+ * With PointerInput on, touches come straight from the digitizer as pointer messages, and this is
+ * where they're turned into what Traktor gets instead: mouse events for the primary finger, or
+ * scrolling once the pan recognizer has decided it's looking at a gesture.
+ */
+#define TOUCH_KEY_LBUTTON 0x0001  /* MK_LBUTTON */
+
+struct TouchPointer {
+	TouchContactType type;    /* WM_POINTERDOWN, WM_POINTERUPDATE or WM_POINTERUP */
+	uint32_t id;
+	bool primary;             /* the first finger down, which stands in for the mouse */
+	short x, y;               /* in screen coordinates */
+};
+
+enum TouchPointerAction {
+	TOUCH_POINTER_MOUSE,      /* process the mouse event returned in place of the message */
+	TOUCH_POINTER_DROP,       /* drop the message */
+	TOUCH_POINTER_PAN_BEGIN,  /* drop the message, cancel the touch and start scrolling */
+	TOUCH_POINTER_PAN_MOVE,   /* drop the message and scroll by panDelta */
+	TOUCH_POINTER_PAN_END,    /* drop the message, the fingers have lifted */
+};
+
+class TouchPointerInput {
+public:
+	void configure(int panThreshold);
+
+	/*
+	 * Translate one pointer message of a touch contact for a window whose client area starts at
+	 * (clientX, clientY) on the screen. For TOUCH_POINTER_MOUSE, event gets the mouse event's
+	 * type, position in client coordinates and key state; its time is left alone.
+	 */
+	TouchPointerAction translate(const TouchPointer &pointer, short clientX, short clientY, TouchEvent &event, int &panDelta);
+
+	bool inGesture() const { return pan.inGesture(); }
+
+private:
+	PanRecognizer pan;
+};
+
+/*
+ * Kinetic scrolling: pan motion goes in as it comes, mouse wheel distance comes out at a fixed
+ * cadence, so how fast things scroll doesn't depend on how often the pan gets reported. While the
+ * fingers are down the wheel follows their motion; once they lift, scrolling carries on at their
+ * last speed and slows down exponentially. That speed is measured over whole ticks, since pan
+ * reports can come in bunches only microseconds apart.
+ */
+#define SCROLL_LUT_STEPS     4      /* acceleration table entries per pixel of motion per tick */
+#define SCROLL_LUT_SIZE      1024   /* beyond the end of the table the last entry applies */
+#define SCROLL_STOP_DISTANCE 0.25f  /* coasting stops below this many pixels per tick */
+#define SCROLL_MAX_SPEED     10000  /* fastest throw in pixels per second, anything beyond is a glitch */
+
+struct ScrollConfig {
+	int scale;                /* wheel distance per pixel of motion */
+	int accelDeadZone;        /* pixels per tick up to which there is no acceleration */
+	float accelExponent;      /* how the wheel distance grows with speed beyond that */
+	uint64_t cadence;         /* microseconds between ticks */
+	uint64_t inertia;         /* time constant of the slowdown after release in microseconds, 0 = stop dead */
+};
+
+class ScrollEngine {
+public:
+	ScrollEngine();
+
+	void configure(const ScrollConfig &config);
+
+	/* The fingers came down: stop coasting and follow them */
+	void begin(uint64_t time);
+
+	/* The fingers moved by delta pixels */
+	void move(int delta, uint64_t time);
+
+	/* The fingers lifted */
+	void end(uint64_t time);
+
+	/* Wheel distance to send now; call once per tick for as long as isActive() says so */
+	int tick(uint64_t time);
+
+	bool isActive() const { return active; }
+
+private:
+	ScrollConfig config;
+	float acceleration[SCROLL_LUT_SIZE];   /* wheel distance for motion of i / SCROLL_LUT_STEPS pixels per tick */
+
+	bool active;
+	bool following;           /* fingers are down */
+	float pendingDelta;       /* motion since the last tick */
+	float velocity;           /* pixels per second, averaged over the last few ticks of motion */
+	float remainder;          /* wheel distance not sent yet */
+	uint64_t lastMove, lastTick;   /* when the fingers last moved, and when the last tick was */
+};
+
+#endif
+
+/* End of File */
@@ -86,6 +86,12 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 		return 1;
 	}
 
+	/* Have the DLL plan its hooks now, so it doesn't have to disassemble anything inside Traktor */
+	typedef void (*WriteHookPlan_t)();
+	WriteHookPlan_t writeHookPlan = (WriteHookPlan_t)GetProcAddress(dll, "WriteHookPlan");
+	if (writeHookPlan)
+		writeHookPlan();
+
 	/* Grab Traktor and install the entry hook */
 	HWND hTraktorWindow = getTraktor(lpCmdLine);
 	DWORD idTraktorUIThread  = GetWindowThreadProcessId(hTraktorWindow, NULL);
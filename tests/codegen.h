@@ -0,0 +1,91 @@
+/*
+ * Traktouch Linux tests: machine code for mhook to hook
+ *
+ * Test functions are assembled byte by byte into an executable block, so the tests control
+ * exactly which instructions end up in the bytes mhook overwrites. The functions take two ints
+ * in edi and esi and return an int in eax, as gcc's calling convention has it.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CODEGEN_H__
+#define __CODEGEN_H__
+
+#include <windows.h>
+#include <initializer_list>
+
+typedef int (*TestFunction)(int a, int b);
+
+class CodeBuffer {
+public:
+	explicit CodeBuffer(SIZE_T size = 0x10000) : size(size), used(0)
+	{
+		base = (PBYTE)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	}
+
+	~CodeBuffer()
+	{
+		VirtualFree(base, 0, MEM_RELEASE);
+	}
+
+	/* Start a new function, 16-byte aligned, with `padding' int3 bytes in front */
+	PBYTE function(DWORD padding = 0, BYTE paddingByte = 0xcc)
+	{
+		used = (used + padding + 15) & ~(SIZE_T)15;
+		memset(base + used - padding, paddingByte, padding);
+		return base + used;
+	}
+
+	PBYTE here() const { return base + used; }
+
+	void emit(std::initializer_list<BYTE> bytes)
+	{
+		for (BYTE b : bytes)
+			base[used++] = b;
+	}
+
+	void emit32(INT32 value)
+	{
+		memcpy(base + used, &value, sizeof(value));
+		used += sizeof(value);
+	}
+
+	/* The rel32 operand of an instruction ending right after it, pointing at target */
+	void emitRel32(PBYTE target)
+	{
+		emit32(INT32(target - (here() + 4)));
+	}
+
+	/* A 4-byte data word, for RIP-relative operands to refer to */
+	PBYTE data(INT32 value)
+	{
+		used = (used + 3) & ~(SIZE_T)3;
+		PBYTE p = here();
+		emit32(value);
+		return p;
+	}
+
+	bool ok() const { return base != NULL; }
+
+private:
+	PBYTE base;
+	SIZE_T size;
+	SIZE_T used;
+};
+
+#endif /* __CODEGEN_H__ */
+
+/* End of File */
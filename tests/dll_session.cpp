@@ -0,0 +1,534 @@
+/*
+ * Traktouch Linux tests: the DLL in a scripted Traktor session
+ *
+ * Runs the DLL's own dllmain.cpp on the shim's user32: the loader writes the hook plan and calls
+ * the entry hook, which hooks the message loop and SetCursorPos, and a stand-in for Traktor's
+ * window with a button, a knob and a track list gets touch input the way Windows delivers it, on
+ * a clock the test runs by hand. Its message loop peeks at every message before taking it off
+ * the queue, like many do.
+ *
+ * A tap has to reach the button as a move, then the button down once the button has repainted,
+ * then the button up, and the second tap waits only as long as the first one showed was needed.
+ * A button down that goes the slow way because its message got lost still arrives once. A knob
+ * drag turns the knob by exactly how far the finger moved, without the cursor ever really
+ * moving, and a pan scrolls the track list by exactly its distance. The same again with
+ * PointerInput, where a second finger turns the touch into scrolling. Reports the messages
+ * each session took and how long each input took to handle, in real time.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <windowsx.h>
+#include <tpcshrd.h>
+#include "mhook-lib/mhook.h"
+#include "disasm-lib/disasm.h"
+#include "test.h"
+
+#include <libgen.h>
+#include <limits.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+/* What the DLL exports to the loader */
+BOOL APIENTRY DllMain(HMODULE hModule, DWORD reason, LPVOID reserved);
+extern "C" LRESULT CALLBACK EntryHook(int nCode, WPARAM wParam, LPARAM lParam);
+extern "C" void WriteHookPlan();
+
+#define MS 1000000LL                  /* on the clock, which counts nanoseconds */
+#define TOUCH_SIGNATURE 0xFF515700    /* extra info of mouse messages from touch */
+
+/* Traktor's window on the screen, and its controls in client coordinates */
+#define CLIENT_X 100
+#define CLIENT_Y 50
+#define WIDTH 1200
+#define HEIGHT 800
+
+enum { BUTTON, KNOB, N_CONTROLS };
+static const RECT controls[N_CONTROLS] = {
+	{ 256, 128, 320, 192 },
+	{ 448, 320, 512, 384 },
+};
+
+/* How long a control takes to repaint once the mouse is over it */
+#define HOVER_MS 10
+#define HOVER_TIMER_ID 1
+
+static HWND hwnd;
+static char iniFileName[PATH_MAX], planFileName[PATH_MAX];
+
+/*
+ * The stand-in for Traktor. A control is ready to be clicked once it has repainted after the
+ * mouse moved over it. A knob drag keeps moving the cursor back to where it started and turns
+ * the knob by how far the mouse got away from there.
+ */
+static struct {
+	int hovered;              /* control under the mouse, -1 = none */
+	bool ready;
+	int pressed;              /* control the button went down on, -1 = none */
+	POINT anchor;             /* where a knob drag started, in client coordinates */
+	int knob;
+	int clicks;
+	int wheel;
+	POINT wheelPos;
+	int moves, downs, ups, wheels, paints, others;
+	int unready;              /* button downs on a control that wasn't ready */
+	LONGLONG downTime;
+} traktor;
+
+static int controlAt(POINT pos)
+{
+	for (int i = 0; i < N_CONTROLS; i++)
+		if (pos.x >= controls[i].left && pos.x < controls[i].right && pos.y >= controls[i].top && pos.y < controls[i].bottom)
+			return i;
+	return -1;
+}
+
+static void hover(int control)
+{
+	if (control == traktor.hovered)
+		return;
+	traktor.hovered = control;
+	traktor.ready = false;
+	if (control >= 0)
+		SetTimer(hwnd, HOVER_TIMER_ID, HOVER_MS, NULL);
+	else
+		KillTimer(hwnd, HOVER_TIMER_ID);
+}
+
+static LRESULT CALLBACK TraktorWindowProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	POINT pos = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+	RECT update;
+
+	switch (message) {
+	case WM_MOUSEMOVE:
+		traktor.moves++;
+		if (traktor.pressed == KNOB) {
+			traktor.knob += pos.y - traktor.anchor.y;
+			POINT screen = traktor.anchor;
+			ClientToScreen(hWnd, &screen);
+			SetCursorPos(screen.x, screen.y);
+		}
+		else if (traktor.pressed < 0)
+			hover(controlAt(pos));
+		return 0;
+
+	case WM_LBUTTONDOWN:
+		traktor.downs++;
+		traktor.downTime = win32ClockNow;
+		hover(controlAt(pos));
+		if (!traktor.ready)
+			traktor.unready++;
+		traktor.pressed = traktor.hovered;
+		traktor.anchor = pos;
+		return 0;
+
+	case WM_LBUTTONUP:
+		traktor.ups++;
+		if (traktor.pressed == BUTTON && controlAt(pos) == BUTTON)
+			traktor.clicks++;
+		traktor.pressed = -1;
+		return 0;
+
+	case WM_MOUSEWHEEL:
+		traktor.wheels++;
+		traktor.wheel += GET_WHEEL_DELTA_WPARAM(wParam);
+		traktor.wheelPos = pos;
+		return 0;
+
+	case WM_TIMER:
+		if (wParam == HOVER_TIMER_ID) {
+			KillTimer(hWnd, HOVER_TIMER_ID);
+			if (traktor.hovered >= 0)
+				InvalidateRect(hWnd, &controls[traktor.hovered], FALSE);
+			return 0;
+		}
+		break;
+
+	case WM_PAINT:
+		traktor.paints++;
+		if (traktor.hovered >= 0 && GetUpdateRect(hWnd, &update, FALSE)) {
+			const RECT &control = controls[traktor.hovered];
+			if (update.left <= control.left && update.top <= control.top && update.right >= control.right && update.bottom >= control.bottom)
+				traktor.ready = true;
+		}
+		ValidateRect(hWnd, NULL);
+		return 0;
+	}
+	traktor.others++;
+	return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+/* Traktor's message loop, which can be told to lose the WM_NULL the DLL makes of its own messages */
+static struct {
+	int retrieved;
+	int swallowed;
+	bool swallowNull;
+} loop;
+
+static void pump()
+{
+	MSG msg;
+	while (PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE)) {
+		PeekMessage(&msg, NULL, 0, 0, PM_REMOVE);
+		loop.retrieved++;
+		if (msg.message == WM_NULL && loop.swallowNull) {
+			loop.swallowed++;
+			continue;
+		}
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+	}
+}
+
+/* A session: input from the script, with the real time it took to handle each */
+static struct {
+	const char *name;
+	LONGLONG start;
+	std::vector<LONGLONG> latencies;
+} session;
+
+static LONGLONG realTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return LONGLONG(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+/* Run the message loop until ms into the session */
+static void at(int ms)
+{
+	LONGLONG until = session.start + ms * MS;
+	pump();
+	while (win32RunTimers(until))
+		pump();
+}
+
+static void handle()
+{
+	LONGLONG start = realTime();
+	pump();
+	session.latencies.push_back(realTime() - start);
+}
+
+static void mouse(UINT message, short x, short y)
+{
+	win32PostInput(hwnd, message, message == WM_LBUTTONDOWN ? MK_LBUTTON : 0, MAKELPARAM(x, y), 0);
+	handle();
+}
+
+/* Windows' mouse emulation for a finger: the button is down from touching to lifting */
+static void touch(UINT message, short x, short y)
+{
+	win32PostInput(hwnd, message, message == WM_LBUTTONUP ? 0 : MK_LBUTTON, MAKELPARAM(x, y), TOUCH_SIGNATURE | 1);
+	handle();
+}
+
+/* A pointer message of a finger, in screen coordinates */
+static void pointer(UINT message, UINT32 id, bool primary, short x, short y)
+{
+	DWORD flags = POINTER_MESSAGE_FLAG_INRANGE;
+	if (message != WM_POINTERUP)
+		flags |= POINTER_MESSAGE_FLAG_INCONTACT;
+	if (primary)
+		flags |= POINTER_MESSAGE_FLAG_PRIMARY;
+	win32PostInput(hwnd, message, MAKEWPARAM(id, flags), MAKELPARAM(x, y), 0);
+	handle();
+}
+
+static void pan(DWORD flags, short y)
+{
+	win32PostGesture(hwnd, GID_PAN, flags, CLIENT_X + 600, y);
+	handle();
+}
+
+/* Start a session with the mouse away from all controls */
+static void begin(const char *name)
+{
+	mouse(WM_MOUSEMOVE, 10, 10);
+	at(0);
+	int hovered = traktor.hovered;
+	memset(&traktor, 0, sizeof(traktor));
+	traktor.hovered = hovered;
+	traktor.pressed = -1;
+	loop.retrieved = loop.swallowed = 0;
+	session.name = name;
+	session.start = win32ClockNow;
+	session.latencies.clear();
+}
+
+static void report()
+{
+	std::vector<LONGLONG> &latencies = session.latencies;
+	std::sort(latencies.begin(), latencies.end());
+	size_t n = latencies.size();
+	printf("  %-18s %3zu inputs %4d messages, Traktor got %3d moves %2d downs %2d ups %3d wheels %3d paints, "
+		"per input median %6.1f  max %6.1f us\n", session.name, n, loop.retrieved, traktor.moves, traktor.downs,
+		traktor.ups, traktor.wheels, traktor.paints, n ? latencies[n / 2] / 1000.0 : 0.0, n ? latencies[n - 1] / 1000.0 : 0.0);
+}
+
+static void writeIni(bool pointerInput)
+{
+	FILE *f = fopen(iniFileName, "w");
+	CHECK(f != NULL);
+	if (!f)
+		return;
+	/* No smoothing, linear scrolling and no coasting, so everything adds up exactly */
+	fprintf(f, "[Touch]\nPointerInput=%d\nSmoothMinCutoff=0\n\n[Scroll]\nAccelDeadZone=1000\nInertiaMs=0\n", pointerInput);
+	fclose(f);
+}
+
+/* Counts how often mhook starts disassembling something */
+typedef BOOL (*InitDisassemblerFunction)(DISASSEMBLER *disassembler, ARCHITECTURE_TYPE architecture);
+static InitDisassemblerFunction origInitDisassembler;
+static int disassemblies;
+
+static BOOL initDisassemblerHook(DISASSEMBLER *disassembler, ARCHITECTURE_TYPE architecture)
+{
+	disassemblies++;
+	return origInitDisassembler(disassembler, architecture);
+}
+
+static void setup(const char *argv0)
+{
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", argv0);
+	char moduleName[PATH_MAX];
+	snprintf(moduleName, sizeof(moduleName), "%s/traktouch.dll", dirname(dir));
+	mbstowcs(win32ModuleFileName, moduleName, _countof(win32ModuleFileName) - 1);
+	snprintf(iniFileName, sizeof(iniFileName), "%.*s.ini", (int)strlen(moduleName) - 4, moduleName);
+	snprintf(planFileName, sizeof(planFileName), "%.*s.plan", (int)strlen(moduleName) - 4, moduleName);
+
+	win32ManualClock = TRUE;
+	win32ClockNow = 1000 * MS;
+	writeIni(false);
+	remove(planFileName);
+
+	HMODULE module = GetModuleHandle(NULL);
+	CHECK(DllMain(module, DLL_PROCESS_ATTACH, NULL));
+	hwnd = win32CreateWindow(L"Traktor", TraktorWindowProc, CLIENT_X, CLIENT_Y, WIDTH, HEIGHT);
+	traktor.hovered = traktor.pressed = -1;
+
+	/* The loader works out the hook plan in its own process, then has Traktor run the entry
+	 * hook, which has nothing left to disassemble if it really goes by the plan */
+	WriteHookPlan();
+	FILE *plan = fopen(planFileName, "rb");
+	CHECK(plan != NULL);
+	if (plan)
+		fclose(plan);
+	origInitDisassembler = InitDisassembler;
+	CHECK(Mhook_SetHook((PVOID *)&origInitDisassembler, (PVOID)initDisassemblerHook));
+	EntryHook(HC_ACTION, 0, 0);
+	CHECK_EQ(disassemblies, 0);
+	CHECK(Mhook_Unhook((PVOID *)&origInitDisassembler));
+
+	/* The first message past the hook gets the window subclassed */
+	session.start = win32ClockNow;
+	mouse(WM_MOUSEMOVE, 10, 10);
+	CHECK_EQ(SendMessage(hwnd, WM_TABLET_QUERYSYSTEMGESTURESTATUS, 0, 0), TABLET_DISABLE_PRESSANDHOLD);
+}
+
+static void testTap()
+{
+	begin("tap");
+	touch(WM_LBUTTONDOWN, 288, 160);
+	at(50);
+	touch(WM_LBUTTONUP, 288, 160);
+	at(100);
+	report();
+
+	/* The button went down when the deferral ran out, long after the button was ready */
+	CHECK_EQ(traktor.downs, 1);
+	CHECK_EQ(traktor.ups, 1);
+	CHECK_EQ(traktor.clicks, 1);
+	CHECK_EQ(traktor.unready, 0);
+	CHECK_EQ(traktor.downTime - session.start, 30 * MS);
+
+	/* Now the DLL knows: a quarter on top of what the button took, rounded up to the timer's milliseconds */
+	begin("tap again");
+	touch(WM_LBUTTONDOWN, 288, 160);
+	at(50);
+	touch(WM_LBUTTONUP, 288, 160);
+	at(100);
+	report();
+
+	CHECK_EQ(traktor.clicks, 1);
+	CHECK_EQ(traktor.unready, 0);
+	CHECK_EQ(traktor.downTime - session.start, 13 * MS);
+}
+
+/* The message carrying the button down never gets dispatched: it goes out with the next one */
+static void testLeftover()
+{
+	begin("lost message");
+	loop.swallowNull = true;
+	touch(WM_LBUTTONDOWN, 288, 160);
+	at(35);
+	PostMessage(hwnd, WM_APP + 1, 0, 0);
+	handle();
+	at(60);
+	touch(WM_LBUTTONUP, 288, 160);
+	at(100);
+	loop.swallowNull = false;
+	report();
+
+	CHECK_EQ(loop.swallowed, 1);
+	CHECK_EQ(traktor.downs, 1);
+	CHECK_EQ(traktor.ups, 1);
+	CHECK_EQ(traktor.clicks, 1);
+	CHECK_EQ(traktor.downTime - session.start, 35 * MS);
+}
+
+/* Drag the knob up by 20 pixels of dead zone and then 80 more, a report every 8 ms */
+static void testKnob()
+{
+	int cursorMoves = win32SetCursorPosCalls;
+	begin("knob drag");
+	touch(WM_LBUTTONDOWN, 480, 352);
+	int ms = 40, y = 332;
+	for (; y >= 252; y -= 2, ms += 8) {
+		at(ms);
+		touch(WM_MOUSEMOVE, 480, (short)y);
+	}
+	at(ms);
+	touch(WM_LBUTTONUP, 480, (short)(y + 2));
+	at(ms + 50);
+	report();
+
+	CHECK_EQ(traktor.unready, 0);
+	CHECK_EQ(traktor.knob, -80);
+	CHECK_EQ(traktor.ups, 1);
+	CHECK(traktor.moves < 40);
+	CHECK_EQ(win32SetCursorPosCalls, cursorMoves);
+
+	/* With the finger up, Traktor moves the cursor for real */
+	CHECK(SetCursorPos(5, 5));
+	CHECK_EQ(win32SetCursorPosCalls, cursorMoves + 1);
+	POINT cursor;
+	GetCursorPos(&cursor);
+	CHECK_EQ(cursor.x, 5);
+	CHECK_EQ(cursor.y, 5);
+}
+
+/* Pan two fingers up by 90 pixels; six wheel units per pixel */
+static void testPan()
+{
+	begin("pan");
+	short y = 500;
+	pan(GF_BEGIN, y);
+	int ms = 8;
+	for (int i = 0; i < 30; i++, ms += 8) {
+		at(ms);
+		y -= 3;
+		pan(0, y);
+	}
+	pan(GF_END, y);
+	at(ms + 100);
+	report();
+
+	CHECK_EQ(traktor.wheel, -540);
+	CHECK(traktor.wheels > 10);
+	CHECK_EQ(traktor.wheelPos.x, CLIENT_X + WIDTH - 20);
+	CHECK_EQ(traktor.wheelPos.y, CLIENT_Y + HEIGHT - 80);
+	CHECK_EQ(traktor.downs, 0);
+	CHECK_EQ(win32OpenGestureHandles, 0);
+}
+
+static void testPointerKnob()
+{
+	int cursorMoves = win32SetCursorPosCalls;
+	begin("pointer knob drag");
+	short x = CLIENT_X + 480, y = CLIENT_Y + 352;
+	pointer(WM_POINTERDOWN, 5, true, x, y);
+	int ms = 40;
+	for (int i = 0; i < 40; i++, ms += 8) {
+		at(ms);
+		y -= 2;
+		pointer(WM_POINTERUPDATE, 5, true, x, y);
+	}
+	at(ms);
+	pointer(WM_POINTERUP, 5, true, x, y);
+	at(ms + 50);
+	report();
+
+	/* No dead zone to take out with pointers, and the cursor never moves at all */
+	CHECK_EQ(traktor.unready, 0);
+	CHECK_EQ(traktor.knob, -80);
+	CHECK_EQ(traktor.downs, 1);
+	CHECK_EQ(traktor.ups, 1);
+	CHECK_EQ(win32SetCursorPosCalls, cursorMoves);
+	POINT cursor;
+	GetCursorPos(&cursor);
+	CHECK_EQ(cursor.x, CLIENT_X + 10);
+	CHECK_EQ(cursor.y, CLIENT_Y + 10);
+}
+
+/* A second finger comes down before the first one's button went down, and they pan up by 80 */
+static void testPointerPan()
+{
+	begin("pointer pan");
+	short y1 = 500, y2 = 500;
+	pointer(WM_POINTERDOWN, 7, true, 700, y1);
+	at(8);
+	pointer(WM_POINTERDOWN, 8, false, 760, y2);
+	int ms = 16;
+	for (int i = 0; i < 20; i++, ms += 8) {
+		at(ms);
+		y1 -= 4;
+		pointer(WM_POINTERUPDATE, 7, true, 700, y1);
+		y2 -= 4;
+		pointer(WM_POINTERUPDATE, 8, false, 760, y2);
+	}
+	pointer(WM_POINTERUP, 8, false, 760, y2);
+	pointer(WM_POINTERUP, 7, true, 700, y1);
+	at(ms + 100);
+	report();
+
+	CHECK_EQ(traktor.downs, 0);
+	CHECK_EQ(traktor.ups, 0);
+	CHECK_EQ(traktor.wheel, -480);
+
+	/* A pen isn't a finger, its messages go to Traktor as they are */
+	win32SetPointerType(9, PT_PEN);
+	int others = traktor.others;
+	pointer(WM_POINTERDOWN, 9, true, 700, 500);
+	pointer(WM_POINTERUP, 9, true, 700, 500);
+	CHECK_EQ(traktor.others, others + 2);
+	CHECK_EQ(traktor.downs, 0);
+}
+
+int main(int argc, char **argv)
+{
+	setup(argv[0]);
+	printf("PointerInput=0:\n");
+	testTap();
+	testLeftover();
+	testKnob();
+	testPan();
+
+	writeIni(true);
+	DllMain(GetModuleHandle(NULL), DLL_PROCESS_ATTACH, NULL);
+	printf("PointerInput=1:\n");
+	testPointerKnob();
+	testPointerPan();
+
+	DestroyWindow(hwnd);
+	return testExit("dll_session");
+}
+
+/* End of File */
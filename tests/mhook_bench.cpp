@@ -0,0 +1,244 @@
+/*
+ * Traktouch Linux tests: mhook latency and stress benchmark
+ *
+ * Worker threads call a set of generated functions as fast as they can while the main thread
+ * hooks and unhooks them, one at a time and in transactions. Every call has to return either
+ * the original or the hooked result. Reports how long each operation took, how often and for
+ * how long the workers were stopped, and what placing trampolines cost, for functions patched
+ * with threads suspended, atomically and at hot-patch points.
+ *
+ *   mhook_bench [workers [rounds]]
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define N_FUNCTIONS 16
+#define MAX_WORKERS 64
+
+enum { MODE_SUSPEND, MODE_ATOMIC, MODE_HOTPATCH, N_MODES };
+static const char *modeNames[N_MODES] = { "suspend", "atomic", "hot-patch" };
+
+static TestFunction functions[N_MODES][N_FUNCTIONS];
+static TestFunction originals[N_MODES][N_FUNCTIONS];
+
+static volatile bool stopWorkers;
+static volatile long long workerCalls[MAX_WORKERS];
+static volatile long long badResults;
+
+static int hookFunction(int a, int b)
+{
+	return -a;
+}
+
+static void generate(CodeBuffer &code)
+{
+	for (int i = 0; i < N_FUNCTIONS; i++) {
+		/* push rbp; mov rbp, rsp; lea eax, [rdi+i]; pop rbp; ret: one-byte first instruction */
+		functions[MODE_SUSPEND][i] = (TestFunction)code.function();
+		code.emit({ 0x55, 0x48, 0x89, 0xe5, 0x8d, 0x87 });
+		code.emit32(i);
+		code.emit({ 0x5d, 0xc3 });
+
+		/* mov eax, i; add eax, edi; ret: the first instruction takes the whole jump */
+		functions[MODE_ATOMIC][i] = (TestFunction)code.function();
+		code.emit({ 0xb8 });
+		code.emit32(i);
+		code.emit({ 0x01, 0xf8, 0xc3 });
+
+		/* int3 padding; mov edi, edi; lea eax, [rdi+i]; ret */
+		functions[MODE_HOTPATCH][i] = (TestFunction)code.function(8);
+		code.emit({ 0x8b, 0xff, 0x8d, 0x87 });
+		code.emit32(i);
+		code.emit({ 0xc3 });
+	}
+}
+
+static void *worker(void *arg)
+{
+	int id = (int)(LONG_PTR)arg;
+	long long calls = 0;
+	while (!stopWorkers) {
+		for (int mode = 0; mode < N_MODES; mode++) {
+			for (int i = 0; i < N_FUNCTIONS; i++) {
+				int a = (int)(calls & 0xff) + 1;
+				int result = functions[mode][i](a, 0);
+				if (result != a + i && result != -a)
+					__atomic_add_fetch(&badResults, 1, __ATOMIC_RELAXED);
+				calls++;
+			}
+		}
+		workerCalls[id] = calls;
+	}
+	return NULL;
+}
+
+static void crashed(int signal)
+{
+	static const char message[] = "mhook_bench: crashed\n";
+	write(2, message, sizeof(message) - 1);
+	_exit(2);
+}
+
+static double ticksPerMicrosecond;
+
+static LONGLONG nanoseconds()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static void calibrate()
+{
+	LONGLONG start = nanoseconds();
+	ULONGLONG tscStart = __rdtsc();
+	usleep(50000);
+	ticksPerMicrosecond = (__rdtsc() - tscStart) * 1000.0 / (nanoseconds() - start);
+}
+
+static double microseconds(ULONGLONG ticks)
+{
+	return ticks / ticksPerMicrosecond;
+}
+
+/* Latencies of single operations or commits, in nanoseconds */
+static void report(const char *what, std::vector<LONGLONG> &latencies)
+{
+	if (latencies.empty())
+		return;
+	std::sort(latencies.begin(), latencies.end());
+	size_t n = latencies.size();
+	printf("  %-22s %6zu ops   min %8.1f  median %8.1f  p99 %8.1f  max %8.1f us\n", what, n,
+		latencies[0] / 1000.0, latencies[n / 2] / 1000.0, latencies[n * 99 / 100] / 1000.0, latencies[n - 1] / 1000.0);
+}
+
+static void reportTimings(const MHOOK_TIMINGS &before)
+{
+	MHOOK_TIMINGS after;
+	Mhook_GetTimings(&after);
+	ULONGLONG suspensions = after.nSuspensions - before.nSuspensions;
+	ULONGLONG allocs = after.nTrampolineAllocs - before.nTrampolineAllocs;
+	printf("  threads stopped %llu times, %.1f us on average, %.1f us at most (%llu threads)\n",
+		(unsigned long long)suspensions,
+		suspensions ? microseconds(after.qwSuspendedTicks - before.qwSuspendedTicks) / suspensions : 0.0,
+		microseconds(after.qwMaxSuspendedTicks), (unsigned long long)after.nMaxSuspendedThreads);
+	printf("  %llu trampolines placed, %.1f us on average, %.1f us at most\n", (unsigned long long)allocs,
+		allocs ? microseconds(after.qwTrampolineAllocTicks - before.qwTrampolineAllocTicks) / allocs : 0.0,
+		microseconds(after.qwMaxTrampolineAllocTicks));
+	CHECK_EQ(after.nFailedOperations, before.nFailedOperations);
+}
+
+static void benchSingle(int mode, int rounds)
+{
+	std::vector<LONGLONG> hooks, unhooks;
+	for (int round = 0; round < rounds; round++) {
+		int i = round % N_FUNCTIONS;
+		originals[mode][i] = functions[mode][i];
+		LONGLONG start = nanoseconds();
+		BOOL hooked = Mhook_SetHook((PVOID *)&originals[mode][i], (PVOID)hookFunction);
+		LONGLONG middle = nanoseconds();
+		CHECK(hooked);
+		if (!hooked)
+			continue;
+		CHECK(Mhook_Unhook((PVOID *)&originals[mode][i]));
+		LONGLONG end = nanoseconds();
+		hooks.push_back(middle - start);
+		unhooks.push_back(end - middle);
+	}
+	report("Mhook_SetHook", hooks);
+	report("Mhook_Unhook", unhooks);
+}
+
+static void benchBatch(int mode, int rounds)
+{
+	std::vector<LONGLONG> hooks, unhooks;
+	for (int round = 0; round < rounds / N_FUNCTIONS; round++) {
+		LONGLONG start = nanoseconds();
+		Mhook_BeginTransaction();
+		for (int i = 0; i < N_FUNCTIONS; i++) {
+			originals[mode][i] = functions[mode][i];
+			Mhook_TransactionSetHook((PVOID *)&originals[mode][i], (PVOID)hookFunction, NULL);
+		}
+		CHECK_EQ(Mhook_CommitTransaction(), N_FUNCTIONS);
+		LONGLONG middle = nanoseconds();
+		Mhook_BeginTransaction();
+		for (int i = 0; i < N_FUNCTIONS; i++)
+			Mhook_TransactionUnhook((PVOID *)&originals[mode][i], NULL);
+		CHECK_EQ(Mhook_CommitTransaction(), N_FUNCTIONS);
+		LONGLONG end = nanoseconds();
+		hooks.push_back(middle - start);
+		unhooks.push_back(end - middle);
+	}
+	report("hook 16 in a commit", hooks);
+	report("unhook 16 in a commit", unhooks);
+}
+
+int main(int argc, char **argv)
+{
+	int nWorkers = argc > 1 ? atoi(argv[1]) : 4;
+	int rounds = argc > 2 ? atoi(argv[2]) : 500;
+	if (nWorkers < 0 || nWorkers > MAX_WORKERS || rounds < N_FUNCTIONS) {
+		fprintf(stderr, "usage: mhook_bench [workers (0-%d) [rounds (at least %d)]]\n", MAX_WORKERS, N_FUNCTIONS);
+		return 2;
+	}
+
+	CodeBuffer code;
+	CHECK(code.ok());
+	if (!code.ok())
+		return testExit("mhook_bench");
+	generate(code);
+	signal(SIGSEGV, crashed);
+	signal(SIGILL, crashed);
+	signal(SIGBUS, crashed);
+	calibrate();
+
+	pthread_t threads[MAX_WORKERS];
+	for (int i = 0; i < nWorkers; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)(LONG_PTR)i);
+
+	printf("%d workers, %d rounds, %.0f ticks per us\n", nWorkers, rounds, ticksPerMicrosecond);
+	for (int mode = 0; mode < N_MODES; mode++) {
+		MHOOK_TIMINGS before;
+		Mhook_GetTimings(&before);
+		printf("%s:\n", modeNames[mode]);
+		benchSingle(mode, rounds);
+		benchBatch(mode, rounds);
+		reportTimings(before);
+	}
+
+	stopWorkers = true;
+	long long calls = 0;
+	for (int i = 0; i < nWorkers; i++) {
+		pthread_join(threads[i], NULL);
+		calls += workerCalls[i];
+	}
+	printf("workers made %lld calls, %lld of them returned a wrong result\n", calls, badResults);
+	CHECK_EQ(badResults, 0);
+	return testExit("mhook_bench");
+}
+
+/* End of File */
@@ -0,0 +1,127 @@
+/*
+ * Traktouch Linux tests: when a new hook's function pointer becomes usable
+ *
+ * A hook can be called the moment its patch is written, and mhook itself calls a few functions
+ * between writing the patch and returning. Hooking those functions is the surest way to catch a
+ * hook that is called before the pointer it calls the original through leads to the original.
+ * FlushInstructionCache is patched atomically, VirtualProtect only with threads suspended.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "test.h"
+
+typedef BOOL (*FlushFunction)(HANDLE process, LPCVOID address, SIZE_T size);
+typedef BOOL (*ProtectFunction)(PVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect);
+
+static FlushFunction origFlush, origFlush2;
+static ProtectFunction origProtect;
+
+/* Calls through a stale pointer come straight back in, which these count instead of recursing */
+static int depth, recursions, calls;
+
+static BOOL recurse()
+{
+	recursions++;
+	return TRUE;
+}
+
+static BOOL flushHook(HANDLE process, LPCVOID address, SIZE_T size)
+{
+	if (depth)
+		return recurse();
+	depth++;
+	calls++;
+	BOOL result = origFlush(process, address, size);
+	depth--;
+	return result;
+}
+
+static BOOL flushHook2(HANDLE process, LPCVOID address, SIZE_T size)
+{
+	if (depth)
+		return recurse();
+	depth++;
+	calls++;
+	/* The first hook lets its own calls through, this one only counts */
+	depth--;
+	return origFlush2(process, address, size);
+}
+
+static BOOL protectHook(PVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect)
+{
+	if (depth)
+		return recurse();
+	depth++;
+	calls++;
+	BOOL result = origProtect(address, size, newProtect, oldProtect);
+	depth--;
+	return result;
+}
+
+static void testAtomic()
+{
+	recursions = calls = 0;
+	origFlush = FlushInstructionCache;
+	CHECK(Mhook_SetHook((PVOID *)&origFlush, (PVOID)flushHook));
+	CHECK(origFlush != FlushInstructionCache);
+	CHECK_EQ(recursions, 0);
+	CHECK(calls > 0);
+
+	/* A second hook on the same function calls on through a chain link */
+	calls = 0;
+	origFlush2 = FlushInstructionCache;
+	CHECK(Mhook_SetHook((PVOID *)&origFlush2, (PVOID)flushHook2));
+	CHECK_EQ(recursions, 0);
+	CHECK(calls > 0);
+
+	CHECK(FlushInstructionCache(GetCurrentProcess(), NULL, 0));
+	CHECK_EQ(recursions, 0);
+
+	CHECK(Mhook_Unhook((PVOID *)&origFlush2));
+	CHECK(Mhook_Unhook((PVOID *)&origFlush));
+	CHECK(origFlush == FlushInstructionCache);
+	CHECK_EQ(recursions, 0);
+}
+
+static void testSuspended()
+{
+	recursions = calls = 0;
+	origProtect = VirtualProtect;
+	CHECK(Mhook_SetHook((PVOID *)&origProtect, (PVOID)protectHook));
+	CHECK_EQ(recursions, 0);
+	CHECK(calls > 0);
+
+	DWORD oldProtect;
+	static BYTE page[1];
+	CHECK(VirtualProtect(page, sizeof(page), PAGE_READWRITE, &oldProtect));
+	CHECK_EQ(recursions, 0);
+
+	CHECK(Mhook_Unhook((PVOID *)&origProtect));
+	CHECK(origProtect == VirtualProtect);
+	CHECK_EQ(recursions, 0);
+}
+
+int main()
+{
+	testAtomic();
+	testSuspended();
+	return testExit("mhook_commit");
+}
+
+/* End of File */
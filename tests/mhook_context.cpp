@@ -0,0 +1,122 @@
+/*
+ * Traktouch Linux tests: context hooks in the middle of a function
+ *
+ * A context hook hands the registers at the hooked instruction to a callback, which may change
+ * them before the original instructions carry on. The thunk that saves them must not touch the
+ * 128 bytes below the stack pointer, where a leaf function may keep its locals without ever
+ * moving the stack pointer (the System V red zone).
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+/* What the callbacks saw */
+static int calls;
+static MHOOK_REGISTERS seen;
+static int redZone[2];
+
+static VOID WINAPI addToRax(MHOOK_REGISTERS *registers, PVOID arg)
+{
+	calls++;
+	seen = *registers;
+	registers->Rax += (DWORD64)(LONG_PTR)arg;
+}
+
+static VOID WINAPI readRedZone(MHOOK_REGISTERS *registers, PVOID)
+{
+	calls++;
+	seen = *registers;
+	redZone[0] = *(int *)(registers->Rsp - 8);
+	redZone[1] = *(int *)(registers->Rsp - 16);
+}
+
+static void testChangeRegister(CodeBuffer &code)
+{
+	/* (a + b) * 3 + 7, hooked at the multiplication */
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x8d, 0x04, 0x37 });                /* lea eax, [rdi+rsi] */
+	PBYTE hooked = code.here();
+	code.emit({ 0x6b, 0xc0, 0x03 });                /* imul eax, eax, 3 */
+	code.emit({ 0x83, 0xc0, 0x07 });                /* add eax, 7 */
+	code.emit({ 0xc3 });                            /* ret */
+	BYTE before[16];
+	memcpy(before, (PVOID)fn, sizeof(before));
+
+	calls = 0;
+	PVOID address = hooked;
+	CHECK(Mhook_SetContextHook(&address, addToRax, (PVOID)100));
+	CHECK_EQ(fn(2, 3), (2 + 3 + 100) * 3 + 7);
+	CHECK_EQ(calls, 1);
+	CHECK_EQ(seen.Rdi, 2);
+	CHECK_EQ(seen.Rsi, 3);
+	CHECK_EQ((DWORD)seen.Rax, 5);
+	/* Called from here, so the return address is the only thing on the function's stack */
+	CHECK_EQ(seen.Rsp & 15, 8);
+
+	CHECK_EQ(fn(-4, 1), (-4 + 1 + 100) * 3 + 7);
+	CHECK_EQ(calls, 2);
+
+	CHECK(Mhook_Unhook(&address));
+	CHECK(address == hooked);
+	CHECK(!memcmp(before, (PVOID)fn, sizeof(before)));
+	CHECK_EQ(fn(2, 3), (2 + 3) * 3 + 7);
+	CHECK_EQ(calls, 2);
+}
+
+static void testRedZone(CodeBuffer &code)
+{
+	/* a + b by way of two locals below the stack pointer, hooked where they are read back */
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x89, 0x7c, 0x24, 0xf8 });          /* mov [rsp-8], edi */
+	code.emit({ 0x89, 0x74, 0x24, 0xf0 });          /* mov [rsp-16], esi */
+	PBYTE hooked = code.here();
+	code.emit({ 0x8b, 0x44, 0x24, 0xf8 });          /* mov eax, [rsp-8] */
+	code.emit({ 0x03, 0x44, 0x24, 0xf0 });          /* add eax, [rsp-16] */
+	code.emit({ 0xc3 });                            /* ret */
+	CHECK_EQ(fn(5, 7), 12);
+
+	calls = 0;
+	PVOID address = hooked;
+	CHECK(Mhook_SetContextHook(&address, readRedZone, NULL));
+	CHECK_EQ(fn(5, 7), 12);
+	CHECK_EQ(calls, 1);
+	CHECK_EQ(redZone[0], 5);
+	CHECK_EQ(redZone[1], 7);
+	CHECK_EQ(seen.Rsp & 15, 8);
+
+	CHECK_EQ(fn(-20, 1000), 980);
+	CHECK_EQ(redZone[0], -20);
+	CHECK_EQ(redZone[1], 1000);
+
+	CHECK(Mhook_Unhook(&address));
+	CHECK_EQ(fn(5, 7), 12);
+	CHECK_EQ(calls, 2);
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	testChangeRegister(code);
+	testRedZone(code);
+	return testExit("mhook_context");
+}
+
+/* End of File */
@@ -0,0 +1,91 @@
+/*
+ * Traktouch Linux tests: which functions mhook hot-patches
+ *
+ * Only the "mov edi, edi" (8b ff) of MSVC's /hotpatch with int3 padding in front is a hot-patch
+ * point. Those get a short jump into the padding; everything else gets the usual five-byte jump
+ * and its padding left alone.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+#define PADDING 8
+
+static TestFunction original;
+
+static int hookFunction(int a, int b)
+{
+	return original(a, b) * 10 + 1;
+}
+
+/* padding, then a two-byte first instruction; lea eax, [rdi+5]; ret */
+static TestFunction generate(CodeBuffer &code, BYTE paddingByte, BYTE first0, BYTE first1)
+{
+	TestFunction fn = (TestFunction)code.function(PADDING, paddingByte);
+	code.emit({ first0, first1 });
+	code.emit({ 0x8d, 0x47, 0x05, 0xc3 });
+	return fn;
+}
+
+static void checkHook(const char *what, TestFunction fn, bool hotPatch)
+{
+	PBYTE pb = (PBYTE)fn;
+	BYTE before[PADDING + 8];
+	memcpy(before, pb - PADDING, sizeof(before));
+	int failures = testFailures;
+
+	original = fn;
+	CHECK(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction));
+	if (hotPatch) {
+		CHECK_EQ(pb[0], 0xeb);
+		CHECK_EQ(pb[-5], 0xe9);
+	} else {
+		CHECK_EQ(pb[0], 0xe9);
+		CHECK(!memcmp(before, pb - PADDING, PADDING));
+	}
+	CHECK_EQ(fn(2, 0), 71);
+	CHECK_EQ(original(2, 0), 7);
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	CHECK_EQ(fn(2, 0), 7);
+	if (hotPatch)
+		CHECK_EQ(pb[0], 0x8b);
+	if (testFailures != failures)
+		fprintf(stderr, "... in %s\n", what);
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	if (!code.ok())
+		return testExit("mhook_hotpatch");
+
+	/* mov edi, edi as /hotpatch emits it */
+	checkHook("8b ff after int3", generate(code, 0xcc, 0x8b, 0xff), true);
+	/* the same instruction in its other encoding isn't what a compiler leaves for patching */
+	checkHook("89 ff after int3", generate(code, 0xcc, 0x89, 0xff), false);
+	/* xor eax, eax */
+	checkHook("31 c0 after int3", generate(code, 0xcc, 0x31, 0xc0), false);
+	/* nops may be the end of code that falls through */
+	checkHook("8b ff after nop", generate(code, 0x90, 0x8b, 0xff), false);
+	return testExit("mhook_hotpatch");
+}
+
+/* End of File */
@@ -0,0 +1,115 @@
+/*
+ * Traktouch Linux tests: hooking the calls one module makes to another
+ *
+ * On Windows an import hook swaps an import address table entry; on Linux it swaps the global
+ * offset table entry the module's PLT jumps through. Either way only that module's calls are
+ * redirected: the function itself stays as it is, and so do calls made through other pointers.
+ * Import hooks on the same entry stack up and come off in reverse order.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "test.h"
+
+#define LIBC "libc.so.6"
+#define VARIABLE "TRAKTOUCH_IMPORT_TEST"
+
+typedef char *(*GetenvFunction)(const char *name);
+
+static GetenvFunction origGetenv, origGetenv2;
+static int hookCalls, hook2Calls;
+
+static char *getenvHook(const char *name)
+{
+	hookCalls++;
+	if (!strcmp(name, VARIABLE))
+		return (char *)"hooked";
+	return origGetenv(name);
+}
+
+static char *getenvHook2(const char *name)
+{
+	hook2Calls++;
+	return origGetenv2(name);
+}
+
+static void testImport()
+{
+	GetenvFunction realGetenv = (GetenvFunction)dlsym(RTLD_DEFAULT, "getenv");
+	CHECK(realGetenv != NULL);
+	CHECK(realGetenv(VARIABLE) == NULL);
+	const char *home = realGetenv("HOME");
+
+	/* Nothing has called getenv through the executable's PLT yet, so unless the executable was
+	 * linked with -z now, its entry still leads to the lazy binding stub */
+	CHECK(Mhook_SetImportHook(NULL, LIBC, "getenv", (PVOID *)&origGetenv, (PVOID)getenvHook));
+	CHECK(origGetenv == realGetenv);
+	CHECK(getenv(VARIABLE) && !strcmp(getenv(VARIABLE), "hooked"));
+	CHECK(getenv("HOME") == home);
+	CHECK_EQ(hookCalls, 3);
+
+	/* The function itself isn't touched */
+	CHECK(realGetenv(VARIABLE) == NULL);
+	CHECK_EQ(hookCalls, 3);
+
+	/* A second hook on the same entry, finding the executable by an address in it */
+	HMODULE module = NULL;
+	CHECK(GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)testImport, &module));
+	CHECK(Mhook_SetImportHook(module, LIBC, "getenv", (PVOID *)&origGetenv2, (PVOID)getenvHook2));
+	CHECK(origGetenv2 == getenvHook);
+	CHECK(getenv(VARIABLE) && !strcmp(getenv(VARIABLE), "hooked"));
+	CHECK_EQ(hook2Calls, 2);
+	CHECK_EQ(hookCalls, 5);
+
+	/* The first hook can't come off from underneath the second */
+	CHECK(!Mhook_UnhookImport((PVOID *)&origGetenv));
+	CHECK(Mhook_UnhookImport((PVOID *)&origGetenv2));
+	CHECK(origGetenv2 == getenvHook);
+	CHECK(Mhook_UnhookImport((PVOID *)&origGetenv));
+	CHECK(origGetenv == realGetenv);
+	CHECK(!Mhook_UnhookImport((PVOID *)&origGetenv));
+
+	hookCalls = hook2Calls = 0;
+	CHECK(getenv(VARIABLE) == NULL);
+	CHECK_EQ(hookCalls, 0);
+	CHECK_EQ(hook2Calls, 0);
+}
+
+/* Functions the module doesn't call, and modules that don't have them, can't be hooked */
+static void testNotImported()
+{
+	GetenvFunction unchanged = NULL;
+	CHECK(!Mhook_SetImportHook(NULL, LIBC, "mkfifo", (PVOID *)&unchanged, (PVOID)getenvHook));
+	CHECK(!Mhook_SetImportHook(NULL, LIBC, "no_such_function", (PVOID *)&unchanged, (PVOID)getenvHook));
+	CHECK(!Mhook_SetImportHook(NULL, "libtraktouch_missing.so", "getenv", (PVOID *)&unchanged, (PVOID)getenvHook));
+	CHECK(unchanged == NULL);
+	CHECK(getenv(VARIABLE) == NULL);
+	CHECK_EQ(hookCalls, 0);
+}
+
+int main()
+{
+	testImport();
+	testNotImported();
+	return testExit("mhook_import");
+}
+
+/* End of File */
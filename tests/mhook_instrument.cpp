@@ -0,0 +1,106 @@
+/*
+ * Traktouch Linux tests: call counts and timings of an instrumented hook
+ *
+ * MHOOK_INSTRUMENT counts every call that enters the hook and times the calls that return, as
+ * long as they aren't nested deeper than the per-thread probe buffer goes. Deeper calls are
+ * counted and left untimed, and every timed call lands in exactly one latency bucket.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+/* MHOOKS_PROBE_DEPTH in mhook.cpp */
+#define PROBE_DEPTH 64
+
+static TestFunction fn, original;
+
+/* Recurses through the hooked function until a runs out, then calls the original */
+static int hookFunction(int a, int b)
+{
+	if (a > 0)
+		return fn(a - 1, b) + 1;
+	return original(a, b);
+}
+
+static void checkStats(const MHOOK_STATS &stats, ULONGLONG calls, ULONGLONG returns)
+{
+	CHECK_EQ(stats.nCalls, calls);
+	CHECK_EQ(stats.nReturns, returns);
+	CHECK(stats.qwMinTicks <= stats.qwMaxTicks);
+	CHECK(stats.qwMaxTicks <= stats.qwTotalTicks);
+	CHECK(stats.qwFirstCallTsc <= stats.qwLastCallTsc);
+	ULONGLONG bucketed = 0;
+	for (int i = 0; i < MHOOK_LATENCY_BUCKETS; i++)
+		bucketed += stats.nLatency[i];
+	CHECK_EQ(bucketed, returns);
+}
+
+static void testInstrument(CodeBuffer &code)
+{
+	fn = (TestFunction)code.function();
+	code.emit({ 0x8d, 0x04, 0x37 });                /* lea eax, [rdi+rsi] */
+	code.emit({ 0x83, 0xc0, 0x00 });                /* add eax, 0 */
+	code.emit({ 0xc3 });                            /* ret */
+
+	original = fn;
+	CHECK(Mhook_SetHookEx((PVOID *)&original, (PVOID)hookFunction, MHOOK_INSTRUMENT));
+	MHOOK_STATS stats;
+	CHECK(Mhook_GetHookStats((PVOID)original, &stats));
+	CHECK_EQ(stats.nCalls, 0);
+	CHECK_EQ(stats.qwMinTicks, 0);
+
+	/* Plain calls are all counted and timed */
+	const int N = 1000;
+	for (int i = 0; i < N; i++)
+		CHECK_EQ(fn(0, i), i);
+	CHECK(Mhook_GetHookStats((PVOID)original, &stats));
+	checkStats(stats, N, N);
+	CHECK(stats.qwMinTicks > 0);
+
+	/* Of a call nested deeper than the probe buffer, only the outer calls are timed */
+	const int depth = 2 * PROBE_DEPTH;
+	CHECK_EQ(fn(depth, 3), depth + 3);
+	CHECK(Mhook_GetHookStats((PVOID)original, &stats));
+	checkStats(stats, N + depth + 1, N + PROBE_DEPTH);
+
+	/* ... which doesn't keep the next calls from being timed */
+	for (int i = 0; i < N; i++)
+		CHECK_EQ(fn(1, i), i + 1);
+	CHECK(Mhook_GetHookStats((PVOID)original, &stats));
+	checkStats(stats, N + depth + 1 + 2 * N, N + PROBE_DEPTH + 2 * N);
+
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	CHECK(!Mhook_GetHookStats((PVOID)original, &stats));
+
+	/* Hooks set without the flag have no statistics */
+	CHECK(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction));
+	CHECK(!Mhook_GetHookStats((PVOID)original, &stats));
+	CHECK(Mhook_Unhook((PVOID *)&original));
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	testInstrument(code);
+	return testExit("mhook_instrument");
+}
+
+/* End of File */
@@ -0,0 +1,163 @@
+/*
+ * Traktouch Linux tests: where mhook puts trampolines
+ *
+ * Trampolines come from the free-region map, which is built by walking the address space once
+ * and then kept up to date, so hooking many functions must not walk it again. Trampolines have
+ * to be within reach of a rel32 jump from their function, and blocks the map still thinks are
+ * free but have been taken since must be skipped. Trampolines share blocks, which go back to
+ * the system with their last trampoline.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+#define N_FUNCTIONS 300
+#define GRANULARITY 0x10000
+
+static TestFunction functions[N_FUNCTIONS];
+static TestFunction originals[N_FUNCTIONS];
+
+static int negate(int a, int b)
+{
+	return -a;
+}
+
+/* push rbp; mov rbp, rsp; lea eax, [rdi+i]; pop rbp; ret: four instructions in the first five bytes */
+static void generate(CodeBuffer &code)
+{
+	for (int i = 0; i < N_FUNCTIONS; i++) {
+		functions[i] = (TestFunction)code.function();
+		code.emit({ 0x55, 0x48, 0x89, 0xe5 });
+		code.emit({ 0x8d, 0x87 });
+		code.emit32(i);
+		code.emit({ 0x5d, 0xc3 });
+	}
+}
+
+static long long distance(PVOID a, PVOID b)
+{
+	return a > b ? (PBYTE)a - (PBYTE)b : (PBYTE)b - (PBYTE)a;
+}
+
+static void testManyHooks()
+{
+	int reservationsBefore = win32Reservations;
+	int queriesBefore = win32VirtualQueryCalls;
+	originals[0] = functions[0];
+	CHECK(Mhook_SetHook((PVOID *)&originals[0], (PVOID)negate));
+	int buildQueries = win32VirtualQueryCalls - queriesBefore;
+	CHECK(buildQueries > 0);
+
+	/* The map is built now, the rest must not walk the address space again */
+	queriesBefore = win32VirtualQueryCalls;
+	long long maxDistance = 0;
+	for (int i = 1; i < N_FUNCTIONS; i++) {
+		originals[i] = functions[i];
+		CHECK(Mhook_SetHook((PVOID *)&originals[i], (PVOID)negate));
+		long long d = distance((PVOID)originals[i], (PVOID)functions[i]);
+		if (d > maxDistance)
+			maxDistance = d;
+	}
+	int queries = win32VirtualQueryCalls - queriesBefore;
+	int blocks = win32Reservations - reservationsBefore;
+	printf("address space walk: %d queries, %d more for %d hooks; trampolines at most %lld KB away\n",
+		buildQueries, queries, N_FUNCTIONS - 1, maxDistance >> 10);
+	printf("%d trampolines in %d blocks\n", N_FUNCTIONS, blocks);
+	CHECK(queries < buildQueries);
+	CHECK(maxDistance < 0x7fff0000);
+	CHECK(blocks > 0);
+	CHECK(blocks <= N_FUNCTIONS / 16);
+
+	for (int i = 0; i < N_FUNCTIONS; i++) {
+		CHECK_EQ(functions[i](i, 0), -i);
+		CHECK_EQ(originals[i](5, 0), 5 + i);
+	}
+	for (int i = 0; i < N_FUNCTIONS; i++) {
+		CHECK(Mhook_Unhook((PVOID *)&originals[i]));
+		CHECK_EQ(functions[i](5, 0), 5 + i);
+	}
+}
+
+/* Unhooked trampolines are released in batches; once all of them are, so are their blocks */
+static void testBlocksReleased()
+{
+	int releasesBefore = win32Releases;
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < N_FUNCTIONS; i++) {
+			originals[i] = functions[i];
+			CHECK(Mhook_SetHook((PVOID *)&originals[i], (PVOID)negate));
+		}
+		for (int i = 0; i < N_FUNCTIONS; i++)
+			CHECK(Mhook_Unhook((PVOID *)&originals[i]));
+	}
+	CHECK(win32Releases > releasesBefore);
+
+	/* A slot that's handed out again starts out clean */
+	originals[0] = functions[0];
+	CHECK(Mhook_SetHook((PVOID *)&originals[0], (PVOID)negate));
+	CHECK_EQ(functions[0](4, 0), -4);
+	CHECK_EQ(originals[0](4, 0), 4);
+	CHECK(Mhook_Unhook((PVOID *)&originals[0]));
+}
+
+/* Take every block around the code that the map still thinks is free, then hook again */
+static void testStaleMap(CodeBuffer &code)
+{
+	PBYTE around = (PBYTE)((ULONG_PTR)functions[0] & ~(ULONG_PTR)(GRANULARITY - 1));
+	PVOID taken[64];
+	int nTaken = 0;
+	for (int i = 1; i <= 32; i++) {
+		PVOID below = VirtualAlloc(around - i * GRANULARITY, GRANULARITY, MEM_RESERVE, PAGE_NOACCESS);
+		PVOID above = VirtualAlloc(around + (i + 1) * GRANULARITY, GRANULARITY, MEM_RESERVE, PAGE_NOACCESS);
+		if (below)
+			taken[nTaken++] = below;
+		if (above)
+			taken[nTaken++] = above;
+	}
+	CHECK(nTaken > 0);
+
+	originals[0] = functions[0];
+	CHECK(Mhook_SetHook((PVOID *)&originals[0], (PVOID)negate));
+	CHECK_EQ(functions[0](3, 0), -3);
+	CHECK_EQ(originals[0](3, 0), 3);
+	for (int i = 0; i < nTaken; i++)
+		CHECK(distance((PVOID)originals[0], (PBYTE)taken[i] + GRANULARITY / 2) >= GRANULARITY / 2);
+	CHECK(distance((PVOID)originals[0], (PVOID)functions[0]) < 0x7fff0000);
+	CHECK(Mhook_Unhook((PVOID *)&originals[0]));
+
+	for (int i = 0; i < nTaken; i++)
+		VirtualFree(taken[i], 0, MEM_RELEASE);
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	if (!code.ok())
+		return testExit("mhook_place");
+
+	generate(code);
+	testManyHooks();
+	testBlocksReleased();
+	testStaleMap(code);
+	return testExit("mhook_place");
+}
+
+/* End of File */
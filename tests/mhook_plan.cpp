@@ -0,0 +1,190 @@
+/*
+ * Traktouch Linux tests: hooking from a plan made ahead of time
+ *
+ * A plan holds what hooking a function takes, so the hook can later be set without disassembling
+ * anything. It is only used if the function still has the bytes the plan was made for, and only
+ * if the plan itself is consistent: the right version, instructions that cover the overwritten
+ * bytes, and relocations that stay inside their instructions. Everything else is refused.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "disasm-lib/disasm.h"
+#include "codegen.h"
+#include "test.h"
+
+/* Plans are relative to a module, so the functions have to be in the executable */
+extern "C" int planAdd(int a, int b);
+extern "C" int planRipRelative(int a, int b);
+extern "C" int planData;
+
+asm(".pushsection .text\n"
+	".p2align 4\n"
+	"planAdd:\n"
+	"	lea (%rdi,%rsi), %eax\n"
+	"	add $0, %eax\n"
+	"	ret\n"
+	".p2align 4\n"
+	"planRipRelative:\n"
+	"	mov planData(%rip), %eax\n"
+	"	add %edi, %eax\n"
+	"	ret\n"
+	".popsection\n"
+	".pushsection .data\n"
+	"planData:\n"
+	"	.long 1000\n"
+	".popsection\n");
+
+/* MHOOKS_RELOC_IPREL and MHOOKS_RELOC_LOOP in mhook.cpp */
+#define RELOC_IPREL 1
+#define RELOC_LOOP 5
+
+static TestFunction original;
+
+static int hookFunction(int a, int b)
+{
+	return original(a, b) * 10 + 1;
+}
+
+/* Counts how often mhook starts disassembling something */
+typedef BOOL (*InitDisassemblerFunction)(DISASSEMBLER *disassembler, ARCHITECTURE_TYPE architecture);
+static InitDisassemblerFunction origInitDisassembler;
+static int disassemblies;
+
+static BOOL initDisassemblerHook(DISASSEMBLER *disassembler, ARCHITECTURE_TYPE architecture)
+{
+	disassemblies++;
+	return origInitDisassembler(disassembler, architecture);
+}
+
+/* Hook fn from the plan without disassembling it, check it and unhook it */
+static void checkPlan(const char *what, TestFunction fn, const MHOOK_PLAN &plan, int a, int b, int expected)
+{
+	int failures = testFailures;
+	disassemblies = 0;
+	original = fn;
+	CHECK(Mhook_SetHookFromPlan((PVOID *)&original, (PVOID)hookFunction, 0, &plan));
+	CHECK_EQ(disassemblies, 0);
+	CHECK_EQ(fn(a, b), expected * 10 + 1);
+	CHECK_EQ(original(a, b), expected);
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	CHECK(original == fn);
+	CHECK_EQ(fn(a, b), expected);
+	if (testFailures != failures)
+		fprintf(stderr, "... in %s\n", what);
+}
+
+/* The plan has to be turned down, and leave the function alone */
+static void checkRefused(const char *what, TestFunction fn, const MHOOK_PLAN &plan)
+{
+	int failures = testFailures;
+	BYTE before[16];
+	memcpy(before, (PVOID)fn, sizeof(before));
+	original = fn;
+	CHECK(!Mhook_SetHookFromPlan((PVOID *)&original, (PVOID)hookFunction, 0, &plan));
+	CHECK(original == fn);
+	CHECK(!memcmp(before, (PVOID)fn, sizeof(before)));
+	if (testFailures != failures)
+		fprintf(stderr, "... in %s\n", what);
+}
+
+static void testPlans()
+{
+	MHOOK_PLAN plan, ripPlan;
+	CHECK(Mhook_PlanHook((PVOID)planAdd, &plan));
+	CHECK(Mhook_PlanHook((PVOID)planRipRelative, &ripPlan));
+	CHECK_EQ(plan.dwVersion, MHOOK_PLAN_VERSION);
+	HMODULE module = NULL;
+	CHECK(GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)planAdd, &module));
+	CHECK_EQ(plan.dwRva, (PBYTE)planAdd - (PBYTE)module);
+	CHECK_EQ(plan.cbOverwrite, 6);
+	CHECK_EQ(plan.nInstructions, 2);
+	CHECK_EQ(ripPlan.instructions[0].bReloc, RELOC_IPREL);
+
+	origInitDisassembler = InitDisassembler;
+	CHECK(Mhook_SetHook((PVOID *)&origInitDisassembler, (PVOID)initDisassemblerHook));
+
+	checkPlan("plan", planAdd, plan, 2, 3, 5);
+	checkPlan("IP-relative plan", planRipRelative, ripPlan, 2, 0, 1002);
+
+	/* A plan for one function doesn't do for another */
+	checkRefused("another function", planRipRelative, plan);
+
+	MHOOK_PLAN damaged = plan;
+	damaged.codeExpected[1] ^= 0xff;
+	checkRefused("code changed", planAdd, damaged);
+
+	damaged = plan;
+	damaged.dwVersion++;
+	checkRefused("version", planAdd, damaged);
+
+	damaged = plan;
+	damaged.bInstallMode = 3;
+	checkRefused("install mode", planAdd, damaged);
+
+	damaged = plan;
+	damaged.instructions[0].bReloc = RELOC_LOOP + 1;
+	checkRefused("relocation kind", planAdd, damaged);
+
+	damaged = ripPlan;
+	damaged.instructions[0].bDispOffset = damaged.instructions[0].cbLength - 3;
+	checkRefused("displacement past the instruction", planRipRelative, damaged);
+
+	damaged = plan;
+	damaged.instructions[1].bOffset++;
+	checkRefused("gap between instructions", planAdd, damaged);
+
+	damaged = plan;
+	damaged.instructions[1].cbLength++;
+	checkRefused("instructions past the overwritten bytes", planAdd, damaged);
+
+	damaged = plan;
+	damaged.nInstructions = 1;
+	checkRefused("instructions short of the overwritten bytes", planAdd, damaged);
+
+	damaged = plan;
+	damaged.nInstructions = MHOOK_PLAN_MAX_INSTRUCTIONS + 1;
+	checkRefused("too many instructions", planAdd, damaged);
+
+	/* The damaged plans didn't break anything */
+	checkPlan("plan again", planAdd, plan, -7, 3, -4);
+
+	CHECK(Mhook_Unhook((PVOID *)&origInitDisassembler));
+}
+
+/* Code outside a module can't be planned for */
+static void testNoModule(CodeBuffer &code)
+{
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x8d, 0x04, 0x37 });                /* lea eax, [rdi+rsi] */
+	code.emit({ 0x83, 0xc0, 0x00 });                /* add eax, 0 */
+	code.emit({ 0xc3 });                            /* ret */
+	MHOOK_PLAN plan;
+	CHECK(!Mhook_PlanHook((PVOID)fn, &plan));
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	testPlans();
+	testNoModule(code);
+	return testExit("mhook_plan");
+}
+
+/* End of File */
@@ -0,0 +1,157 @@
+/*
+ * Traktouch Linux tests: when mhook frees what unhooking leaves behind
+ *
+ * Unhooked trampolines are retired and freed in batches, with all threads suspended to make
+ * sure none is still in them. Adding and removing chained hooks on a function that is patched
+ * atomically must never suspend threads, so the chains those replace don't set off a batch.
+ * The jump a hot-patch hook leaves in the padding leads into its trampoline until the batch
+ * that frees the trampoline puts the padding back.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+#define N_FILLERS 40
+
+static TestFunction original, chained;
+static TestFunction fillers[N_FILLERS];
+
+static int hookFunction(int a, int b)
+{
+	return original(a, b) * 10 + 1;
+}
+
+static int chainedHook(int a, int b)
+{
+	return chained(a, b) + 1000;
+}
+
+static int negate(int a, int b)
+{
+	return -a;
+}
+
+/* mov eax, 5; add eax, edi; ret: the first instruction takes the whole jump */
+static TestFunction generateAtomic(CodeBuffer &code)
+{
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0xb8, 0x05, 0x00, 0x00, 0x00 });
+	code.emit({ 0x01, 0xf8, 0xc3 });
+	return fn;
+}
+
+/* int3 padding; mov edi, edi; lea eax, [rdi+5]; ret */
+static TestFunction generateHotPatch(CodeBuffer &code)
+{
+	TestFunction fn = (TestFunction)code.function(8);
+	code.emit({ 0x8b, 0xff, 0x8d, 0x47, 0x05, 0xc3 });
+	return fn;
+}
+
+static ULONGLONG suspensions()
+{
+	MHOOK_TIMINGS timings;
+	Mhook_GetTimings(&timings);
+	return timings.nSuspensions;
+}
+
+/* Hook and unhook enough other functions for a batch of retired trampolines to be freed */
+static void retireMany()
+{
+	for (int i = 0; i < N_FILLERS; i++) {
+		TestFunction fn = fillers[i];
+		CHECK(Mhook_SetHook((PVOID *)&fn, (PVOID)negate));
+		CHECK(Mhook_Unhook((PVOID *)&fn));
+	}
+}
+
+static void testChainsDontSuspend(CodeBuffer &code)
+{
+	TestFunction fn = generateAtomic(code);
+	ULONGLONG before = suspensions();
+	original = fn;
+	CHECK(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction));
+	for (int i = 0; i < 100; i++) {
+		chained = fn;
+		CHECK(Mhook_SetHook((PVOID *)&chained, (PVOID)chainedHook));
+		CHECK_EQ(fn(2, 0), 1071);
+		CHECK(Mhook_Unhook((PVOID *)&chained));
+		CHECK_EQ(fn(2, 0), 71);
+	}
+	CHECK_EQ(suspensions(), before);
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	CHECK_EQ(fn(2, 0), 7);
+	CHECK_EQ(suspensions(), before);
+}
+
+static void testHotPatchPadding(CodeBuffer &code)
+{
+	TestFunction fn = generateHotPatch(code);
+	PBYTE padding = (PBYTE)fn - 5;
+
+	original = fn;
+	CHECK(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction));
+	CHECK_EQ(padding[0], 0xe9);
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	CHECK_EQ(fn(2, 0), 7);
+	/* The trampoline is retired, and the padding still leads into it */
+	CHECK_EQ(padding[0], 0xe9);
+
+	ULONGLONG before = suspensions();
+	retireMany();
+	CHECK(suspensions() > before);
+	for (int i = 0; i < 5; i++)
+		CHECK_EQ(padding[i], 0xcc);
+
+	/* Hooked again, the function is a hot-patch point again */
+	original = fn;
+	CHECK(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction));
+	CHECK_EQ(((PBYTE)fn)[0], 0xeb);
+	CHECK_EQ(padding[0], 0xe9);
+	CHECK(Mhook_Unhook((PVOID *)&original));
+
+	/* Until that trampoline is freed, hooking it again has to go without the padding */
+	original = fn;
+	CHECK(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction));
+	CHECK_EQ(((PBYTE)fn)[0], 0xe9);
+	CHECK_EQ(fn(2, 0), 71);
+	CHECK_EQ(original(2, 0), 7);
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	retireMany();
+	for (int i = 0; i < 5; i++)
+		CHECK_EQ(padding[i], 0xcc);
+	CHECK_EQ(fn(2, 0), 7);
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	if (!code.ok())
+		return testExit("mhook_reclaim");
+
+	for (int i = 0; i < N_FILLERS; i++)
+		fillers[i] = generateAtomic(code);
+	testChainsDontSuspend(code);
+	testHotPatchPadding(code);
+	return testExit("mhook_reclaim");
+}
+
+/* End of File */
@@ -0,0 +1,218 @@
+/*
+ * Traktouch Linux tests: mhook moving relative branches and RIP-relative operands
+ *
+ * Each case is a generated function whose overwritten bytes hold one kind of instruction that
+ * has to be rewritten in the trampoline. The hooked function has to give the original results
+ * through the trampoline for every input, and unhooking has to restore the original bytes.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+static const int inputs[] = { -3, -1, 0, 1, 4 };
+#define N_INPUTS int(_countof(inputs))
+
+static TestFunction original;
+
+static int hookFunction(int a, int b)
+{
+	return original(a, b) * 10 + 1;
+}
+
+/* Hook fn, check it through the hook and the trampoline, unhook it and check it's back to normal */
+static void checkRelocation(const char *what, TestFunction fn)
+{
+	int expected[N_INPUTS][N_INPUTS];
+	for (int i = 0; i < N_INPUTS; i++)
+		for (int j = 0; j < N_INPUTS; j++)
+			expected[i][j] = fn(inputs[i], inputs[j]);
+	BYTE before[16];
+	memcpy(before, (PVOID)fn, sizeof(before));
+
+	original = fn;
+	if (!Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction)) {
+		fprintf(stderr, "%s: can't hook\n", what);
+		CHECK(false);
+		return;
+	}
+	int failures = testFailures;
+	for (int i = 0; i < N_INPUTS; i++) {
+		for (int j = 0; j < N_INPUTS; j++) {
+			CHECK_EQ(fn(inputs[i], inputs[j]), expected[i][j] * 10 + 1);
+			CHECK_EQ(original(inputs[i], inputs[j]), expected[i][j]);
+		}
+	}
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	CHECK(original == fn);
+	CHECK(!memcmp(before, (PVOID)fn, sizeof(before)));
+	CHECK_EQ(fn(inputs[0], inputs[1]), expected[0][1]);
+	if (testFailures != failures)
+		fprintf(stderr, "... in %s\n", what);
+}
+
+/* mov eax, value; ret */
+static void emitReturn(CodeBuffer &code, BYTE value)
+{
+	code.emit({ 0xb8, value, 0x00, 0x00, 0x00 });  /* mov eax, value */
+	code.emit({ 0xc3 });                            /* ret */
+}
+
+static void testConditionalJumps(CodeBuffer &code)
+{
+	static const char *names[16] = {
+		"jo", "jno", "jb", "jae", "je", "jne", "jbe", "ja", "js", "jns", "jp", "jnp", "jl", "jge", "jle", "jg"
+	};
+	char what[32];
+
+	for (BYTE cc = 0; cc < 16; cc++) {
+		/* cmp edi, esi; jcc rel8 taken; return 0; taken: return 1 */
+		TestFunction fn = (TestFunction)code.function();
+		code.emit({ 0x39, 0xf7, BYTE(0x70 | cc), 0x06 });
+		emitReturn(code, 0);
+		emitReturn(code, 1);
+		snprintf(what, sizeof(what), "%s rel8", names[cc]);
+		checkRelocation(what, fn);
+
+		/* The same with jcc rel32 */
+		fn = (TestFunction)code.function();
+		code.emit({ 0x39, 0xf7, 0x0f, BYTE(0x80 | cc) });
+		code.emit32(6);
+		emitReturn(code, 0);
+		emitReturn(code, 1);
+		snprintf(what, sizeof(what), "%s rel32", names[cc]);
+		checkRelocation(what, fn);
+	}
+
+	/* A branch back to code in front of the function: return 7 if a < b */
+	PBYTE target = code.function();
+	emitReturn(code, 7);
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x39, 0xf7, 0x7c, BYTE(target - (code.here() + 4)) });
+	emitReturn(code, 0);
+	checkRelocation("jl backwards", fn);
+
+	/* A branch to the next instruction, which moves into the trampoline as well */
+	fn = (TestFunction)code.function();
+	code.emit({ 0x85, 0xff, 0x74, 0x00 });          /* test edi, edi; jz next */
+	code.emit({ 0xb8, 0x05, 0x00, 0x00, 0x00 });    /* mov eax, 5 */
+	code.emit({ 0x01, 0xf8, 0xc3 });                /* add eax, edi; ret */
+	checkRelocation("jz inside the overwritten bytes", fn);
+}
+
+static void testJumpsAndCalls(CodeBuffer &code)
+{
+	/* xor eax, eax; jmp rel32 to lea eax, [rdi+7]; ret */
+	PBYTE target = code.function();
+	code.emit({ 0x8d, 0x47, 0x07, 0xc3 });
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x31, 0xc0, 0xe9 });
+	code.emitRel32(target);
+	checkRelocation("jmp rel32", fn);
+
+	/* A jmp rel8 ends the function after four bytes, which is too short to hook */
+	fn = (TestFunction)code.function();
+	code.emit({ 0x31, 0xc0, 0xeb, 0x00 });
+	code.emit({ 0x8d, 0x47, 0x07, 0xc3 });
+	TestFunction hooked = fn;
+	CHECK(!Mhook_SetHook((PVOID *)&hooked, (PVOID)hookFunction));
+	CHECK_EQ(fn(1, 0), 8);
+
+	/* call rel32 to lea eax, [rdi+3]; ret; then add eax, 1 */
+	PBYTE helper = code.function();
+	code.emit({ 0x8d, 0x47, 0x03, 0xc3 });
+	fn = (TestFunction)code.function();
+	code.emit({ 0xe8 });
+	code.emitRel32(helper);
+	code.emit({ 0x83, 0xc0, 0x01, 0xc3 });
+	checkRelocation("call rel32", fn);
+}
+
+static void testLoops(CodeBuffer &code)
+{
+	static const struct {
+		const char *name;
+		BYTE opcode;
+	} loops[] = {
+		{ "loopne", 0xe0 }, { "loope", 0xe1 }, { "loop", 0xe2 }, { "jecxz", 0xe3 },
+	};
+
+	for (int i = 0; i < int(_countof(loops)); i++) {
+		/* mov ecx, edi; cmp edi, esi; loop taken; return 1; taken: return 2 */
+		TestFunction fn = (TestFunction)code.function();
+		code.emit({ 0x89, 0xf9, 0x39, 0xf7, loops[i].opcode, 0x06 });
+		emitReturn(code, 1);
+		emitReturn(code, 2);
+		checkRelocation(loops[i].name, fn);
+	}
+}
+
+static void testRipRelative(CodeBuffer &code)
+{
+	/* mov eax, [rip+d]; add eax, edi; ret */
+	PBYTE data = code.data(1000);
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x8b, 0x05 });
+	code.emitRel32(data);
+	code.emit({ 0x01, 0xf8, 0xc3 });
+	checkRelocation("mov eax, [rip+d]", fn);
+
+	/* lea rax, [rip+d]; mov eax, [rax]; add eax, edi; ret */
+	data = code.data(77);
+	fn = (TestFunction)code.function();
+	code.emit({ 0x48, 0x8d, 0x05 });
+	code.emitRel32(data);
+	code.emit({ 0x8b, 0x00, 0x01, 0xf8, 0xc3 });
+	checkRelocation("lea rax, [rip+d]", fn);
+
+	/* An immediate behind the displacement: cmp dword [rip+d], 5; sete al; movzx eax, al; ret */
+	data = code.data(5);
+	fn = (TestFunction)code.function();
+	code.emit({ 0x83, 0x3d });
+	code.emit32(INT32(data - (code.here() + 5)));
+	code.emit({ 0x05 });
+	code.emit({ 0x0f, 0x94, 0xc0, 0x0f, 0xb6, 0xc0, 0xc3 });
+	CHECK_EQ(fn(0, 0), 1);
+	checkRelocation("cmp dword [rip+d], imm8", fn);
+
+	/* ... where the hooked function has to keep seeing the data change */
+	original = fn;
+	CHECK(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction));
+	*(INT32 *)data = 6;
+	CHECK_EQ(fn(0, 0), 1);
+	*(INT32 *)data = 5;
+	CHECK_EQ(fn(0, 0), 11);
+	CHECK(Mhook_Unhook((PVOID *)&original));
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	if (!code.ok())
+		return testExit("mhook_reloc");
+
+	testConditionalJumps(code);
+	testJumpsAndCalls(code);
+	testLoops(code);
+	testRipRelative(code);
+	return testExit("mhook_reloc");
+}
+
+/* End of File */
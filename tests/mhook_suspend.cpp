@@ -0,0 +1,111 @@
+/*
+ * Traktouch Linux tests: hooking while another thread can't be looked at
+ *
+ * Before mhook patches code byte by byte, it suspends the other threads and checks that none of
+ * them is in the middle of that code. A thread whose registers can't be read could be anywhere,
+ * so such a hook has to fail rather than take the chance. Jumps written atomically don't care
+ * where the other threads are and still go in.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+static TestFunction original;
+static TestFunction volatile workerFunction;
+static volatile bool stopWorker;
+static volatile long workerCalls, workerBadResults;
+
+static int hookFunction(int a, int b)
+{
+	return original(a, b) * 10 + 1;
+}
+
+static void *worker(void *)
+{
+	while (!stopWorker) {
+		int result = workerFunction(1, 2);
+		if (result != 3 && result != 31)
+			workerBadResults++;
+		workerCalls++;
+	}
+	return NULL;
+}
+
+static void checkHook(const char *what, TestFunction fn, bool hookable)
+{
+	int failures = testFailures;
+	BYTE before[16];
+	memcpy(before, (PVOID)fn, sizeof(before));
+
+	original = fn;
+	CHECK_EQ(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction), hookable);
+	if (hookable) {
+		CHECK_EQ(fn(1, 2), 31);
+		CHECK(Mhook_Unhook((PVOID *)&original));
+	}
+	CHECK(original == fn);
+	CHECK(!memcmp(before, (PVOID)fn, sizeof(before)));
+	CHECK_EQ(fn(1, 2), 3);
+	if (testFailures != failures)
+		fprintf(stderr, "... in %s\n", what);
+}
+
+static void testFailClosed(CodeBuffer &code)
+{
+	/* The first instruction is shorter than the jump, so a thread could stop right behind it */
+	TestFunction suspend = (TestFunction)code.function();
+	code.emit({ 0x8d, 0x04, 0x37 });                /* lea eax, [rdi+rsi] */
+	code.emit({ 0x83, 0xc0, 0x00 });                /* add eax, 0 */
+	code.emit({ 0xc3 });                            /* ret */
+
+	/* Here it is as long as the jump, which then goes in with one write */
+	TestFunction atomic = (TestFunction)code.function();
+	code.emit({ 0x8d, 0x84, 0x37 });                /* lea eax, [rdi+rsi+0] */
+	code.emit32(0);
+	code.emit({ 0xc3 });                            /* ret */
+
+	workerFunction = suspend;
+	pthread_t thread;
+	CHECK_EQ(pthread_create(&thread, NULL, worker, NULL), 0);
+	while (!workerCalls)
+		Sleep(1);
+
+	win32FailThreadContext = TRUE;
+	checkHook("suspend, no context", suspend, false);
+	checkHook("atomic, no context", atomic, true);
+	win32FailThreadContext = FALSE;
+	checkHook("suspend", suspend, true);
+	checkHook("atomic", atomic, true);
+
+	stopWorker = true;
+	pthread_join(thread, NULL);
+	CHECK_EQ(workerBadResults, 0);
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	testFailClosed(code);
+	return testExit("mhook_suspend");
+}
+
+/* End of File */
@@ -0,0 +1,114 @@
+/*
+ * Traktouch Linux tests: switching hooks off and on
+ *
+ * A hook set with MHOOK_SWITCHABLE gets a gate in front of it: switched off, calls to the
+ * function go straight to the original code, switched on, they reach the hook again. Only the
+ * hook that owns the gate can be switched; the others refuse.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+static TestFunction original, original2;
+static int hookCalls;
+
+static int hookFunction(int a, int b)
+{
+	hookCalls++;
+	return original(a, b) * 10 + 1;
+}
+
+static int hookFunction2(int a, int b)
+{
+	return original2(a, b) * 10 + 2;
+}
+
+/* lea eax, [rdi+rsi]; ret, padded out to something mhook can hook */
+static TestFunction emitAdd(CodeBuffer &code)
+{
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x8d, 0x04, 0x37 });                /* lea eax, [rdi+rsi] */
+	code.emit({ 0x83, 0xc0, 0x00 });                /* add eax, 0 */
+	code.emit({ 0xc3 });                            /* ret */
+	return fn;
+}
+
+static void testSwitch(CodeBuffer &code)
+{
+	TestFunction fn = emitAdd(code);
+	hookCalls = 0;
+	original = fn;
+	CHECK(Mhook_SetHookEx((PVOID *)&original, (PVOID)hookFunction, MHOOK_SWITCHABLE));
+	CHECK_EQ(fn(2, 3), 51);
+	CHECK_EQ(hookCalls, 1);
+
+	CHECK(Mhook_EnableHook((PVOID)original, FALSE));
+	CHECK_EQ(fn(2, 3), 5);
+	CHECK_EQ(hookCalls, 1);
+	CHECK_EQ(original(2, 3), 5);
+
+	/* Switching off twice is fine */
+	CHECK(Mhook_EnableHook((PVOID)original, FALSE));
+	CHECK_EQ(fn(2, 3), 5);
+
+	CHECK(Mhook_EnableHook((PVOID)original, TRUE));
+	CHECK_EQ(fn(2, 3), 51);
+	CHECK_EQ(hookCalls, 2);
+
+	/* Hooks chained on top have no switch of their own */
+	original2 = fn;
+	CHECK(Mhook_SetHook((PVOID *)&original2, (PVOID)hookFunction2));
+	CHECK(!Mhook_EnableHook((PVOID)original2, FALSE));
+	CHECK(Mhook_Unhook((PVOID *)&original2));
+	CHECK_EQ(fn(2, 3), 51);
+
+	/* Unhooking a switched off hook leaves the function as it was */
+	CHECK(Mhook_EnableHook((PVOID)original, FALSE));
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	CHECK(original == fn);
+	CHECK_EQ(fn(2, 3), 5);
+	CHECK(!Mhook_EnableHook((PVOID)original, TRUE));
+	CHECK_EQ(fn(2, 3), 5);
+	CHECK_EQ(hookCalls, 3);
+}
+
+static void testNotSwitchable(CodeBuffer &code)
+{
+	TestFunction fn = emitAdd(code);
+	hookCalls = 0;
+	original = fn;
+	CHECK(Mhook_SetHook((PVOID *)&original, (PVOID)hookFunction));
+	CHECK(!Mhook_EnableHook((PVOID)original, FALSE));
+	CHECK_EQ(fn(2, 3), 51);
+	CHECK_EQ(hookCalls, 1);
+	CHECK(Mhook_Unhook((PVOID *)&original));
+	CHECK_EQ(fn(2, 3), 5);
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	testSwitch(code);
+	testNotSwitchable(code);
+	return testExit("mhook_switch");
+}
+
+/* End of File */
@@ -0,0 +1,190 @@
+/*
+ * Traktouch Linux tests: hooking and unhooking several functions in one transaction
+ *
+ * A transaction applies whatever it can of its queued operations under one suspension and tells
+ * the caller which ones went through. Failed operations, and every operation of an aborted
+ * transaction, leave their function pointers and the functions' code alone. While a transaction
+ * is open, it belongs to the thread that began it and nobody else is held up.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "codegen.h"
+#include "test.h"
+
+static TestFunction original1, original2, original3;
+
+static int hook1(int a, int b) { return original1(a, b) * 10 + 1; }
+static int hook2(int a, int b) { return original2(a, b) * 10 + 2; }
+static int hook3(int a, int b) { return original3(a, b) * 10 + 3; }
+
+/* lea eax, [rdi+rsi]; ret, padded out to something mhook can hook */
+static TestFunction emitAdd(CodeBuffer &code)
+{
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x8d, 0x04, 0x37 });                /* lea eax, [rdi+rsi] */
+	code.emit({ 0x83, 0xc0, 0x00 });                /* add eax, 0 */
+	code.emit({ 0xc3 });                            /* ret */
+	return fn;
+}
+
+/* A jmp rel8 ends the function after four bytes, which is too short to hook */
+static TestFunction emitShort(CodeBuffer &code)
+{
+	TestFunction fn = (TestFunction)code.function();
+	code.emit({ 0x31, 0xc0, 0xeb, 0x00 });          /* xor eax, eax; jmp next */
+	code.emit({ 0x8d, 0x47, 0x07, 0xc3 });          /* lea eax, [rdi+7]; ret */
+	return fn;
+}
+
+static void testMixed(CodeBuffer &code)
+{
+	TestFunction fn1 = emitAdd(code), fn2 = emitShort(code), fn3 = emitAdd(code), fn4 = emitAdd(code);
+	BYTE before2[8], before4[8];
+	memcpy(before2, (PVOID)fn2, sizeof(before2));
+	memcpy(before4, (PVOID)fn4, sizeof(before4));
+
+	/* Hook, fail to hook, unhook something that was never hooked, hook */
+	original1 = fn1;
+	original2 = fn2;
+	TestFunction unhooked = fn4;
+	original3 = fn3;
+	BOOL results[4] = { -1, -1, -1, -1 };
+	CHECK(Mhook_BeginTransaction());
+	CHECK(Mhook_TransactionSetHook((PVOID *)&original1, (PVOID)hook1, &results[0]));
+	CHECK(Mhook_TransactionSetHook((PVOID *)&original2, (PVOID)hook2, &results[1]));
+	CHECK(Mhook_TransactionUnhook((PVOID *)&unhooked, &results[2]));
+	CHECK(Mhook_TransactionSetHook((PVOID *)&original3, (PVOID)hook3, &results[3]));
+
+	/* Nothing happens before the commit */
+	CHECK(original1 == fn1);
+	CHECK(original3 == fn3);
+	CHECK_EQ(results[0], -1);
+	CHECK_EQ(fn1(2, 3), 5);
+
+	CHECK_EQ(Mhook_CommitTransaction(), 2);
+	CHECK_EQ(results[0], TRUE);
+	CHECK_EQ(results[1], FALSE);
+	CHECK_EQ(results[2], FALSE);
+	CHECK_EQ(results[3], TRUE);
+
+	CHECK(original1 != fn1);
+	CHECK_EQ(fn1(2, 3), 51);
+	CHECK(original2 == fn2);
+	CHECK(!memcmp(before2, (PVOID)fn2, sizeof(before2)));
+	CHECK_EQ(fn2(1, 0), 8);
+	CHECK(unhooked == fn4);
+	CHECK(!memcmp(before4, (PVOID)fn4, sizeof(before4)));
+	CHECK(original3 != fn3);
+	CHECK_EQ(fn3(2, 3), 53);
+
+	/* The transaction is over */
+	CHECK(!Mhook_TransactionUnhook((PVOID *)&original1, NULL));
+	CHECK_EQ(Mhook_CommitTransaction(), 0);
+
+	CHECK(Mhook_Unhook((PVOID *)&original1));
+	CHECK(Mhook_Unhook((PVOID *)&original3));
+	CHECK_EQ(fn1(2, 3), 5);
+	CHECK_EQ(fn3(2, 3), 5);
+}
+
+static void testAbort(CodeBuffer &code)
+{
+	TestFunction fn1 = emitAdd(code), fn3 = emitAdd(code);
+	BYTE before1[8], before3[8];
+	memcpy(before1, (PVOID)fn1, sizeof(before1));
+	memcpy(before3, (PVOID)fn3, sizeof(before3));
+
+	original1 = fn1;
+	original3 = fn3;
+	BOOL results[2] = { -1, -1 };
+	CHECK(Mhook_BeginTransaction());
+	CHECK(Mhook_TransactionSetHook((PVOID *)&original1, (PVOID)hook1, &results[0]));
+	CHECK(Mhook_TransactionSetHook((PVOID *)&original3, (PVOID)hook3, &results[1]));
+	Mhook_AbortTransaction();
+
+	CHECK_EQ(results[0], FALSE);
+	CHECK_EQ(results[1], FALSE);
+	CHECK(original1 == fn1);
+	CHECK(original3 == fn3);
+	CHECK(!memcmp(before1, (PVOID)fn1, sizeof(before1)));
+	CHECK(!memcmp(before3, (PVOID)fn3, sizeof(before3)));
+	CHECK_EQ(fn1(2, 3), 5);
+	CHECK_EQ(Mhook_CommitTransaction(), 0);
+	CHECK(original1 == fn1);
+}
+
+struct OtherThread {
+	TestFunction fn;
+	BOOL hooked, queued, begun;
+};
+
+static void *otherThread(void *arg)
+{
+	OtherThread *other = (OtherThread *)arg;
+	original2 = other->fn;
+	other->hooked = Mhook_SetHook((PVOID *)&original2, (PVOID)hook2);
+	other->queued = Mhook_TransactionUnhook((PVOID *)&original2, NULL);
+	other->begun = Mhook_BeginTransaction();
+	return NULL;
+}
+
+/* An open transaction doesn't hold up hooks elsewhere, and doesn't take operations from them */
+static void testOtherThreads(CodeBuffer &code)
+{
+	TestFunction fn1 = emitAdd(code);
+	OtherThread other = { emitAdd(code), -1, -1, -1 };
+
+	original1 = fn1;
+	BOOL result = -1;
+	CHECK(Mhook_BeginTransaction());
+	CHECK(!Mhook_BeginTransaction());
+	CHECK(Mhook_TransactionSetHook((PVOID *)&original1, (PVOID)hook1, &result));
+
+	pthread_t thread;
+	CHECK_EQ(pthread_create(&thread, NULL, otherThread, &other), 0);
+	pthread_join(thread, NULL);
+	CHECK_EQ(other.hooked, TRUE);
+	CHECK_EQ(other.queued, FALSE);
+	CHECK_EQ(other.begun, FALSE);
+	CHECK_EQ(other.fn(2, 3), 52);
+
+	/* Only the hook queued by this thread is committed */
+	CHECK_EQ(Mhook_CommitTransaction(), 1);
+	CHECK_EQ(result, TRUE);
+	CHECK_EQ(fn1(2, 3), 51);
+	CHECK_EQ(other.fn(2, 3), 52);
+
+	CHECK(Mhook_Unhook((PVOID *)&original1));
+	CHECK(Mhook_Unhook((PVOID *)&original2));
+	CHECK_EQ(fn1(2, 3), 5);
+	CHECK_EQ(other.fn(2, 3), 5);
+}
+
+int main()
+{
+	CodeBuffer code;
+	CHECK(code.ok());
+	testMixed(code);
+	testAbort(code);
+	testOtherThreads(code);
+	return testExit("mhook_transaction");
+}
+
+/* End of File */
@@ -0,0 +1,166 @@
+/*
+ * Traktouch Linux tests: hooking virtual functions
+ *
+ * A virtual function hook swaps one entry of a class's virtual function table, which every
+ * object of that class calls through, while objects of other classes in the hierarchy keep
+ * their own tables. An instance hook gives one object a copy of the table to hook instead, and
+ * the copy still tells the object's type. Slots past the end of the table are refused.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <typeinfo>
+#include <windows.h>
+#include "mhook-lib/mhook.h"
+#include "test.h"
+
+class Shape {
+public:
+	explicit Shape(int size) : size(size) {}
+	virtual int area(int) { return 0; }
+	virtual int sides() { return 0; }
+protected:
+	int size;
+};
+
+class Square : public Shape {
+public:
+	explicit Square(int size) : Shape(size) {}
+	int area(int scale) override { return size * size * scale; }
+	int sides() override { return 4; }
+};
+
+class Triangle : public Shape {
+public:
+	explicit Triangle(int size) : Shape(size) {}
+	int area(int scale) override { return size * size * scale / 2; }
+	int sides() override { return 3; }
+};
+
+/* Where the functions are in the table, and how many there are */
+#define SLOT_AREA 0
+#define SLOT_SIDES 1
+#define SHAPE_SLOTS 2
+
+/* Called out of line, so the calls go through the table */
+static __attribute__((noinline)) int area(Shape *shape, int scale)
+{
+	return shape->area(scale);
+}
+
+static __attribute__((noinline)) int sides(Shape *shape)
+{
+	return shape->sides();
+}
+
+typedef int (*AreaFunction)(Shape *self, int scale);
+
+static AreaFunction origClassArea, origInstanceArea;
+
+static int classAreaHook(Shape *self, int scale)
+{
+	return origClassArea(self, scale) + 1000;
+}
+
+static int instanceAreaHook(Shape *self, int scale)
+{
+	return origInstanceArea(self, scale) + 2000;
+}
+
+static void testClass()
+{
+	Square a(2), b(3);
+	Triangle t(4);
+
+	CHECK(Mhook_SetVtableHook(&a, SLOT_AREA, SHAPE_SLOTS, (PVOID *)&origClassArea, (PVOID)classAreaHook));
+	CHECK(origClassArea != NULL);
+	CHECK_EQ(area(&a, 1), 1004);
+	CHECK_EQ(area(&b, 2), 1018);
+	CHECK_EQ(area(&t, 1), 8);
+	CHECK_EQ(sides(&a), 4);
+	CHECK_EQ(origClassArea(&b, 1), 9);
+
+	/* Objects made after hooking use the same table */
+	Square c(1);
+	CHECK_EQ(area(&c, 5), 1005);
+
+	CHECK(Mhook_UnhookVtable((PVOID *)&origClassArea));
+	CHECK(!Mhook_UnhookVtable((PVOID *)&origClassArea));
+	CHECK_EQ(area(&a, 1), 4);
+	CHECK_EQ(area(&b, 2), 18);
+	CHECK_EQ(area(&c, 5), 5);
+}
+
+static void testInstance()
+{
+	Square a(2), b(3);
+	Triangle t(4);
+	Shape *shape = &a;
+
+	CHECK(Mhook_SetInstanceHook(&a, SLOT_AREA, SHAPE_SLOTS, (PVOID *)&origInstanceArea, (PVOID)instanceAreaHook));
+	CHECK_EQ(area(&a, 1), 2004);
+	CHECK_EQ(area(&b, 1), 9);
+	CHECK_EQ(area(&t, 1), 8);
+	CHECK_EQ(sides(&a), 4);
+	CHECK(typeid(*shape) == typeid(Square));
+	CHECK(dynamic_cast<Square *>(shape) == &a);
+	CHECK(dynamic_cast<Triangle *>(shape) == NULL);
+
+	/* A class hook passes by the object that has a copy of the table */
+	CHECK(Mhook_SetVtableHook(&a, SLOT_AREA, SHAPE_SLOTS, (PVOID *)&origClassArea, (PVOID)classAreaHook));
+	CHECK_EQ(area(&a, 1), 2004);
+	CHECK_EQ(area(&b, 1), 1009);
+	CHECK(Mhook_UnhookVtable((PVOID *)&origClassArea));
+
+	CHECK(Mhook_UnhookVtable((PVOID *)&origInstanceArea));
+	CHECK_EQ(area(&a, 1), 4);
+	CHECK_EQ(area(&b, 1), 9);
+	CHECK_EQ(sides(&a), 4);
+	CHECK(typeid(*shape) == typeid(Square));
+}
+
+static void testOutOfRange()
+{
+	Square a(2);
+	Shape *shape = &a;
+	PVOID vtable = *(PVOID *)&a;
+	AreaFunction unchanged = NULL;
+
+	CHECK(!Mhook_SetVtableHook(&a, SHAPE_SLOTS, SHAPE_SLOTS, (PVOID *)&unchanged, (PVOID)classAreaHook));
+	CHECK(!Mhook_SetInstanceHook(&a, SHAPE_SLOTS, SHAPE_SLOTS, (PVOID *)&unchanged, (PVOID)instanceAreaHook));
+	CHECK(unchanged == NULL);
+	CHECK(*(PVOID *)&a == vtable);
+	CHECK_EQ(area(&a, 1), 4);
+	CHECK_EQ(sides(shape), 4);
+
+	/* An object's copy is only as long as the first instance hook asked for */
+	CHECK(Mhook_SetInstanceHook(&a, SLOT_AREA, SLOT_AREA + 1, (PVOID *)&origInstanceArea, (PVOID)instanceAreaHook));
+	CHECK(!Mhook_SetInstanceHook(&a, SLOT_SIDES, SHAPE_SLOTS, (PVOID *)&unchanged, (PVOID)instanceAreaHook));
+	CHECK(unchanged == NULL);
+	CHECK_EQ(area(&a, 1), 2004);
+	CHECK(Mhook_UnhookVtable((PVOID *)&origInstanceArea));
+	CHECK_EQ(area(&a, 1), 4);
+}
+
+int main()
+{
+	testClass();
+	testInstance();
+	testOutOfRange();
+	return testExit("mhook_vtable");
+}
+
+/* End of File */
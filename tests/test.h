@@ -0,0 +1,57 @@
+/*
+ * Traktouch Linux tests: the bare minimum of a test framework
+ *
+ * Every test program is a main() that calls its test functions one after the other. CHECK
+ * complains about a failed condition and carries on, testExit reports and sets the exit code.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+static int testChecks;
+static int testFailures;
+
+#define CHECK(cond) do { \
+		testChecks++; \
+		if (!(cond)) { \
+			testFailures++; \
+			fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #cond); \
+		} \
+	} while (0)
+
+/* Like CHECK, for integers, and shows both values */
+#define CHECK_EQ(a, b) do { \
+		long long _a = (long long)(a), _b = (long long)(b); \
+		testChecks++; \
+		if (_a != _b) { \
+			testFailures++; \
+			fprintf(stderr, "%s:%d: %s: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, __func__, #a, #b, _a, _b); \
+		} \
+	} while (0)
+
+static inline int testExit(const char *name)
+{
+	printf("%s: %d checks, %d failed\n", name, testChecks, testFailures);
+	return testFailures ? 1 : 0;
+}
+
+#endif /* __TEST_H__ */
+
+/* End of File */
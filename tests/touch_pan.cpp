@@ -0,0 +1,170 @@
+/*
+ * Traktouch Linux tests: the pan recognizer
+ *
+ * Plays recorded contact streams into the recognizer. One finger is never a gesture; two are,
+ * from the moment the second comes down until the last one lifts. Nothing scrolls while their
+ * midpoint jitters within the threshold, and once it's over, the motion that got it there is
+ * reported along with everything after it, so the scroll starts with the first frame of motion
+ * and adds up to how far the fingers moved.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "touch.h"
+#include "test.h"
+
+#define THRESHOLD 4
+
+/* One contact report as it came in, and what the recognizer should have made of it */
+struct Record {
+	TouchContactType type;
+	uint32_t id;
+	short x, y;
+	bool gesture;
+	int deltaY;
+};
+
+#define D TOUCH_CONTACT_DOWN
+#define M TOUCH_CONTACT_MOVE
+#define U TOUCH_CONTACT_UP
+
+/* One finger swiping is a touch, however far it goes */
+static const Record swipe[] = {
+	{ D, 1, 400, 600, false },
+	{ M, 1, 400, 560, false },
+	{ M, 1, 400, 400, false },
+	{ U, 1, 400, 400, false },
+};
+
+/* Two fingers resting with some jitter: a gesture, but no scrolling */
+static const Record rest[] = {
+	{ D, 1, 400, 600, false },
+	{ D, 2, 450, 604, true },
+	{ M, 1, 401, 602, true },
+	{ M, 2, 449, 601, true },
+	{ M, 1, 400, 598, true },
+	{ U, 1, 400, 598, true },
+	{ U, 2, 449, 601, true },
+};
+
+/* Two fingers flicking down, reported alternately as the digitizer does */
+static const Record flick[] = {
+	{ D, 1, 400, 300, false },
+	{ D, 2, 450, 310, true },                /* midpoint 305 */
+	{ M, 1, 400, 304, true },                /* 307, within the threshold */
+	{ M, 2, 450, 318, true, 6 },             /* 311: over it, and the way there counts */
+	{ M, 1, 400, 330, true, 13 },
+	{ M, 2, 450, 350, true, 16 },
+	{ M, 1, 400, 362, true, 16 },
+	{ M, 2, 450, 364, true, 7 },
+	{ U, 1, 400, 362, true },
+	{ M, 2, 450, 380, true },                /* one finger left: still a gesture, no more pan */
+	{ U, 2, 450, 380, true },
+	{ D, 3, 420, 200, false },               /* a new touch afterwards is a touch again */
+	{ U, 3, 420, 200, false },
+};
+
+/*
+ * A third finger restarts the gesture from where the fingers are. Lifting one ends the pan, and
+ * the two left start another once they move past the threshold.
+ */
+static const Record third[] = {
+	{ D, 1, 400, 500, false },
+	{ D, 2, 440, 500, true },
+	{ M, 1, 400, 490, true, -5 },
+	{ M, 2, 440, 490, true, -5 },
+	{ D, 3, 480, 520, true },                /* midpoint 500 */
+	{ M, 3, 480, 517, true },                /* 499 */
+	{ U, 3, 480, 517, true },
+	{ M, 1, 400, 470, true, -10 },           /* two again, over the threshold from 500 */
+	{ M, 2, 440, 470, true, -10 },
+	{ U, 1, 400, 470, true },
+	{ U, 2, 440, 470, true },
+};
+
+/* Contacts the recognizer has never seen, moving or lifting, don't disturb it */
+static const Record unknown[] = {
+	{ M, 9, 100, 100, false },
+	{ U, 9, 100, 100, false },
+	{ D, 1, 400, 500, false },
+	{ M, 9, 100, 200, false },
+	{ D, 2, 440, 500, true },
+	{ M, 9, 100, 300, true },
+	{ M, 1, 400, 520, true, 10 },
+	{ U, 1, 400, 520, true },
+	{ U, 2, 440, 500, true },
+};
+
+/* Play a stream; returns the total scroll distance */
+static int play(const char *name, const Record *records, int count)
+{
+	PanRecognizer recognizer;
+	recognizer.configure(THRESHOLD);
+
+	int total = 0;
+	for (int i = 0; i < count; i++) {
+		const Record &r = records[i];
+		int deltaY = 12345;
+		bool gesture = recognizer.processContact(r.type, r.id, r.x, r.y, deltaY);
+		if (gesture != r.gesture || deltaY != r.deltaY)
+			fprintf(stderr, "%s, record %d:\n", name, i);
+		CHECK_EQ(gesture, r.gesture);
+		CHECK_EQ(deltaY, r.deltaY);
+		total += deltaY;
+	}
+	CHECK(!recognizer.inGesture());
+	return total;
+}
+
+#define PLAY(stream) play(#stream, stream, sizeof(stream) / sizeof(stream[0]))
+
+static void testStreams()
+{
+	CHECK_EQ(PLAY(swipe), 0);
+	CHECK_EQ(PLAY(rest), 0);
+
+	/* The midpoint went from 305 to 363; nothing of that is lost */
+	CHECK_EQ(PLAY(flick), 363 - 305);
+
+	CHECK_EQ(PLAY(third), -30);
+	CHECK_EQ(PLAY(unknown), 10);
+}
+
+/* More fingers than it keeps track of: the extra ones are ignored, and the gesture still ends */
+static void testTooManyFingers()
+{
+	PanRecognizer recognizer;
+	recognizer.configure(THRESHOLD);
+	int deltaY;
+
+	for (uint32_t id = 0; id < TOUCH_MAX_CONTACTS + 2; id++)
+		CHECK_EQ(recognizer.processContact(TOUCH_CONTACT_DOWN, id, short(100 + 10 * id), 300, deltaY), id > 0);
+	CHECK(recognizer.processContact(TOUCH_CONTACT_MOVE, TOUCH_MAX_CONTACTS + 1, 0, 0, deltaY));
+	CHECK_EQ(deltaY, 0);
+	for (uint32_t id = TOUCH_MAX_CONTACTS + 2; id-- > 0; )
+		CHECK(recognizer.processContact(TOUCH_CONTACT_UP, id, 0, 0, deltaY));
+	CHECK(!recognizer.inGesture());
+	CHECK(!recognizer.processContact(TOUCH_CONTACT_DOWN, 1, 100, 100, deltaY));
+}
+
+int main()
+{
+	testStreams();
+	testTooManyFingers();
+	return testExit("touch_pan");
+}
+
+/* End of File */
@@ -0,0 +1,127 @@
+/*
+ * Traktouch Linux tests: pointer input
+ *
+ * Plays recorded WM_POINTER streams into the pointer translation. The primary finger becomes the
+ * mouse, in client coordinates and with the button held from down to up; other fingers are dropped
+ * unless they make a gesture, which then turns into scrolling and cancels the touch.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "touch.h"
+#include "test.h"
+
+/* The Traktor window's client area on the screen */
+#define CLIENT_X 200
+#define CLIENT_Y 150
+
+/* One pointer message as it came in, and what it should have turned into */
+struct Record {
+	TouchContactType type;
+	uint32_t id;
+	bool primary;
+	short x, y;
+	TouchPointerAction action;
+	TouchEventType event;     /* for TOUCH_POINTER_MOUSE */
+	int panDelta;             /* for TOUCH_POINTER_PAN_MOVE */
+};
+
+#define D TOUCH_CONTACT_DOWN
+#define M TOUCH_CONTACT_MOVE
+#define U TOUCH_CONTACT_UP
+
+/* A finger going down, dragging and lifting */
+static const Record drag[] = {
+	{ D, 7, true,  600, 400, TOUCH_POINTER_MOUSE, TOUCH_EVENT_BUTTON_DOWN },
+	{ M, 7, true,  603, 398, TOUCH_POINTER_MOUSE, TOUCH_EVENT_MOUSE_MOVE },
+	{ M, 7, true,  610, 391, TOUCH_POINTER_MOUSE, TOUCH_EVENT_MOUSE_MOVE },
+	{ U, 7, true,  612, 390, TOUCH_POINTER_MOUSE, TOUCH_EVENT_BUTTON_UP },
+};
+
+/* A second finger comes down, they pan up together, and lift one after the other */
+static const Record pan[] = {
+	{ D, 1, true,  500, 500, TOUCH_POINTER_MOUSE,     TOUCH_EVENT_BUTTON_DOWN },
+	{ M, 1, true,  501, 500, TOUCH_POINTER_MOUSE,     TOUCH_EVENT_MOUSE_MOVE },
+	{ D, 2, false, 560, 504, TOUCH_POINTER_PAN_BEGIN },
+	{ M, 1, true,  501, 496, TOUCH_POINTER_PAN_MOVE,  TOUCH_EVENT_OTHER, 0 },
+	{ M, 2, false, 560, 496, TOUCH_POINTER_PAN_MOVE,  TOUCH_EVENT_OTHER, -6 },
+	{ M, 1, true,  501, 480, TOUCH_POINTER_PAN_MOVE,  TOUCH_EVENT_OTHER, -8 },
+	{ M, 2, false, 560, 480, TOUCH_POINTER_PAN_MOVE,  TOUCH_EVENT_OTHER, -8 },
+	{ U, 2, false, 560, 480, TOUCH_POINTER_PAN_END },
+	{ M, 1, true,  501, 470, TOUCH_POINTER_PAN_MOVE,  TOUCH_EVENT_OTHER, 0 },
+	{ U, 1, true,  501, 470, TOUCH_POINTER_PAN_END },
+	/* and then a plain tap again */
+	{ D, 3, true,  300, 200, TOUCH_POINTER_MOUSE,     TOUCH_EVENT_BUTTON_DOWN },
+	{ U, 3, true,  300, 200, TOUCH_POINTER_MOUSE,     TOUCH_EVENT_BUTTON_UP },
+};
+
+/* A palm resting on the screen while the other hand drags: the stray contact goes down after the lift */
+static const Record stray[] = {
+	{ D, 4, true,  400, 300, TOUCH_POINTER_MOUSE, TOUCH_EVENT_BUTTON_DOWN },
+	{ U, 4, true,  400, 300, TOUCH_POINTER_MOUSE, TOUCH_EVENT_BUTTON_UP },
+	{ D, 5, false, 900, 700, TOUCH_POINTER_DROP },
+	{ M, 5, false, 905, 700, TOUCH_POINTER_DROP },
+	{ U, 5, false, 905, 700, TOUCH_POINTER_DROP },
+};
+
+static void play(const char *name, const Record *records, int count)
+{
+	TouchPointerInput input;
+	input.configure(4);
+
+	for (int i = 0; i < count; i++) {
+		const Record &r = records[i];
+		TouchPointer pointer;
+		pointer.type = r.type;
+		pointer.id = r.id;
+		pointer.primary = r.primary;
+		pointer.x = r.x;
+		pointer.y = r.y;
+
+		TouchEvent event = TouchEvent();
+		event.type = TOUCH_EVENT_OTHER;
+		event.time = 1234;
+		int panDelta = 0;
+		TouchPointerAction action = input.translate(pointer, CLIENT_X, CLIENT_Y, event, panDelta);
+		if (action != r.action)
+			fprintf(stderr, "%s, record %d:\n", name, i);
+		CHECK_EQ(action, r.action);
+		CHECK_EQ(event.time, 1234);
+
+		if (r.action == TOUCH_POINTER_MOUSE) {
+			CHECK_EQ(event.type, r.event);
+			CHECK(event.fromTouch);
+			CHECK_EQ(event.x, r.x - CLIENT_X);
+			CHECK_EQ(event.y, r.y - CLIENT_Y);
+			CHECK_EQ(event.keys, r.type == TOUCH_CONTACT_UP ? 0 : TOUCH_KEY_LBUTTON);
+		}
+		else {
+			CHECK_EQ(event.type, TOUCH_EVENT_OTHER);
+			CHECK_EQ(panDelta, r.panDelta);
+		}
+	}
+	CHECK(!input.inGesture());
+}
+
+int main()
+{
+	play("drag", drag, sizeof(drag) / sizeof(drag[0]));
+	play("pan", pan, sizeof(pan) / sizeof(pan[0]));
+	play("stray", stray, sizeof(stray) / sizeof(stray[0]));
+	return testExit("touch_pointer");
+}
+
+/* End of File */
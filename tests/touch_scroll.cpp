@@ -0,0 +1,203 @@
+/*
+ * Traktouch Linux tests: the scroll engine
+ *
+ * The wheel distance has to follow the fingers tick by tick however the pan reports are spread
+ * over the ticks, bunched up microseconds apart included. Once the fingers lift, the motion since
+ * the last tick still goes out, then scrolling coasts at the speed they were moving at, never
+ * faster than the limit, and dies down; fingers that rested before lifting don't throw anything.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "touch.h"
+#include "test.h"
+
+#include <stdlib.h>
+
+#define CADENCE 16000
+
+/* One wheel unit per pixel, no acceleration: what comes out is how far the fingers moved */
+static void configure(ScrollEngine &engine)
+{
+	ScrollConfig config;
+	config.scale = 1;
+	config.accelDeadZone = 1000;
+	config.accelExponent = 1;
+	config.cadence = CADENCE;
+	config.inertia = 300000;
+	engine.configure(config);
+}
+
+/* Tick until coasting stops; returns the distance scrolled, and checks it only ever slows down */
+static int coast(ScrollEngine &engine, uint64_t &time)
+{
+	int total = 0, last = 0;
+	for (int i = 0; i < 1000 && engine.isActive(); i++) {
+		time += CADENCE;
+		int scroll = engine.tick(time);
+		if (i > 0)
+			CHECK(abs(scroll) <= abs(last) + 1);
+		last = scroll;
+		total += scroll;
+	}
+	CHECK(!engine.isActive());
+	return total;
+}
+
+/* Pan at 16 pixels per tick for ten ticks, reported in the given number of pieces per tick */
+static int pan(ScrollEngine &engine, int pieces, uint64_t spacing, int *coasted)
+{
+	configure(engine);
+	uint64_t time = 0;
+	engine.begin(time);
+
+	int total = 0;
+	for (int i = 0; i < 10; i++) {
+		for (int piece = 0; piece < pieces; piece++)
+			engine.move(16 / pieces, time + 1000 + piece * spacing);
+		time += CADENCE;
+		int scroll = engine.tick(time);
+		if (i > 0)
+			CHECK_EQ(scroll, 16);
+		total += scroll;
+	}
+	engine.end(time);
+	*coasted = coast(engine, time);
+	return total;
+}
+
+static void testCadence()
+{
+	ScrollEngine engine;
+	int coasted1, coasted4, coastedBunched;
+	CHECK_EQ(pan(engine, 1, 0, &coasted1), 160);
+	CHECK_EQ(pan(engine, 4, 3000, &coasted4), 160);
+	CHECK_EQ(pan(engine, 4, 1, &coastedBunched), 160);
+
+	/* 1000 pixels per second decaying over 300 ms: 300 pixels, plus half a tick for the first one */
+	CHECK(coasted1 > 280 && coasted1 <= 310);
+	CHECK_EQ(coasted4, coasted1);
+	CHECK_EQ(coastedBunched, coasted1);
+}
+
+/* Reports microseconds apart mustn't make for a huge throw */
+static void testBunchedReports()
+{
+	ScrollEngine engine;
+	configure(engine);
+	engine.begin(0);
+	engine.move(10, 15000);
+	engine.move(10, 15001);
+	engine.move(10, 15002);
+	CHECK_EQ(engine.tick(CADENCE), 30);
+	engine.end(CADENCE + 500);
+
+	/* Half of 30 pixels per tick after one tick of averaging, for the time constant and a tick */
+	uint64_t time = CADENCE;
+	int coasted = coast(engine, time);
+	CHECK(coasted > 0);
+	CHECK(coasted <= 15 * (300000 / CADENCE + 1));
+}
+
+/* A glitch in the reports is clamped to the fastest possible throw */
+static void testClamp()
+{
+	ScrollEngine engine;
+	configure(engine);
+	engine.begin(0);
+	engine.move(30000, 1000);
+	CHECK_EQ(engine.tick(CADENCE), 255);   /* beyond the table the last entry applies */
+	engine.end(CADENCE);
+
+	uint64_t time = CADENCE + CADENCE;
+	int first = engine.tick(time);
+	CHECK(first > 0);
+	CHECK(first <= SCROLL_MAX_SPEED * CADENCE / 1000000);
+}
+
+/* Motion after the last tick still goes out once the fingers have lifted */
+static void testFlushOnRelease()
+{
+	ScrollEngine engine;
+	configure(engine);
+	engine.begin(0);
+	CHECK_EQ(engine.tick(CADENCE), 0);
+	engine.move(12, 20000);
+	engine.end(21000);
+	CHECK(engine.isActive());
+	CHECK_EQ(engine.tick(2 * CADENCE), 12);
+
+	/* There was no speed before that to coast on */
+	CHECK_EQ(engine.tick(3 * CADENCE), 0);
+	CHECK(!engine.isActive());
+}
+
+/* Fingers that stopped before lifting leave the list where it is */
+static void testRestBeforeRelease()
+{
+	ScrollEngine engine;
+	configure(engine);
+	uint64_t time = 0;
+	engine.begin(time);
+	for (int i = 0; i < 5; i++) {
+		engine.move(20, time + 1000);
+		time += CADENCE;
+		engine.tick(time);
+	}
+	for (int i = 0; i < 5; i++) {
+		time += CADENCE;
+		CHECK_EQ(engine.tick(time), 0);
+	}
+	engine.end(time);
+	CHECK_EQ(coast(engine, time), 0);
+}
+
+/* Fingers coming down again stop the coasting dead */
+static void testCatch()
+{
+	ScrollEngine engine;
+	configure(engine);
+	uint64_t time = 0;
+	engine.begin(time);
+	for (int i = 0; i < 5; i++) {
+		engine.move(-20, time + 1000);
+		time += CADENCE;
+		engine.tick(time);
+	}
+	engine.end(time);
+	time += CADENCE;
+	CHECK(engine.tick(time) < 0);
+
+	engine.begin(time);
+	time += CADENCE;
+	CHECK_EQ(engine.tick(time), 0);
+	CHECK(engine.isActive());
+	engine.end(time);
+	CHECK_EQ(coast(engine, time), 0);
+}
+
+int main()
+{
+	testCadence();
+	testBunchedReports();
+	testClamp();
+	testFlushOnRelease();
+	testRestBeforeRelease();
+	testCatch();
+	return testExit("touch_scroll");
+}
+
+/* End of File */
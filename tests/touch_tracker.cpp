@@ -0,0 +1,485 @@
+/*
+ * Traktouch Linux tests: the touch tracker
+ *
+ * Feeds the tracker the events MessageHook would and checks what Traktor gets to see: the touch
+ * goes down as a move with the button following behind it, the jump at the end of Windows' dead
+ * zone is taken out, and where Traktor moves the cursor back the following moves are corrected.
+ * Deferred buttons go out at their deadline, from a timer event if nothing else comes along,
+ * and with adaptive deferral a region that repainted quickly before doesn't wait that long.
+ * Drag moves are held back to one per frame, and the last one held back goes out at the frame's
+ * end or in front of the button. The smoothing filter settles on a step without overshooting,
+ * faster the faster the finger moves, and its lag doesn't show up as a jump when Traktor moves
+ * the cursor back.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "touch.h"
+#include "test.h"
+
+#include <string.h>
+
+#define KEY_LBUTTON 1  /* MK_LBUTTON */
+
+static TouchEvent makeEvent(TouchEventType type, short x, short y, uint64_t time, bool fromTouch = true)
+{
+	TouchEvent event = TouchEvent();
+	event.type = type;
+	event.fromTouch = fromTouch;
+	event.x = x;
+	event.y = y;
+	event.keys = type == TOUCH_EVENT_BUTTON_UP ? 0 : KEY_LBUTTON;
+	event.time = time;
+	return event;
+}
+
+static TouchConfig makeConfig()
+{
+	TouchConfig config;
+	memset(&config, 0, sizeof(config));
+	config.smoothSpeedCutoff = 1;
+	return config;
+}
+
+/* Run one event through the tracker and check where it ended up */
+static void process(TouchTracker &tracker, TouchEvent &event, TouchOutput &out,
+	TouchEventType type, short x, short y, uint64_t time, TouchEventType expectType, short expectX, short expectY)
+{
+	event = makeEvent(type, x, y, time);
+	tracker.processEvent(event, out);
+	CHECK_EQ(event.type, expectType);
+	CHECK_EQ(event.x, expectX);
+	CHECK_EQ(event.y, expectY);
+}
+
+/* Filter a step from 0 to 100 sampled every 10 ms, and return after how many samples it is within a pixel */
+static int stepResponse(float minCutoff, float beta, short *first)
+{
+	TouchFilter filter;
+	filter.configure(minCutoff, beta, 1.0f);
+	filter.reset(0, 0, 0);
+
+	short previous = 0;
+	for (int i = 1; i <= 1000; i++) {
+		short x = 100, y = 0;
+		filter.apply(x, y, uint64_t(i) * 10000);
+		if (i == 1)
+			*first = x;
+		CHECK(x >= previous);
+		CHECK(x <= 100);
+		CHECK_EQ(y, 0);
+		previous = x;
+		if (x >= 99)
+			return i;
+	}
+	return -1;
+}
+
+static void testFilterStep()
+{
+	/* At 1 Hz and a 10 ms step the first sample moves by 1 / (1 + 1 / (2 pi 0.01)), about 6 % */
+	short first;
+	int slow = stepResponse(1.0f, 0, &first);
+	CHECK_EQ(first, 6);
+	CHECK(slow > 50);
+
+	/* A higher cutoff settles faster, and so does a finger that moves fast */
+	int fast = stepResponse(10.0f, 0, &first);
+	CHECK(fast > 0 && fast < slow);
+	int adaptive = stepResponse(1.0f, 0.1f, &first);
+	CHECK(adaptive > 0 && adaptive < slow);
+	CHECK(first > 6);
+
+	/* Two samples at the same time tell nothing new */
+	TouchFilter filter;
+	filter.configure(1.0f, 0, 1.0f);
+	filter.reset(0, 0, 0);
+	short x = 100, y = 100;
+	filter.apply(x, y, 10000);
+	CHECK_EQ(x, 6);
+	x = 200;
+	y = 200;
+	filter.apply(x, y, 10000);
+	CHECK_EQ(x, 6);
+	CHECK_EQ(y, 6);
+}
+
+/* Traktor only ever sees smoothed positions; correcting for the cursor must not make it jump */
+static void testSmoothedDrag()
+{
+	TouchTracker tracker;
+	TouchConfig config = makeConfig();
+	config.pointerInput = true;
+	config.smoothMinCutoff = 1.0f;
+	tracker.configure(config);
+	TouchEvent event;
+	TouchOutput out;
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 0, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	short lastX = 100;
+	for (int i = 1; i <= 5; i++) {
+		event = makeEvent(TOUCH_EVENT_MOUSE_MOVE, 100 + 10 * i, 100, uint64_t(i) * 10000);
+		tracker.processEvent(event, out);
+		CHECK(event.x > lastX);
+		CHECK(event.x < 100 + 10 * i);
+		lastX = event.x;
+	}
+
+	/* Traktor moves the cursor back to where it saw the touch last; the finger is further along */
+	CHECK(tracker.setCursorPos(100, 100, 150, 100));
+	event = makeEvent(TOUCH_EVENT_MOUSE_MOVE, 150, 100, 60000);
+	tracker.processEvent(event, out);
+	CHECK(event.x >= 100);
+	CHECK(event.x <= 100 + 150 - lastX);
+}
+
+static void testMouseUntouched()
+{
+	TouchTracker tracker;
+	tracker.configure(makeConfig());
+
+	TouchEvent event = makeEvent(TOUCH_EVENT_BUTTON_DOWN, 10, 20, 1000, false);
+	TouchOutput out;
+	tracker.processEvent(event, out);
+	CHECK_EQ(event.type, TOUCH_EVENT_BUTTON_DOWN);
+	CHECK_EQ(event.x, 10);
+	CHECK_EQ(event.keys, KEY_LBUTTON);
+	CHECK_EQ(out.count, 0);
+	CHECK(!tracker.isTouching());
+	CHECK(!tracker.setCursorPos(0, 0, 10, 20));
+}
+
+static void testTouchDown()
+{
+	TouchTracker tracker;
+	tracker.configure(makeConfig());
+	TouchEvent event;
+	TouchOutput out;
+
+	/* The button down turns into a move, the button goes right behind it */
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 1000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	CHECK_EQ(event.keys, 0);
+	CHECK_EQ(out.count, 1);
+	CHECK_EQ(out.events[0].type, TOUCH_EVENT_BUTTON_DOWN);
+	CHECK_EQ(out.events[0].x, 100);
+	CHECK_EQ(out.events[0].y, 100);
+	CHECK_EQ(out.events[0].keys, KEY_LBUTTON);
+	CHECK(tracker.isTouching());
+	uint64_t deadline;
+	CHECK(!tracker.nextDeadline(deadline));
+
+	/* Mouse emulation reports the first move 20 pixels over; Traktor doesn't see the jump */
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 120, 100, 2000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 125, 97, 3000, TOUCH_EVENT_MOUSE_MOVE, 105, 97);
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_UP, 125, 97, 4000, TOUCH_EVENT_BUTTON_UP, 105, 97);
+	CHECK_EQ(out.count, 0);
+	CHECK(!tracker.isTouching());
+}
+
+static void testCursorCorrection()
+{
+	TouchTracker tracker;
+	tracker.configure(makeConfig());
+	TouchEvent event;
+	TouchOutput out;
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 1000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 120, 100, 2000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 130, 90, 3000, TOUCH_EVENT_MOUSE_MOVE, 110, 90);
+
+	/* Traktor puts the cursor back where the drag started; the finger carries on from there */
+	CHECK(tracker.setCursorPos(100, 100, 130, 90));
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 135, 90, 4000, TOUCH_EVENT_MOUSE_MOVE, 105, 100);
+	CHECK(tracker.setCursorPos(100, 100, 135, 90));
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 135, 95, 5000, TOUCH_EVENT_MOUSE_MOVE, 100, 105);
+
+	/* Other mouse messages from the touch get the same correction */
+	process(tracker, event, out, TOUCH_EVENT_MOUSE, 140, 95, 6000, TOUCH_EVENT_MOUSE, 105, 105);
+
+	/* Once the finger is up, Traktor moves the cursor for real */
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_UP, 140, 95, 7000, TOUCH_EVENT_BUTTON_UP, 105, 105);
+	CHECK(!tracker.setCursorPos(100, 100, 140, 95));
+}
+
+/* Touches straight from the digitizer have no dead zone to make up for */
+static void testPointerInput()
+{
+	TouchTracker tracker;
+	TouchConfig config = makeConfig();
+	config.pointerInput = true;
+	tracker.configure(config);
+	TouchEvent event;
+	TouchOutput out;
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 1000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	CHECK_EQ(out.count, 1);
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 103, 100, 2000, TOUCH_EVENT_MOUSE_MOVE, 103, 100);
+	CHECK(tracker.setCursorPos(100, 100, 103, 100));
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 104, 101, 3000, TOUCH_EVENT_MOUSE_MOVE, 101, 101);
+}
+
+/* The button down waits for its deadline, and the timer event is what sends it */
+static void testDeferral()
+{
+	TouchTracker tracker;
+	TouchConfig config = makeConfig();
+	config.deferButtons = 30000;
+	tracker.configure(config);
+	TouchEvent event;
+	TouchOutput out;
+	uint64_t deadline;
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 1000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	CHECK_EQ(out.count, 0);
+	CHECK(tracker.nextDeadline(deadline));
+	CHECK_EQ(deadline, 31000);
+
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 120, 100, 20000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	CHECK_EQ(out.count, 0);
+	process(tracker, event, out, TOUCH_EVENT_TIMER, 0, 0, 30999, TOUCH_EVENT_DISCARD, 0, 0);
+	CHECK_EQ(out.count, 0);
+	CHECK(tracker.nextDeadline(deadline));
+	CHECK_EQ(deadline, 31000);
+
+	process(tracker, event, out, TOUCH_EVENT_TIMER, 0, 0, 31000, TOUCH_EVENT_DISCARD, 0, 0);
+	CHECK_EQ(out.count, 1);
+	CHECK_EQ(out.events[0].type, TOUCH_EVENT_BUTTON_DOWN);
+	CHECK_EQ(out.events[0].x, 100);
+	CHECK_EQ(out.events[0].y, 100);
+	CHECK_EQ(out.events[0].keys, KEY_LBUTTON);
+	CHECK(!tracker.nextDeadline(deadline));
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_UP, 125, 100, 40000, TOUCH_EVENT_BUTTON_UP, 105, 100);
+	CHECK_EQ(out.count, 0);
+}
+
+/* A tap shorter than the deferral: the button up waits behind the down */
+static void testDeferredTap()
+{
+	TouchTracker tracker;
+	TouchConfig config = makeConfig();
+	config.deferButtons = 30000;
+	tracker.configure(config);
+	TouchEvent event;
+	TouchOutput out;
+	uint64_t deadline;
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 1000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_UP, 100, 100, 5000, TOUCH_EVENT_DISCARD, 100, 100);
+	CHECK_EQ(out.count, 0);
+	CHECK(!tracker.isTouching());
+	CHECK(tracker.nextDeadline(deadline));
+	CHECK_EQ(deadline, 31000);
+
+	/* Whatever message comes along late carries them out, and goes through itself */
+	TouchEvent other = makeEvent(TOUCH_EVENT_OTHER, 0, 0, 45000, false);
+	tracker.processEvent(other, out);
+	CHECK_EQ(other.type, TOUCH_EVENT_OTHER);
+	CHECK_EQ(out.count, 2);
+	CHECK_EQ(out.events[0].type, TOUCH_EVENT_BUTTON_DOWN);
+	CHECK_EQ(out.events[0].keys, KEY_LBUTTON);
+	CHECK_EQ(out.events[1].type, TOUCH_EVENT_BUTTON_UP);
+	CHECK_EQ(out.events[1].keys, 0);
+	CHECK_EQ(out.events[1].x, 100);
+	CHECK(!tracker.nextDeadline(deadline));
+}
+
+static TouchEvent makePaint(short left, short top, short right, short bottom, uint64_t time)
+{
+	TouchEvent event = makeEvent(TOUCH_EVENT_PAINT, left, top, time, false);
+	event.right = right;
+	event.bottom = bottom;
+	return event;
+}
+
+static void tap(TouchTracker &tracker, short x, short y, uint64_t time, uint64_t expectDeadline)
+{
+	TouchEvent event;
+	TouchOutput out;
+	uint64_t deadline;
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, x, y, time, TOUCH_EVENT_MOUSE_MOVE, x, y);
+	CHECK(tracker.nextDeadline(deadline));
+	CHECK_EQ(deadline, expectDeadline);
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_UP, x, y, time + 1000, TOUCH_EVENT_DISCARD, x, y);
+}
+
+static void finishTap(TouchTracker &tracker, uint64_t time)
+{
+	TouchEvent event;
+	TouchOutput out;
+	process(tracker, event, out, TOUCH_EVENT_TIMER, 0, 0, time, TOUCH_EVENT_DISCARD, 0, 0);
+	CHECK_EQ(out.count, 2);
+}
+
+/* Only a repaint of the touched spot tells how long Traktor needs there */
+static void testReadiness()
+{
+	TouchTracker tracker;
+	TouchConfig config = makeConfig();
+	config.deferButtons = 30000;
+	config.deferAdaptive = true;
+	tracker.configure(config);
+	TouchOutput out;
+
+	/* Nothing learned yet: the full delay. A meter across the window repaints first, then the button */
+	tap(tracker, 100, 100, 1000, 31000);
+	TouchEvent paint = makePaint(500, 0, 600, 400, 3000);
+	tracker.processEvent(paint, out);
+	paint = makePaint(90, 120, 140, 140, 9000);
+	tracker.processEvent(paint, out);
+	CHECK_EQ(out.count, 0);
+	finishTap(tracker, 31000);
+
+	/* The same region now waits for the 8 ms it took, plus a quarter */
+	tap(tracker, 70, 120, 100000, 110000);
+	paint = makePaint(0, 0, 1024, 768, 106000);
+	tracker.processEvent(paint, out);
+	finishTap(tracker, 110000);
+
+	/* A full repaint counts; the average moves towards it */
+	tap(tracker, 120, 70, 200000, 200000 + 7500 + 1875);
+	finishTap(tracker, 209375);
+
+	/* Other regions haven't learned anything */
+	tap(tracker, 300, 100, 300000, 330000);
+	paint = makePaint(0, 0, 128, 128, 301000);
+	tracker.processEvent(paint, out);
+	finishTap(tracker, 330000);
+	tap(tracker, 300, 100, 400000, 430000);
+	finishTap(tracker, 430000);
+}
+
+static void testCoalescing()
+{
+	TouchTracker tracker;
+	TouchConfig config = makeConfig();
+	config.coalesceMoves = 16000;
+	tracker.configure(config);
+	TouchEvent event;
+	TouchOutput out;
+	uint64_t deadline;
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 0, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	CHECK_EQ(out.count, 1);
+	CHECK(!tracker.nextDeadline(deadline));
+
+	/* The first move of a frame goes through, the others wait */
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 120, 100, 1000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 125, 100, 2000, TOUCH_EVENT_DISCARD, 105, 100);
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 130, 102, 3000, TOUCH_EVENT_DISCARD, 110, 102);
+	CHECK_EQ(out.count, 0);
+	CHECK(tracker.nextDeadline(deadline));
+	CHECK_EQ(deadline, 17000);
+
+	/* At the end of the frame the latest of them goes out */
+	process(tracker, event, out, TOUCH_EVENT_TIMER, 0, 0, 17000, TOUCH_EVENT_DISCARD, 0, 0);
+	CHECK_EQ(out.count, 1);
+	CHECK_EQ(out.events[0].type, TOUCH_EVENT_MOUSE_MOVE);
+	CHECK_EQ(out.events[0].x, 110);
+	CHECK_EQ(out.events[0].y, 102);
+	CHECK_EQ(out.events[0].keys, KEY_LBUTTON);
+	CHECK(!tracker.nextDeadline(deadline));
+
+	/* So does it when Traktor repaints before the deadline */
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 131, 102, 18000, TOUCH_EVENT_DISCARD, 111, 102);
+	TouchEvent paint = makeEvent(TOUCH_EVENT_PAINT, 0, 0, 20000, false);
+	tracker.processEvent(paint, out);
+	CHECK_EQ(paint.type, TOUCH_EVENT_PAINT);
+	CHECK_EQ(out.count, 1);
+	CHECK_EQ(out.events[0].x, 111);
+
+	/* A newer move at the start of a frame makes the held one pointless */
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 133, 102, 21000, TOUCH_EVENT_DISCARD, 113, 102);
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 134, 102, 40000, TOUCH_EVENT_MOUSE_MOVE, 114, 102);
+	CHECK_EQ(out.count, 0);
+
+	/* The button goes up behind the held move, which takes its place */
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 135, 103, 41000, TOUCH_EVENT_DISCARD, 115, 103);
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_UP, 136, 103, 42000, TOUCH_EVENT_MOUSE_MOVE, 115, 103);
+	CHECK_EQ(out.count, 1);
+	CHECK_EQ(out.events[0].type, TOUCH_EVENT_BUTTON_UP);
+	CHECK_EQ(out.events[0].x, 116);
+	CHECK_EQ(out.events[0].keys, 0);
+	CHECK(!tracker.isTouching());
+	CHECK(!tracker.nextDeadline(deadline));
+
+	/* Traktor moving the cursor back for that move is still taken as a correction */
+	CHECK(tracker.isCorrecting());
+	CHECK(tracker.setCursorPos(100, 100, 136, 103));
+
+	/* Mouse moves that aren't a touch drag aren't held back */
+	TouchEvent mouse = makeEvent(TOUCH_EVENT_MOUSE_MOVE, 50, 50, 43000, false);
+	tracker.processEvent(mouse, out);
+	CHECK(!tracker.isCorrecting());
+	CHECK(!tracker.setCursorPos(100, 100, 50, 50));
+	mouse = makeEvent(TOUCH_EVENT_MOUSE_MOVE, 51, 50, 43500, false);
+	tracker.processEvent(mouse, out);
+	CHECK_EQ(mouse.type, TOUCH_EVENT_MOUSE_MOVE);
+	CHECK_EQ(out.count, 0);
+}
+
+/* A second finger makes it a gesture: the touch's button goes back up */
+static void testCancel()
+{
+	TouchTracker tracker;
+	tracker.configure(makeConfig());
+	TouchEvent event;
+	TouchOutput out;
+
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 1000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	process(tracker, event, out, TOUCH_EVENT_MOUSE_MOVE, 120, 100, 2000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	tracker.cancelTouch(out);
+	CHECK(!tracker.isTouching());
+	CHECK_EQ(out.count, 1);
+	CHECK_EQ(out.events[0].type, TOUCH_EVENT_BUTTON_UP);
+	CHECK_EQ(out.events[0].x, 100);
+	CHECK_EQ(out.events[0].y, 100);
+
+	tracker.cancelTouch(out);
+	CHECK_EQ(out.count, 0);
+
+	/* or never goes down at all if it's still deferred */
+	TouchConfig config = makeConfig();
+	config.deferButtons = 30000;
+	tracker.configure(config);
+	process(tracker, event, out, TOUCH_EVENT_BUTTON_DOWN, 100, 100, 10000, TOUCH_EVENT_MOUSE_MOVE, 100, 100);
+	tracker.cancelTouch(out);
+	CHECK_EQ(out.count, 0);
+	uint64_t deadline;
+	CHECK(!tracker.nextDeadline(deadline));
+	process(tracker, event, out, TOUCH_EVENT_TIMER, 0, 0, 40000, TOUCH_EVENT_DISCARD, 0, 0);
+	CHECK_EQ(out.count, 0);
+}
+
+int main()
+{
+	testFilterStep();
+	testSmoothedDrag();
+	testMouseUntouched();
+	testTouchDown();
+	testCursorCorrection();
+	testPointerInput();
+	testDeferral();
+	testDeferredTap();
+	testReadiness();
+	testCoalescing();
+	testCancel();
+	return testExit("touch_tracker");
+}
+
+/* End of File */
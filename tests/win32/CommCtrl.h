@@ -0,0 +1,26 @@
+/*
+ * Traktouch Linux test shim: window subclassing, implemented in user32.cpp
+ */
+
+#ifndef __WIN32_SHIM_COMMCTRL_H__
+#define __WIN32_SHIM_COMMCTRL_H__
+
+#include <windows.h>
+
+typedef LRESULT (CALLBACK *SUBCLASSPROC)(HWND, UINT, WPARAM, LPARAM, UINT_PTR, DWORD_PTR);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+BOOL SetWindowSubclass(HWND hwnd, SUBCLASSPROC proc, UINT_PTR id, DWORD_PTR refData);
+BOOL RemoveWindowSubclass(HWND hwnd, SUBCLASSPROC proc, UINT_PTR id);
+LRESULT DefSubclassProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __WIN32_SHIM_COMMCTRL_H__ */
+
+/* End of File */
@@ -0,0 +1,7 @@
+/*
+ * Traktouch Linux test shim: compiler intrinsics come with <windows.h> (x86intrin.h)
+ */
+
+#include <windows.h>
+
+/* End of File */
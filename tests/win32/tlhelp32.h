@@ -0,0 +1,26 @@
+/*
+ * Traktouch Linux test shim: tool help snapshots
+ *
+ * mhook binds these functions at run time through GetProcAddress, so only the types live here.
+ */
+
+#ifndef __WIN32_SHIM_TLHELP32_H__
+#define __WIN32_SHIM_TLHELP32_H__
+
+#include <windows.h>
+
+#define TH32CS_SNAPTHREAD 0x00000004
+
+typedef struct {
+	DWORD dwSize;
+	DWORD cntUsage;
+	DWORD th32ThreadID;
+	DWORD th32OwnerProcessID;
+	LONG tpBasePri;
+	LONG tpDeltaPri;
+	DWORD dwFlags;
+} THREADENTRY32, *LPTHREADENTRY32;
+
+#endif /* __WIN32_SHIM_TLHELP32_H__ */
+
+/* End of File */
@@ -0,0 +1,15 @@
+/*
+ * Traktouch Linux test shim: the tablet PC message that turns off press-and-hold
+ */
+
+#ifndef __WIN32_SHIM_TPCSHRD_H__
+#define __WIN32_SHIM_TPCSHRD_H__
+
+#include <windows.h>
+
+#define WM_TABLET_QUERYSYSTEMGESTURESTATUS 0x02CC
+#define TABLET_DISABLE_PRESSANDHOLD 0x00000001
+
+#endif /* __WIN32_SHIM_TPCSHRD_H__ */
+
+/* End of File */
@@ -0,0 +1,665 @@
+/*
+ * Traktouch Linux test shim: windows, messages and timers behind <windows.h>
+ *
+ * One UI thread's worth of user32: windows with their subclass chains, a message queue that runs
+ * every message past the WH_GETMESSAGE hooks as it's retrieved, paint and timer messages made up
+ * when the queue is empty like Windows does, the cursor, gestures and pointers. Timer queue
+ * timers fire from the UI thread's waits rather than from a thread of their own.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <CommCtrl.h>
+
+#include <time.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+int win32SetCursorPosCalls;
+int win32OpenGestureHandles;
+
+static LONGLONG clockNow()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+/* Windows: a client area on the screen, a window procedure and the subclasses in front of it */
+struct Subclass {
+	SUBCLASSPROC proc;
+	UINT_PTR id;
+	DWORD_PTR refData;
+};
+
+struct Window {
+	wchar_t title[64];
+	WNDPROC proc;
+	RECT rect;
+	std::vector<Subclass> subclasses;   /* the last one installed is called first */
+	bool invalid;
+	RECT update;
+};
+
+static std::vector<Window *> windows;
+
+static Window *findWindow(HWND hwnd)
+{
+	for (Window *window : windows)
+		if ((HWND)window == hwnd)
+			return window;
+	return NULL;
+}
+
+HWND win32CreateWindow(LPCWSTR title, WNDPROC proc, int x, int y, int width, int height)
+{
+	Window *window = new Window();
+	wcsncpy(window->title, title, _countof(window->title) - 1);
+	window->proc = proc;
+	window->rect = { x, y, x + width, y + height };
+	windows.push_back(window);
+	return (HWND)window;
+}
+
+int GetWindowTextW(HWND hwnd, LPWSTR text, int size)
+{
+	Window *window = findWindow(hwnd);
+	if (!window || size <= 0)
+		return 0;
+	wcsncpy(text, window->title, size - 1);
+	text[size - 1] = 0;
+	return (int)wcslen(text);
+}
+
+BOOL GetWindowRect(HWND hwnd, LPRECT rect)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return FALSE;
+	*rect = window->rect;
+	return TRUE;
+}
+
+BOOL ClientToScreen(HWND hwnd, LPPOINT point)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return FALSE;
+	point->x += window->rect.left;
+	point->y += window->rect.top;
+	return TRUE;
+}
+
+BOOL ScreenToClient(HWND hwnd, LPPOINT point)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return FALSE;
+	point->x -= window->rect.left;
+	point->y -= window->rect.top;
+	return TRUE;
+}
+
+/*
+ * Subclassing. DefSubclassProc calls whatever is below the subclass procedure the thread is
+ * in right now, so it finds its way even after that one has removed itself.
+ */
+struct SubclassCall {
+	Window *window;
+	size_t index;
+};
+static thread_local SubclassCall currentSubclass;
+
+static LRESULT callSubclass(Window *window, size_t index, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	SubclassCall saved = currentSubclass;
+	currentSubclass = { window, index };
+	Subclass subclass = window->subclasses[index];
+	LRESULT result = subclass.proc((HWND)window, message, wParam, lParam, subclass.id, subclass.refData);
+	currentSubclass = saved;
+	return result;
+}
+
+static LRESULT callWindow(Window *window, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	if (window->subclasses.empty())
+		return window->proc((HWND)window, message, wParam, lParam);
+	return callSubclass(window, window->subclasses.size() - 1, message, wParam, lParam);
+}
+
+BOOL SetWindowSubclass(HWND hwnd, SUBCLASSPROC proc, UINT_PTR id, DWORD_PTR refData)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return FALSE;
+	for (Subclass &subclass : window->subclasses) {
+		if (subclass.proc == proc && subclass.id == id) {
+			subclass.refData = refData;
+			return TRUE;
+		}
+	}
+	window->subclasses.push_back({ proc, id, refData });
+	return TRUE;
+}
+
+BOOL RemoveWindowSubclass(HWND hwnd, SUBCLASSPROC proc, UINT_PTR id)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return FALSE;
+	for (size_t i = 0; i < window->subclasses.size(); i++) {
+		if (window->subclasses[i].proc == proc && window->subclasses[i].id == id) {
+			window->subclasses.erase(window->subclasses.begin() + i);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+LRESULT DefSubclassProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return 0;
+	size_t index = window->subclasses.size();
+	if (currentSubclass.window == window && currentSubclass.index < index)
+		index = currentSubclass.index;
+	if (!index)
+		return window->proc(hwnd, message, wParam, lParam);
+	return callSubclass(window, index - 1, message, wParam, lParam);
+}
+
+/* Painting: one update rectangle per window, growing to cover everything invalidated */
+BOOL InvalidateRect(HWND hwnd, LPCRECT rect, BOOL erase)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return FALSE;
+	RECT area = { 0, 0, window->rect.right - window->rect.left, window->rect.bottom - window->rect.top };
+	if (rect)
+		area = *rect;
+	if (!window->invalid)
+		window->update = area;
+	else {
+		window->update.left = std::min(window->update.left, area.left);
+		window->update.top = std::min(window->update.top, area.top);
+		window->update.right = std::max(window->update.right, area.right);
+		window->update.bottom = std::max(window->update.bottom, area.bottom);
+	}
+	window->invalid = true;
+	return TRUE;
+}
+
+BOOL ValidateRect(HWND hwnd, LPCRECT rect)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return FALSE;
+	if (!rect || (rect->left <= window->update.left && rect->top <= window->update.top &&
+		rect->right >= window->update.right && rect->bottom >= window->update.bottom))
+		window->invalid = false;
+	return TRUE;
+}
+
+BOOL GetUpdateRect(HWND hwnd, LPRECT rect, BOOL erase)
+{
+	Window *window = findWindow(hwnd);
+	if (!window || !window->invalid) {
+		if (rect)
+			*rect = { 0, 0, 0, 0 };
+		return FALSE;
+	}
+	if (rect)
+		*rect = window->update;
+	return TRUE;
+}
+
+/* The cursor; SetCursorPos is what the DLL hooks, so it counts the calls that got through */
+static POINT cursor;
+
+BOOL WINAPI SetCursorPos(int x, int y)
+{
+	cursor.x = x;
+	cursor.y = y;
+	win32SetCursorPosCalls++;
+	return TRUE;
+}
+
+BOOL GetCursorPos(LPPOINT point)
+{
+	*point = cursor;
+	return TRUE;
+}
+
+/* Timers: window timers turn into WM_TIMER when they're due, timer queue timers call back */
+struct WindowTimer {
+	HWND hwnd;
+	UINT_PTR id;
+	TIMERPROC proc;
+	LONGLONG due, period;
+};
+
+struct QueueTimer {
+	WAITORTIMERCALLBACK callback;
+	PVOID parameter;
+	LONGLONG due, period;
+	bool done;
+};
+
+static std::vector<WindowTimer> windowTimers;
+static std::vector<QueueTimer *> queueTimers;
+
+UINT_PTR SetTimer(HWND hwnd, UINT_PTR id, UINT elapse, TIMERPROC proc)
+{
+	LONGLONG period = LONGLONG(elapse) * 1000000;
+	for (WindowTimer &timer : windowTimers) {
+		if (timer.hwnd == hwnd && timer.id == id) {
+			timer.proc = proc;
+			timer.period = period;
+			timer.due = clockNow() + period;
+			return id;
+		}
+	}
+	windowTimers.push_back({ hwnd, id, proc, clockNow() + period, period });
+	return id;
+}
+
+BOOL KillTimer(HWND hwnd, UINT_PTR id)
+{
+	for (size_t i = 0; i < windowTimers.size(); i++) {
+		if (windowTimers[i].hwnd == hwnd && windowTimers[i].id == id) {
+			windowTimers.erase(windowTimers.begin() + i);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+BOOL CreateTimerQueueTimer(HANDLE *timer, HANDLE queue, WAITORTIMERCALLBACK callback, PVOID parameter,
+	DWORD dueTime, DWORD period, ULONG flags)
+{
+	QueueTimer *t = new QueueTimer();
+	t->callback = callback;
+	t->parameter = parameter;
+	t->due = clockNow() + LONGLONG(dueTime) * 1000000;
+	t->period = LONGLONG(period) * 1000000;
+	queueTimers.push_back(t);
+	*timer = t;
+	return TRUE;
+}
+
+BOOL DeleteTimerQueueTimer(HANDLE queue, HANDLE timer, HANDLE completionEvent)
+{
+	std::vector<QueueTimer *>::iterator it = std::find(queueTimers.begin(), queueTimers.end(), (QueueTimer *)timer);
+	if (it == queueTimers.end())
+		return FALSE;
+	delete *it;
+	queueTimers.erase(it);
+	return TRUE;
+}
+
+/* Run the timer queue timers that are due; they may add or delete timers while at it */
+static void fireQueueTimers()
+{
+	LONGLONG now = clockNow();
+	std::vector<QueueTimer *> due;
+	for (QueueTimer *timer : queueTimers)
+		if (!timer->done && timer->due <= now)
+			due.push_back(timer);
+
+	for (QueueTimer *timer : due) {
+		if (std::find(queueTimers.begin(), queueTimers.end(), timer) == queueTimers.end())
+			continue;
+		if (timer->period)
+			timer->due += timer->period;
+		else
+			timer->done = true;
+		timer->callback(timer->parameter, TRUE);
+	}
+}
+
+static bool nextTimer(LONGLONG &due)
+{
+	bool found = false;
+	for (const WindowTimer &timer : windowTimers) {
+		if (!found || timer.due < due)
+			due = timer.due;
+		found = true;
+	}
+	for (const QueueTimer *timer : queueTimers) {
+		if (timer->done)
+			continue;
+		if (!found || timer->due < due)
+			due = timer->due;
+		found = true;
+	}
+	return found;
+}
+
+BOOL win32RunTimers(LONGLONG until)
+{
+	LONGLONG due;
+	bool pending = nextTimer(due) && due <= until;
+	LONGLONG to = pending ? due : until;
+	if (win32ManualClock) {
+		if (to > win32ClockNow)
+			win32ClockNow = to;
+	}
+	else {
+		LONGLONG wait = to - clockNow();
+		if (wait > 0) {
+			struct timespec ts = { time_t(wait / 1000000000), long(wait % 1000000000) };
+			nanosleep(&ts, NULL);
+		}
+	}
+	fireQueueTimers();
+	return pending;
+}
+
+/* Hooks: the last one installed is called first, and CallNextHookEx goes on from the current one */
+struct Hook {
+	HOOKPROC proc;
+};
+static std::vector<Hook *> hooks;
+static thread_local size_t currentHook;
+
+static LRESULT callHooks(size_t below, int code, WPARAM wParam, LPARAM lParam)
+{
+	if (!below || below > hooks.size())
+		return 0;
+	size_t saved = currentHook;
+	currentHook = below - 1;
+	LRESULT result = hooks[below - 1]->proc(code, wParam, lParam);
+	currentHook = saved;
+	return result;
+}
+
+HHOOK SetWindowsHookExW(int idHook, HOOKPROC proc, HINSTANCE module, DWORD threadId)
+{
+	if (idHook != WH_GETMESSAGE)
+		return NULL;
+	Hook *hook = new Hook();
+	hook->proc = proc;
+	hooks.push_back(hook);
+	return (HHOOK)hook;
+}
+
+BOOL UnhookWindowsHookEx(HHOOK hook)
+{
+	std::vector<Hook *>::iterator it = std::find(hooks.begin(), hooks.end(), (Hook *)hook);
+	if (it == hooks.end())
+		return FALSE;
+	delete *it;
+	hooks.erase(it);
+	return TRUE;
+}
+
+LRESULT CallNextHookEx(HHOOK hook, int code, WPARAM wParam, LPARAM lParam)
+{
+	return callHooks(currentHook, code, wParam, lParam);
+}
+
+/*
+ * The message queue. Posted messages come before input, and only when there is neither does a
+ * window that needs painting get WM_PAINT, or a timer that's due WM_TIMER.
+ */
+struct QueuedMessage {
+	MSG msg;
+	LPARAM extraInfo;
+};
+static std::deque<QueuedMessage> posted, input;
+static LPARAM messageExtraInfo;
+
+static bool matches(const MSG &msg, HWND hwnd, UINT filterMin, UINT filterMax)
+{
+	return (!hwnd || msg.hwnd == hwnd) &&
+		((!filterMin && !filterMax) || (msg.message >= filterMin && msg.message <= filterMax));
+}
+
+static bool takeQueued(std::deque<QueuedMessage> &queue, LPMSG msg, LPARAM &extraInfo, HWND hwnd, UINT filterMin, UINT filterMax, UINT remove)
+{
+	for (std::deque<QueuedMessage>::iterator it = queue.begin(); it != queue.end(); ++it) {
+		if (matches(it->msg, hwnd, filterMin, filterMax)) {
+			*msg = it->msg;
+			extraInfo = it->extraInfo;
+			if (remove & PM_REMOVE)
+				queue.erase(it);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void makeMessage(LPMSG msg, HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	msg->hwnd = hwnd;
+	msg->message = message;
+	msg->wParam = wParam;
+	msg->lParam = lParam;
+	msg->time = GetTickCount();
+	msg->pt = cursor;
+}
+
+static bool retrieve(LPMSG msg, HWND hwnd, UINT filterMin, UINT filterMax, UINT remove)
+{
+	fireQueueTimers();
+
+	LPARAM extraInfo = 0;
+	bool found = takeQueued(posted, msg, extraInfo, hwnd, filterMin, filterMax, remove) ||
+		takeQueued(input, msg, extraInfo, hwnd, filterMin, filterMax, remove);
+
+	for (size_t i = 0; !found && i < windows.size(); i++) {
+		makeMessage(msg, (HWND)windows[i], WM_PAINT, 0, 0);
+		found = windows[i]->invalid && matches(*msg, hwnd, filterMin, filterMax);
+	}
+
+	LONGLONG now = clockNow();
+	for (size_t i = 0; !found && i < windowTimers.size(); i++) {
+		WindowTimer &timer = windowTimers[i];
+		makeMessage(msg, timer.hwnd, WM_TIMER, timer.id, (LPARAM)timer.proc);
+		found = timer.due <= now && matches(*msg, hwnd, filterMin, filterMax);
+		if (found && (remove & PM_REMOVE))
+			timer.due = now + timer.period;
+	}
+
+	if (!found)
+		return false;
+	messageExtraInfo = extraInfo;
+	callHooks(hooks.size(), HC_ACTION, remove & PM_REMOVE, (LPARAM)msg);
+	return true;
+}
+
+BOOL PeekMessageW(LPMSG msg, HWND hwnd, UINT filterMin, UINT filterMax, UINT remove)
+{
+	return retrieve(msg, hwnd, filterMin, filterMax, remove);
+}
+
+/* There being nothing that could ever arrive is an error here, rather than a hang */
+BOOL GetMessageW(LPMSG msg, HWND hwnd, UINT filterMin, UINT filterMax)
+{
+	while (!retrieve(msg, hwnd, filterMin, filterMax, PM_REMOVE)) {
+		LONGLONG due;
+		if (!nextTimer(due))
+			return -1;
+		win32RunTimers(due);
+	}
+	return TRUE;
+}
+
+BOOL PostMessageW(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	QueuedMessage queued;
+	makeMessage(&queued.msg, hwnd, message, wParam, lParam);
+	queued.extraInfo = 0;
+	posted.push_back(queued);
+	return TRUE;
+}
+
+void win32PostInput(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam, LPARAM extraInfo)
+{
+	/* Mouse messages but the wheel have the position in client coordinates */
+	if (message >= WM_MOUSEFIRST && message <= WM_MOUSELAST && message != WM_MOUSEWHEEL) {
+		POINT point = { (short)LOWORD(lParam), (short)HIWORD(lParam) };
+		ClientToScreen(hwnd, &point);
+		cursor = point;
+	}
+	QueuedMessage queued;
+	makeMessage(&queued.msg, hwnd, message, wParam, lParam);
+	queued.extraInfo = extraInfo;
+	input.push_back(queued);
+}
+
+LPARAM GetMessageExtraInfo(void)
+{
+	return messageExtraInfo;
+}
+
+BOOL TranslateMessage(const MSG *msg)
+{
+	return FALSE;
+}
+
+LRESULT DispatchMessageW(const MSG *msg)
+{
+	if (msg->message == WM_TIMER && msg->lParam) {
+		((TIMERPROC)msg->lParam)(msg->hwnd, WM_TIMER, msg->wParam, GetTickCount());
+		return 0;
+	}
+	Window *window = findWindow(msg->hwnd);
+	return window ? callWindow(window, msg->message, msg->wParam, msg->lParam) : 0;
+}
+
+LRESULT SendMessageW(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	Window *window = findWindow(hwnd);
+	return window ? callWindow(window, message, wParam, lParam) : 0;
+}
+
+LRESULT DefWindowProcW(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	switch (message) {
+	case WM_PAINT:
+		ValidateRect(hwnd, NULL);
+		break;
+	case WM_GESTURE:
+		CloseGestureInfoHandle((HGESTUREINFO)lParam);
+		break;
+	}
+	return 0;
+}
+
+BOOL DestroyWindow(HWND hwnd)
+{
+	Window *window = findWindow(hwnd);
+	if (!window)
+		return FALSE;
+	SendMessageW(hwnd, WM_DESTROY, 0, 0);
+	SendMessageW(hwnd, WM_NCDESTROY, 0, 0);
+
+	for (size_t i = windowTimers.size(); i-- > 0; )
+		if (windowTimers[i].hwnd == hwnd)
+			windowTimers.erase(windowTimers.begin() + i);
+	for (std::deque<QueuedMessage> *queue : { &posted, &input }) {
+		for (size_t i = queue->size(); i-- > 0; )
+			if ((*queue)[i].msg.hwnd == hwnd)
+				queue->erase(queue->begin() + i);
+	}
+	windows.erase(std::find(windows.begin(), windows.end(), window));
+	delete window;
+	return TRUE;
+}
+
+UINT RegisterWindowMessageW(LPCWSTR name)
+{
+	static std::vector<std::wstring> names;
+	std::vector<std::wstring>::iterator it = std::find(names.begin(), names.end(), name);
+	if (it == names.end())
+		it = names.insert(names.end(), name);
+	return 0xC000 + UINT(it - names.begin());
+}
+
+/* Gestures: each WM_GESTURE carries a handle to its GESTUREINFO until it's closed */
+static std::vector<GESTUREINFO *> gestureHandles;
+
+void win32PostGesture(HWND hwnd, DWORD id, DWORD flags, short x, short y)
+{
+	static DWORD sequence;
+	GESTUREINFO *info = new GESTUREINFO();
+	info->cbSize = sizeof(GESTUREINFO);
+	info->dwFlags = flags;
+	info->dwID = id;
+	info->hwndTarget = hwnd;
+	info->ptsLocation.x = x;
+	info->ptsLocation.y = y;
+	info->dwSequenceID = ++sequence;
+	gestureHandles.push_back(info);
+	win32OpenGestureHandles++;
+	win32PostInput(hwnd, WM_GESTURE, id, (LPARAM)info, 0);
+}
+
+BOOL GetGestureInfo(HGESTUREINFO gestureInfo, PGESTUREINFO info)
+{
+	GESTUREINFO *found = (GESTUREINFO *)gestureInfo;
+	if (std::find(gestureHandles.begin(), gestureHandles.end(), found) == gestureHandles.end() ||
+		info->cbSize != sizeof(GESTUREINFO))
+		return FALSE;
+	*info = *found;
+	return TRUE;
+}
+
+BOOL CloseGestureInfoHandle(HGESTUREINFO gestureInfo)
+{
+	std::vector<GESTUREINFO *>::iterator it = std::find(gestureHandles.begin(), gestureHandles.end(), (GESTUREINFO *)gestureInfo);
+	if (it == gestureHandles.end())
+		return FALSE;
+	delete *it;
+	gestureHandles.erase(it);
+	win32OpenGestureHandles--;
+	return TRUE;
+}
+
+BOOL SetGestureConfig(HWND hwnd, DWORD reserved, UINT count, PGESTURECONFIG config, UINT size)
+{
+	return findWindow(hwnd) && count && size == sizeof(GESTURECONFIG);
+}
+
+/* Pointers: touch unless a test says otherwise */
+static std::vector<std::pair<UINT32, POINTER_INPUT_TYPE> > pointerTypes;
+
+void win32SetPointerType(UINT32 pointerId, POINTER_INPUT_TYPE type)
+{
+	for (std::pair<UINT32, POINTER_INPUT_TYPE> &entry : pointerTypes) {
+		if (entry.first == pointerId) {
+			entry.second = type;
+			return;
+		}
+	}
+	pointerTypes.push_back(std::make_pair(pointerId, type));
+}
+
+BOOL WINAPI GetPointerType(UINT32 pointerId, POINTER_INPUT_TYPE *pointerType)
+{
+	*pointerType = PT_TOUCH;
+	for (const std::pair<UINT32, POINTER_INPUT_TYPE> &entry : pointerTypes)
+		if (entry.first == pointerId)
+			*pointerType = entry.second;
+	return TRUE;
+}
+
+/* End of File */
@@ -0,0 +1,745 @@
+/*
+ * Traktouch Linux test shim: the Win32 functions behind <windows.h>
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <tlhelp32.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#define PAGE_SIZE_4K 0x1000UL
+#define GRANULARITY 0x10000UL
+#define USER_SPACE_END 0x7FFFFFFFF000UL
+
+int win32VirtualQueryCalls;
+int win32Reservations;
+int win32Releases;
+BOOL win32FailThreadContext;
+BOOL win32ManualClock;
+LONGLONG win32ClockNow;
+wchar_t win32ModuleFileName[260];
+
+/* Critical sections: recursive mutexes */
+void InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	cs->mutex = malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init((pthread_mutex_t *)cs->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void EnterCriticalSection(CRITICAL_SECTION *cs)
+{
+	pthread_mutex_lock((pthread_mutex_t *)cs->mutex);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION *cs)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)cs->mutex);
+}
+
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *cs)
+{
+	return pthread_mutex_trylock((pthread_mutex_t *)cs->mutex) == 0;
+}
+
+/*
+ * Virtual memory. Reservations are remembered so that committing part of one and releasing the
+ * whole of it work like they do on Windows; mmap doesn't know about allocation granularity.
+ */
+struct Reservation {
+	uintptr_t base;
+	size_t size;
+};
+
+static Reservation reservations[4096];
+static int nReservations;
+static pthread_mutex_t memoryLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int protectionFlags(DWORD protect)
+{
+	switch (protect) {
+	case PAGE_NOACCESS:          return PROT_NONE;
+	case PAGE_READWRITE:         return PROT_READ | PROT_WRITE;
+	case PAGE_EXECUTE_READ:      return PROT_READ | PROT_EXEC;
+	default:                     return PROT_READ | PROT_WRITE | PROT_EXEC;
+	}
+}
+
+static Reservation *findReservation(uintptr_t address)
+{
+	for (int i = 0; i < nReservations; i++)
+		if (address >= reservations[i].base && address < reservations[i].base + reservations[i].size)
+			return &reservations[i];
+	return NULL;
+}
+
+static void *reserve(uintptr_t address, size_t size, int prot)
+{
+	if (address) {
+		void *p = mmap((void *)address, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		if ((uintptr_t)p != address) {
+			munmap(p, size);
+			return NULL;
+		}
+		return p;
+	}
+
+	/* Anywhere will do, as long as it's on an allocation granularity boundary */
+	void *p = mmap(NULL, size + GRANULARITY, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	uintptr_t start = ((uintptr_t)p + GRANULARITY - 1) & ~(GRANULARITY - 1);
+	if (start > (uintptr_t)p)
+		munmap(p, start - (uintptr_t)p);
+	if ((uintptr_t)p + GRANULARITY > start)
+		munmap((void *)(start + size), (uintptr_t)p + GRANULARITY - start);
+	return (void *)start;
+}
+
+PVOID VirtualAlloc(PVOID address, SIZE_T size, DWORD allocationType, DWORD protect)
+{
+	pthread_mutex_lock(&memoryLock);
+	void *result = NULL;
+	if (allocationType & MEM_RESERVE) {
+		uintptr_t base = (uintptr_t)address & ~(GRANULARITY - 1);
+		size_t length = ((uintptr_t)address + size - base + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+		int prot = allocationType & MEM_COMMIT ? protectionFlags(protect) : PROT_NONE;
+		if (nReservations < (int)_countof(reservations) && (result = reserve(base, length, prot)) != NULL) {
+			reservations[nReservations].base = (uintptr_t)result;
+			reservations[nReservations].size = length;
+			nReservations++;
+			win32Reservations++;
+		}
+	}
+	else if (allocationType & MEM_COMMIT) {
+		uintptr_t start = (uintptr_t)address & ~(PAGE_SIZE_4K - 1);
+		uintptr_t end = ((uintptr_t)address + size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+		Reservation *r = findReservation(start);
+		if (r && end <= r->base + r->size && !mprotect((void *)start, end - start, protectionFlags(protect)))
+			result = (void *)start;
+	}
+	pthread_mutex_unlock(&memoryLock);
+	if (!result)
+		SetLastError(487); /* ERROR_INVALID_ADDRESS */
+	return result;
+}
+
+BOOL VirtualFree(PVOID address, SIZE_T size, DWORD freeType)
+{
+	pthread_mutex_lock(&memoryLock);
+	BOOL ok = FALSE;
+	Reservation *r = findReservation((uintptr_t)address);
+	if (r && freeType == MEM_RELEASE && r->base == (uintptr_t)address && !size) {
+		munmap((void *)r->base, r->size);
+		*r = reservations[--nReservations];
+		win32Releases++;
+		ok = TRUE;
+	}
+	else if (r && freeType == MEM_DECOMMIT) {
+		uintptr_t start = (uintptr_t)address & ~(PAGE_SIZE_4K - 1);
+		uintptr_t end = ((uintptr_t)address + size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+		ok = !mprotect((void *)start, end - start, PROT_NONE) && !madvise((void *)start, end - start, MADV_DONTNEED);
+	}
+	pthread_mutex_unlock(&memoryLock);
+	return ok;
+}
+
+/*
+ * Look up an address in /proc/self/maps: the mapping it's in, or the gap it's in. mhook queries
+ * memory while other threads are suspended, so this mustn't allocate: one of them may hold the
+ * heap lock.
+ */
+static bool queryMaps(uintptr_t address, uintptr_t &start, uintptr_t &end, bool &mapped, char perms[5])
+{
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if (fd < 0)
+		return false;
+	char buffer[4096];
+	size_t used = 0;
+	uintptr_t gapStart = 0;
+	bool done = false;
+	mapped = false;
+	start = 0;
+	end = USER_SPACE_END;
+	while (!done) {
+		ssize_t n = read(fd, buffer + used, sizeof(buffer) - 1 - used);
+		if (n <= 0)
+			break;
+		used += n;
+		buffer[used] = 0;
+		char *line = buffer;
+		char *eol;
+		while (!done && (eol = strchr(line, '\n')) != NULL) {
+			*eol = 0;
+			char *p;
+			unsigned long s = strtoul(line, &p, 16);
+			unsigned long e = *p == '-' ? strtoul(p + 1, &p, 16) : 0;
+			line = eol + 1;
+			if (*p != ' ')
+				continue;
+			if (address < s) {
+				start = gapStart;
+				end = s;
+				done = true;
+			}
+			else if (address < e) {
+				start = s;
+				end = e;
+				mapped = true;
+				memcpy(perms, p + 1, 4);
+				perms[4] = 0;
+				done = true;
+			}
+			else {
+				gapStart = e;
+				start = e;
+			}
+		}
+		used -= line - buffer;
+		memmove(buffer, line, used);
+	}
+	close(fd);
+	return address < USER_SPACE_END;
+}
+
+static SIZE_T queryRegion(LPCVOID address, MEMORY_BASIC_INFORMATION *info)
+{
+	uintptr_t page = (uintptr_t)address & ~(PAGE_SIZE_4K - 1);
+	uintptr_t start, end;
+	bool mapped;
+	char perms[5];
+	if (!queryMaps(page, start, end, mapped, perms))
+		return 0;
+
+	memset(info, 0, sizeof(*info));
+	info->BaseAddress = (PVOID)page;
+	info->AllocationBase = mapped ? (PVOID)start : NULL;
+	info->RegionSize = end - page;
+	if (!mapped) {
+		info->State = MEM_FREE;
+		info->Protect = PAGE_NOACCESS;
+	}
+	else if (!strncmp(perms, "---", 3)) {
+		info->State = MEM_RESERVE;
+		info->Protect = PAGE_NOACCESS;
+	}
+	else {
+		info->State = MEM_COMMIT;
+		info->Protect = perms[2] == 'x' ? (perms[1] == 'w' ? PAGE_EXECUTE_READWRITE : PAGE_EXECUTE_READ) : PAGE_READWRITE;
+	}
+	return sizeof(*info);
+}
+
+SIZE_T VirtualQuery(LPCVOID address, MEMORY_BASIC_INFORMATION *info, SIZE_T length)
+{
+	win32VirtualQueryCalls++;
+	return queryRegion(address, info);
+}
+
+BOOL VirtualProtect(PVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect)
+{
+	MEMORY_BASIC_INFORMATION info;
+	if (!queryRegion(address, &info) || info.State != MEM_COMMIT)
+		return FALSE;
+	if (oldProtect)
+		*oldProtect = info.Protect;
+	uintptr_t start = (uintptr_t)address & ~(PAGE_SIZE_4K - 1);
+	uintptr_t end = ((uintptr_t)address + size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+	return !mprotect((void *)start, end - start, protectionFlags(newProtect));
+}
+
+void GetSystemInfo(SYSTEM_INFO *info)
+{
+	info->dwPageSize = PAGE_SIZE_4K;
+	info->dwAllocationGranularity = GRANULARITY;
+	info->lpMinimumApplicationAddress = (PVOID)GRANULARITY;
+	info->lpMaximumApplicationAddress = (PVOID)(USER_SPACE_END - GRANULARITY);
+}
+
+BOOL FlushInstructionCache(HANDLE process, LPCVOID address, SIZE_T size)
+{
+	return TRUE;
+}
+
+/*
+ * Threads. SuspendThread stops a thread in a signal handler, where GetThreadContext and
+ * SetThreadContext get at the registers it was interrupted with; they take effect when
+ * ResumeThread lets the handler return. Thread handles are slots of a fixed table, so a thread
+ * can be opened while others are suspended.
+ */
+#define SUSPEND_SIGNAL SIGUSR2
+#define MAX_THREADS 256
+
+struct ThreadSlot {
+	volatile pid_t tid;
+	int suspendCount;
+	volatile int suspendGeneration;
+	volatile int stoppedGeneration;
+	volatile int resumeGeneration;
+	ucontext_t *volatile context;
+};
+
+static ThreadSlot threads[MAX_THREADS];
+static pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static ThreadSlot *findThread(pid_t tid)
+{
+	for (int i = 0; i < MAX_THREADS; i++) {
+		if (threads[i].tid == tid)
+			return &threads[i];
+	}
+	return NULL;
+}
+
+static bool isThreadHandle(HANDLE handle)
+{
+	return (ThreadSlot *)handle >= threads && (ThreadSlot *)handle < threads + MAX_THREADS;
+}
+
+static void futexWait(volatile int *word, int value)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static void futexWake(volatile int *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void suspendHandler(int signal, siginfo_t *info, void *context)
+{
+	int savedErrno = errno;
+	ThreadSlot *slot = findThread((pid_t)gettid());
+	if (slot) {
+		int generation = slot->suspendGeneration;
+		slot->context = (ucontext_t *)context;
+		__atomic_store_n(&slot->stoppedGeneration, generation, __ATOMIC_RELEASE);
+		int resumed;
+		while ((resumed = __atomic_load_n(&slot->resumeGeneration, __ATOMIC_ACQUIRE)) < generation)
+			futexWait(&slot->resumeGeneration, resumed);
+	}
+	errno = savedErrno;
+}
+
+HANDLE GetCurrentProcess(void) { return (HANDLE)(LONG_PTR)-1; }
+HANDLE GetCurrentThread(void) { return (HANDLE)(LONG_PTR)-2; }
+DWORD GetCurrentProcessId(void) { return (DWORD)getpid(); }
+DWORD GetCurrentThreadId(void) { return (DWORD)gettid(); }
+
+HANDLE OpenThread(DWORD access, BOOL inherit, DWORD threadId)
+{
+	static bool handlerInstalled;
+	pthread_mutex_lock(&threadsLock);
+	if (!handlerInstalled) {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = suspendHandler;
+		action.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(SUSPEND_SIGNAL, &action, NULL);
+		handlerInstalled = true;
+	}
+	ThreadSlot *slot = findThread((pid_t)threadId);
+	if (!slot && (slot = findThread(0)) != NULL)
+		slot->tid = (pid_t)threadId;
+	pthread_mutex_unlock(&threadsLock);
+	return slot;
+}
+
+DWORD SuspendThread(HANDLE thread)
+{
+	ThreadSlot *slot = (ThreadSlot *)thread;
+	if (!isThreadHandle(thread))
+		return (DWORD)-1;
+	if (slot->suspendCount++)
+		return slot->suspendCount - 1;
+	int generation = slot->suspendGeneration + 1;
+	slot->suspendGeneration = generation;
+	if (syscall(SYS_tgkill, getpid(), slot->tid, SUSPEND_SIGNAL)) {
+		slot->suspendCount = 0;
+		slot->resumeGeneration = generation;
+		return (DWORD)-1;
+	}
+	while (__atomic_load_n(&slot->stoppedGeneration, __ATOMIC_ACQUIRE) != generation)
+		sched_yield();
+	return 0;
+}
+
+DWORD ResumeThread(HANDLE thread)
+{
+	ThreadSlot *slot = (ThreadSlot *)thread;
+	if (!isThreadHandle(thread) || !slot->suspendCount)
+		return (DWORD)-1;
+	if (--slot->suspendCount)
+		return slot->suspendCount + 1;
+	__atomic_store_n(&slot->resumeGeneration, slot->suspendGeneration, __ATOMIC_RELEASE);
+	futexWake(&slot->resumeGeneration);
+	return 1;
+}
+
+static greg_t *registerOf(ucontext_t *context, int index)
+{
+	static const int gregs[] = { REG_RIP, REG_RSP, REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RBP, REG_RSI, REG_RDI,
+		REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15 };
+	return &context->uc_mcontext.gregs[gregs[index]];
+}
+
+BOOL GetThreadContext(HANDLE thread, CONTEXT *context)
+{
+	ThreadSlot *slot = (ThreadSlot *)thread;
+	if (!isThreadHandle(thread) || !slot->suspendCount || win32FailThreadContext)
+		return FALSE;
+	DWORD64 *registers = &context->Rip;
+	for (int i = 0; i < 17; i++)
+		registers[i] = *registerOf(slot->context, i);
+	context->EFlags = (DWORD)slot->context->uc_mcontext.gregs[REG_EFL];
+	return TRUE;
+}
+
+BOOL SetThreadContext(HANDLE thread, const CONTEXT *context)
+{
+	ThreadSlot *slot = (ThreadSlot *)thread;
+	if (!isThreadHandle(thread) || !slot->suspendCount)
+		return FALSE;
+	const DWORD64 *registers = &context->Rip;
+	for (int i = 0; i < 17; i++)
+		*registerOf(slot->context, i) = registers[i];
+	return TRUE;
+}
+
+int GetThreadPriority(HANDLE thread) { return 0; }
+BOOL SetThreadPriority(HANDLE thread, int priority) { return TRUE; }
+BOOL GetThreadSelectorEntry(HANDLE thread, DWORD selector, LDT_ENTRY *entry) { return FALSE; }
+
+/* Tool help snapshots list the threads in /proc/self/task */
+#define SNAPSHOT_MAGIC 0x70616e53
+
+struct Snapshot {
+	DWORD magic;
+	int count;
+	int next;
+	DWORD threadIds[MAX_THREADS];
+};
+
+/* Files are their descriptor above FILE_HANDLE_BASE, which is below any snapshot's address */
+#define FILE_HANDLE_BASE 0x1000
+
+static bool isFileHandle(HANDLE handle)
+{
+	return (LONG_PTR)handle >= FILE_HANDLE_BASE && (LONG_PTR)handle < (LONG_PTR)GRANULARITY;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+	if (isFileHandle(handle))
+		return !close(int((LONG_PTR)handle - FILE_HANDLE_BASE));
+	if ((LONG_PTR)handle > (LONG_PTR)GRANULARITY && !isThreadHandle(handle) && ((Snapshot *)handle)->magic == SNAPSHOT_MAGIC) {
+		((Snapshot *)handle)->magic = 0;
+		free(handle);
+	}
+	return TRUE;
+}
+
+void Sleep(DWORD ms)
+{
+	usleep(ms * 1000);
+}
+
+static HANDLE WINAPI CreateToolhelp32Snapshot(DWORD flags, DWORD processId)
+{
+	Snapshot *snapshot = (Snapshot *)calloc(1, sizeof(Snapshot));
+	DIR *dir = opendir("/proc/self/task");
+	if (!snapshot || !dir) {
+		free(snapshot);
+		if (dir)
+			closedir(dir);
+		return INVALID_HANDLE_VALUE;
+	}
+	snapshot->magic = SNAPSHOT_MAGIC;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL && snapshot->count < MAX_THREADS) {
+		if (entry->d_name[0] != '.')
+			snapshot->threadIds[snapshot->count++] = (DWORD)atoi(entry->d_name);
+	}
+	closedir(dir);
+	return snapshot;
+}
+
+static BOOL WINAPI Thread32Next(HANDLE snapshot, LPTHREADENTRY32 entry)
+{
+	Snapshot *s = (Snapshot *)snapshot;
+	if (s->next == s->count)
+		return FALSE;
+	entry->th32ThreadID = s->threadIds[s->next++];
+	entry->th32OwnerProcessID = (DWORD)getpid();
+	return TRUE;
+}
+
+static BOOL WINAPI Thread32First(HANDLE snapshot, LPTHREADENTRY32 entry)
+{
+	((Snapshot *)snapshot)->next = 0;
+	return Thread32Next(snapshot, entry);
+}
+
+/* Thread local storage */
+static pthread_key_t tlsKeys[64];
+static DWORD nTlsKeys;
+
+DWORD TlsAlloc(void)
+{
+	if (nTlsKeys == _countof(tlsKeys) || pthread_key_create(&tlsKeys[nTlsKeys], NULL))
+		return TLS_OUT_OF_INDEXES;
+	return nTlsKeys++;
+}
+
+PVOID TlsGetValue(DWORD index)
+{
+	return pthread_getspecific(tlsKeys[index]);
+}
+
+BOOL TlsSetValue(DWORD index, PVOID value)
+{
+	return !pthread_setspecific(tlsKeys[index], value);
+}
+
+/* Odds and ends */
+static thread_local DWORD lastError;
+
+DWORD GetLastError(void) { return lastError; }
+void SetLastError(DWORD error) { lastError = error; }
+void OutputDebugStringA(LPCSTR text) { fputs(text, stderr); }
+void OutputDebugStringW(LPCWSTR text) { fprintf(stderr, "%ls", text); }
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+	if (win32ManualClock) {
+		count->QuadPart = win32ClockNow;
+		return TRUE;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	count->QuadPart = LONGLONG(now.tv_sec) * 1000000000 + now.tv_nsec;
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+{
+	frequency->QuadPart = 1000000000;
+	return TRUE;
+}
+
+DWORD GetTickCount(void)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return DWORD(now.QuadPart / 1000000);
+}
+
+/* Files, by name as far as ASCII goes */
+static bool narrow(LPCWSTR wide, char *buffer, size_t size)
+{
+	size_t n = wcstombs(buffer, wide, size);
+	return n != (size_t)-1 && n < size;
+}
+
+HANDLE CreateFileW(LPCWSTR fileName, DWORD access, DWORD shareMode, LPSECURITY_ATTRIBUTES security,
+	DWORD disposition, DWORD flags, HANDLE templateFile)
+{
+	char name[PATH_MAX];
+	if (!narrow(fileName, name, sizeof(name)))
+		return INVALID_HANDLE_VALUE;
+	int mode = (access & GENERIC_READ) && (access & GENERIC_WRITE) ? O_RDWR : (access & GENERIC_WRITE) ? O_WRONLY : O_RDONLY;
+	if (disposition == CREATE_ALWAYS)
+		mode |= O_CREAT | O_TRUNC;
+	int fd = open(name, mode | O_CLOEXEC, 0644);
+	if (fd < 0 || fd >= (int)GRANULARITY - FILE_HANDLE_BASE) {
+		if (fd >= 0)
+			close(fd);
+		return INVALID_HANDLE_VALUE;
+	}
+	return (HANDLE)(LONG_PTR)(fd + FILE_HANDLE_BASE);
+}
+
+BOOL ReadFile(HANDLE file, LPVOID buffer, DWORD size, LPDWORD read, LPOVERLAPPED overlapped)
+{
+	ssize_t n = isFileHandle(file) ? ::read(int((LONG_PTR)file - FILE_HANDLE_BASE), buffer, size) : -1;
+	*read = n > 0 ? DWORD(n) : 0;
+	return n >= 0;
+}
+
+BOOL WriteFile(HANDLE file, LPCVOID buffer, DWORD size, LPDWORD written, LPOVERLAPPED overlapped)
+{
+	ssize_t n = isFileHandle(file) ? ::write(int((LONG_PTR)file - FILE_HANDLE_BASE), buffer, size) : -1;
+	*written = n > 0 ? DWORD(n) : 0;
+	return n >= 0;
+}
+
+BOOL DeleteFileW(LPCWSTR fileName)
+{
+	char name[PATH_MAX];
+	return narrow(fileName, name, sizeof(name)) && !unlink(name);
+}
+
+/* Ini files: [section] headers and key=value lines, names compared without regard to case */
+UINT GetPrivateProfileIntW(LPCWSTR section, LPCWSTR key, INT defaultValue, LPCWSTR fileName)
+{
+	char name[PATH_MAX], wantSection[128], wantKey[128];
+	if (!narrow(fileName, name, sizeof(name)) || !narrow(section, wantSection, sizeof(wantSection)) ||
+		!narrow(key, wantKey, sizeof(wantKey)))
+		return (UINT)defaultValue;
+	FILE *f = fopen(name, "r");
+	if (!f)
+		return (UINT)defaultValue;
+
+	char line[256];
+	bool inSection = false;
+	INT value = defaultValue;
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line + strspn(line, " \t");
+		char *end = p + strcspn(p, "\r\n");
+		*end = 0;
+		if (*p == '[') {
+			char *bracket = strchr(p, ']');
+			if (bracket)
+				*bracket = 0;
+			inSection = !strcasecmp(p + 1, wantSection);
+			continue;
+		}
+		char *equals = strchr(p, '=');
+		if (!inSection || !equals)
+			continue;
+		*equals = 0;
+		for (char *t = equals; t > p && (t[-1] == ' ' || t[-1] == '\t'); )
+			*--t = 0;
+		if (!strcasecmp(p, wantKey)) {
+			value = atoi(equals + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return (UINT)value;
+}
+
+/* Modules: the one module is the test executable, and there are no PE images */
+HMODULE GetModuleHandleA(LPCSTR name) { return NULL; }
+HMODULE GetModuleHandleW(LPCWSTR name) { return (HMODULE)(LONG_PTR)0x10; }
+HMODULE LoadLibraryW(LPCWSTR fileName) { return GetModuleHandleW(fileName); }
+
+DWORD GetModuleFileNameW(HMODULE module, LPWSTR fileName, DWORD size)
+{
+	wchar_t exe[PATH_MAX];
+	const wchar_t *name = win32ModuleFileName;
+	if (!*name) {
+		char path[PATH_MAX];
+		ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+		path[n > 0 ? n : 0] = 0;
+		mbstowcs(exe, path, _countof(exe));
+		exe[_countof(exe) - 1] = 0;
+		name = exe;
+	}
+	if (!size)
+		return 0;
+	wcsncpy(fileName, name, size - 1);
+	fileName[size - 1] = 0;
+	return (DWORD)wcslen(fileName);
+}
+
+BOOL GetModuleHandleExW(DWORD flags, LPCWSTR name, HMODULE *module)
+{
+	Dl_info info;
+	if (!(flags & GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS) || !dladdr((void *)name, &info))
+		return FALSE;
+	*module = (HMODULE)info.dli_fbase;
+	return TRUE;
+}
+
+void *GetProcAddress(HMODULE module, LPCSTR name)
+{
+	if (!strcmp(name, "CreateToolhelp32Snapshot"))
+		return (void *)CreateToolhelp32Snapshot;
+	if (!strcmp(name, "Thread32First"))
+		return (void *)Thread32First;
+	if (!strcmp(name, "Thread32Next"))
+		return (void *)Thread32Next;
+
+	/* Functions the test itself exports, e.g. user32's when it's linked with -rdynamic */
+	return dlsym(RTLD_DEFAULT, name);
+}
+
+int lstrcmpiA(LPCSTR a, LPCSTR b)
+{
+	return strcasecmp(a, b);
+}
+
+int _vscprintf(const char *format, va_list args)
+{
+	va_list copy;
+	va_copy(copy, args);
+	int n = vsnprintf(NULL, 0, format, copy);
+	va_end(copy);
+	return n;
+}
+
+int _vscwprintf(const wchar_t *format, va_list args)
+{
+	static wchar_t scratch[4096];
+	va_list copy;
+	va_copy(copy, args);
+	int n = vswprintf(scratch, _countof(scratch), format, copy);
+	va_end(copy);
+	return n;
+}
+
+int vsprintf_s(char *buffer, size_t size, const char *format, va_list args)
+{
+	return vsnprintf(buffer, size, format, args);
+}
+
+int vswprintf_s(wchar_t *buffer, size_t size, const wchar_t *format, va_list args)
+{
+	return vswprintf(buffer, size, format, args);
+}
+
+int _snprintf(char *buffer, size_t size, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(buffer, size, format, args);
+	va_end(args);
+	return n;
+}
+
+/* End of File */
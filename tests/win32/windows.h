@@ -0,0 +1,485 @@
+/*
+ * Traktouch Linux test shim: the part of the Win32 API that mhook and the touch logic use
+ *
+ * Just enough of <windows.h> to build the DLL's sources with gcc on x86-64 Linux and run them
+ * in a test process. Memory management sits on mmap, the performance counter on
+ * CLOCK_MONOTONIC, critical sections and TLS on pthreads. Threads are suspended with a signal
+ * that parks them in its handler, and their context is the one the signal saved. Windows,
+ * their message queue, hooks and timers live in user32.cpp, for a single UI thread; tests post
+ * input into it and can run the clock by hand.
+ *
+ * Copyright (c) 2019 by Joachim Fenkes <github@dojoe.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WIN32_SHIM_WINDOWS_H__
+#define __WIN32_SHIM_WINDOWS_H__
+
+#if !defined(__x86_64__) || !defined(__GNUC__)
+#error The Win32 shim only supports gcc on x86-64
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <ctype.h>
+#include <sched.h>
+#include <x86intrin.h>
+
+/* What the DLL's sources check for; the 64-bit build is the one we run */
+#ifndef _M_X64
+#define _M_X64 1
+#endif
+#ifndef _WIN64
+#define _WIN64 1
+#endif
+
+/* Calling conventions: Win32 callbacks and anything mhook generates code for use the Microsoft ABI */
+#define __int64 long long
+#define __cdecl
+#define __stdcall
+#define WINAPI __attribute__((ms_abi))
+#define CALLBACK WINAPI
+#define APIENTRY WINAPI
+#define _inline inline
+#define __forceinline inline __attribute__((always_inline))
+#define __declspec(x)
+#define _In_
+#define _Out_
+
+/* Base types, with the sizes of the LLP64 data model */
+#define VOID void
+typedef int BOOL;
+typedef unsigned char BOOLEAN, BYTE, UCHAR, *PBYTE, *LPBYTE;
+typedef uint16_t WORD, USHORT;
+typedef int16_t SHORT;
+typedef uint32_t DWORD, *PDWORD, *LPDWORD, UINT, ULONG;
+typedef int32_t LONG, INT;
+typedef int64_t LONG64, LONGLONG;
+typedef uint64_t ULONG64, ULONGLONG, DWORD64;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef unsigned __int64 ULONG_PTR, *PULONG_PTR, DWORD_PTR, *PDWORD_PTR, SIZE_T, UINT_PTR, WPARAM;
+typedef __int64 LONG_PTR, INT_PTR, LPARAM, LRESULT;
+typedef void *PVOID, *LPVOID, *HANDLE, *HMODULE, *HINSTANCE;
+typedef const void *LPCVOID;
+typedef char CHAR, *PSTR, *LPSTR;
+typedef const char *PCSTR, *LPCSTR;
+typedef wchar_t WCHAR, TCHAR, *PWSTR, *LPWSTR;
+typedef const wchar_t *PCWSTR, *LPCWSTR;
+typedef union { struct { DWORD LowPart; LONG HighPart; }; LONGLONG QuadPart; } LARGE_INTEGER;
+
+#define TRUE 1
+#define FALSE 0
+#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
+#define TLS_OUT_OF_INDEXES ((DWORD)0xFFFFFFFF)
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#define CopyMemory(d, s, n) memcpy((d), (s), (n))
+#define MoveMemory(d, s, n) memmove((d), (s), (n))
+#define FillMemory(p, n, v) memset((p), (v), (n))
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Memory */
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_DECOMMIT 0x4000
+#define MEM_RELEASE 0x8000
+#define MEM_FREE 0x10000
+#define PAGE_NOACCESS 0x01
+#define PAGE_READWRITE 0x04
+#define PAGE_EXECUTE_READ 0x20
+#define PAGE_EXECUTE_READWRITE 0x40
+
+typedef struct {
+	PVOID BaseAddress;
+	PVOID AllocationBase;
+	DWORD AllocationProtect;
+	SIZE_T RegionSize;
+	DWORD State;
+	DWORD Protect;
+	DWORD Type;
+} MEMORY_BASIC_INFORMATION;
+
+typedef struct {
+	DWORD dwPageSize;
+	PVOID lpMinimumApplicationAddress;
+	PVOID lpMaximumApplicationAddress;
+	DWORD dwAllocationGranularity;
+} SYSTEM_INFO;
+
+/* Threads */
+#define THREAD_ALL_ACCESS 0x1FFFFF
+#define THREAD_PRIORITY_TIME_CRITICAL 15
+#define CONTEXT_CONTROL 1
+#define CONTEXT_INTEGER 2
+#define CONTEXT_FULL 7
+
+typedef struct {
+	DWORD ContextFlags;
+	DWORD64 Rip, Rsp, Rax, Rcx, Rdx, Rbx, Rbp, Rsi, Rdi, R8, R9, R10, R11, R12, R13, R14, R15;
+	DWORD EFlags;
+} CONTEXT;
+
+typedef struct {
+	void *mutex;
+} CRITICAL_SECTION;
+
+typedef struct {
+	BYTE bytes[8];
+} LDT_ENTRY;
+
+/* Portable executable images, for import address table hooks */
+#define IMAGE_DOS_SIGNATURE 0x5A4D
+#define IMAGE_NT_SIGNATURE 0x00004550
+#define IMAGE_DIRECTORY_ENTRY_IMPORT 1
+#define IMAGE_SNAP_BY_ORDINAL(o) (((o) >> 63) != 0)
+#define GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT 2
+#define GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS 4
+
+typedef struct { WORD e_magic; WORD e_res[29]; LONG e_lfanew; } IMAGE_DOS_HEADER, *PIMAGE_DOS_HEADER;
+typedef struct { DWORD VirtualAddress; DWORD Size; } IMAGE_DATA_DIRECTORY;
+typedef struct { BYTE fields[112]; IMAGE_DATA_DIRECTORY DataDirectory[16]; } IMAGE_OPTIONAL_HEADER;
+typedef struct { DWORD Signature; BYTE FileHeader[20]; IMAGE_OPTIONAL_HEADER OptionalHeader; } IMAGE_NT_HEADERS, *PIMAGE_NT_HEADERS;
+typedef struct {
+	DWORD OriginalFirstThunk;
+	DWORD TimeDateStamp;
+	DWORD ForwarderChain;
+	DWORD Name;
+	DWORD FirstThunk;
+} IMAGE_IMPORT_DESCRIPTOR, *PIMAGE_IMPORT_DESCRIPTOR;
+typedef struct { union { ULONGLONG ForwarderString, Function, Ordinal, AddressOfData; } u1; } IMAGE_THUNK_DATA, *PIMAGE_THUNK_DATA;
+typedef struct { WORD Hint; CHAR Name[1]; } IMAGE_IMPORT_BY_NAME, *PIMAGE_IMPORT_BY_NAME;
+
+/* Files and DLLs */
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x00000001
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define DLL_PROCESS_DETACH 0
+#define DLL_PROCESS_ATTACH 1
+#define DLL_THREAD_ATTACH 2
+#define DLL_THREAD_DETACH 3
+
+typedef struct { DWORD nLength; LPVOID lpSecurityDescriptor; BOOL bInheritHandle; } SECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+typedef struct OVERLAPPED OVERLAPPED, *LPOVERLAPPED;
+
+/* Windows and their messages */
+typedef struct HWND__ *HWND;
+typedef struct HHOOK__ *HHOOK;
+typedef struct HGESTUREINFO__ *HGESTUREINFO;
+typedef struct { LONG x, y; } POINT, *LPPOINT;
+typedef struct { SHORT x, y; } POINTS;
+typedef struct { LONG left, top, right, bottom; } RECT, *LPRECT;
+typedef const RECT *LPCRECT;
+
+typedef struct {
+	HWND hwnd;
+	UINT message;
+	WPARAM wParam;
+	LPARAM lParam;
+	DWORD time;
+	POINT pt;
+} MSG, *LPMSG;
+
+typedef LRESULT (CALLBACK *WNDPROC)(HWND, UINT, WPARAM, LPARAM);
+typedef LRESULT (CALLBACK *HOOKPROC)(int, WPARAM, LPARAM);
+typedef VOID (CALLBACK *TIMERPROC)(HWND, UINT, UINT_PTR, DWORD);
+typedef VOID (CALLBACK *WAITORTIMERCALLBACK)(PVOID, BOOLEAN);
+
+#define WM_NULL 0x0000
+#define WM_DESTROY 0x0002
+#define WM_PAINT 0x000F
+#define WM_NCDESTROY 0x0082
+#define WM_TIMER 0x0113
+#define WM_GESTURE 0x0119
+#define WM_MOUSEFIRST 0x0200
+#define WM_MOUSEMOVE 0x0200
+#define WM_LBUTTONDOWN 0x0201
+#define WM_LBUTTONUP 0x0202
+#define WM_MOUSEWHEEL 0x020A
+#define WM_MOUSELAST 0x020E
+#define WM_POINTERUPDATE 0x0245
+#define WM_POINTERDOWN 0x0246
+#define WM_POINTERUP 0x0247
+#define WM_APP 0x8000
+#define MK_LBUTTON 0x0001
+
+#define PM_NOREMOVE 0x0000
+#define PM_REMOVE 0x0001
+#define WH_GETMESSAGE 3
+#define HC_ACTION 0
+#define WT_EXECUTEONLYONCE 0x00000008
+#define WT_EXECUTEINTIMERTHREAD 0x00000020
+
+/* Gestures */
+#define GID_BEGIN 1
+#define GID_END 2
+#define GID_ZOOM 3
+#define GID_PAN 4
+#define GF_BEGIN 0x00000001
+#define GF_INERTIA 0x00000002
+#define GF_END 0x00000004
+#define GC_ALLGESTURES 0x00000001
+#define GC_PAN 0x00000001
+
+typedef struct {
+	UINT cbSize;
+	DWORD dwFlags;
+	DWORD dwID;
+	HWND hwndTarget;
+	POINTS ptsLocation;
+	DWORD dwInstanceID;
+	DWORD dwSequenceID;
+	ULONGLONG ullArguments;
+	UINT cbExtraArgs;
+} GESTUREINFO, *PGESTUREINFO;
+
+typedef struct {
+	DWORD dwID;
+	DWORD dwWant;
+	DWORD dwBlock;
+} GESTURECONFIG, *PGESTURECONFIG;
+
+/* Pointer input */
+#define PT_POINTER 1
+#define PT_TOUCH 2
+#define PT_PEN 3
+#define PT_MOUSE 4
+#define POINTER_MESSAGE_FLAG_NEW 0x00000001
+#define POINTER_MESSAGE_FLAG_INRANGE 0x00000002
+#define POINTER_MESSAGE_FLAG_INCONTACT 0x00000004
+#define POINTER_MESSAGE_FLAG_PRIMARY 0x00002000
+
+typedef DWORD POINTER_INPUT_TYPE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs);
+void EnterCriticalSection(CRITICAL_SECTION *cs);
+void LeaveCriticalSection(CRITICAL_SECTION *cs);
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *cs);
+
+PVOID VirtualAlloc(PVOID address, SIZE_T size, DWORD allocationType, DWORD protect);
+BOOL VirtualFree(PVOID address, SIZE_T size, DWORD freeType);
+BOOL VirtualProtect(PVOID address, SIZE_T size, DWORD newProtect, PDWORD oldProtect);
+SIZE_T VirtualQuery(LPCVOID address, MEMORY_BASIC_INFORMATION *info, SIZE_T length);
+void GetSystemInfo(SYSTEM_INFO *info);
+BOOL FlushInstructionCache(HANDLE process, LPCVOID address, SIZE_T size);
+
+HANDLE GetCurrentProcess(void);
+HANDLE GetCurrentThread(void);
+DWORD GetCurrentProcessId(void);
+DWORD GetCurrentThreadId(void);
+HANDLE OpenThread(DWORD access, BOOL inherit, DWORD threadId);
+DWORD SuspendThread(HANDLE thread);
+DWORD ResumeThread(HANDLE thread);
+BOOL GetThreadContext(HANDLE thread, CONTEXT *context);
+BOOL SetThreadContext(HANDLE thread, const CONTEXT *context);
+int GetThreadPriority(HANDLE thread);
+BOOL SetThreadPriority(HANDLE thread, int priority);
+BOOL GetThreadSelectorEntry(HANDLE thread, DWORD selector, LDT_ENTRY *entry);
+BOOL CloseHandle(HANDLE handle);
+void Sleep(DWORD ms);
+DWORD TlsAlloc(void);
+PVOID TlsGetValue(DWORD index);
+BOOL TlsSetValue(DWORD index, PVOID value);
+
+DWORD GetLastError(void);
+void SetLastError(DWORD error);
+void OutputDebugStringA(LPCSTR text);
+void OutputDebugStringW(LPCWSTR text);
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency);
+
+HMODULE GetModuleHandleA(LPCSTR name);
+HMODULE GetModuleHandleW(LPCWSTR name);
+BOOL GetModuleHandleExW(DWORD flags, LPCWSTR name, HMODULE *module);
+DWORD GetModuleFileNameW(HMODULE module, LPWSTR fileName, DWORD size);
+HMODULE LoadLibraryW(LPCWSTR fileName);
+void *GetProcAddress(HMODULE module, LPCSTR name);
+int lstrcmpiA(LPCSTR a, LPCSTR b);
+DWORD GetTickCount(void);
+
+UINT GetPrivateProfileIntW(LPCWSTR section, LPCWSTR key, INT defaultValue, LPCWSTR fileName);
+HANDLE CreateFileW(LPCWSTR fileName, DWORD access, DWORD shareMode, LPSECURITY_ATTRIBUTES security,
+	DWORD disposition, DWORD flags, HANDLE templateFile);
+BOOL ReadFile(HANDLE file, LPVOID buffer, DWORD size, LPDWORD read, LPOVERLAPPED overlapped);
+BOOL WriteFile(HANDLE file, LPCVOID buffer, DWORD size, LPDWORD written, LPOVERLAPPED overlapped);
+BOOL DeleteFileW(LPCWSTR fileName);
+
+/* User32, from user32.cpp */
+LRESULT DefWindowProcW(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam);
+LRESULT SendMessageW(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam);
+BOOL PostMessageW(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam);
+BOOL PeekMessageW(LPMSG msg, HWND hwnd, UINT filterMin, UINT filterMax, UINT remove);
+BOOL GetMessageW(LPMSG msg, HWND hwnd, UINT filterMin, UINT filterMax);
+BOOL TranslateMessage(const MSG *msg);
+LRESULT DispatchMessageW(const MSG *msg);
+LPARAM GetMessageExtraInfo(void);
+UINT RegisterWindowMessageW(LPCWSTR name);
+
+HHOOK SetWindowsHookExW(int idHook, HOOKPROC proc, HINSTANCE module, DWORD threadId);
+BOOL UnhookWindowsHookEx(HHOOK hook);
+LRESULT CallNextHookEx(HHOOK hook, int code, WPARAM wParam, LPARAM lParam);
+
+BOOL DestroyWindow(HWND hwnd);
+int GetWindowTextW(HWND hwnd, LPWSTR text, int size);
+BOOL GetWindowRect(HWND hwnd, LPRECT rect);
+BOOL ClientToScreen(HWND hwnd, LPPOINT point);
+BOOL ScreenToClient(HWND hwnd, LPPOINT point);
+BOOL InvalidateRect(HWND hwnd, LPCRECT rect, BOOL erase);
+BOOL ValidateRect(HWND hwnd, LPCRECT rect);
+BOOL GetUpdateRect(HWND hwnd, LPRECT rect, BOOL erase);
+
+BOOL WINAPI SetCursorPos(int x, int y);
+BOOL GetCursorPos(LPPOINT point);
+
+UINT_PTR SetTimer(HWND hwnd, UINT_PTR id, UINT elapse, TIMERPROC proc);
+BOOL KillTimer(HWND hwnd, UINT_PTR id);
+BOOL CreateTimerQueueTimer(HANDLE *timer, HANDLE queue, WAITORTIMERCALLBACK callback, PVOID parameter,
+	DWORD dueTime, DWORD period, ULONG flags);
+BOOL DeleteTimerQueueTimer(HANDLE queue, HANDLE timer, HANDLE completionEvent);
+
+BOOL GetGestureInfo(HGESTUREINFO gestureInfo, PGESTUREINFO info);
+BOOL CloseGestureInfoHandle(HGESTUREINFO gestureInfo);
+BOOL SetGestureConfig(HWND hwnd, DWORD reserved, UINT count, PGESTURECONFIG config, UINT size);
+BOOL WINAPI GetPointerType(UINT32 pointerId, POINTER_INPUT_TYPE *pointerType);
+
+static inline int lstrlenW(LPCWSTR s) { return (int)wcslen(s); }
+static inline LPWSTR lstrcpyW(LPWSTR d, LPCWSTR s) { return wcscpy(d, s); }
+static inline int lstrcmpW(LPCWSTR a, LPCWSTR b) { return wcscmp(a, b); }
+
+int _vscprintf(const char *format, va_list args);
+int _vscwprintf(const wchar_t *format, va_list args);
+int vsprintf_s(char *buffer, size_t size, const char *format, va_list args);
+int vswprintf_s(wchar_t *buffer, size_t size, const wchar_t *format, va_list args);
+int _snprintf(char *buffer, size_t size, const char *format, ...);
+
+/*
+ * Counters for tests that check how often mhook goes to the system: address space queries,
+ * and blocks reserved and released
+ */
+extern int win32VirtualQueryCalls;
+extern int win32Reservations;
+extern int win32Releases;
+
+/* While this is set, GetThreadContext fails even for a suspended thread */
+extern BOOL win32FailThreadContext;
+
+/*
+ * A clock for tests to run by hand: while win32ManualClock is set, QueryPerformanceCounter and
+ * GetTickCount read win32ClockNow in nanoseconds, and waiting for a timer moves it to when the
+ * timer is due. GetModuleFileName returns win32ModuleFileName if it is set.
+ */
+extern BOOL win32ManualClock;
+extern LONGLONG win32ClockNow;
+extern wchar_t win32ModuleFileName[260];
+
+/*
+ * What user32.cpp has in place of the desktop. Windows are created with a title, a window
+ * procedure and where their client area is on the screen. Input goes into the queue with the
+ * extra info GetMessageExtraInfo returns for it, and a mouse message moves the cursor to its
+ * position right away, as the real thing does. Gestures come with a GESTUREINFO handle of their own, and
+ * GetPointerType says PT_TOUCH for every pointer unless told otherwise.
+ *
+ * win32RunTimers waits for the next timer due by the given time on the manual clock: it moves
+ * the clock there, fires timer queue timers that are due and returns TRUE, or moves the clock
+ * to that time and returns FALSE if there is none.
+ */
+HWND win32CreateWindow(LPCWSTR title, WNDPROC proc, int x, int y, int width, int height);
+void win32PostInput(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam, LPARAM extraInfo);
+void win32PostGesture(HWND hwnd, DWORD id, DWORD flags, short x, short y);
+void win32SetPointerType(UINT32 pointerId, POINTER_INPUT_TYPE type);
+BOOL win32RunTimers(LONGLONG until);
+
+/* Counters: calls that really moved the cursor, and gesture info handles not closed yet */
+extern int win32SetCursorPosCalls;
+extern int win32OpenGestureHandles;
+
+#ifdef __cplusplus
+}
+#endif
+
+#define GetModuleHandle GetModuleHandleW
+#define GetModuleFileName GetModuleFileNameW
+#define LoadLibrary LoadLibraryW
+#define GetPrivateProfileInt GetPrivateProfileIntW
+#define CreateFile CreateFileW
+#define DeleteFile DeleteFileW
+#define lstrcpy lstrcpyW
+#define lstrcmp lstrcmpW
+#define DefWindowProc DefWindowProcW
+#define SendMessage SendMessageW
+#define PostMessage PostMessageW
+#define PeekMessage PeekMessageW
+#define GetMessage GetMessageW
+#define DispatchMessage DispatchMessageW
+#define RegisterWindowMessage RegisterWindowMessageW
+#define SetWindowsHookEx SetWindowsHookExW
+#define GetWindowText GetWindowTextW
+
+#define LOWORD(l) ((WORD)(((DWORD_PTR)(l)) & 0xffff))
+#define HIWORD(l) ((WORD)((((DWORD_PTR)(l)) >> 16) & 0xffff))
+#define MAKELONG(a, b) ((LONG)(((WORD)(((DWORD_PTR)(a)) & 0xffff)) | ((DWORD)((WORD)(((DWORD_PTR)(b)) & 0xffff))) << 16))
+#define MAKEWPARAM(l, h) ((WPARAM)(DWORD)MAKELONG(l, h))
+#define MAKELPARAM(l, h) ((LPARAM)(DWORD)MAKELONG(l, h))
+#define MAKEPOINTS(l) (*((POINTS *)&(l)))
+#define GET_WHEEL_DELTA_WPARAM(wParam) ((short)HIWORD(wParam))
+#define GET_POINTERID_WPARAM(wParam) (LOWORD(wParam))
+#define IS_POINTER_FLAG_SET_WPARAM(wParam, flag) (((DWORD)HIWORD(wParam) & (flag)) == (flag))
+#define IS_POINTER_PRIMARY_WPARAM(wParam) IS_POINTER_FLAG_SET_WPARAM(wParam, POINTER_MESSAGE_FLAG_PRIMARY)
+#define SwitchToThread() sched_yield()
+
+/* Interlocked operations */
+#define MemoryBarrier() __sync_synchronize()
+#define _ReadWriteBarrier() __asm__ __volatile__("" ::: "memory")
+#define YieldProcessor() _mm_pause()
+
+static inline LONG InterlockedIncrement(volatile LONG *p) { return __sync_add_and_fetch(p, 1); }
+static inline LONG InterlockedDecrement(volatile LONG *p) { return __sync_sub_and_fetch(p, 1); }
+static inline LONG InterlockedExchange(volatile LONG *p, LONG v) { return __sync_lock_test_and_set(p, v); }
+static inline LONG InterlockedCompareExchange(volatile LONG *p, LONG v, LONG cmp) { return __sync_val_compare_and_swap(p, cmp, v); }
+static inline LONG64 _InterlockedCompareExchange64(volatile LONG64 *p, LONG64 v, LONG64 cmp) { return __sync_val_compare_and_swap(p, cmp, v); }
+static inline PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID v) { return __sync_lock_test_and_set(p, v); }
+static inline PVOID InterlockedCompareExchangePointer(PVOID volatile *p, PVOID v, PVOID cmp) { return __sync_val_compare_and_swap(p, cmp, v); }
+
+static inline unsigned char _InterlockedCompareExchange128(volatile LONG64 *p, LONG64 high, LONG64 low, LONG64 *cmp)
+{
+	unsigned __int128 expected = ((unsigned __int128)(ULONG64)cmp[1] << 64) | (ULONG64)cmp[0];
+	unsigned __int128 desired = ((unsigned __int128)(ULONG64)high << 64) | (ULONG64)low;
+	unsigned __int128 previous = __sync_val_compare_and_swap((volatile unsigned __int128 *)p, expected, desired);
+	cmp[0] = (LONG64)previous;
+	cmp[1] = (LONG64)(previous >> 64);
+	return previous == expected;
+}
+
+#endif /* __WIN32_SHIM_WINDOWS_H__ */
+
+/* End of File */
@@ -0,0 +1,15 @@
+/*
+ * Traktouch Linux test shim: message cracker macros
+ */
+
+#ifndef __WIN32_SHIM_WINDOWSX_H__
+#define __WIN32_SHIM_WINDOWSX_H__
+
+#include <windows.h>
+
+#define GET_X_LPARAM(lp) ((int)(short)LOWORD(lp))
+#define GET_Y_LPARAM(lp) ((int)(short)HIWORD(lp))
+
+#endif /* __WIN32_SHIM_WINDOWSX_H__ */
+
+/* End of File */